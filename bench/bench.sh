@@ -0,0 +1,54 @@
+#!/bin/sh
+# bench.sh
+# Runs the benchmark scripts on both execution engines, and prints the best wall time (in milliseconds) of some runs.
+# usage: bench/bench.sh [-jit] [scripts], with funk built in build/funk (make prepare compile)
+#   -jit  also time the byte code engine with the jit compiler, for reference
+
+FUNK=${FUNK:-build/funk}
+RUNS=${RUNS:-5}
+JIT=0
+
+if [ "$1" = "-jit" ]; then
+  JIT=1
+  shift
+fi
+
+SCRIPTS=${@:-bench/*.funk}
+
+# Best time of RUNS runs, in milliseconds
+best_time() {
+  best=""
+  i=0
+  while [ $i -lt $RUNS ]; do
+    start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    end=$(date +%s%N)
+    time=$(( (end - start) / 1000000 ))
+    if [ -z "$best" ] || [ $time -lt $best ]; then
+      best=$time
+    fi
+    i=$((i + 1))
+  done
+  echo $best
+}
+
+if [ $JIT -eq 1 ]; then
+  printf "%-24s %10s %10s %10s\n" "script" "stack" "register" "stack+jit"
+else
+  printf "%-24s %10s %10s\n" "script" "stack" "register"
+fi
+
+for script in $SCRIPTS; do
+  # Both engines have to print the same result
+  if [ "$($FUNK -nojit $script 2>&1)" != "$($FUNK -reg $script 2>&1)" ]; then
+    echo "$script: the engines disagree"
+  fi
+  stack=$(best_time $FUNK -nojit $script)
+  register=$(best_time $FUNK -reg $script)
+  if [ $JIT -eq 1 ]; then
+    jit=$(best_time $FUNK $script)
+    printf "%-24s %10s %10s %10s\n" "$(basename $script)" "$stack" "$register" "$jit"
+  else
+    printf "%-24s %10s %10s\n" "$(basename $script)" "$stack" "$register"
+  fi
+done
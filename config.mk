@@ -18,4 +18,23 @@ INC=${wildcard ${INC_DIR}/*.h}
 
 LIBS=-lreadline
 
-FLAGS=-o ${BUILD_DIR}/${PROG} ${LIBS} -I${INC_DIR} -O2 -Wall
+# Instruction dispatch in the virtual machine. Computed goto (labels as values)
+# requires gcc or clang, remove the define to use the portable switch dispatch.
+# gcse and crossjumping would merge the per-instruction jumps back into one.
+DISPATCH=-DUSE_COMPUTED_GOTO -fno-gcse -fno-crossjumping
+
+# Compile hot funk functions to machine code (x86-64 Linux only, ignored elsewhere).
+# Remove the define to only use the interpreter, or run funk with -nojit.
+JIT=-DUSE_JIT
+
+# Generate the byte code of funk functions on their first call instead of up front,
+# remove the define to compile every function before the program runs.
+LAZY=-DUSE_LAZY_COMPILE
+
+# Maximum depth of funk function calls, and maximum number of values on the stack
+LIMITS=-DMAX_FRAMES=100000 -DMAX_STACK=4194304
+
+# Maximum size (in ir instructions) of funk functions that are inlined at their call sites, 0 to never inline
+INLINE=-DINLINE_BUDGET=16
+
+FLAGS=-o ${BUILD_DIR}/${PROG} ${LIBS} -I${INC_DIR} -O2 -Wall ${DISPATCH} ${JIT} ${LAZY} ${LIMITS} ${INLINE}
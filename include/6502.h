@@ -3,14 +3,18 @@
 #ifndef _6502_H
 #define _6502_H
 
-#include "hash.h"
+#include "ir.h"
 
 struct Compile_state {
   i32 status;
   i8* program;
   i32 program_size;
+  i32 program_capacity;
   i32 data_section;
-  Htable symbol_table;
+  i32* zero_page;  // Zero page address of every value (-1 if it has none)
+  i32 zero_page_count;
+  i32 zero_page_capacity;
+  struct Ir_stats removed;  // Unreachable code and unused values that were not compiled
 };
 
 i32 run_6502(char* path);
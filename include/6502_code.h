@@ -5,7 +5,13 @@
 
 // http://6502.org/tutorials/6502opcodes.html
 enum Opcode {
+  OP_CLC = 0x18,
+  OP_SEC = 0x38,
+
   OP_ADC_IMM = 0x69,
+  OP_ADC_ZPG = 0x65,
+  OP_SBC_IMM = 0xe9,
+  OP_SBC_ZPG = 0xe5,
 
   OP_STY_ZPG = 0x84,
   OP_STA_ZPG = 0x85,
@@ -21,7 +27,9 @@ enum Opcode {
 };
 
 struct Compile_state;
+struct VM_state;
 
-i32 code_gen_6502(struct Compile_state* state, Ast* ast);
+// The vm is the compile-time environment (values, constants and symbols) of the program
+i32 code_gen_6502(struct Compile_state* state, struct VM_state* vm, Ast* ast);
 
 #endif
@@ -0,0 +1,35 @@
+// arena.h
+// Bump allocator for the memory of one compilation (the ast, and the temporary tables of the code generators),
+// which is released all at once when the compilation is done
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include "common.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)  // Including the header of the block
+
+struct Arena_block;
+struct Allocator;
+
+typedef struct Arena {
+  struct Arena_block* blocks;  // The block that is allocated from, followed by the ones that are full
+  u32 used;  // Bytes used in the first block
+  struct Allocator* source;  // Where the blocks come from, NULL for the current allocator (see memory.h)
+} Arena;
+
+void arena_init(Arena* arena);
+
+// An arena with its blocks taken from the source allocator
+void arena_init_from(Arena* arena, struct Allocator* source);
+
+// Allocate memory that is aligned for any type, it is valid until the arena is released
+void* arena_alloc(Arena* arena, u32 size);
+
+// Grow an allocation (or allocate, if data is NULL). The last allocation grows in place, others are copied.
+void* arena_realloc(Arena* arena, void* data, u32 old_size, u32 new_size);
+
+// Release every allocation that was made in the arena
+void arena_free(Arena* arena);
+
+#endif
@@ -5,22 +5,25 @@
 
 #include "common.h"
 #include "token.h"
+#include "arena.h"
 
 typedef struct Token Value;
 
 typedef struct Node* Ast;
 
+// NOTE(lucas): The nodes are allocated in the arena of the compilation, and the tree is released with it
 Ast ast_create();
 
 i32 ast_is_empty(const Ast ast);
 
-Ast ast_add_node(Ast* ast, Value value);
+// Returns NULL when the arena is out of memory
+Ast ast_add_node(Arena* arena, Ast* ast, Value value);
 
-Ast ast_add_node_at(Ast* ast, i32 index, Value value);
+Ast ast_add_node_at(Arena* arena, Ast* ast, i32 index, Value value);
 
 Ast ast_get_node_at(Ast* ast, i32 index);
 
-Ast ast_add_node_last(Ast* ast, Value value);
+Ast ast_add_node_last(Arena* arena, Ast* ast, Value value);
 
 Ast ast_get_last(Ast* ast);
 
@@ -40,6 +43,4 @@ Value* ast_get_value(Ast* ast);
 
 void ast_print(const Ast ast);
 
-void ast_free(Ast* ast);
-
 #endif
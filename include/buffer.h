@@ -6,6 +6,7 @@
 typedef struct Buffer {
   char* data;
   i32 length;
+  i32 capacity;  // Number of allocated characters
 } Buffer;
 
 typedef struct Buffer_list {
@@ -0,0 +1,10 @@
+// c_code.h
+
+#ifndef _C_CODE_H
+#define _C_CODE_H
+
+#include "c_compile.h"
+
+i32 code_gen_c(struct C_state* state, Ast* ast);
+
+#endif
@@ -0,0 +1,46 @@
+// c_compile.h
+// Ahead-of-time compilation of funk programs to C
+
+#ifndef _C_COMPILE_H
+#define _C_COMPILE_H
+
+#include "object.h"
+#include "buffer.h"
+
+// A value (let or define) as it is known at compile time
+struct C_value {
+  struct Object value;  // Only the type of the value is known, same as in the vm during code generation
+  i32 function;  // Index of the C function of a define (-1 for other values)
+  i32 is_int;  // Declared as int, it is stored as a native i32
+  struct Token name;
+};
+
+// Every define is compiled to one C function
+struct C_function {
+  i32 value;  // The value of the define
+  i32 argc;
+  i32 int_args;  // Bit mask of the parameters that are declared as int
+  i32 self_tail_call;  // The function calls itself in tail position, which jumps back to its start
+  Buffer code;  // Body of the function
+};
+
+struct C_state {
+  i32 status;
+  struct C_value* values;
+  i32 values_count;
+  i32 values_capacity;
+  struct C_function* functions;
+  i32 functions_count;
+  i32 functions_capacity;
+  struct Token* strings;  // String literals, the index is the string handle
+  i32 strings_count;
+  i32 strings_capacity;
+  i32 value_calls;  // Are function values called (which needs a table of all functions)?
+  struct Function_state fs_global;
+  Buffer program;  // Top level code
+  Buffer output;  // The complete C file
+};
+
+i32 run_c(char* path);
+
+#endif
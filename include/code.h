@@ -3,10 +3,22 @@
 #ifndef _CODE_H
 #define _CODE_H
 
+// Byte code encoding: every instruction is a one byte opcode followed by its operands, which are
+// 16 bits wide (little-endian). Jump offsets are signed, all other operands are unsigned.
+// An instruction with an operand that does not fit in 16 bits is prefixed with I_WIDE,
+// and then all of its operands are 32 bits wide.
+#define ARG_SIZE 2
+#define WIDE_ARG_SIZE 4
+
+#define READ_ARG(P) ((i32)((P)[0] | ((P)[1] << 8)))
+#define READ_JUMP_ARG(P) ((i32)(i16)((P)[0] | ((P)[1] << 8)))
+#define READ_WIDE_ARG(P) ((i32)((u32)(P)[0] | ((u32)(P)[1] << 8) | ((u32)(P)[2] << 16) | ((u32)(P)[3] << 24)))
+
 enum Instruction {
   I_EXIT = 0,
   I_UNKNOWN,
   I_NOP,
+  I_WIDE,  // Prefix, the operands of the next instruction are 32 bits wide
 
   I_PUSH,
   I_PUSH_ARG,
@@ -15,8 +27,11 @@ enum Instruction {
   I_COND_JUMP,
   I_JUMP,
   I_RETURN,
-  I_CALL,
+  I_CALL,       // The last argument of the call instructions is the index of the inline cache of the call site
   I_LOCAL_CALL, // Uses the stack to fetch a function value to call
+  I_TAIL_CALL,  // Call in tail position, reuses the call frame of the caller
+  I_LOCAL_TAIL_CALL,
+  I_CHECK_INT_ARGS, // At function entry, makes sure that arguments of parameters declared as int are numbers
 
   I_ADD,
   I_SUB,
@@ -27,11 +42,96 @@ enum Instruction {
   I_GT,
   I_EQ,
 
-  MAX_INS,
+  // Arithmetic on operands that are known to be numbers at compile time, without type checks.
+  // Same order as the generic instructions above.
+  I_ADD_INT,
+  I_SUB_INT,
+  I_MUL_INT,
+  I_DIV_INT,
+  I_LT_INT,
+  I_GT_INT,
+  I_EQ_INT,
+
+  // Superinstructions, produced by fusing common instruction sequences (see peephole.c)
+  I_PUSH_ARG_PUSH_ADD,  // push_arg, push, add
+  I_PUSH_ARG_PUSH_SUB,  // push_arg, push, sub
+  I_PUSH_ADD,           // push, add
+  I_PUSH_SUB,           // push, sub
+  I_LT_COND_JUMP,       // lt, cond_jump
+  I_GT_COND_JUMP,       // gt, cond_jump
+  I_EQ_COND_JUMP,       // eq, cond_jump
+  I_PUSH_LT_COND_JUMP,  // push, lt, cond_jump
+  I_PUSH_GT_COND_JUMP,  // push, gt, cond_jump
+  I_PUSH_EQ_COND_JUMP,  // push, eq, cond_jump
+
+  // Superinstructions fused from the integer instructions, same order as above
+  I_PUSH_ARG_PUSH_ADD_INT,
+  I_PUSH_ARG_PUSH_SUB_INT,
+  I_PUSH_ADD_INT,
+  I_PUSH_SUB_INT,
+  I_LT_COND_JUMP_INT,
+  I_GT_COND_JUMP_INT,
+  I_EQ_COND_JUMP_INT,
+  I_PUSH_LT_COND_JUMP_INT,
+  I_PUSH_GT_COND_JUMP_INT,
+  I_PUSH_EQ_COND_JUMP_INT,
+
+  I_PUSH_ARG_LOCAL_CALL,      // push_arg, local_call
+  I_PUSH_ARG_LOCAL_TAIL_CALL, // push_arg, local_tail_call
+
+  // Produced by the peephole optimizer (see peephole.c)
+  I_PUSH_ASSIGN,  // push, assign: copy a value into another value
+  I_SHL_INT,      // push 2^n, mul_int: multiply the number on top of the stack by 2^n
+  I_SHR_INT,      // push 2^n, div_int: divide the number on top of the stack by 2^n, rounding toward zero
+
+  I_COMPILE,  // Stub of a function that is compiled on its first call (always wide), replaced by a wide jump to its code
+
+  MAX_INS,  // Opcodes have to fit in one byte
 };
 
+// Size of the stub that functions which are compiled on their first call start with
+#define STUB_SIZE (2 + WIDE_ARG_SIZE)
+
 struct VM_state;
 
+// The ir of a function whose byte code is generated on its first call. The instructions are kept in
+// vm->lazy_ins (with their temporaries relative to start), and the function value holds the address of its
+// stub (wide compile <index of the function>).
+struct Lazy_function {
+  i32 start;
+  i32 count;
+  i32 labels_count;
+  i32 entry;  // Address of the code, -1 until it has been compiled
+};
+
+i32 ins_argc(i32 instruction);
+
+// Which operand of the instruction is a relative jump offset (-1 if none)
+i32 ins_jump_arg(i32 instruction);
+
+// Is the operand of the instruction a value address?
+i32 ins_value_arg(i32 instruction, i32 arg);
+
+// Which operand of the instruction is the index of its inline cache (-1 if none)
+i32 ins_cache_arg(i32 instruction);
+
+// An instruction of the encoded program
+struct Decoded {
+  i32 ins;
+  i32 args[3];
+  i32 size;  // In bytes, with the wide prefix
+};
+
+// Decode the instruction at the address, fails if it does not fit in the program
+i32 ins_decode(const u8* program, i32 program_size, i32 at, struct Decoded* d);
+
 i32 code_gen(struct VM_state* vm, Ast* ast);
 
+// Generate the byte code of a function that was deferred to its first call at the end of the program,
+// and replace its stub (at address) with a jump to it. Entry is set to the address of the code.
+i32 code_gen_function(struct VM_state* vm, i32 address, i32* entry);
+
+// Number of compile errors that the last code generation reported, code is still generated for some of them
+i32 code_gen_errors();
+
 #endif
@@ -0,0 +1,43 @@
+// constant.h
+
+#ifndef _CONSTANT_H
+#define _CONSTANT_H
+
+#include "common.h"
+
+struct VM_state;
+struct Token;
+
+#define NO_CONSTANT -1
+
+// Literals that have been added to the values of the virtual machine, so that identical constants share one value
+typedef struct Constant_pool {
+  i32* slots;  // Value addresses of the constants, or NO_CONSTANT for unused slots
+  u32 count;   // Count of used slots
+  u32 size;    // Total size of the table
+} Constant_pool;
+
+void constant_pool_init(Constant_pool* pool);
+
+// Get the value address of the constant that this literal evaluates to, fails if it has not been added yet
+i32 constant_pool_lookup(struct VM_state* vm, const struct Token* token, i32* address);
+
+// Does the value at this address hold a literal (and not a value that can change at run time)?
+i32 constant_pool_contains(struct VM_state* vm, i32 address);
+
+// Add the constant at this value address to the pool
+i32 constant_pool_insert(struct VM_state* vm, i32 address);
+
+// Remove constants whose values have been removed (after a code generation rollback)
+void constant_pool_trim(struct VM_state* vm);
+
+// Move the constants at the value addresses from first and on to their new addresses in map (-1 if removed)
+void constant_pool_relocate(struct VM_state* vm, i32 first, const i32* map);
+
+// Replace the pool with a copy of the table of another one (of a loaded image), which has to hold constants
+// of the values of the vm. Fails when out of memory.
+i32 constant_pool_restore(struct VM_state* vm, const i32* slots, u32 size);
+
+void constant_pool_free(Constant_pool* pool);
+
+#endif
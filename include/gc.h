@@ -0,0 +1,37 @@
+// gc.h
+// Garbage collector of the values, strings and byte code that every line of a REPL session adds. What the global
+// symbols and the stack can no longer reach is reclaimed between runs, and the rest is moved down to fill the gaps.
+
+#ifndef _GC_H
+#define _GC_H
+
+#include "common.h"
+
+#ifndef GC_THRESHOLD
+  #define GC_THRESHOLD 4096  // Number of values (or bytes of byte code) before the first collection
+#endif
+
+struct VM_state;
+
+typedef struct Gc {
+  i32 next_values;   // Collect when there are this many values
+  i32 next_program;  // or this many bytes of byte code
+  i32 collections;
+  i32 values;    // What the last collection reclaimed
+  i32 strings;
+  i32 bytes;
+  i64 pause;     // Microseconds that the last collection took
+  i64 max_pause;
+  i64 total_pause;
+  i32 report;  // Print every collection to stderr
+} Gc;
+
+void gc_init(Gc* gc);
+
+// Collect if enough has been added since the last collection. Only the byte code of the stack based engine
+// is collected, and only between runs (when nothing is executing).
+i32 gc_check(struct VM_state* vm);
+
+i32 gc_collect(struct VM_state* vm);
+
+#endif
@@ -8,17 +8,22 @@ typedef i32 Hvalue;
 typedef char Hkey[HTABLE_KEY_SIZE];
 
 struct Item;
+struct Arena;
 
 typedef struct {
   struct Item* items;
   u32 count;	// Count of used slots
   u32 size;	// Total size of the hash table
+  struct Arena* arena;	// Where the items are allocated (NULL if they are allocated on their own)
 } Htable;
 
 Htable ht_create(u32 size);
 
 Htable ht_create_empty();
 
+// Empty table whose items are allocated in the arena, they are released with it
+Htable ht_create_arena(struct Arena* arena);
+
 i32 ht_is_empty(const Htable* table);
 
 u32 ht_insert_element(Htable* table, const Hkey key, const Hvalue value);
@@ -0,0 +1,37 @@
+// image.h
+// Precompiled programs, so that scripts don't have to be parsed and compiled on every run
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include "common.h"
+
+// Bump when the byte code, the object representation or the layout of the file changes
+#define IMAGE_VERSION 8
+
+struct VM_state;
+
+// Hash of the source code, to detect precompiled programs that are out of date
+u64 image_hash(const char* source, u32 length);
+
+// Write the compiled program of a newly created vm (values, strings, global symbols and byte code) to file
+i32 image_save(struct VM_state* vm, const char* path, u64 source_hash);
+
+// Map a precompiled program into a newly created vm, the values, strings and byte code are used in place.
+// Fails if there is no such file, or if it was compiled from another source or by another version. Only the
+// header is checked against its checksum, unless verify is set, which reads the whole file to check all of it.
+i32 image_load(struct VM_state* vm, const char* path, u64 source_hash, i32 verify);
+
+// Copy the mapped parts of the vm into allocated memory, so that more code can be added to it
+i32 image_detach(struct VM_state* vm);
+
+// Copy only the mapped byte code, so that functions can be compiled on their first call while the values are in use
+i32 image_detach_program(struct VM_state* vm);
+
+// Is the byte code still used from the mapped file?
+i32 image_program_mapped(struct VM_state* vm);
+
+// Unmap the precompiled program without copying anything (when the vm is freed)
+void image_unmap(struct VM_state* vm);
+
+#endif
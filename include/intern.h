@@ -0,0 +1,29 @@
+// intern.h
+
+#ifndef _INTERN_H
+#define _INTERN_H
+
+#include "common.h"
+
+struct VM_state;
+
+// Strings of the virtual machine by their characters, so that equal strings share one handle and
+// can be compared by their handles
+typedef struct String_index {
+  i32* slots;  // String handles, or NO_STRING for unused slots
+  u32 count;   // Count of used slots
+  u32 size;    // Total size of the table
+} String_index;
+
+void string_index_init(String_index* index);
+
+// Get the handle of the string with these characters, it is added to the strings of the vm if there is none.
+// The empty string is NO_STRING.
+i32 string_intern(struct VM_state* vm, const char* data, i32 length, i32* handle);
+
+// Index all strings of the vm again, after they have been replaced (by loading an image)
+i32 string_index_rebuild(struct VM_state* vm);
+
+void string_index_free(String_index* index);
+
+#endif
@@ -0,0 +1,114 @@
+// ir.h
+// Intermediate representation, lowered from the abstract syntax tree once and shared by the code generators
+
+#ifndef _IR_H
+#define _IR_H
+
+#include "ast.h"
+#include "hash.h"
+
+#ifndef INLINE_BUDGET
+  #define INLINE_BUDGET 16
+#endif
+
+// NOTE(lucas): Funk passes values on the stack, and an expression can push any number of values. Only expressions
+// that always produce exactly one value without side effects (literals, arguments, values, and operations on them)
+// are lowered into temporaries. A temporary is the index of the instruction that defines it, and it is used once,
+// before any instruction with side effects. Everything else is lowered
+// into instructions that work on the stack, in the same order as the byte code of the virtual machine.
+enum Ir_op {
+  IR_NOP = 0,  // Removed by an optimization pass
+
+  // Definitions of temporaries
+  IR_CONST,   // address: value that holds a literal
+  IR_ARG,     // index: argument of the current function
+  IR_LOAD,    // address
+  IR_BINARY,  // op, a, b: operation (T_ADD, ...) on two temporaries
+
+  IR_PUSH,          // a
+  IR_STACK_BINARY,  // op: operation on the two values on top of the stack
+  IR_STORE,         // address, a: store a temporary in a value
+  IR_ASSIGN,        // address: pop the value on top of the stack into a value
+  IR_CALL,          // address, the function value is called with the arguments on the stack
+  IR_LOCAL_CALL,    // a, argc: call the function in a temporary
+  IR_JUMP,          // label
+  IR_BRANCH,        // a, label: jump if the temporary is false
+  IR_COND_BRANCH,   // label: pop a value, and jump if it is false
+  IR_LABEL,         // label
+  IR_FUNC,          // address, argc, int_args: start of a function, which ends at the matching IR_END
+  IR_RETURN,
+  IR_END,
+
+  MAX_IR_OP,
+};
+
+// Instruction flags
+#define IR_INT    (1 << 0)  // Operation on operands that are known to be numbers
+#define IR_TAIL   (1 << 1)  // Call that is followed by a return
+#define IR_LOCAL  (1 << 2)  // Store to a value that is defined in a function, which is not visible to later compilations
+
+#define IR_MAX_ARGS 3
+#define NO_TEMP -1
+#define UNRESOLVED_LABEL -1
+
+struct Ir_ins {
+  i32 op;
+  i32 args[IR_MAX_ARGS];
+  i32 type;   // Compile-time type of temporaries
+  i32 flags;
+  struct Token* token;  // Where the instruction comes from in the source
+};
+
+// What was removed as unreachable or unused (see ir_build)
+struct Ir_stats {
+  i32 functions;  // Functions that are never called or used as values
+  i32 ins;        // Instructions, including the ones of the removed functions
+  i32 values;     // Values that nothing refers to
+};
+
+typedef struct Ir {
+  struct Ir_ins* ins;
+  i32 count;
+  i32 capacity;
+  i32 labels_count;
+  i32 values_added;  // How many values was added when lowering
+  Htable symbols;    // Which global symbols was added when lowering
+  i32 errors;        // How many compile errors was reported when lowering
+  struct Ir_stats removed;
+} Ir;
+
+struct VM_state;
+
+void ir_init(Ir* ir);
+
+// Lower the ast into the ir, and optimize it. Values, constants and symbols are added to the vm. When the vm
+// compiles the whole program at once, unreferenced functions and values are removed as well.
+i32 ir_build(struct VM_state* vm, Ast* ast, Ir* ir);
+
+// Remove the values and global symbols that was added by ir_build
+void ir_rollback(struct VM_state* vm, Ir* ir);
+
+// Is the instruction a definition of a temporary?
+i32 ir_is_temp(i32 op);
+
+// Index of the IR_END of the function that starts at the IR_FUNC at start
+i32 ir_function_end(const Ir* ir, i32 start);
+
+// Which operand of the instruction is a label (-1 if none)
+i32 ir_label(const struct Ir_ins* ins);
+
+// Is the first operand of the instruction a value address?
+i32 ir_value_operand(const struct Ir_ins* ins);
+
+// Move the symbols of the values from first and on to their new addresses in map, removing the ones that are -1
+void ir_relocate_symbols(Htable* table, i32 first, const i32* map);
+
+// Copy the instructions from start to end (inclusive) into out, with the temporaries relative to start and
+// the labels renumbered from 0. Returns the number of labels. The tokens are not copied, they belong to the ast.
+i32 ir_copy(const Ir* ir, i32 start, i32 end, struct Ir_ins* out);
+
+void ir_print(struct VM_state* vm, Ir* ir, FILE* fp);
+
+void ir_free(Ir* ir);
+
+#endif
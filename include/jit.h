@@ -0,0 +1,67 @@
+// jit.h
+// Compiles the byte code of hot funk functions to x86-64 machine code
+
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "common.h"
+
+// Machine code is only generated for x86-64 (System V calling convention)
+#if defined(USE_JIT) && !(defined(__x86_64__) && defined(__linux__))
+  #undef USE_JIT
+#endif
+
+#define JIT_THRESHOLD 100  // Number of calls before a function is compiled
+#define JIT_MAX_DEPTH 4096  // Compiled functions nest on the C stack, calls deeper than this are interpreted
+
+struct VM_state;
+
+// A funk function that calls are counted for, and that is compiled once it gets hot
+struct Jit_function {
+  i32 address;  // Entry address in the program
+  i32 argc;
+  i32 calls;
+  i32 failed;  // Uses something that can not be compiled, it is always interpreted
+  void* code;  // Entry point of the machine code, NULL until the function is compiled
+  u32 code_size;
+};
+
+// i32 function(struct VM_state* vm), called with the arguments on top of the stack. Replaces them with the
+// result of the function (if there is one) the same way as I_RETURN, and returns NO_ERR or ERR.
+typedef i32 (*Jit_code)(struct VM_state*);
+
+typedef struct Jit {
+  struct Jit_function** functions;
+  i32 functions_count;
+  i32 functions_capacity;
+  i32 depth;  // Number of compiled functions that are being executed
+  i32 enabled;
+} Jit;
+
+void jit_init(Jit* jit, i32 enabled);
+
+// The record of a funk function value, shared by all call sites of the function (NULL if the jit is disabled)
+struct Jit_function* jit_function(struct VM_state* vm, u64 func);
+
+// Count a call to a function that has not been compiled, and compile it when it gets hot.
+// Returns 1 if the function has been compiled.
+i32 jit_hot(struct VM_state* vm, struct Jit_function* func);
+
+i32 jit_enter(struct VM_state* vm, struct Jit_function* func);
+
+void jit_free(Jit* jit);
+
+// Called from the machine code, defined in vm.c
+
+// Call a function value the same way as the call instruction with the inline cache (cache_index) does,
+// argc is the argument count of local calls (-1 for calls by address). Tail calls (tail_base >= 0) move the
+// arguments down to the tail base first. Returns ERR, NO_ERR, or 1 if the called function was a C function.
+i32 vm_jit_call(struct VM_state* vm, i32 cache_index, u64 func, i32 argc, i32 tail_base);
+
+// Same as the I_EQ instruction
+i32 vm_jit_equal(struct VM_state* vm, u64 a, u64 b);
+
+// Make room on the stack for count more values
+i32 vm_jit_reserve(struct VM_state* vm, i32 count);
+
+#endif
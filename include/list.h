@@ -1,4 +1,6 @@
 // list.h
+// Dynamic arrays of any type. A list is a pointer to its elements, the number of elements (count) and the number
+// of elements that are allocated (capacity). The capacity grows geometrically, so pushing is amortized O(1).
 
 #ifndef _LIST_H
 #define _LIST_H
@@ -7,29 +9,48 @@
 
 #include "memory.h"
 
-#define list_push(list, count, value) do { \
-	if (list == NULL) { list = list_init(sizeof(value), 1); list[0] = value; count = 1; break; } \
-	void* new_list = m_realloc(list, count * sizeof(*list), (1 + count) * (sizeof(value))); \
-	if (new_list) { \
-		list = new_list; \
-		list[(count)++] = value; \
-	} \
-} while (0); \
-
-#define list_realloc(list, count, new_size) do { \
-  if (list == NULL) break; \
-  if (new_size == 0) { list_free(list, count); break; } \
-	void* new_list = m_realloc(list, count * sizeof(*list), (new_size) * (sizeof(*list))); \
-  list = new_list; \
-  count = new_size; \
-} while(0); \
-
-#define list_shrink(list, count, num) { \
-  if ((count - num) >= 0) { \
-	  list_realloc(list, count, count - num); \
+#define LIST_INIT_CAPACITY 8
+
+// Make room for at least size elements
+#define list_reserve(list, capacity, size) do { \
+  if ((size) > (capacity)) { \
+    i32 new_capacity = (capacity) > 0 ? (capacity) * 2 : LIST_INIT_CAPACITY; \
+    while (new_capacity < (size)) { \
+      new_capacity *= 2; \
+    } \
+    void* new_list = (list) ? m_realloc(list, (capacity) * sizeof(*(list)), new_capacity * sizeof(*(list))) : m_malloc(new_capacity * sizeof(*(list))); \
+    if (new_list) { \
+      list = new_list; \
+      capacity = new_capacity; \
+    } \
+  } \
+} while (0)
+
+#define list_push(list, count, capacity, value) do { \
+  list_reserve(list, capacity, (count) + 1); \
+  if ((count) < (capacity)) { \
+    (list)[(count)++] = (value); \
+  } \
+} while (0)
+
+// Append n elements that are copied from values
+#define list_append(list, count, capacity, values, n) do { \
+  list_reserve(list, capacity, (count) + (n)); \
+  if ((count) + (n) <= (capacity)) { \
+    memcpy(&(list)[count], values, (n) * sizeof(*(list))); \
+    (count) += (n); \
   } \
-}
- 
+} while (0)
+
+// Remove the elements from mark and on (the count at some earlier point), the memory is kept for later pushes
+#define list_truncate(list, count, mark) do { \
+  assert((mark) >= 0 && (mark) <= (count)); \
+  (count) = (mark); \
+} while (0)
+
+// Remove the last num elements
+#define list_shrink(list, count, num) list_truncate(list, count, (count) - (num))
+
 #define list_assign(list, count, index, value) { \
 	assert(list != NULL); \
 	if (index < count) { \
@@ -37,13 +58,14 @@
 	} else { assert(0); } \
 } \
 
-#define list_free(list, count) { \
-	if ((list) != NULL) { \
-		m_free(list, count * sizeof(*list)); \
-		count = 0; \
+#define list_free(list, count, capacity) do { \
+  if ((list) != NULL) { \
+    m_free(list, (capacity) * sizeof(*(list))); \
     list = NULL; \
-	}\
-}
+  } \
+  count = 0; \
+  capacity = 0; \
+} while (0)
 
 // size of type, count of elements to allocate
 void* list_init(const u32 size, u32 count);
@@ -1,15 +1,57 @@
 // memory.h
+// Every allocation goes through the current allocator, which keeps count of what is in use. A vm owns an allocator
+// and makes it the current one while it runs (see vm.h), so everything that it and its compilations allocate
+// comes from there. Each thread has its own current allocator.
 
 #ifndef _MEMORY_H
 #define _MEMORY_H
 
 #include "common.h"
+#include "arena.h"
 
-i32 memory_total();
+#define FIXED_MIN_SIZE 16  // Smallest block of the fixed buffer allocator
+#define FIXED_CLASSES 28   // Block sizes from FIXED_MIN_SIZE and up, doubling
 
-i32 memory_num_blocks();
+enum Allocator_kind {
+  ALLOCATOR_SYSTEM = 0,  // malloc and free
+  ALLOCATOR_ARENA,  // Nothing is freed before the allocator is released
+  ALLOCATOR_FIXED,  // Blocks of one buffer of a fixed size, allocation fails when it is full
+};
 
-void memory_print_info();
+typedef struct Allocator {
+  void* (*alloc)(struct Allocator* allocator, u32 size);
+  void* (*realloc)(struct Allocator* allocator, void* data, u32 old_size, u32 new_size);
+  void (*free)(struct Allocator* allocator, void* data, u32 size);
+  void (*release)(struct Allocator* allocator);  // Return all memory of the allocator
+  i32 kind;
+  i32 total;   // Bytes in use
+  i32 blocks;  // Allocations in use
+  i32 peak;    // Most bytes that have been in use at once
+  u8 failed;   // An allocation has failed, so what was built with it is incomplete (see list.h)
+  Arena arena;
+  u8* memory;  // Buffer of the fixed buffer allocator
+  u32 size;
+  u32 used;    // Bytes of the buffer that have been handed out at least once
+  u8 owns_memory;
+  void* free_lists[FIXED_CLASSES];  // Freed blocks of the fixed buffer allocator, one list for every size
+} Allocator;
+
+void allocator_system(Allocator* allocator);
+
+// The blocks of the arena are taken from the system allocator
+void allocator_arena(Allocator* allocator);
+
+// Allocate from the memory (of size bytes), or from one block of that size that is allocated now if memory
+// is NULL. Sizes are rounded up to powers of two, and freed blocks are reused for allocations of the same size.
+i32 allocator_fixed(Allocator* allocator, void* memory, u32 size);
+
+void allocator_release(Allocator* allocator);
+
+// Make the allocator the current one of this thread, and return the one that was current before it
+// (NULL when it was the system allocator of the thread)
+Allocator* memory_use(Allocator* allocator);
+
+void memory_print_info(const Allocator* allocator);
 
 void* m_malloc(const u32 size);
 
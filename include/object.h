@@ -9,12 +9,6 @@
 
 struct VM_state;
 
-struct Function {
-  i32 address;
-  i32 argc;
-  struct Function* parent;
-};
-
 // NOTE(lucas): Return value represents the number of values
 // that was produced from the function call
 typedef i32 (*cfunction)(struct VM_state*);
@@ -24,34 +18,78 @@ struct CFunction {
   i32 argc;
 };
 
+// Location of a string in the string buffer of the VM
+struct String {
+  i32 offset;
+  i32 length;
+};
+
 struct Function_state {
-  struct Function* func;
   struct Function_state* parent;
   Htable symbol_table;
   Htable args;
+  i32 int_args;  // Bit mask of the parameters that are declared as int
 };
 
+// NOTE(lucas): Objects are NaN-boxed into 8 bytes. Quiet NaNs with one of the tags below in
+// the upper 16 bits carry a 48-bit payload, every other bit pattern is left for doubles.
+//   number:    i32 in the lower 32 bits
+//   string:    handle into vm->strings
+//   function:  entry address in the lower 32 bits, argc in the 16 bits above
+//   cfunction: handle into vm->cfunctions
 typedef struct Object {
-  union {
-    i32 number;
-    struct Function func;
-    struct CFunction cfunc;
-    struct Buffer buffer;
-  } value;
-  i32 type;
+  u64 bits;
 } Object;
 
+#define TAG_SHIFT 48
+
+enum Object_tag {
+  TAG_UNKNOWN = 0x7ff9,
+  TAG_NUMBER = 0x7ffa,
+  TAG_STRING = 0x7ffb,
+  TAG_FUNCTION = 0x7ffc,
+  TAG_CFUNCTION = 0x7ffd,
+};
+
+#define NO_STRING -1  // Handle of the empty string
+
+#define BOX(TAG, PAYLOAD) ((struct Object) { .bits = ((u64)(TAG) << TAG_SHIFT) | (u64)(PAYLOAD) })
+#define OBJECT_TAG(OBJ) ((u32)((OBJ).bits >> TAG_SHIFT))
+
+#define MAKE_UNKNOWN() BOX(TAG_UNKNOWN, 0)
+#define MAKE_NUMBER(N) BOX(TAG_NUMBER, (u32)(N))
+#define MAKE_STRING(HANDLE) BOX(TAG_STRING, (u32)(HANDLE))
+#define MAKE_FUNCTION(ADDRESS, ARGC) BOX(TAG_FUNCTION, ((u64)(u16)(ARGC) << 32) | (u32)(ADDRESS))
+#define MAKE_CFUNCTION(HANDLE) BOX(TAG_CFUNCTION, (u32)(HANDLE))
+
+#define IS_NUMBER(OBJ) (OBJECT_TAG(OBJ) == TAG_NUMBER)
+#define IS_STRING(OBJ) (OBJECT_TAG(OBJ) == TAG_STRING)
+#define IS_FUNCTION(OBJ) (OBJECT_TAG(OBJ) == TAG_FUNCTION)
+#define IS_CFUNCTION(OBJ) (OBJECT_TAG(OBJ) == TAG_CFUNCTION)
+
+#define AS_NUMBER(OBJ) ((i32)(u32)(OBJ).bits)
+#define AS_HANDLE(OBJ) ((i32)(u32)(OBJ).bits)  // Strings and cfunctions
+#define FUNC_ADDRESS(OBJ) ((i32)(u32)(OBJ).bits)
+#define FUNC_ARGC(OBJ) ((i32)(((OBJ).bits >> 32) & 0xffff))
+#define MAX_ARGC 0xffff
+
 i32 token_to_object(struct VM_state* vm, struct Token* t, struct Object* obj);
 
-void object_print(FILE* fp, struct Object* obj);
+// The type (T_NUMBER, T_STRING, ...) of the object
+i32 object_type(struct Object obj);
+
+// An object of the given type, with an empty value
+struct Object object_of_type(i32 type);
 
-void object_printline(FILE* fp, struct Object* obj);
+// The characters of a string (data is NULL for the empty string)
+struct Buffer string_get(struct VM_state* vm, i32 handle);
 
-void func_init(struct Function* func, struct Function* parent);
+void object_print(struct VM_state* vm, FILE* fp, struct Object* obj);
 
-void func_free(struct Function* func);
+void object_printline(struct VM_state* vm, FILE* fp, struct Object* obj);
 
-void func_state_init(struct Function_state* fs, struct Function_state* parent, struct Function* func);
+// The symbol tables are allocated in the arena, or on their own if it is NULL
+void func_state_init(struct Function_state* fs, struct Function_state* parent, struct Arena* arena);
 
 void func_state_free(struct Function_state* fs);
 
@@ -0,0 +1,14 @@
+// optimize.h
+
+#ifndef _OPTIMIZE_H
+#define _OPTIMIZE_H
+
+#include "ast.h"
+
+// Fold constant expressions, propagate top-level let constants and prune constant if expressions
+i32 optimize_ast(Ast* ast);
+
+// Evaluate the operation the same way as the virtual machine does, fails if the result should be a run time error
+i32 optimize_fold(i32 op, i32 left, i32 right, i32* result);
+
+#endif
@@ -5,10 +5,11 @@
 
 typedef struct Parser {
   struct Lexer* l;
+  Arena* arena;  // Where the nodes of the ast are allocated
   Ast* ast;
   i32 status;
 } Parser;
 
-i32 parser_parse(char* input, char* filename, Ast* ast);
+i32 parser_parse(char* input, char* filename, Arena* arena, Ast* ast);
 
 #endif
@@ -0,0 +1,21 @@
+// peephole.h
+
+#ifndef _PEEPHOLE_H
+#define _PEEPHOLE_H
+
+struct VM_state;
+
+// What the optimizations did to the generated code
+struct Peephole_stats {
+  i32 ins_before;      // Number of generated instructions
+  i32 ins_after;       // Number of instructions that were encoded
+  i32 jumps_threaded;  // Jumps that were redirected past other jumps, or replaced by returns
+  i32 jumps_removed;   // Jumps to the next instruction
+  i32 reduced;         // Arithmetic with literals that was removed or strength reduced
+};
+
+// Optimize the generated code, fuse common instruction sequences into superinstructions,
+// and encode the result at the end of the program
+i32 peephole_assemble(struct VM_state* vm, struct Peephole_stats* stats);
+
+#endif
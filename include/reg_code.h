@@ -0,0 +1,85 @@
+// reg_code.h
+// Register based code, an alternative to the stack based byte code (see code.h)
+
+#ifndef _REG_CODE_H
+#define _REG_CODE_H
+
+#include "ast.h"
+
+// Every instruction is a sequence of i32 words, the opcode followed by its operands.
+// Operands of the register instructions name a slot: a register (temporary values of the
+// expression that is being evaluated), an argument of the current function, or a value
+// (literals and lets). Destinations can also be the stack, which pushes the result.
+enum Slot_kind {
+  SLOT_REG = 0,
+  SLOT_ARG,
+  SLOT_VALUE,
+  SLOT_PUSH,  // Only as destination
+};
+
+#define SLOT_BITS 2
+#define MAKE_SLOT(KIND, INDEX) (((INDEX) << SLOT_BITS) | (KIND))
+#define SLOT_KIND(SLOT) ((SLOT) & ((1 << SLOT_BITS) - 1))
+#define SLOT_INDEX(SLOT) ((SLOT) >> SLOT_BITS)
+
+#define MAX_REGS 256
+
+enum Reg_instruction {
+  R_UNKNOWN = 0,
+
+  R_MOVE,         // dst, src
+  R_ASSIGN,       // address: pop a value from the stack into a value
+  R_JUMP,         // offset
+  R_JUMP_FALSE,   // src, offset
+  R_COND_JUMP,    // offset, pops the condition from the stack
+  R_CALL,         // address, calls the function value at the address
+  R_LOCAL_CALL,   // src, argc
+  R_TAIL_CALL,    // address
+  R_LOCAL_TAIL_CALL,  // src, argc
+  R_SELF_TAIL_CALL,   // reg, argc, offset: the arguments are in the registers reg.., and the current function starts at the offset
+  R_CHECK_INT_ARGS,   // mask
+  R_RETURN,
+
+  // dst, a, b
+  R_ADD,
+  R_SUB,
+  R_MUL,
+  R_DIV,
+  R_LT,
+  R_GT,
+  R_EQ,
+
+  // dst, a, b, where both operands are known to be numbers at compile time. Same order as above.
+  R_ADD_INT,
+  R_SUB_INT,
+  R_MUL_INT,
+  R_DIV_INT,
+  R_LT_INT,
+  R_GT_INT,
+  R_EQ_INT,
+
+  // a, b, offset: compare, and jump if the comparison is false
+  R_LT_JUMP,
+  R_GT_JUMP,
+  R_EQ_JUMP,
+  R_LT_JUMP_INT,
+  R_GT_JUMP_INT,
+  R_EQ_JUMP_INT,
+
+  // Operations on the two values on top of the stack, for operands that are not known to be single values
+  R_STACK_ADD,
+  R_STACK_SUB,
+  R_STACK_MUL,
+  R_STACK_DIV,
+  R_STACK_LT,
+  R_STACK_GT,
+  R_STACK_EQ,
+
+  MAX_REG_INS,
+};
+
+struct VM_state;
+
+i32 reg_code_gen(struct VM_state* vm, Ast* ast);
+
+#endif
@@ -0,0 +1,36 @@
+// reg_vm.h
+// Execution engine of the register based code
+
+#ifndef _REG_VM_H
+#define _REG_VM_H
+
+#include "object.h"
+#include "reg_code.h"
+
+struct Reg_frame {
+  i32* return_ip;  // Where to continue in the caller
+  i32 stack_base;  // Stack base of the caller, restored on return
+  i32 argc;
+};
+
+typedef struct Reg_state {
+  i32* code;  // Register based program
+  i32 code_size;
+  i32 code_capacity;
+  i32 start;  // Where the code that was added since the last run starts
+  struct Reg_frame* frames;
+  i32 frame_count;
+  i32 frames_size;  // Number of allocated frames
+  struct Object regs[MAX_REGS];  // Registers only hold values while an expression is evaluated, they are shared by all functions
+} Reg_state;
+
+struct VM_state;
+
+void reg_init(Reg_state* reg);
+
+// Execute the register program from its start, until the top level code returns
+i32 reg_execute(struct VM_state* vm);
+
+void reg_free(Reg_state* reg);
+
+#endif
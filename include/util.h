@@ -3,7 +3,8 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
-char* read_file(const char* path);
+// Read the whole file into a null terminated buffer, which is size bytes (to be freed with m_free)
+char* read_file(const char* path, u32* size);
 
 i32 string_to_int(char* string, i32 length, i32* value);
 
@@ -12,4 +13,7 @@ i32 string_copy(char* source, char* dest, i32 length, i32 max_length);
 // String copy, but with no null termination
 i32 string_copy2(char* source, char* dest, i32 length, i32 max_length);
 
+// djb2 hash of the characters
+u32 hash_bytes(const char* data, i32 length);
+
 #endif
@@ -3,34 +3,136 @@
 #ifndef _VM_H
 #define _VM_H
 
+#include "memory.h"
 #include "object.h"
+#include "constant.h"
+#include "intern.h"
 #include "hash.h"
 #include "list.h"
 #include "buffer.h"
+#include "jit.h"
+#include "reg_vm.h"
+#include "gc.h"
 
-#define MAX_STACK 512
+#define STACK_INIT_SIZE 512
+
+#ifndef MAX_STACK
+  #define MAX_STACK (1 << 22)
+#endif
+
+#ifndef MAX_FRAMES
+  #define MAX_FRAMES 100000
+#endif
+
+#define FRAMES_INIT_SIZE 32
+
+// Which engine executes the program, chosen at startup
+enum Engine {
+  ENGINE_STACK = 0,  // Byte code (see code.h)
+  ENGINE_REGISTER,  // Register based code (see reg_code.h)
+};
+
+// Are compiled programs saved next to their files, and loaded on later runs (see image.h)?
+enum Image_cache {
+  IMAGE_CACHE_OFF = 0,
+  IMAGE_CACHE_ON,
+  IMAGE_CACHE_VERIFY,  // Also check the whole file against its checksum before it is used
+};
+
+struct Call_frame {
+  u8* return_ip;  // Where to continue in the caller
+  i32 stack_base;  // Stack base of the caller, restored on return
+  i32 argc;
+};
+
+// Inline cache of a call site, remembers the funk function that was called from there the last time
+struct Call_cache {
+  struct Object func;  // Zero (which is not a function) if nothing has been cached
+  i32 entry;  // Where the code of the function starts, past the stub of functions that are compiled on their first call
+  struct Jit_function* jit;  // Call counter and machine code of the cached function (NULL without the jit)
+};
 
 typedef struct VM_state {
-  struct Object stack[MAX_STACK];
+  struct Object* stack;
   i32 stack_top;
+  i32 stack_size; // Number of allocated stack slots
+  i32 max_stack;
   i32 stack_base;
   struct Object* values;
   i32 values_count;
-  struct Buffer buffer;
-  struct Function global;
+  i32 values_capacity;
+  struct Constant_pool constants;  // Which values that hold literals
+  struct Buffer buffer;  // Characters of all strings
+  struct String* strings;
+  i32 strings_count;
+  i32 strings_capacity;
+  struct String_index strings_index;  // Equal strings share one handle
+  struct CFunction* cfunctions;
+  i32 cfunctions_count;
+  i32 cfunctions_capacity;
   struct Function_state fs_global;
-  i32* program;
+  u8* program;  // Encoded byte code
   i32 program_size;
+  i32 program_capacity;
+  i32* code;  // Instructions of the current code generation pass, before they are encoded into the program
+  i32 code_size;
+  i32 code_capacity;
+  i32* code_values;  // Values that hold the functions of the current code generation pass, relocated when it is encoded
+  i32 code_values_count;
+  i32 code_values_capacity;
   i32 old_program_size;
-  i32* ip;
+  u8* image;  // Precompiled program file that the values, strings and program are mapped from (NULL if they are allocated)
+  u32 image_size;
+  u8* ip;
   i32 saved_ip;
+  struct Call_frame* frames;
+  i32 frame_count;
+  i32 frames_size; // Number of allocated frames
+  i32 max_frames;
+  struct Call_cache* caches;  // One for every call site in the program
+  i32 caches_count;
+  i32 caches_capacity;
+  struct Lazy_function* lazy;  // Functions that are compiled on their first call (see code.h)
+  i32 lazy_count;
+  i32 lazy_capacity;
+  struct Ir_ins* lazy_ins;
+  i32 lazy_ins_count;
+  i32 lazy_ins_capacity;
+  Jit jit;
+  Gc gc;
+  i32 engine;
+  i32 whole_program;  // Is all code compiled at once (no interactive input)? Unreferenced code is then removed.
+  i32 image_cache;
+  struct Arena* arena;  // Temporary allocations of the compilation in progress (NULL when nothing is compiled)
+  Reg_state reg;
+  Allocator allocator;  // Where all memory of the vm comes from, it is the current allocator while the vm runs
   i32 status;
 } VM_state;
 
+// Initialize the vm with the system allocator
 i32 vm_init(struct VM_state* vm);
 
+// Initialize the vm with a copy of an allocator that has not been used yet, which the vm owns from then on.
+// With a fixed buffer allocator nothing is allocated from the system after this.
+i32 vm_init_with_allocator(struct VM_state* vm, const Allocator* allocator);
+
 i32 vm_exec(struct VM_state* vm, char* file, char* source);
 
+// Execute a source file. With the image cache enabled the compiled program is saved next to it (path.fbc),
+// and used instead of compiling the source again as long as the source has not changed.
+i32 vm_exec_file(struct VM_state* vm, char* path);
+
 void vm_free(struct VM_state* vm);
 
+// Report that the allocator of the vm has run out of memory (unless an error has been reported already),
+// and stop the vm. Returns NO_ERR when every allocation has succeeded.
+i32 vm_memory_check(struct VM_state* vm);
+
+// Shared with the register based engine
+i32 stack_grow(struct VM_state* vm);
+
+i32 objects_are_equal(struct VM_state* vm, struct Object* a, struct Object* b);
+
+i32 call_cfunction(struct VM_state* vm, struct CFunction* cfunc);
+
 #endif
@@ -4,7 +4,9 @@
 #include "list.h"
 #include "util.h"
 #include "ast.h"
+#include "optimize.h"
 #include "parser.h"
+#include "vm.h"
 #include "6502_code.h"
 #include "6502.h"
 
@@ -16,13 +18,17 @@ void compile_state_init(struct Compile_state* state) {
   state->status = NO_ERR;
   state->program = NULL;
   state->program_size = 0;
+  state->program_capacity = 0;
   state->data_section = 0x1;
-  ht_create_empty(&state->symbol_table);
+  state->zero_page = NULL;
+  state->zero_page_count = 0;
+  state->zero_page_capacity = 0;
+  state->removed = (struct Ir_stats) {0};
 }
 
 void compile_state_free(struct Compile_state* state) {
-  list_free(state->program, state->program_size);
-  ht_free(&state->symbol_table);
+  list_free(state->program, state->program_size, state->program_capacity);
+  list_free(state->zero_page, state->zero_page_count, state->zero_page_capacity);
 }
 
 void output_program(struct Compile_state* state, char* path) {
@@ -35,22 +41,36 @@ void output_program(struct Compile_state* state, char* path) {
 
 i32 run_6502(char* path) {
   i32 result = NO_ERR;
-  char* source = read_file(path);
+  u32 source_size = 0;
+  char* source = read_file(path, &source_size);
   if (source) {
     struct Compile_state state;
     compile_state_init(&state);
+    struct VM_state vm;
+    vm_init(&vm);
+    vm.whole_program = 1;
+    Allocator* previous = memory_use(&vm.allocator);
+    Arena arena;
+    arena_init(&arena);
+    vm.arena = &arena;
 
     Ast ast = ast_create();
-    if (parser_parse(source, path, &ast) == NO_ERR) {
+    if (parser_parse(source, path, &arena, &ast) == NO_ERR) {
+      optimize_ast(&ast);
       // ast_print(ast);
-      if ((result = code_gen_6502(&state, &ast)) == NO_ERR) {
+      if ((result = code_gen_6502(&state, &vm, &ast)) == NO_ERR) {
         char output_path[MAX_PATH_SIZE] = {0};
         snprintf(output_path, MAX_PATH_SIZE, "%s.o65", path);
         output_program(&state, output_path);
+        printf("%s: %i bytes (%i unreferenced functions, %i ir instructions and %i values removed)\n",
+          output_path, state.program_size, state.removed.functions, state.removed.ins, state.removed.values);
       }
     }
-    ast_free(&ast);
-    free(source);
+    vm.arena = NULL;
+    arena_free(&arena);
+    memory_use(previous);
+    m_free(source, source_size);
+    vm_free(&vm);
     compile_state_free(&state);
   }
   else {
@@ -6,22 +6,25 @@
 #include "token.h"
 #include "ast.h"
 #include "error.h"
+#include "vm.h"
+#include "ir.h"
 #include "6502.h"
 #include "6502_code.h"
 
-#define compile_error(token, fmt, ...) \
-  fprintf(stderr, "compile-error: %s:%i:%i: " fmt, token.filename, token.line, token.count, ##__VA_ARGS__); \
+#define compile_error(fmt, ...) \
+  fprintf(stderr, "compile-error: " fmt, ##__VA_ARGS__)
 
 #define compile_error2(token, fmt, ...) \
   fprintf(stderr, "compile-error: %s:%i:%i: " fmt, token.filename, token.line, token.count, ##__VA_ARGS__); \
   error_printline((&token.source[0]), token)
 
 static i32 alloc_byte(struct Compile_state* state, i32* address);
-static i32 define_value(struct Compile_state* state, struct Token token, i32 type, i32* address);
-static i32 get_value_address(struct Compile_state* state, struct Token token, i32* address);
-static i32 set_branch_type(i32* branch_type, i32 type);
-static i32 ins_add(struct Compile_state* state, i8 instruction, i32* ins_count);
-static i32 generate(struct Compile_state* state, Ast* ast, i32* ins_count, i32* branch_type);
+static i32 unsupported(struct Compile_state* state, const struct Ir_ins* ins);
+static i32 zero_page_address(struct Compile_state* state, struct VM_state* vm, i32 value_address, i32 define, i32* address);
+static i32 ins_add(struct Compile_state* state, i8 instruction);
+static i32 operand(struct Compile_state* state, struct VM_state* vm, Ir* ir, i32 temp, i32* mode, i32* arg);
+static i32 load(struct Compile_state* state, struct VM_state* vm, Ir* ir, i32 temp);
+static i32 generate(struct Compile_state* state, struct VM_state* vm, Ir* ir);
 
 // Stores stuff both in the zero page and non-zero page, but only zero page memory is used at the moment
 i32 alloc_byte(struct Compile_state* state, i32* address) {
@@ -30,178 +33,172 @@ i32 alloc_byte(struct Compile_state* state, i32* address) {
   return NO_ERR;
 }
 
-i32 define_value(struct Compile_state* state, struct Token token, i32 type, i32* address) {
-  char name[HTABLE_KEY_SIZE] = {0};
-  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
-  const i32* found = ht_lookup(&state->symbol_table, name);
-  if (found) {
-    compile_error2(token, "Value '%.*s' has already been defined\n", token.length, token.string);
-    return state->status = ERR;
+i32 unsupported(struct Compile_state* state, const struct Ir_ins* ins) {
+  if (ins->token) {
+    compile_error2((*ins->token), "Expression '%.*s' is not supported by the 6502 code generator\n", ins->token->length, ins->token->string);
   }
   else {
-    switch (type) {
-      case T_NUMBER: {
-        alloc_byte(state, address);
-        break;
-      }
-      default:
-        assert(0);
-        break;
-    }
-    ht_insert_element(&state->symbol_table, name, *address);
+    compile_error("Expression is not supported by the 6502 code generator\n");
   }
-  return NO_ERR;
+  return state->status = ERR;
 }
 
-i32 get_value_address(struct Compile_state* state, struct Token token, i32* address) {
-  char name[HTABLE_KEY_SIZE] = {};
-  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
-  const i32* found = ht_lookup(&state->symbol_table, name);
-  if (!found) {
-    compile_error2(token, "No such value '%.*s'\n", token.length, token.string);
-    return state->status = ERR;
+// Zero page address of a value, values get their address when they are first defined (stored to)
+i32 zero_page_address(struct Compile_state* state, struct VM_state* vm, i32 value_address, i32 define, i32* address) {
+  while (state->zero_page_count < vm->values_count) {
+    list_push(state->zero_page, state->zero_page_count, state->zero_page_capacity, -1);
   }
-  else {
-    *address = *found;
+  if (state->zero_page[value_address] < 0) {
+    if (!define || object_type(vm->values[value_address]) != T_NUMBER) {
+      return ERR;
+    }
+    alloc_byte(state, &state->zero_page[value_address]);
+  }
+  *address = state->zero_page[value_address];
+  if (*address > UINT8_MAX) { // Zero page mode only allows for addresses up to UINT8_MAX i.e. 0-255
+    compile_error("Out of zero page memory\n");
+    return state->status = ERR;
   }
   return NO_ERR;
 }
 
-i32 set_branch_type(i32* branch_type, i32 type) {
-  if (branch_type) {
-    *branch_type = type;
-    return NO_ERR;
+i32 ins_add(struct Compile_state* state, i8 instruction) {
+  list_push(state->program, state->program_size, state->program_capacity, instruction);
+  return NO_ERR;
+}
+
+// Get the addressing mode (immediate or zero page) and the argument for a temporary that can be an operand
+i32 operand(struct Compile_state* state, struct VM_state* vm, Ir* ir, i32 temp, i32* mode, i32* arg) {
+  const struct Ir_ins* ins = &ir->ins[temp];
+  switch (ins->op) {
+    case IR_CONST: {
+      struct Object value = vm->values[ins->args[0]];
+      if (!IS_NUMBER(value)) {
+        return unsupported(state, ins);
+      }
+      *mode = OP_LDA_IMM;
+      *arg = AS_NUMBER(value);
+      return NO_ERR;
+    }
+    case IR_LOAD: {
+      if (zero_page_address(state, vm, ins->args[0], 0, arg) != NO_ERR) {
+        return unsupported(state, ins);
+      }
+      *mode = OP_LDA_ZPG;
+      return NO_ERR;
+    }
+    default:
+      break;
   }
   return ERR;
 }
 
-i32 ins_add(struct Compile_state* state, i8 instruction, i32* ins_count) {
-  list_push(state->program, state->program_size, instruction);
-  if (ins_count) {
-    (*ins_count)++;
+// Load a temporary into A
+i32 load(struct Compile_state* state, struct VM_state* vm, Ir* ir, i32 temp) {
+  const struct Ir_ins* ins = &ir->ins[temp];
+  i32 mode = 0;
+  i32 arg = 0;
+  if (ins->op == IR_CONST || ins->op == IR_LOAD) {
+    if (operand(state, vm, ir, temp, &mode, &arg) != NO_ERR) {
+      return state->status;
+    }
+    ins_add(state, mode);
+    ins_add(state, (i8)arg);
+    return NO_ERR;
+  }
+  // Only 8-bit addition and subtraction of numbers
+  if (ins->op != IR_BINARY || !(ins->flags & IR_INT) || (ins->args[0] != T_ADD && ins->args[0] != T_SUB)) {
+    return unsupported(state, ins);
+  }
+  i32 right = ins->args[2];
+  if (ir->ins[right].op != IR_CONST && ir->ins[right].op != IR_LOAD) {
+    // Spill the right operand
+    i32 spill = 0;
+    if (load(state, vm, ir, right) != NO_ERR) {
+      return state->status;
+    }
+    alloc_byte(state, &spill);
+    if (spill > UINT8_MAX) {
+      compile_error("Out of zero page memory\n");
+      return state->status = ERR;
+    }
+    ins_add(state, OP_STA_ZPG);
+    ins_add(state, (i8)spill);
+    mode = OP_LDA_ZPG;
+    arg = spill;
+  }
+  else if (operand(state, vm, ir, right, &mode, &arg) != NO_ERR) {
+    return state->status;
   }
+  if (load(state, vm, ir, ins->args[1]) != NO_ERR) {
+    return state->status;
+  }
+  if (ins->args[0] == T_ADD) {
+    ins_add(state, OP_CLC);
+    ins_add(state, mode == OP_LDA_IMM ? OP_ADC_IMM : OP_ADC_ZPG);
+  }
+  else {
+    ins_add(state, OP_SEC);
+    ins_add(state, mode == OP_LDA_IMM ? OP_SBC_IMM : OP_SBC_ZPG);
+  }
+  ins_add(state, (i8)arg);
   return NO_ERR;
 }
 
-i32 generate(struct Compile_state* state, Ast* ast, i32* ins_count, i32* branch_type) {
-#if 0
-  ins_add(state, OP_LDA_IMM, ins_count);
-  ins_add(state, 1, ins_count);
-  ins_add(state, OP_ADC_IMM, ins_count);
-  ins_add(state, 2, ins_count);
-  ins_add(state, OP_LDX_IMM, ins_count);
-  ins_add(state, 5, ins_count);
-
-  ins_add(state, OP_LDA_ZPG_X, ins_count);
-  ins_add(state, 3, ins_count);
-#endif
-
-#if 1
-  i32 child_count = ast_child_count(ast);
-  struct Token* token = NULL;
-  for (i32 i = 0; i < child_count; i++) {
-    if ((token = ast_get_node_value(ast, i))) {
-      switch (token->type) {
-        // Load value into A
-        case T_NUMBER: {
-          set_branch_type(branch_type, T_NUMBER);
-          i8 value = (i8)token->value.number;
-          ins_add(state, OP_LDA_IMM, ins_count);
-          ins_add(state, value, ins_count);
-          break;
-        }
-        // Load value into A
-        case T_IDENTIFIER: {
-          i32 value_address = -1;
-          if (get_value_address(state, *token, &value_address) == NO_ERR) {
-            if (value_address <= INT8_MAX) {
-              i8 address = (i8)value_address;
-              ins_add(state, OP_LDA_ZPG, ins_count);
-              ins_add(state, address, ins_count);
-            }
-            else {
-              // Handle
-            }
-          }
-          else {
-            return state->status;
-          }
-          break;
+// Values are passed in A, only straight-line code on numbers is supported
+i32 generate(struct Compile_state* state, struct VM_state* vm, Ir* ir) {
+  for (i32 i = 0; i < ir->count; i++) {
+    const struct Ir_ins* ins = &ir->ins[i];
+    switch (ins->op) {
+      case IR_PUSH: {
+        if (load(state, vm, ir, ins->args[0]) != NO_ERR) {
+          return state->status;
         }
-        // let
-        // \-- identifier
-        //        \--type (optional)
-        //     \-- (expression)
-        case T_LET: {
-          Ast let_branch = ast_get_node_at(ast, i);
-          Ast ident_branch = ast_get_node_at(&let_branch, 0);
-          Ast value_branch = ast_get_node_at(&let_branch, 1);
-          struct Token* ident = ast_get_value(&ident_branch);
-          struct Token* type_token = ast_get_node_value(&ident_branch, 0);
-          if (type_token) {
-            if (type_token->type == T_NUMBER) {
-              i32 value_branch_type = -1;
-              if ((generate(state, &value_branch, ins_count, &value_branch_type)) == NO_ERR) {
-                if (type_token->type == value_branch_type) {
-                  i32 value_address = -1;
-                  if (define_value(state, *ident, type_token->type, &value_address) == NO_ERR) {
-                    if (value_address <= INT8_MAX) { // Zero page mode only allows for addresses up to INT8_MAX i.e. 0-255
-                      i8 address = (i8)value_address;
-                      // Store the value of A into address
-                      ins_add(state, OP_STA_ZPG, ins_count);
-                      ins_add(state, address, ins_count);
-                    }
-                    else {
-                      // Handle
-                    }
-                  }
-                  else {
-                    return state->status;
-                  }
-                }
-                else {
-                  compile_error((*type_token), "This expression was expected to have type '%.*s'\n", type_token->length, type_token->string);
-                  return state->status = ERR;
-                }
-              }
-              else {
-                return state->status = ERR;
-              }
-            }
-            else {
-              compile_error2((*type_token), "The type '%.*s' is not defined\n", type_token->length, type_token->string);
-            }
-          }
-          else {
-            compile_error2((*ident), "Expected type in value definition\n");
-            return state->status = ERR;
-          
-          }
-          break;
+        break;
+      }
+      case IR_STORE:
+      case IR_ASSIGN: {
+        if (ins->op == IR_STORE && load(state, vm, ir, ins->args[1]) != NO_ERR) {
+          return state->status;
         }
-        case T_EXPR: {
-          Ast expr_branch = ast_get_node_at(ast, i);
-          if (ast_child_count(&expr_branch) > 0) {
-            generate(state, &expr_branch, ins_count, branch_type);
-          }
-          break;
+        i32 address = -1;
+        if (zero_page_address(state, vm, ins->args[0], 1, &address) != NO_ERR) {
+          return unsupported(state, ins);
         }
-        default:
-          break;
+        // Store the value of A into address
+        ins_add(state, OP_STA_ZPG);
+        ins_add(state, (i8)address);
+        break;
       }
+      case IR_NOP:
+      case IR_CONST:
+      case IR_ARG:
+      case IR_LOAD:
+      case IR_BINARY:
+      case IR_JUMP:  // Skips functions, which are unsupported
+      case IR_LABEL:
+        break;
+      default:
+        return unsupported(state, ins);
     }
   }
-#endif
   return state->status;
 }
 
-i32 code_gen_6502(struct Compile_state* state, Ast* ast) {
+i32 code_gen_6502(struct Compile_state* state, struct VM_state* vm, Ast* ast) {
   i32 result = NO_ERR;
-  i32 ins_count = 0;
-  i32 branch_type = 0;
   if (ast_is_empty(*ast)) {
     return NO_ERR;
   }
-  result = generate(state, ast, &ins_count, &branch_type);
+  Ir ir;
+  ir_init(&ir);
+  if ((result = ir_build(vm, ast, &ir)) == NO_ERR && ir.errors == 0) {
+    state->removed = ir.removed;
+    result = generate(state, vm, &ir);
+  }
+  else {
+    result = state->status = ERR;
+  }
+  ir_free(&ir);
   return result;
 }
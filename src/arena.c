@@ -0,0 +1,107 @@
+// arena.c
+
+#include "memory.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 8
+#define align(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct Arena_block {
+  struct Arena_block* next;
+  u32 size;  // Bytes of data
+  u8 data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+#define BLOCK_DATA_SIZE (ARENA_BLOCK_SIZE - sizeof(struct Arena_block))
+
+static struct Arena_block* block_add(Arena* arena, u32 size);
+static void block_free(Arena* arena, struct Arena_block* block);
+
+// Blocks that are larger than the default size hold one allocation, and are placed after the
+// first block so that the remaining space of it can still be used
+struct Arena_block* block_add(Arena* arena, u32 size) {
+  u32 data_size = size > BLOCK_DATA_SIZE ? size : BLOCK_DATA_SIZE;
+  u32 block_size = sizeof(struct Arena_block) + data_size;
+  struct Arena_block* block = arena->source ? arena->source->alloc(arena->source, block_size) : m_malloc(block_size);
+  if (!block) {
+    return NULL;
+  }
+  block->size = data_size;
+  if (data_size > BLOCK_DATA_SIZE && arena->blocks) {
+    block->next = arena->blocks->next;
+    arena->blocks->next = block;
+  }
+  else {
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->used = 0;
+  }
+  return block;
+}
+
+void block_free(Arena* arena, struct Arena_block* block) {
+  u32 block_size = sizeof(struct Arena_block) + block->size;
+  if (arena->source) {
+    arena->source->free(arena->source, block, block_size);
+  }
+  else {
+    m_free(block, block_size);
+  }
+}
+
+void arena_init(Arena* arena) {
+  arena_init_from(arena, NULL);
+}
+
+void arena_init_from(Arena* arena, struct Allocator* source) {
+  arena->blocks = NULL;
+  arena->used = 0;
+  arena->source = source;
+}
+
+void* arena_alloc(Arena* arena, u32 size) {
+  size = align(size);
+  struct Arena_block* block = arena->blocks;
+  if (!block || arena->used + size > block->size) {
+    if (!(block = block_add(arena, size))) {
+      return NULL;
+    }
+    if (block != arena->blocks) {
+      return block->data;
+    }
+  }
+  void* data = &block->data[arena->used];
+  arena->used += size;
+  return data;
+}
+
+void* arena_realloc(Arena* arena, void* data, u32 old_size, u32 new_size) {
+  if (!data) {
+    return arena_alloc(arena, new_size);
+  }
+  if (new_size <= old_size) {
+    return data;
+  }
+  struct Arena_block* block = arena->blocks;
+  u32 start = arena->used - align(old_size);
+  if (arena->used >= align(old_size) && (u8*)data == &block->data[start] && start + align(new_size) <= block->size) {
+    arena->used = start + align(new_size);
+    return data;
+  }
+  void* result = arena_alloc(arena, new_size);
+  if (result) {
+    memcpy(result, data, old_size);
+  }
+  return result;
+}
+
+void arena_free(Arena* arena) {
+  struct Arena_block* block = arena->blocks;
+  while (block) {
+    struct Arena_block* next = block->next;
+    block_free(arena, block);
+    block = next;
+  }
+  arena->blocks = NULL;
+  arena->used = 0;
+}
@@ -4,32 +4,35 @@
 #include <stdio.h>
 #include <assert.h>
 
-#include "memory.h"
+#include "arena.h"
 #include "ast.h"
 
+#define CHILDREN_INIT_SIZE 4
+
 struct Node {
   struct Node** children;
   i32 child_count;
+  i32 child_capacity;
   Value value;
 };
 
 static i32 is_empty(const Ast ast);
-static struct Node* create_node(Value value);
+static struct Node* create_node(Arena* arena, Value value);
 static i32 print_tree(const Ast ast, i32 level);
 
 i32 is_empty(const Ast ast) {
   return ast == NULL;
 }
 
-struct Node* create_node(Value value) {
-  struct Node* node = m_malloc(sizeof(struct Node));
+struct Node* create_node(Arena* arena, Value value) {
+  struct Node* node = arena_alloc(arena, sizeof(struct Node));
   if (!node) {
-    printf("Failed to allocate new AST node\n");
     return NULL;
   }
 
   node->value = value;
   node->child_count = 0;
+  node->child_capacity = 0;
   node->children = NULL;
 
   return node;
@@ -63,45 +66,45 @@ i32 ast_is_empty(const Ast ast) {
   return is_empty(ast);
 }
 
-Ast ast_add_node(Ast* ast, Value value) {
-  struct Node* new_node = create_node(value);
+Ast ast_add_node(Arena* arena, Ast* ast, Value value) {
+  struct Node* new_node = create_node(arena, value);
   if (!new_node)
     return NULL;
 
   if (is_empty(*ast)) {
-    *ast = create_node((Value) {});
+    *ast = create_node(arena, (Value) {});
     if (!(*ast)) {
       return NULL;
     }
   }
-  if (!(*ast)->children) {
-    (*ast)->children = m_malloc(sizeof(struct Node*));
-  }
-  else {
-    struct Node** tmp = m_realloc((*ast)->children, (sizeof(struct Node*) * (*ast)->child_count), (sizeof(struct Node*)) * ((*ast)->child_count + 1));
+  struct Node* node = *ast;
+  if (node->child_count == node->child_capacity) {
+    i32 capacity = node->child_capacity ? node->child_capacity * 2 : CHILDREN_INIT_SIZE;
+    struct Node** tmp = arena_realloc(arena, node->children, sizeof(struct Node*) * node->child_capacity, sizeof(struct Node*) * capacity);
     if (!tmp) {
       return NULL;
     }
-    (*ast)->children = tmp;
+    node->children = tmp;
+    node->child_capacity = capacity;
   }
-  (*ast)->children[(*ast)->child_count++] = new_node;
+  node->children[node->child_count++] = new_node;
   return new_node;
 }
 
-Ast ast_add_node_at(Ast* ast, i32 index, Value value) {
+Ast ast_add_node_at(Arena* arena, Ast* ast, i32 index, Value value) {
   assert(!is_empty(*ast));
   assert(index < (*ast)->child_count);
-  Ast result = ast_add_node(&(*ast)->children[index], value);
+  Ast result = ast_add_node(arena, &(*ast)->children[index], value);
   return result;
 }
 
-Ast ast_add_node_last(Ast* ast, Value value) {
+Ast ast_add_node_last(Arena* arena, Ast* ast, Value value) {
   assert(!is_empty(*ast));
   i32 child_count = ast_child_count(ast);
   if (child_count == 0) {
     return NULL;
   }
-  return ast_add_node_at(ast, child_count - 1, value);
+  return ast_add_node_at(arena, ast, child_count - 1, value);
 }
 
 Ast ast_get_node_at(Ast* ast, i32 index) {
@@ -119,13 +122,11 @@ Ast ast_get_last(Ast* ast) {
   return (*ast)->children[child_count - 1];
 }
 
+// NOTE(lucas): The removed subtree stays in the arena until the arena is released
 i32 ast_remove_node_at(Ast* ast, i32 index) {
   assert(!is_empty(*ast));
   i32 child_count = ast_child_count(ast);
   assert(index < child_count);
-  Ast node_to_remove = ast_get_node_at(ast, index);
-  ast_free(&node_to_remove);	// NOTE(lucas): Removes the subtree(s) from this node - if there are any
-  (*ast)->children[index] = NULL;
   for (i32 i = index; i < child_count - 1; i++) {
     (*ast)->children[i] = (*ast)->children[i + 1];
   }
@@ -191,22 +192,3 @@ void ast_print(const Ast ast) {
   print_tree(ast, 0);
   printf("\n");
 }
-
-void ast_free(Ast* ast) {
-  assert(ast != NULL);
-  if (is_empty(*ast)) return;
-  for (i32 i = 0; i < (*ast)->child_count; i++) {
-    ast_free(&(*ast)->children[i]);
-  }
-
-  if ((*ast)->children) {
-    m_free((*ast)->children, sizeof(struct Node*) * (*ast)->child_count);
-    (*ast)->children = NULL;
-    (*ast)->child_count = 0;
-  }
-  if (*ast) {
-    m_free(*ast, sizeof(struct Node));
-    *ast = NULL;
-  }
-  assert(is_empty(*ast));
-}
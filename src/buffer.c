@@ -8,6 +8,7 @@
 void buffer_init(Buffer* buffer) {
   buffer->data = NULL;
   buffer->length = 0;
+  buffer->capacity = 0;
 }
 
 i32 buffer_append(Buffer* buffer, char* string) {
@@ -21,29 +22,14 @@ i32 buffer_append_n(Buffer* buffer, char* string, i32 length) {
     return NO_ERR;
   }
   assert(length > 0);
-  if (!buffer->data) {
-    buffer->data = list_init(sizeof(char), length);
-    if (!buffer->data) {
-      return ERR;
-    }
-    buffer->length = length;
-    string_copy2(buffer->data, string, length, length);
-  }
-  else {
-    char* at = &buffer->data[buffer->length];
-    i32 old_length = buffer->length; // To see if the reallocation was successful
-    list_realloc(buffer->data, buffer->length, buffer->length + length);
-    if (old_length == buffer->length) {
-      return ERR;
-    }
-    string_copy2(at, string, length, length);
+  i32 old_length = buffer->length; // To see if the allocation was successful
+  list_append(buffer->data, buffer->length, buffer->capacity, string, length);
+  if (old_length == buffer->length) {
+    return ERR;
   }
   return NO_ERR;
 }
 
 void buffer_free(Buffer* buffer) {
-  if (buffer->data) {
-    m_free(buffer->data, buffer->length);
-    buffer->length = 0;
-  }
+  list_free(buffer->data, buffer->length, buffer->capacity);
 }
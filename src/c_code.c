@@ -0,0 +1,1153 @@
+// c_code.c
+// C code generator (abstract syntax tree -> C)
+// NOTE(lucas): The generated program uses the same value stack and object representation as the vm, so that
+// it behaves the same way, but without any instruction dispatch. Every define is a C function, calls to them
+// are direct C calls, int lets are native i32 variables and expressions of int operands don't use the stack.
+
+#include <stdarg.h>
+#include <ctype.h>
+
+#include "common.h"
+#include "list.h"
+#include "util.h"
+#include "ast.h"
+#include "error.h"
+#include "vm.h"
+#include "c_compile.h"
+#include "c_code.h"
+
+#define compile_error2(token, fmt, ...) \
+  fprintf(stderr, "compile-error: %s:%i:%i: " fmt, token.filename, token.line, token.count, ##__VA_ARGS__); \
+  error_printline((&token.source[0]), token)
+
+// Branch type of expressions that do not push exactly one value, or where it can not be known at compile time
+#define UNKNOWN_VALUES -1
+
+#define NO_FUNCTION -1  // Top level code
+#define MAX_LINE 1024
+#define MAX_INT_EXPR 512  // Longer int expressions are evaluated on the stack
+#define MAX_NAME 32
+
+// Where code is being generated
+struct C_context {
+  struct Function_state* fs;
+  i32 func;  // Index of the function (NO_FUNCTION for top level code)
+  i32 indent;
+};
+
+static Buffer* code_buffer(struct C_state* state, struct C_context* ctx);
+static void emit(struct C_state* state, struct C_context* ctx, const char* fmt, ...);
+static void out(struct C_state* state, const char* fmt, ...);
+static void out_string(struct C_state* state, struct Token* token);
+static void c_name(char* name, char prefix, i32 index, struct Token* token);
+static i32 value_add(struct C_state* state, struct Token token, struct Object value, i32 is_int);
+static i32 string_add(struct C_state* state, struct Token* token);
+static i32 define_value(struct C_state* state, struct Token token, struct Function_state* fs, i32 type, i32 is_int, i32* index);
+static i32 define_arg(struct C_state* state, struct Token token, struct Function_state* fs, i32* index);
+static i32 lookup_arg(struct Token token, struct Function_state* fs, i32* index);
+static i32 lookup_value(struct C_state* state, struct Token token, struct Function_state* fs, i32* index);
+static i32 get_value(struct C_state* state, struct Token token, struct Function_state* fs, i32* index);
+static const char* token_to_op(const struct Token* token);
+static i32 transparent(Ast* ast, i32 first, i32 last);
+static i32 int_expr(struct C_state* state, Ast* ast, i32 index, struct C_context* ctx, char* expr, i32 size);
+static void value_name(struct C_state* state, i32 index, char* name);
+static void function_name(struct C_state* state, i32 func, char* name);
+static void call_value(struct C_state* state, struct C_context* ctx, i32 index, i32 tail);
+static void call_arg(struct C_state* state, struct C_context* ctx, i32 arg, i32 argc, i32 tail);
+static void push_value(struct C_state* state, struct C_context* ctx, i32 index);
+static i32 generate_func(struct C_state* state, struct Token name, Ast* args, Ast* body, struct C_context* ctx);
+static i32 generate(struct C_state* state, Ast* ast, struct C_context* ctx, i32 tail, i32* branch_type);
+static i32 generate_range(struct C_state* state, Ast* ast, i32 first, i32 last, struct C_context* ctx, i32 tail, i32* branch_type);
+static void output_c(struct C_state* state);
+
+// C functions of the runtime, in the same order as in the vm
+static const char* cfunction_names[] = { "print" };
+
+// The runtime that is written into every generated program, most of it mirrors the vm
+static const char* runtime =
+  "#include <setjmp.h>\n"
+  "#include <stdarg.h>\n"
+  "#include <stdint.h>\n"
+  "#include <stdio.h>\n"
+  "#include <string.h>\n"
+  "\n"
+  "typedef int32_t i32;\n"
+  "typedef uint32_t u32;\n"
+  "typedef uint64_t u64;\n"
+  "\n"
+  "// The runtime helpers are small, and have to be inlined for the generated code to be fast\n"
+  "#if defined(__GNUC__)\n"
+  "  #define INLINE static inline __attribute__((always_inline))\n"
+  "  #define COLD __attribute__((cold, noreturn))\n"
+  "#else\n"
+  "  #define INLINE static inline\n"
+  "  #define COLD\n"
+  "#endif\n"
+  "\n"
+  "// Values are NaN-boxed into 8 bytes, the same way as in the funk vm\n"
+  "typedef struct Object {\n"
+  "  u64 bits;\n"
+  "} Object;\n"
+  "\n"
+  "#define TAG_SHIFT 48\n"
+  "#define TAG_UNKNOWN 0x7ff9\n"
+  "#define TAG_NUMBER 0x7ffa\n"
+  "#define TAG_STRING 0x7ffb\n"
+  "#define TAG_FUNCTION 0x7ffc\n"
+  "#define TAG_CFUNCTION 0x7ffd\n"
+  "\n"
+  "#define BOX(TAG, PAYLOAD) ((Object) { .bits = ((u64)(TAG) << TAG_SHIFT) | (u64)(PAYLOAD) })\n"
+  "#define OBJECT_TAG(OBJ) ((u32)((OBJ).bits >> TAG_SHIFT))\n"
+  "\n"
+  "#define MAKE_UNKNOWN() BOX(TAG_UNKNOWN, 0)\n"
+  "#define MAKE_NUMBER(N) BOX(TAG_NUMBER, (u32)(N))\n"
+  "#define MAKE_STRING(HANDLE) BOX(TAG_STRING, (u32)(HANDLE))\n"
+  "#define MAKE_FUNCTION(INDEX, ARGC) BOX(TAG_FUNCTION, ((u64)((ARGC) & 0xffff) << 32) | (u32)(INDEX))\n"
+  "#define MAKE_CFUNCTION(HANDLE) BOX(TAG_CFUNCTION, (u32)(HANDLE))\n"
+  "\n"
+  "#define IS_NUMBER(OBJ) (OBJECT_TAG(OBJ) == TAG_NUMBER)\n"
+  "#define IS_FUNCTION(OBJ) (OBJECT_TAG(OBJ) == TAG_FUNCTION)\n"
+  "#define IS_CFUNCTION(OBJ) (OBJECT_TAG(OBJ) == TAG_CFUNCTION)\n"
+  "\n"
+  "#define AS_NUMBER(OBJ) ((i32)(u32)(OBJ).bits)\n"
+  "#define AS_HANDLE(OBJ) ((i32)(u32)(OBJ).bits)\n"
+  "#define FUNC_INDEX(OBJ) ((i32)(u32)(OBJ).bits)\n"
+  "#define FUNC_ARGC(OBJ) ((i32)(((OBJ).bits >> 32) & 0xffff))\n"
+  "\n"
+  "// Integer arithmetic, wraps around on overflow\n"
+  "#define ADD(A, B) ((i32)((u32)(A) + (u32)(B)))\n"
+  "#define SUB(A, B) ((i32)((u32)(A) - (u32)(B)))\n"
+  "#define MUL(A, B) ((i32)((u32)(A) * (u32)(B)))\n"
+  "#define DIV(A, B) ((A) / (B))\n"
+  "#define LT(A, B) ((A) < (B))\n"
+  "#define GT(A, B) ((A) > (B))\n"
+  "#define EQ(A, B) ((A) == (B))\n"
+  "\n"
+  "struct String {\n"
+  "  const char* data;\n"
+  "  i32 length;\n"
+  "};\n"
+  "\n"
+  "static Object stack[MAX_STACK];\n"
+  "static i32 top = 0;\n"
+  "static i32 depth = 0;  // Number of funk functions that are being executed\n"
+  "static jmp_buf error_exit;\n"
+  "\n"
+  "INLINE struct String string_get(i32 handle);\n"
+  "\n"
+  "static COLD void runtime_error(const char* fmt, ...) {\n"
+  "  va_list args;\n"
+  "  va_start(args, fmt);\n"
+  "  fprintf(stderr, \"runtime-error: \");\n"
+  "  vfprintf(stderr, fmt, args);\n"
+  "  va_end(args);\n"
+  "  longjmp(error_exit, 1);\n"
+  "}\n"
+  "\n"
+  "INLINE void push(Object value) {\n"
+  "  if (top >= MAX_STACK) {\n"
+  "    runtime_error(\"Stack overflow, reached stack limit of %i!\\n\", MAX_STACK);\n"
+  "  }\n"
+  "  stack[top++] = value;\n"
+  "}\n"
+  "\n"
+  "// Pops an unknown value from an empty stack\n"
+  "INLINE Object pop(void) {\n"
+  "  return top > 0 ? stack[--top] : MAKE_UNKNOWN();\n"
+  "}\n"
+  "\n"
+  "INLINE i32 is_true(Object value) {\n"
+  "  return IS_NUMBER(value) && AS_NUMBER(value) != 0;\n"
+  "}\n"
+  "\n"
+  "INLINE i32 equal(Object a, Object b) {\n"
+  "  if (OBJECT_TAG(a) != OBJECT_TAG(b)) {\n"
+  "    return 0;\n"
+  "  }\n"
+  "  switch (OBJECT_TAG(a)) {\n"
+  "    case TAG_NUMBER:\n"
+  "    case TAG_FUNCTION:\n"
+  "      return a.bits == b.bits;\n"
+  "    case TAG_STRING: {\n"
+  "      if (a.bits == b.bits) {\n"
+  "        return 1;\n"
+  "      }\n"
+  "      struct String left = string_get(AS_HANDLE(a));\n"
+  "      struct String right = string_get(AS_HANDLE(b));\n"
+  "      return left.length == right.length && (left.length == 0 || strncmp(left.data, right.data, left.length) == 0);\n"
+  "    }\n"
+  "    default:\n"
+  "      break;\n"
+  "  }\n"
+  "  return 0;\n"
+  "}\n"
+  "\n"
+  "static void print(void);\n"
+  "\n"
+  "static void print_object(FILE* fp, Object value) {\n"
+  "  switch (OBJECT_TAG(value)) {\n"
+  "    case TAG_STRING: {\n"
+  "      struct String string = string_get(AS_HANDLE(value));\n"
+  "      fprintf(fp, \"\\\"%.*s\\\"\", string.length, string.data ? string.data : \"\");\n"
+  "      break;\n"
+  "    }\n"
+  "    case TAG_NUMBER:\n"
+  "      fprintf(fp, \"%i\", AS_NUMBER(value));\n"
+  "      break;\n"
+  "    case TAG_FUNCTION:\n"
+  "      fprintf(fp, \"function: %i\", FUNC_INDEX(value));\n"
+  "      break;\n"
+  "    case TAG_CFUNCTION:\n"
+  "      fprintf(fp, \"cfunction: %p\", (void*)print);\n"
+  "      break;\n"
+  "    default:\n"
+  "      fprintf(fp, \"?\");\n"
+  "      break;\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "static void print_stack(void) {\n"
+  "  printf(\"[\");\n"
+  "  for (i32 i = 0; i < top; i++) {\n"
+  "    print_object(stdout, stack[i]);\n"
+  "    if (i < top - 1) {\n"
+  "      printf(\", \");\n"
+  "    }\n"
+  "  }\n"
+  "  printf(\"]\\n\");\n"
+  "}\n"
+  "\n"
+  "// The built-in print function\n"
+  "static void print(void) {\n"
+  "  if (top < 1) {\n"
+  "    runtime_error(\"Invalid number of arguments in C function call (should be %i)\\n\", 1);\n"
+  "  }\n"
+  "  top--;\n"
+  "  print_object(stdout, stack[top]);\n"
+  "  fprintf(stdout, \"\\n\");\n"
+  "}\n"
+  "\n"
+  "INLINE void check_operands(void) {\n"
+  "  if (top < 2) {\n"
+  "    runtime_error(\"Not enough arguments for arithmetic operation\\n\");\n"
+  "  }\n"
+  "  if (!IS_NUMBER(stack[top - 2]) || !IS_NUMBER(stack[top - 1])) {\n"
+  "    runtime_error(\"Invalid types in arithmetic operation\\n\");\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "// Arithmetic on the two values on top of the stack, with and without type checks\n"
+  "#define ARITH(OP) do { \\\n"
+  "  check_operands(); \\\n"
+  "  stack[top - 2] = MAKE_NUMBER(OP(AS_NUMBER(stack[top - 2]), AS_NUMBER(stack[top - 1]))); \\\n"
+  "  top--; \\\n"
+  "} while (0)\n"
+  "\n"
+  "#define ARITH_INT(OP) do { \\\n"
+  "  stack[top - 2] = MAKE_NUMBER(OP(AS_NUMBER(stack[top - 2]), AS_NUMBER(stack[top - 1]))); \\\n"
+  "  top--; \\\n"
+  "} while (0)\n"
+  "\n"
+  "INLINE void equal_values(void) {\n"
+  "  if (top < 2) {\n"
+  "    runtime_error(\"Not enough arguments for arithmetic operation\\n\");\n"
+  "  }\n"
+  "  stack[top - 2] = MAKE_NUMBER(equal(stack[top - 2], stack[top - 1]));\n"
+  "  top--;\n"
+  "}\n"
+  "\n"
+  "INLINE i32 pop_int(void) {\n"
+  "  Object value = pop();\n"
+  "  if (!IS_NUMBER(value)) {\n"
+  "    runtime_error(\"The value of an int let should be an int\\n\");\n"
+  "  }\n"
+  "  return AS_NUMBER(value);\n"
+  "}\n"
+  "\n"
+  "INLINE void check_int_arg(i32 base, i32 index) {\n"
+  "  if (!IS_NUMBER(stack[base + index])) {\n"
+  "    runtime_error(\"Argument %i should be an int\\n\", index + 1);\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "// Start of a funk function, its arguments are on top of the stack\n"
+  "INLINE void enter(void) {\n"
+  "  if (++depth > MAX_FRAMES) {\n"
+  "    runtime_error(\"Call stack overflow, reached frame limit of %i!\\n\", MAX_FRAMES);\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "// Return from a funk function, the last value that it pushed (if any) replaces its arguments\n"
+  "INLINE void leave(i32 base, i32 argc) {\n"
+  "  if (top > base + argc) {\n"
+  "    stack[base] = stack[top - 1];\n"
+  "    top = base + 1;\n"
+  "  }\n"
+  "  else {\n"
+  "    top = base;\n"
+  "  }\n"
+  "  depth--;\n"
+  "}\n"
+  "\n"
+  "INLINE void call_args(i32 argc) {\n"
+  "  if (top < argc) {\n"
+  "    runtime_error(\"Invalid number of arguments in function call (should be %i)\\n\", argc);\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "// Move the arguments of a tail call down to the base of the calling function, which returns after the call\n"
+  "INLINE void tail_args(i32 base, i32 argc) {\n"
+  "  if (top - base < argc) {\n"
+  "    runtime_error(\"Invalid number of arguments in function call (should be %i)\\n\", argc);\n"
+  "  }\n"
+  "  // NOTE(lucas): Copied one value at a time (never overlapping in the wrong direction), wider loads of\n"
+  "  // values that were just pushed one by one are slow\n"
+  "  const i32 from = top - argc;\n"
+  "  for (i32 i = 0; i < argc; i++) {\n"
+  "    stack[base + i] = stack[from + i];\n"
+  "  }\n"
+  "  top = base + argc;\n"
+  "}\n";
+
+static const char* runtime_calls =
+  "static void (*const cfunctions[])(void) = { print };\n"
+  "\n"
+  "// Calls of function values. argc is the number of arguments given at the call site (-1 if not known at\n"
+  "// compile time), args is the number of values on the stack that can be used as arguments.\n"
+  "INLINE i32 check_call(Object value, i32 argc, i32 args) {\n"
+  "  if (!IS_FUNCTION(value)) {\n"
+  "    runtime_error(\"Attempted to call a value which is not a function\\n\");\n"
+  "  }\n"
+  "  if (argc < 0) {\n"
+  "    argc = FUNC_ARGC(value);\n"
+  "    if (args < argc) {\n"
+  "      runtime_error(\"Invalid number of arguments in function call (should be %i)\\n\", argc);\n"
+  "    }\n"
+  "    return argc;\n"
+  "  }\n"
+  "  if (FUNC_ARGC(value) != argc) {\n"
+  "    runtime_error(\"Invalid number of arguments in local function call (should be %i)\\n\", FUNC_ARGC(value));\n"
+  "  }\n"
+  "  if (args < argc) {\n"
+  "    runtime_error(\"Invalid number of arguments in local function call (should be %i)\\n\", argc);\n"
+  "  }\n"
+  "  return argc;\n"
+  "}\n"
+  "\n"
+  "INLINE void call_value(Object value, i32 argc) {\n"
+  "  if (IS_CFUNCTION(value)) {\n"
+  "    cfunctions[AS_HANDLE(value)]();\n"
+  "    return;\n"
+  "  }\n"
+  "  check_call(value, argc, top);\n"
+  "  functions[FUNC_INDEX(value)]();\n"
+  "}\n"
+  "\n"
+  "// Returns 0 if the calling function has to return right after the call, C functions are called as usual\n"
+  "INLINE i32 tail_call_value(Object value, i32 argc, i32 base) {\n"
+  "  if (IS_CFUNCTION(value)) {\n"
+  "    cfunctions[AS_HANDLE(value)]();\n"
+  "    return 1;\n"
+  "  }\n"
+  "  tail_args(base, check_call(value, argc, top - base));\n"
+  "  depth--;\n"
+  "  functions[FUNC_INDEX(value)]();\n"
+  "  return 0;\n"
+  "}\n";
+
+Buffer* code_buffer(struct C_state* state, struct C_context* ctx) {
+  if (ctx->func == NO_FUNCTION) {
+    return &state->program;
+  }
+  return &state->functions[ctx->func].code;
+}
+
+// Append one line of code, indented to the current block
+void emit(struct C_state* state, struct C_context* ctx, const char* fmt, ...) {
+  char line[MAX_LINE] = {0};
+  i32 indent = 2 * ctx->indent;
+  memset(line, ' ', indent);
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(&line[indent], MAX_LINE - indent - 1, fmt, args);
+  va_end(args);
+  strcat(line, "\n");
+  buffer_append(code_buffer(state, ctx), line);
+}
+
+void out(struct C_state* state, const char* fmt, ...) {
+  char line[MAX_LINE] = {0};
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(line, MAX_LINE, fmt, args);
+  va_end(args);
+  buffer_append(&state->output, line);
+}
+
+// Write the contents of a string literal as a C string literal
+void out_string(struct C_state* state, struct Token* token) {
+  out(state, "\"");
+  for (i32 i = 0; i < token->length; i++) {
+    u8 c = token->string[i];
+    if (c == '"' || c == '\\') {
+      out(state, "\\%c", c);
+    }
+    else if (c < ' ' || c >= 0x7f) {
+      out(state, "\\%03o", c);
+    }
+    else {
+      out(state, "%c", c);
+    }
+  }
+  out(state, "\"");
+}
+
+// C identifiers are made out of the prefix, the index and the funk name, e.g. f3_fib
+void c_name(char* name, char prefix, i32 index, struct Token* token) {
+  i32 length = snprintf(name, MAX_NAME, "%c%i_", prefix, index);
+  for (i32 i = 0; i < token->length && length < MAX_NAME - 1; i++, length++) {
+    char c = token->string[i];
+    name[length] = (isalnum(c) || c == '_') ? c : '_';
+  }
+  name[length] = '\0';
+}
+
+i32 value_add(struct C_state* state, struct Token token, struct Object value, i32 is_int) {
+  i32 index = state->values_count;
+  struct C_value c_value = {
+    .value = value,
+    .function = NO_FUNCTION,
+    .is_int = is_int,
+    .name = token,
+  };
+  list_push(state->values, state->values_count, state->values_capacity, c_value);
+  return index;
+}
+
+// Get the string handle of a string literal, identical literals share the same handle
+i32 string_add(struct C_state* state, struct Token* token) {
+  for (i32 i = 0; i < state->strings_count; i++) {
+    struct Token* string = &state->strings[i];
+    if (string->length == token->length && !strncmp(string->string, token->string, token->length)) {
+      return i;
+    }
+  }
+  i32 handle = state->strings_count;
+  list_push(state->strings, state->strings_count, state->strings_capacity, *token);
+  return handle;
+}
+
+i32 define_value(struct C_state* state, struct Token token, struct Function_state* fs, i32 type, i32 is_int, i32* index) {
+  char name[HTABLE_KEY_SIZE] = {};
+  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+
+  if (ht_lookup(&fs->symbol_table, name)) {
+    compile_error2(token, "Value '%.*s' has already been defined\n", token.length, token.string);
+    return state->status = ERR;
+  }
+  *index = value_add(state, token, object_of_type(type), is_int);
+  ht_insert_element(&fs->symbol_table, name, *index);
+  return NO_ERR;
+}
+
+i32 define_arg(struct C_state* state, struct Token token, struct Function_state* fs, i32* index) {
+  char name[HTABLE_KEY_SIZE] = {};
+  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+
+  if (ht_lookup(&fs->args, name)) {
+    compile_error2(token, "Parameter '%.*s' has already been defined\n", token.length, token.string);
+    return state->status = ERR;
+  }
+  *index = ht_num_elements(&fs->args);
+  ht_insert_element(&fs->args, name, *index);
+  return NO_ERR;
+}
+
+i32 lookup_arg(struct Token token, struct Function_state* fs, i32* index) {
+  char name[HTABLE_KEY_SIZE] = {};
+  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+
+  const i32* found = ht_lookup(&fs->args, name);
+  if (found) {
+    *index = *found;
+    return NO_ERR;
+  }
+  return ERR;
+}
+
+// Find a value in the function or in any of the functions that it is defined in
+i32 lookup_value(struct C_state* state, struct Token token, struct Function_state* fs, i32* index) {
+  char name[HTABLE_KEY_SIZE] = {};
+  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+
+  do {
+    const i32* found = ht_lookup(&fs->symbol_table, name);
+    if (found) {
+      *index = *found;
+      return NO_ERR;
+    }
+  } while ((fs = fs->parent) != NULL);
+  return ERR;
+}
+
+i32 get_value(struct C_state* state, struct Token token, struct Function_state* fs, i32* index) {
+  if (lookup_value(state, token, fs, index) != NO_ERR) {
+    compile_error2(token, "No such value '%.*s'\n", token.length, token.string);
+    return state->status = ERR;
+  }
+  return NO_ERR;
+}
+
+#define OP_CASE(OP) case T_##OP: return #OP
+
+const char* token_to_op(const struct Token* token) {
+  switch (token->type) {
+    OP_CASE(ADD);
+    OP_CASE(SUB);
+    OP_CASE(MUL);
+    OP_CASE(DIV);
+    OP_CASE(LT);
+    OP_CASE(GT);
+    OP_CASE(EQ);
+    default:
+      break;
+  }
+  return NULL;
+}
+
+// Does the range [first, last) generate no code at all? A call that is followed by it is then in tail position.
+i32 transparent(Ast* ast, i32 first, i32 last) {
+  for (i32 i = first; i < last; i++) {
+    struct Token* token = ast_get_node_value(ast, i);
+    if (!token) {
+      continue;
+    }
+    switch (token->type) {
+      case T_STRING:
+      case T_NUMBER:
+      case T_IDENTIFIER:
+      case T_LET:
+      case T_IF:
+      case T_ADD:
+      case T_SUB:
+      case T_MUL:
+      case T_DIV:
+      case T_LT:
+      case T_GT:
+      case T_EQ:
+        return 0;
+      case T_EXPR: {
+        Ast expr_branch = ast_get_node_at(ast, i);
+        if (!transparent(&expr_branch, 0, ast_child_count(&expr_branch))) {
+          return 0;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  return 1;
+}
+
+// Write the child of the ast as a C expression of type i32, if it is an expression where all operands
+// are known to be numbers at compile time. It can then be evaluated without the stack.
+i32 int_expr(struct C_state* state, Ast* ast, i32 index, struct C_context* ctx, char* expr, i32 size) {
+  struct Token* token = ast_get_node_value(ast, index);
+  if (!token) {
+    return ERR;
+  }
+  i32 length = 0;
+  switch (token->type) {
+    case T_NUMBER: {
+      i32 number = token->value.number;
+      if (number == INT32_MIN) {
+        length = snprintf(expr, size, "(-2147483647 - 1)");
+      }
+      else {
+        length = snprintf(expr, size, number < 0 ? "(%i)" : "%i", number);
+      }
+      break;
+    }
+    case T_IDENTIFIER: {
+      i32 value_index = -1;
+      if (lookup_arg(*token, ctx->fs, &value_index) == NO_ERR) {
+        if (!(ctx->fs->int_args & (1 << value_index))) {
+          return ERR;
+        }
+        length = snprintf(expr, size, "AS_NUMBER(stack[base + %i])", value_index);
+        break;
+      }
+      if (lookup_value(state, *token, ctx->fs, &value_index) != NO_ERR) {
+        return ERR;
+      }
+      struct C_value* value = &state->values[value_index];
+      if (object_type(value->value) != T_NUMBER) {
+        return ERR;
+      }
+      char name[MAX_NAME] = {0};
+      value_name(state, value_index, name);
+      length = snprintf(expr, size, value->is_int ? "%s" : "AS_NUMBER(%s)", name);
+      break;
+    }
+    case T_ADD:
+    case T_SUB:
+    case T_MUL:
+    case T_DIV:
+    case T_LT:
+    case T_GT:
+    case T_EQ: {
+      Ast op_branch = ast_get_node_at(ast, index);
+      if (ast_child_count(&op_branch) != 2) {
+        return ERR;
+      }
+      char left[MAX_INT_EXPR] = {0};
+      char right[MAX_INT_EXPR] = {0};
+      if (int_expr(state, &op_branch, 0, ctx, left, MAX_INT_EXPR) != NO_ERR) {
+        return ERR;
+      }
+      if (int_expr(state, &op_branch, 1, ctx, right, MAX_INT_EXPR) != NO_ERR) {
+        return ERR;
+      }
+      // NOTE(lucas): Division by zero is left to the machine, the same as in the vm
+      length = snprintf(expr, size, "%s(%s, %s)", token_to_op(token), left, right);
+      break;
+    }
+    case T_EXPR: {
+      Ast expr_branch = ast_get_node_at(ast, index);
+      if (ast_child_count(&expr_branch) != 1) {
+        return ERR;
+      }
+      return int_expr(state, &expr_branch, 0, ctx, expr, size);
+    }
+    default:
+      return ERR;
+  }
+  return length < size ? NO_ERR : ERR;
+}
+
+void value_name(struct C_state* state, i32 index, char* name) {
+  c_name(name, 'v', index, &state->values[index].name);
+}
+
+void function_name(struct C_state* state, i32 func, char* name) {
+  i32 index = state->functions[func].value;
+  c_name(name, 'f', index, &state->values[index].name);
+}
+
+// Call the value (that is not an argument) at the index, the arguments are on the stack
+void call_value(struct C_state* state, struct C_context* ctx, i32 index, i32 tail) {
+  struct C_value* value = &state->values[index];
+  char name[MAX_NAME] = {0};
+  if (IS_CFUNCTION(value->value)) {
+    emit(state, ctx, "%s();", cfunction_names[AS_HANDLE(value->value)]);
+    return;
+  }
+  if (value->function == NO_FUNCTION) {
+    // A let, the function is not known until run time
+    state->value_calls = 1;
+    value_name(state, index, name);
+    if (tail) {
+      emit(state, ctx, "if (!tail_call_value(%s, -1, base)) {", name);
+      emit(state, ctx, "  return;");
+      emit(state, ctx, "}");
+    }
+    else {
+      emit(state, ctx, "call_value(%s, -1);", name);
+    }
+    return;
+  }
+  struct C_function* func = &state->functions[value->function];
+  function_name(state, value->function, name);
+  if (tail) {
+    emit(state, ctx, "tail_args(base, %i);", func->argc);
+    if (value->function == ctx->func) {
+      func->self_tail_call = 1;
+      emit(state, ctx, "goto start;");
+      return;
+    }
+    emit(state, ctx, "depth--;");
+    emit(state, ctx, "%s();", name);
+    emit(state, ctx, "return;");
+    return;
+  }
+  emit(state, ctx, "call_args(%i);", func->argc);
+  emit(state, ctx, "%s();", name);
+}
+
+// Call the function value of an argument
+void call_arg(struct C_state* state, struct C_context* ctx, i32 arg, i32 argc, i32 tail) {
+  state->value_calls = 1;
+  if (tail) {
+    emit(state, ctx, "if (!tail_call_value(stack[base + %i], %i, base)) {", arg, argc);
+    emit(state, ctx, "  return;");
+    emit(state, ctx, "}");
+  }
+  else {
+    emit(state, ctx, "call_value(stack[base + %i], %i);", arg, argc);
+  }
+}
+
+void push_value(struct C_state* state, struct C_context* ctx, i32 index) {
+  struct C_value* value = &state->values[index];
+  char name[MAX_NAME] = {0};
+  if (value->function != NO_FUNCTION) {
+    emit(state, ctx, "push(MAKE_FUNCTION(%i, %i));", value->function, state->functions[value->function].argc);
+  }
+  else if (IS_CFUNCTION(value->value)) {
+    emit(state, ctx, "push(MAKE_CFUNCTION(%i));", AS_HANDLE(value->value));
+  }
+  else {
+    value_name(state, index, name);
+    emit(state, ctx, value->is_int ? "push(MAKE_NUMBER(%s));" : "push(%s);", name);
+  }
+}
+
+i32 generate_func(struct C_state* state, struct Token name, Ast* args, Ast* body, struct C_context* ctx) {
+  i32 status = NO_ERR;
+  i32 index = -1;
+  if (define_value(state, name, ctx->fs, T_FUNCTION, 0, &index) != NO_ERR) {
+    return state->status = ERR;
+  }
+
+  struct Function_state new_fs;
+  func_state_init(&new_fs, ctx->fs, NULL);
+
+  i32 arg_count = ast_child_count(args);
+  if (arg_count > MAX_ARGC) {
+    compile_error2(name, "Too many parameters\n");
+    status = ERR;
+    goto done;
+  }
+  for (i32 i = 0; i < arg_count; i++) {
+    struct Token* arg = ast_get_node_value(args, i);
+    if (arg) {
+      if (arg->type != T_IDENTIFIER) {
+        compile_error2((*arg), "Expected identifier in function argument list (got '%.*s')\n", arg->length, arg->string);
+        status = ERR;
+        goto done;
+      }
+      i32 arg_index = -1;
+      if ((status = define_arg(state, *arg, &new_fs, &arg_index)) != NO_ERR) {
+        goto done;
+      }
+      Ast arg_branch = ast_get_node_at(args, i);
+      struct Token* type_token = ast_get_node_value(&arg_branch, 0);
+      if (type_token) {
+        if (type_token->type != T_NUMBER) {
+          compile_error2((*type_token), "Only int parameters can be typed\n");
+          status = ERR;
+          goto done;
+        }
+        if (arg_index >= 31) {
+          compile_error2((*type_token), "Too many typed parameters\n");
+          status = ERR;
+          goto done;
+        }
+        new_fs.int_args |= 1 << arg_index;
+      }
+    }
+  }
+
+  struct C_function func = {
+    .value = index,
+    .argc = arg_count,
+    .int_args = new_fs.int_args,
+    .self_tail_call = 0,
+  };
+  buffer_init(&func.code);
+  state->values[index].function = state->functions_count;
+  state->values[index].value = MAKE_FUNCTION(state->functions_count, arg_count);
+  list_push(state->functions, state->functions_count, state->functions_capacity, func);
+
+  struct C_context func_ctx = {
+    .fs = &new_fs,
+    .func = state->values[index].function,
+    .indent = 1,
+  };
+  status = generate(state, body, &func_ctx, 1, NULL);
+done:
+  func_state_free(&new_fs);
+  return state->status = status;
+}
+
+i32 generate(struct C_state* state, Ast* ast, struct C_context* ctx, i32 tail, i32* branch_type) {
+  assert(ast);
+  return generate_range(state, ast, 0, ast_child_count(ast), ctx, tail, branch_type);
+}
+
+// Same as generate_range in code.c, the branch types are tracked in the same way so that the same
+// operations are type checked. Calls are in tail position if tail is set and nothing follows them.
+i32 generate_range(struct C_state* state, Ast* ast, i32 first, i32 last, struct C_context* ctx, i32 tail, i32* branch_type) {
+  assert(ast);
+  struct Token* token = NULL;
+  char expr[MAX_INT_EXPR] = {0};
+  char name[MAX_NAME] = {0};
+  i32 type = UNKNOWN_VALUES;
+  i32 num_values = 0;  // Number of expressions that pushed a value
+  i32 known = 1;  // Do we know the number of values that this range pushes?
+  for (i32 i = first; i < last; i++) {
+    if ((token = ast_get_node_value(ast, i))) {
+      i32 pushes_value = 1;
+      i32 prev_type = type;
+      type = UNKNOWN_VALUES;
+      switch (token->type) {
+        case T_NUMBER: {
+          int_expr(state, ast, i, ctx, expr, MAX_INT_EXPR);
+          emit(state, ctx, "push(MAKE_NUMBER(%s));", expr);
+          type = T_NUMBER;
+          break;
+        }
+        case T_STRING: {
+          emit(state, ctx, "push(MAKE_STRING(%i));", string_add(state, token));
+          type = T_STRING;
+          break;
+        }
+        case T_IDENTIFIER: {
+          i32 index = -1;
+          i32 is_arg = 0;
+          if (lookup_arg(*token, ctx->fs, &index) == NO_ERR) {
+            is_arg = 1;
+            type = (ctx->fs->int_args & (1 << index)) ? T_NUMBER : T_UNKNOWN;
+          }
+          else if (get_value(state, *token, ctx->fs, &index) != NO_ERR) {
+            return state->status = ERR;
+          }
+
+          Ast args = i + 1 < last ? ast_get_node_at(ast, i + 1) : NULL;
+          struct Token* args_token = args ? ast_get_value(&args) : NULL;
+          if (!is_arg) {
+            struct Object value = state->values[index].value;
+            if ((IS_FUNCTION(value) || IS_CFUNCTION(value)) && args_token && args_token->type == T_EXPR) {
+              if (ast_child_count(&args) > 0) {
+                if (generate(state, &args, ctx, 0, NULL) != NO_ERR) {
+                  return state->status;
+                }
+              }
+              i++;
+              call_value(state, ctx, index, tail && transparent(ast, i + 1, last));
+              type = UNKNOWN_VALUES;
+              break;
+            }
+            type = object_type(value);
+            push_value(state, ctx, index);
+            break;
+          }
+          // Local function call
+          if (args_token && args_token->type == T_EXPR) {
+            i32 num_args = ast_child_count(&args);
+            if (num_args > 0) {
+              if (generate(state, &args, ctx, 0, NULL) != NO_ERR) {
+                return state->status;
+              }
+            }
+            i++;
+            call_arg(state, ctx, index, num_args, tail && transparent(ast, i + 1, last));
+            type = UNKNOWN_VALUES;
+            break;
+          }
+          emit(state, ctx, "push(stack[base + %i]);", index);
+          break;
+        }
+        // let
+        // \-- identifier
+        //        \--type (optional)
+        //     \-- (expression)
+        case T_LET: {
+          Ast let_branch = ast_get_node_at(ast, i);
+          Ast ident_branch = ast_get_node_at(&let_branch, 0);
+          Ast value_branch = ast_get_node_at(&let_branch, 1);
+          assert(ast_child_count(&value_branch) == 1);
+
+          pushes_value = 0;
+          struct Token* ident = ast_get_value(&ident_branch);
+          struct Token* type_token = ast_get_node_value(&ident_branch, 0);
+          assert(ident);
+
+          i32 index = -1;
+          i32 let_type = T_UNKNOWN;
+          if (type_token) {
+            if (type_token->type == T_IDENTIFIER) {
+              i32 type_index = -1;
+              if (get_value(state, *type_token, ctx->fs, &type_index) == NO_ERR) {
+                let_type = object_type(state->values[type_index].value);
+              }
+              else {
+                compile_error2((*type_token), "The type '%.*s' is not defined\n", type_token->length, type_token->string);
+                return state->status = ERR;
+              }
+            }
+            else {
+              let_type = type_token->type;
+            }
+          }
+          // Lets that are declared as int are native C variables
+          i32 is_int = type_token && let_type == T_NUMBER;
+          if (define_value(state, *ident, ctx->fs, let_type, is_int, &index) != NO_ERR) {
+            return state->status = ERR;
+          }
+          value_name(state, index, name);
+
+          i32 value_branch_type = UNKNOWN_VALUES;
+          i32 assigned = 0;
+          if (int_expr(state, &let_branch, 1, ctx, expr, MAX_INT_EXPR) == NO_ERR) {
+            value_branch_type = T_NUMBER;
+            emit(state, ctx, is_int ? "%s = %s;" : "%s = MAKE_NUMBER(%s);", name, expr);
+            assigned = 1;
+          }
+          else if (generate(state, &value_branch, ctx, 0, &value_branch_type) != NO_ERR) {
+            return state->status = ERR;
+          }
+          // The type of a call is not known, an int let then checks the value when it is assigned
+          i32 unknown = value_branch_type == UNKNOWN_VALUES || value_branch_type == T_UNKNOWN;
+          if (type_token && !unknown && let_type != value_branch_type) {
+            compile_error2((*type_token), "This expression was expected to have type '%.*s'\n", type_token->length, type_token->string);
+            return state->status = ERR;
+          }
+          if (value_branch_type == UNKNOWN_VALUES) {
+            // The assignment pops whatever is on top of the stack, which might not be the value of this expression
+            known = 0;
+            value_branch_type = T_UNKNOWN;
+          }
+          if (is_int) {
+            value_branch_type = T_NUMBER;
+          }
+          state->values[index].value = object_of_type(value_branch_type);
+          if (!assigned) {
+            emit(state, ctx, is_int ? (unknown ? "%s = pop_int();" : "%s = AS_NUMBER(pop());") : "%s = pop();", name);
+          }
+          break;
+        }
+        case T_DEFINE: {
+          pushes_value = 0;
+          Ast func = ast_get_node_at(ast, i);
+          if ((token = ast_get_node_value(&func, 0))) {
+            Ast args = ast_get_node_at(&func, 1);
+            Ast body = ast_get_node_at(&func, 2);
+            assert(args && body);
+            if (generate_func(state, *token, &args, &body, ctx) != NO_ERR) {
+              return state->status;
+            }
+          }
+          else {
+            assert(0);
+          }
+          break;
+        }
+        case T_IF: {
+          Ast if_branch = ast_get_node_at(ast, i);
+          assert(if_branch);
+          Ast cond = ast_get_node_at(&if_branch, 0);
+          Ast true_body = ast_get_node_at(&if_branch, 1);
+          Ast false_body = ast_get_node_at(&if_branch, 2);
+          assert(cond && true_body && false_body);
+          i32 cond_type = UNKNOWN_VALUES;
+          i32 true_type = UNKNOWN_VALUES;
+          i32 false_type = UNKNOWN_VALUES;
+          i32 body_tail = tail && transparent(ast, i + 1, last);
+
+          if (int_expr(state, &if_branch, 0, ctx, expr, MAX_INT_EXPR) == NO_ERR) {
+            cond_type = T_NUMBER;
+            emit(state, ctx, "if (%s) {", expr);
+          }
+          else {
+            if (generate(state, &cond, ctx, 0, &cond_type) != NO_ERR) {
+              return state->status;
+            }
+            emit(state, ctx, "if (is_true(pop())) {");
+          }
+          ctx->indent++;
+          if (generate(state, &true_body, ctx, body_tail, &true_type) != NO_ERR) {
+            return state->status;
+          }
+          ctx->indent--;
+          if (ast_child_count(&false_body) > 0) {
+            emit(state, ctx, "}");
+            emit(state, ctx, "else {");
+            ctx->indent++;
+            if (generate(state, &false_body, ctx, body_tail, &false_type) != NO_ERR) {
+              return state->status;
+            }
+            ctx->indent--;
+          }
+          emit(state, ctx, "}");
+          if (cond_type == UNKNOWN_VALUES || true_type == UNKNOWN_VALUES || false_type == UNKNOWN_VALUES) {
+            type = UNKNOWN_VALUES;
+          }
+          else {
+            type = true_type == false_type ? true_type : T_UNKNOWN;
+          }
+          break;
+        }
+        case T_ADD:
+        case T_SUB:
+        case T_MUL:
+        case T_DIV:
+        case T_LT:
+        case T_GT:
+        case T_EQ: {
+          if (int_expr(state, ast, i, ctx, expr, MAX_INT_EXPR) == NO_ERR) {
+            emit(state, ctx, "push(MAKE_NUMBER(%s));", expr);
+            type = T_NUMBER;
+            break;
+          }
+          Ast op_branch = ast_get_node_at(ast, i);
+          assert(op_branch);
+          if (ast_child_count(&op_branch) < 2) {
+            compile_error2((*token), "Missing operands\n");
+            return state->status = ERR;
+          }
+          i32 left_type = UNKNOWN_VALUES;
+          i32 right_type = UNKNOWN_VALUES;
+          if (generate_range(state, &op_branch, 0, 1, ctx, 0, &left_type) != NO_ERR) {
+            return state->status;
+          }
+          if (generate_range(state, &op_branch, 1, ast_child_count(&op_branch), ctx, 0, &right_type) != NO_ERR) {
+            return state->status;
+          }
+          if (left_type == T_NUMBER && right_type == T_NUMBER) {
+            emit(state, ctx, "ARITH_INT(%s);", token_to_op(token));
+          }
+          else if (token->type == T_EQ) {
+            emit(state, ctx, "equal_values();");
+          }
+          else {
+            emit(state, ctx, "ARITH(%s);", token_to_op(token));
+          }
+          type = (left_type == UNKNOWN_VALUES || right_type == UNKNOWN_VALUES) ? UNKNOWN_VALUES : T_NUMBER;
+          break;
+        }
+        case T_EXPR: {
+          Ast expr_branch = ast_get_node_at(ast, i);
+          if (ast_child_count(&expr_branch) == 0) {
+            pushes_value = 0;
+          }
+          else if (int_expr(state, ast, i, ctx, expr, MAX_INT_EXPR) == NO_ERR) {
+            emit(state, ctx, "push(MAKE_NUMBER(%s));", expr);
+            type = T_NUMBER;
+          }
+          else if (generate(state, &expr_branch, ctx, tail && transparent(ast, i + 1, last), &type) != NO_ERR) {
+            return state->status;
+          }
+          break;
+        }
+        default:
+          pushes_value = 0;
+          break;
+      }
+      if (!pushes_value) {
+        type = prev_type;
+      }
+      else {
+        num_values++;
+        if (type == UNKNOWN_VALUES) {
+          known = 0;
+        }
+      }
+    }
+  }
+  if (branch_type) {
+    *branch_type = (known && num_values == 1) ? type : UNKNOWN_VALUES;
+  }
+  return state->status;
+}
+
+void output_c(struct C_state* state) {
+  char name[MAX_NAME] = {0};
+  out(state, "// Generated by funk\n\n");
+  out(state, "#define MAX_STACK %i\n", MAX_STACK);
+  out(state, "#define MAX_FRAMES %i\n\n", MAX_FRAMES);
+  buffer_append(&state->output, (char*)runtime);
+
+  out(state, "\n");
+  if (state->strings_count > 0) {
+    out(state, "static const struct String strings[] = {\n");
+    for (i32 i = 0; i < state->strings_count; i++) {
+      out(state, "  { ");
+      out_string(state, &state->strings[i]);
+      out(state, ", %i },\n", state->strings[i].length);
+    }
+    out(state, "};\n\n");
+    out(state, "INLINE struct String string_get(i32 handle) {\n  return strings[handle];\n}\n");
+  }
+  else {
+    out(state, "INLINE struct String string_get(i32 handle) {\n  (void)handle;\n  return (struct String) { NULL, 0 };\n}\n");
+  }
+
+  out(state, "\n");
+  for (i32 i = 0; i < state->values_count; i++) {
+    struct C_value* value = &state->values[i];
+    if (value->function != NO_FUNCTION || IS_CFUNCTION(value->value)) {
+      continue;
+    }
+    value_name(state, i, name);
+    if (value->is_int) {
+      out(state, "static i32 %s = 0;\n", name);
+    }
+    else {
+      out(state, "static Object %s = { .bits = 0x%llxull };\n", name, (unsigned long long)MAKE_UNKNOWN().bits);
+    }
+  }
+
+  out(state, "\n");
+  for (i32 i = 0; i < state->functions_count; i++) {
+    function_name(state, i, name);
+    out(state, "static void %s(void);\n", name);
+  }
+  if (state->value_calls) {
+    out(state, "\nstatic void (*const functions[])(void) = {\n");
+    for (i32 i = 0; i < state->functions_count; i++) {
+      function_name(state, i, name);
+      out(state, "  %s,\n", name);
+    }
+    out(state, "  NULL,\n};\n\n");
+    buffer_append(&state->output, (char*)runtime_calls);
+  }
+
+  for (i32 i = 0; i < state->functions_count; i++) {
+    struct C_function* func = &state->functions[i];
+    function_name(state, i, name);
+    out(state, "\nstatic void %s(void) {\n", name);
+    out(state, "  const i32 base = top - %i;\n", func->argc);
+    out(state, "  enter();\n");
+    if (func->self_tail_call) {
+      out(state, "start:\n");
+    }
+    for (i32 arg = 0; arg < func->argc; arg++) {
+      if (func->int_args & (1 << arg)) {
+        out(state, "  check_int_arg(base, %i);\n", arg);
+      }
+    }
+    if (func->code.data) {
+      buffer_append_n(&state->output, func->code.data, func->code.length);
+    }
+    out(state, "  leave(base, %i);\n", func->argc);
+    out(state, "}\n");
+  }
+
+  out(state, "\nstatic void program(void) {\n");
+  if (state->program.data) {
+    buffer_append_n(&state->output, state->program.data, state->program.length);
+  }
+  out(state, "}\n\n");
+  out(state, "int main(void) {\n");
+  out(state, "  if (!setjmp(error_exit)) {\n");
+  out(state, "    program();\n");
+  out(state, "  }\n");
+  out(state, "  print_stack();\n");
+  out(state, "  return 0;\n");
+  out(state, "}\n");
+}
+
+i32 code_gen_c(struct C_state* state, Ast* ast) {
+  struct C_context ctx = {
+    .fs = &state->fs_global,
+    .func = NO_FUNCTION,
+    .indent = 1,
+  };
+  if (generate(state, ast, &ctx, 0, NULL) != NO_ERR) {
+    return state->status = ERR;
+  }
+  output_c(state);
+  return state->status;
+}
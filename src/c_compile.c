@@ -0,0 +1,94 @@
+// c_compile.c
+
+#include "common.h"
+#include "list.h"
+#include "util.h"
+#include "ast.h"
+#include "optimize.h"
+#include "parser.h"
+#include "c_code.h"
+#include "c_compile.h"
+
+static void compile_state_init(struct C_state* state);
+static void compile_state_free(struct C_state* state);
+static i32 output_program(struct C_state* state, char* path);
+
+void compile_state_init(struct C_state* state) {
+  state->status = NO_ERR;
+  state->values = NULL;
+  state->values_count = 0;
+  state->values_capacity = 0;
+  state->functions = NULL;
+  state->functions_count = 0;
+  state->functions_capacity = 0;
+  state->strings = NULL;
+  state->strings_count = 0;
+  state->strings_capacity = 0;
+  state->value_calls = 0;
+  func_state_init(&state->fs_global, NULL, NULL);
+  buffer_init(&state->program);
+  buffer_init(&state->output);
+
+  // The built-in print function is C function 0, the same as in the vm
+  struct C_value print = {
+    .value = MAKE_CFUNCTION(0),
+    .function = -1,
+    .is_int = 0,
+    .name = { .string = "print", .length = 5, },
+  };
+  Hkey name = "print";
+  ht_insert_element(&state->fs_global.symbol_table, name, state->values_count);
+  list_push(state->values, state->values_count, state->values_capacity, print);
+}
+
+void compile_state_free(struct C_state* state) {
+  for (i32 i = 0; i < state->functions_count; i++) {
+    buffer_free(&state->functions[i].code);
+  }
+  list_free(state->functions, state->functions_count, state->functions_capacity);
+  list_free(state->values, state->values_count, state->values_capacity);
+  list_free(state->strings, state->strings_count, state->strings_capacity);
+  func_state_free(&state->fs_global);
+  buffer_free(&state->program);
+  buffer_free(&state->output);
+}
+
+i32 output_program(struct C_state* state, char* path) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    fprintf(stderr, "Failed to open file '%s'\n", path);
+    return ERR;
+  }
+  fwrite(state->output.data, state->output.length, 1, fp);
+  fclose(fp);
+  return NO_ERR;
+}
+
+i32 run_c(char* path) {
+  i32 result = NO_ERR;
+  u32 source_size = 0;
+  char* source = read_file(path, &source_size);
+  if (source) {
+    struct C_state state;
+    compile_state_init(&state);
+
+    Arena arena;
+    arena_init(&arena);
+    Ast ast = ast_create();
+    if ((result = parser_parse(source, path, &arena, &ast)) == NO_ERR) {
+      optimize_ast(&ast);
+      if ((result = code_gen_c(&state, &ast)) == NO_ERR) {
+        char output_path[MAX_PATH_SIZE] = {0};
+        snprintf(output_path, MAX_PATH_SIZE, "%s.c", path);
+        result = output_program(&state, output_path);
+      }
+    }
+    arena_free(&arena);
+    m_free(source, source_size);
+    compile_state_free(&state);
+  }
+  else {
+    return ERR;
+  }
+  return result;
+}
@@ -2,24 +2,20 @@
 // Code generator (abstract syntax tree -> byte code)
 
 #include "common.h"
+#include "memory.h"
 #include "ast.h"
 #include "vm.h"
 #include "util.h"
 #include "error.h"
+#include "peephole.h"
+#include "ir.h"
 #include "code.h"
 
-#define compile_error(fmt, ...) \
-  fprintf(stderr, "compile-error: " fmt, ##__VA_ARGS__)
-
-#define compile_error2(token, fmt, ...) \
-  fprintf(stderr, "compile-error: %s:%i:%i: " fmt, token.filename, token.line, token.count, ##__VA_ARGS__); \
-  error_printline((&token.source[0]), token)
-
 #define UNRESOLVED_JUMP 0
 
 struct Ins_desc;
 
-typedef void (*ins_desc_callback)(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg_index, FILE* fp);
+typedef void (*ins_desc_callback)(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg, i32 value, FILE* fp);
 
 typedef struct Ins_desc {
   const char* name;
@@ -27,32 +23,36 @@ typedef struct Ins_desc {
   ins_desc_callback callback;
 } Ins_desc;
 
-static i32 num_values_added = 0; // How many values was added in this code generation pass?
-static i32 old_program_size = 0;  // To know how much of the program that we need to shrink back to in case of a rollback
-static Htable symbols;  // Which symbols was added in this code generation pass?
+// Jump whose offset is resolved when the label has been placed
+struct Jump_fixup {
+  i32 index;  // Index of the jump offset in the code
+  i32 label;
+};
+
+static i32 errors_reported = 0;  // How many compile errors was reported in this code generation pass?
 
 // Code generating functions
-static i32 set_branch_type(i32* branch_type, i32 type);
-static i32 ins_add(struct VM_state* vm, i32 instruction, i32* ins_count);
-static i32 value_add(struct VM_state* vm, struct Object value);
-static i32 define_value(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address);
-static i32 define_value_and_type(struct VM_state* vm, struct Token token, struct Function_state* fs, i32 type, i32* address);
-static i32 define_arg(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address);
-static i32 get_arg_value_address(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address);
-static i32 get_value_address(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address);
-static i32 token_to_op(const struct Token* token);
-static i32 generate_func(struct VM_state* vm, struct Token name, Ast* args, Ast* body, struct Function_state* fs, i32* ins_count);
-static i32 generate(struct VM_state* vm, Ast* ast, struct Function_state* fs, i32* ins_count, i32* branch_type);
+static i32 ins_add(struct VM_state* vm, i32 instruction);
+static i32 call_cache_add(struct VM_state* vm);
+static i32 op_to_ins(i32 op, i32 flags);
+static void generate_temp(struct VM_state* vm, Ir* ir, i32 temp);
+#if defined(USE_LAZY_COMPILE)
+static void stub_add(struct VM_state* vm, Ir* ir, i32 start, i32 end);
+#endif
+static void generate(struct VM_state* vm, Ir* ir, i32 entry);
 
 // Functions for writing byte-code descriptions to files
-static void output_byte_code(struct VM_state* vm, const char* path);
-static void desc_value_ins(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg_index, FILE* fp);
+static void output_byte_code(struct VM_state* vm, const struct Ir_stats* removed, const struct Peephole_stats* stats, const char* path);
+static void desc_value_ins(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg, i32 value, FILE* fp);
+static void desc_arg_value_ins(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg, i32 value, FILE* fp);
+static void desc_value_arg_ins(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg, i32 value, FILE* fp);
 
 // The order of the instruction descriptors are based on the Instruction enum from code.h.
 static Ins_desc ins_desc[MAX_INS] = {
   {"exit",        0,  NULL},
   {"unknown",     0,  NULL},
   {"nop",         0,  NULL},
+  {"wide",        0,  NULL},
 
   {"push",        1,  desc_value_ins},
   {"push_arg",    1,  NULL},
@@ -61,8 +61,11 @@ static Ins_desc ins_desc[MAX_INS] = {
   {"cond_jump",   1,  NULL},
   {"jump",        1,  NULL},
   {"return",      0,  NULL},
-  {"call",        1,  desc_value_ins},
-  {"local_call",  1,  NULL},
+  {"call",        2,  desc_value_arg_ins},
+  {"local_call",  2,  NULL},
+  {"tail_call",   2,  desc_value_arg_ins},
+  {"local_tail_call", 2, NULL},
+  {"check_int_args", 1, NULL},
 
   {"add",         0,  NULL},
   {"sub",         0,  NULL},
@@ -72,156 +75,250 @@ static Ins_desc ins_desc[MAX_INS] = {
   {"lt",          0,  NULL},
   {"gt",          0,  NULL},
   {"eq",          0,  NULL},
+
+  {"add_int",     0,  NULL},
+  {"sub_int",     0,  NULL},
+  {"mul_int",     0,  NULL},
+  {"div_int",     0,  NULL},
+  {"lt_int",      0,  NULL},
+  {"gt_int",      0,  NULL},
+  {"eq_int",      0,  NULL},
+
+  {"push_arg_push_add", 2, desc_arg_value_ins},
+  {"push_arg_push_sub", 2, desc_arg_value_ins},
+  {"push_add",    1,  desc_value_ins},
+  {"push_sub",    1,  desc_value_ins},
+  {"lt_cond_jump", 1, NULL},
+  {"gt_cond_jump", 1, NULL},
+  {"eq_cond_jump", 1, NULL},
+  {"push_lt_cond_jump", 2, desc_value_arg_ins},
+  {"push_gt_cond_jump", 2, desc_value_arg_ins},
+  {"push_eq_cond_jump", 2, desc_value_arg_ins},
+
+  {"push_arg_push_add_int", 2, desc_arg_value_ins},
+  {"push_arg_push_sub_int", 2, desc_arg_value_ins},
+  {"push_add_int", 1, desc_value_ins},
+  {"push_sub_int", 1, desc_value_ins},
+  {"lt_cond_jump_int", 1, NULL},
+  {"gt_cond_jump_int", 1, NULL},
+  {"eq_cond_jump_int", 1, NULL},
+  {"push_lt_cond_jump_int", 2, desc_value_arg_ins},
+  {"push_gt_cond_jump_int", 2, desc_value_arg_ins},
+  {"push_eq_cond_jump_int", 2, desc_value_arg_ins},
+
+  {"push_arg_local_call", 3, NULL},
+  {"push_arg_local_tail_call", 3, NULL},
+
+  {"push_assign", 2,  desc_value_arg_ins},
+  {"shl_int",     1,  NULL},
+  {"shr_int",     1,  NULL},
+
+  {"compile",     1,  NULL},
 };
 
-void output_byte_code(struct VM_state* vm, const char* path) {
+i32 ins_argc(i32 instruction) {
+  assert(instruction >= 0 && instruction < MAX_INS);
+  return ins_desc[instruction].argc;
+}
+
+i32 ins_jump_arg(i32 instruction) {
+  switch (instruction) {
+    case I_COND_JUMP:
+    case I_JUMP:
+    case I_LT_COND_JUMP:
+    case I_GT_COND_JUMP:
+    case I_EQ_COND_JUMP:
+    case I_LT_COND_JUMP_INT:
+    case I_GT_COND_JUMP_INT:
+    case I_EQ_COND_JUMP_INT:
+      return 0;
+    case I_PUSH_LT_COND_JUMP:
+    case I_PUSH_GT_COND_JUMP:
+    case I_PUSH_EQ_COND_JUMP:
+    case I_PUSH_LT_COND_JUMP_INT:
+    case I_PUSH_GT_COND_JUMP_INT:
+    case I_PUSH_EQ_COND_JUMP_INT:
+      return 1;
+    default:
+      break;
+  }
+  return -1;
+}
+
+i32 ins_value_arg(i32 instruction, i32 arg) {
+  switch (instruction) {
+    case I_PUSH:
+    case I_ASSIGN:
+    case I_CALL:
+    case I_TAIL_CALL:
+    case I_PUSH_ADD:
+    case I_PUSH_SUB:
+    case I_PUSH_LT_COND_JUMP:
+    case I_PUSH_GT_COND_JUMP:
+    case I_PUSH_EQ_COND_JUMP:
+    case I_PUSH_ADD_INT:
+    case I_PUSH_SUB_INT:
+    case I_PUSH_LT_COND_JUMP_INT:
+    case I_PUSH_GT_COND_JUMP_INT:
+    case I_PUSH_EQ_COND_JUMP_INT:
+      return arg == 0;
+    case I_PUSH_ARG_PUSH_ADD:
+    case I_PUSH_ARG_PUSH_SUB:
+    case I_PUSH_ARG_PUSH_ADD_INT:
+    case I_PUSH_ARG_PUSH_SUB_INT:
+      return arg == 1;
+    case I_PUSH_ASSIGN:
+      return arg == 0 || arg == 1;
+    default:
+      break;
+  }
+  return 0;
+}
+
+i32 ins_cache_arg(i32 instruction) {
+  switch (instruction) {
+    case I_CALL:
+    case I_LOCAL_CALL:
+    case I_TAIL_CALL:
+    case I_LOCAL_TAIL_CALL:
+      return 1;
+    case I_PUSH_ARG_LOCAL_CALL:
+    case I_PUSH_ARG_LOCAL_TAIL_CALL:
+      return 2;
+    default:
+      break;
+  }
+  return -1;
+}
+
+i32 ins_decode(const u8* program, i32 program_size, i32 at, struct Decoded* d) {
+  if (at < 0 || at >= program_size) {
+    return ERR;
+  }
+  i32 wide = program[at] == I_WIDE;
+  i32 p = at + wide;
+  if (p >= program_size || program[p] >= MAX_INS) {
+    return ERR;
+  }
+  d->ins = program[p++];
+  i32 argc = ins_argc(d->ins);
+  i32 jump_arg = ins_jump_arg(d->ins);
+  i32 arg_size = wide ? WIDE_ARG_SIZE : ARG_SIZE;
+  if (argc > 3 || p + argc * arg_size > program_size) {
+    return ERR;
+  }
+  for (i32 i = 0; i < argc; i++, p += arg_size) {
+    if (wide) {
+      d->args[i] = READ_WIDE_ARG(&program[p]);
+    }
+    else {
+      d->args[i] = (i == jump_arg) ? READ_JUMP_ARG(&program[p]) : READ_ARG(&program[p]);
+    }
+  }
+  d->size = p - at;
+  return NO_ERR;
+}
+
+void output_byte_code(struct VM_state* vm, const struct Ir_stats* removed, const struct Peephole_stats* stats, const char* path) {
   FILE* fp = fopen(path, "w");
   if (!fp) {
     fprintf(stderr, "Failed to open file '%s'\n", path);
     return;
   }
-  for (i32 i = 0; i < vm->program_size; i++) {
-    i32 ins = vm->program[i];
+  for (i32 i = 0; i < vm->program_size;) {
+    i32 address = i;
+    i32 wide = vm->program[i] == I_WIDE;
+    if (wide) {
+      i++;
+    }
+    i32 ins = vm->program[i++];
     assert(ins >= 0 && ins < MAX_INS);
     Ins_desc desc = ins_desc[ins];
     if (desc.argc > 0) {
-      fprintf(fp, "%.4i %-14s", i, desc.name);
+      char name[32] = {0};
+      snprintf(name, sizeof(name), "%s%s", wide ? "wide " : "", desc.name);
+      fprintf(fp, "%.4i %-30s", address, name);
       for (i32 arg = 0; arg < desc.argc; arg++) {
+        i32 value = 0;
+        if (wide) {
+          value = READ_WIDE_ARG(&vm->program[i]);
+          i += WIDE_ARG_SIZE;
+        }
+        else {
+          value = (arg == ins_jump_arg(ins)) ? READ_JUMP_ARG(&vm->program[i]) : READ_ARG(&vm->program[i]);
+          i += ARG_SIZE;
+        }
         if (desc.callback) {
-          desc.callback(vm, &desc, ins, i + arg + 1, fp);
+          desc.callback(vm, &desc, ins, arg, value, fp);
         }
         else {
-          fprintf(fp, "%i", vm->program[i + arg + 1]);
+          fprintf(fp, "%i", value);
         }
         if (arg < (desc.argc - 1)) {
           fprintf(fp, ", ");
         }
       }
       fprintf(fp, "\n");
-      i += desc.argc;
     }
     else {
-      fprintf(fp, "%.4i %s\n", i, desc.name);
+      fprintf(fp, "%.4i %s\n", address, desc.name);
     }
   }
+  // What the peephole optimizer did to the code of the last code generation pass
+  fprintf(fp, "// %i of %i instructions removed (%i jumps threaded, %i jumps removed, %i operations reduced)\n",
+    stats->ins_before - stats->ins_after, stats->ins_before, stats->jumps_threaded, stats->jumps_removed, stats->reduced);
+  // And what was removed from the ir before the code was generated
+  fprintf(fp, "// %i unreferenced functions, %i ir instructions and %i values (%i bytes) removed\n",
+    removed->functions, removed->ins, removed->values, removed->values * (i32)sizeof(struct Object));
   if (fp != stdout && fp != stderr) {
     fclose(fp);
   }
 }
 
-void desc_value_ins(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg_index, FILE* fp) {
-  i32 arg = vm->program[arg_index];
-  fprintf(fp, "%i (value = ", arg);
-  struct Object* value = &vm->values[arg];
-  assert(value);
-  object_print(fp, value);
+void desc_value_ins(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg, i32 value, FILE* fp) {
+  i32 address = value;
+  fprintf(fp, "%i (value = ", address);
+  assert(address >= 0 && address < vm->values_count);
+  object_print(vm, fp, &vm->values[address]);
   fprintf(fp, ")");
 }
 
-i32 set_branch_type(i32* branch_type, i32 type) {
-  if (branch_type) {
-    *branch_type = type;
-    return NO_ERR;
+// Argument index followed by a value address
+void desc_arg_value_ins(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg, i32 value, FILE* fp) {
+  if (arg == 1) {
+    desc_value_ins(vm, ins_desc, instruction, arg, value, fp);
+    return;
   }
-  return ERR;
-}
-
-i32 ins_add(struct VM_state* vm, i32 instruction, i32* ins_count) {
-  list_push(vm->program, vm->program_size, instruction);
-  if (ins_count)
-    (*ins_count)++;
-  return NO_ERR;
-}
-
-i32 value_add(struct VM_state* vm, struct Object value) {
-  i32 address = vm->values_count;
-  list_push(vm->values, vm->values_count, value);
-  num_values_added++;
-  return address;
+  fprintf(fp, "%i", value);
 }
 
-i32 define_value(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address) {
-  return define_value_and_type(vm, token, fs, T_UNKNOWN, address);
-}
-
-i32 define_value_and_type(struct VM_state* vm, struct Token token, struct Function_state* fs, i32 type, i32* address) {
-  char name[HTABLE_KEY_SIZE] = {};
-  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
-
-  struct Object obj = (struct Object) { .type = type, };
-  const i32* found = ht_lookup(&fs->symbol_table, name);
-  if (found) {
-    compile_error2(token, "Value '%.*s' has already been defined\n", token.length, token.string);
-    return vm->status = ERR;
-  }
-  else {
-    *address = value_add(vm, obj);
-    ht_insert_element(&fs->symbol_table, name, *address);
-    if (fs == &vm->fs_global) {
-      // NOTE(lucas): Keep track of new global symbols that was added in
-      // this code generation pass (to be able to do rollback on the global symbol table in case of error(s))
-      ht_insert_element(&symbols, name, *address);
-    }
+// Value address followed by a plain argument (jump offset or inline cache index)
+void desc_value_arg_ins(struct VM_state* vm, struct Ins_desc* ins_desc, i32 instruction, i32 arg, i32 value, FILE* fp) {
+  if (arg == 0) {
+    desc_value_ins(vm, ins_desc, instruction, arg, value, fp);
+    return;
   }
-  return NO_ERR;
+  fprintf(fp, "%i", value);
 }
 
-static i32 define_arg(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address) {
-  char name[HTABLE_KEY_SIZE] = {};
-  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
-
-  const i32* found = ht_lookup(&fs->args, name);
-  if (found) {
-    compile_error2(token, "Parameter '%.*s' has already been defined\n", token.length, token.string);
-    return vm->status = ERR;
-  }
-  else {
-    *address = ht_num_elements(&fs->args);
-    ht_insert_element(&fs->args, name, *address);
-  }
+i32 ins_add(struct VM_state* vm, i32 instruction) {
+  list_push(vm->code, vm->code_size, vm->code_capacity, instruction);
   return NO_ERR;
 }
 
-i32 get_arg_value_address(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address) {
-  char name[HTABLE_KEY_SIZE] = {};
-  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
-
-  const i32* found = ht_lookup(&fs->args, name);
-  if (found) {
-    *address = *found;
-    return NO_ERR;
-  }
-  return ERR;
+// Every call site gets an inline cache, which is empty until the call is executed
+i32 call_cache_add(struct VM_state* vm) {
+  i32 index = vm->caches_count;
+  struct Call_cache cache = { .func.bits = 0, };
+  list_push(vm->caches, vm->caches_count, vm->caches_capacity, cache);
+  return index;
 }
 
-i32 get_value_address(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address) {
-  char name[HTABLE_KEY_SIZE] = {};
-  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+#define OP_CASE(OP) case T_##OP: ins = I_##OP; break
 
-  i32 found_value = 0;
-  do {
-    const i32* found = ht_lookup(&fs->symbol_table, name);
-    if (found) {
-      found_value = 1;
-      *address = *found;
-      break;
-    }
-    if (fs == &vm->fs_global) {
-      break;
-    }
-  } while ((fs = fs->parent) != NULL);
-
-  if (!found_value) {
-    compile_error2(token, "No such value '%.*s'\n", token.length, token.string);
-    return vm->status = ERR;
-  }
-  return NO_ERR;
-}
-
-#define OP_CASE(OP) case T_##OP: return I_##OP
-
-i32 token_to_op(const struct Token* token) {
-  switch (token->type) {
+i32 op_to_ins(i32 op, i32 flags) {
+  i32 ins = I_UNKNOWN;
+  switch (op) {
     OP_CASE(ADD);
     OP_CASE(SUB);
     OP_CASE(MUL);
@@ -230,335 +327,252 @@ i32 token_to_op(const struct Token* token) {
     OP_CASE(GT);
     OP_CASE(EQ);
     default:
+      assert(0);
       break;
   }
-  return I_UNKNOWN;
+  if (flags & IR_INT) {
+    ins += I_ADD_INT - I_ADD;
+  }
+  return ins;
 }
 
-i32 generate_func(struct VM_state* vm, struct Token name, Ast* args, Ast* body, struct Function_state* fs, i32* ins_count) {
-  i32 status = NO_ERR;
-  // Allocate a new value for this function
-  i32 address = -1;
-  if (define_value(vm, name, fs, &address) != NO_ERR) {
-    return vm->status = ERR;
+// Push the value of a temporary
+void generate_temp(struct VM_state* vm, Ir* ir, i32 temp) {
+  const struct Ir_ins* ins = &ir->ins[temp];
+  switch (ins->op) {
+    case IR_CONST:
+    case IR_LOAD:
+      ins_add(vm, I_PUSH);
+      ins_add(vm, ins->args[0]);
+      break;
+    case IR_ARG:
+      ins_add(vm, I_PUSH_ARG);
+      ins_add(vm, ins->args[0]);
+      break;
+    case IR_BINARY:
+      generate_temp(vm, ir, ins->args[1]);
+      generate_temp(vm, ir, ins->args[2]);
+      ins_add(vm, op_to_ins(ins->args[0], ins->flags));
+      break;
+    default:
+      assert(0);
+      break;
   }
-  assert(address != -1);
-  struct Object* func_value = &vm->values[address];
-  func_value->type = T_FUNCTION;
-  func_init(&func_value->value.func, fs->func /* parent */);
-
-  struct Function_state new_fs;
-  func_state_init(&new_fs, fs, &func_value->value.func);
-
-  // To skip the function body
-  ins_add(vm, I_JUMP, ins_count);
-  i32 func_jump_ins_index = vm->program_size;
-  ins_add(vm, UNRESOLVED_JUMP, ins_count);
-
-  func_value->value.func.address = vm->program_size;
-
-  i32 func_ins_count = 0;
-
-  // Function arguments
-  i32 arg_count = ast_child_count(args);
-  for (i32 i = 0; i < arg_count; i++) {
-    struct Token* arg = ast_get_node_value(args, i);
-    if (arg) {
-      if (arg->type != T_IDENTIFIER) {
-        compile_error2((*arg), "Expected identifier in function argument list (got '%.*s')\n", arg->length, arg->string);
-        status = ERR;
-        goto done;
-      }
-      if ((status = define_arg(vm, *arg, &new_fs, ins_count)) != NO_ERR) {
-        goto done;
-      }
-    }
+}
+
+#if defined(USE_LAZY_COMPILE)
+
+// Defer the code generation of the function from start to end to its first call. The function value holds
+// the address of a stub, which is compiled and replaced by code_gen_function().
+void stub_add(struct VM_state* vm, Ir* ir, i32 start, i32 end) {
+  struct Lazy_function func = {
+    .start = vm->lazy_ins_count,
+    .count = end - start + 1,
+    .entry = -1,
+  };
+  i32 size = vm->lazy_ins_count + func.count;
+  list_reserve(vm->lazy_ins, vm->lazy_ins_capacity, size);
+  if (vm->lazy_ins_capacity < size) {
+    return;  // Out of memory
   }
-  func_value->value.func.argc = arg_count;
-
-  // Generate the function body
-  generate(vm, body, &new_fs, &func_ins_count, NULL);
-  // Add return instruction at the end of the function
-  ins_add(vm, I_RETURN, &func_ins_count);
-
-  list_assign(vm->program, vm->program_size, func_jump_ins_index, func_ins_count);
-  *ins_count += func_ins_count;
-done:
-  func_state_free(&new_fs); // Okay, we are done with the compile-time function state for static checks
-  return vm->status = status;
+  func.labels_count = ir_copy(ir, start, end, &vm->lazy_ins[vm->lazy_ins_count]);
+  vm->lazy_ins_count = size;
+
+  // The code will be placed at the end of the program, the address is relocated when it is encoded
+  vm->values[ir->ins[start].args[0]] = MAKE_FUNCTION(vm->program_size + vm->code_size, ir->ins[start].args[1]);
+  list_push(vm->code_values, vm->code_values_count, vm->code_values_capacity, ir->ins[start].args[0]);
+  ins_add(vm, I_COMPILE);
+  ins_add(vm, vm->lazy_count);
+  list_push(vm->lazy, vm->lazy_count, vm->lazy_capacity, func);
 }
 
-i32 generate(struct VM_state* vm, Ast* ast, struct Function_state* fs, i32* ins_count, i32* branch_type) {
-  assert(ast);
-  i32 child_count = ast_child_count(ast);
-  struct Token* token = NULL;
-  for (i32 i = 0; i < child_count; i++) {
-    if ((token = ast_get_node_value(ast, i))) {
-      switch (token->type) {
-        case T_STRING:
-        case T_NUMBER: {
-          struct Object obj;
-          if (token_to_object(vm, token, &obj) == NO_ERR) {
-            set_branch_type(branch_type, obj.type);
-            i32 address = value_add(vm, obj);
-            ins_add(vm, I_PUSH, ins_count);
-            ins_add(vm, address, ins_count);
-          }
-          else {
-            assert(0);
-          }
-          break;
-        }
-        case T_IDENTIFIER: {
-          i32 address = -1;
-          i32 push_ins = -1;  // Which push instruction to use, can be either I_PUSH_ARG or I_PUSH.
-          struct Object* value = NULL;
-          if (get_arg_value_address(vm, *token, fs, &address) == NO_ERR) {
-            push_ins = I_PUSH_ARG;
-          }
-          else if (get_value_address(vm, *token, fs, &address) == NO_ERR) {
-            push_ins = I_PUSH;
-            value = &vm->values[address];
-          }
-          else {
-            return vm->status = ERR;
-          }
-
-          if (value) {
-            // Normal function call
-            if (value->type == T_FUNCTION || value->type == T_CFUNCTION) {
-              Ast args = ast_get_node_at(ast, i + 1);
-              if (args) {
-                struct Token* args_token = ast_get_value(&args);
-                if (args_token) {
-                  // Function arguments (if no function arguments are passed, then this is no function call, which is totally fine!)
-                  // We might want to, for instance, pass a function value to another function
-                  if (args_token->type == T_EXPR) {
-                    // printf("I_CALL: %.*s\n", token->length, token->string);
-                    if (ast_child_count(&args) > 0) {
-                      generate(vm, &args, fs, ins_count, branch_type);
-                    }
-                    i++;
-                    ins_add(vm, I_CALL, ins_count);
-                    ins_add(vm, address, ins_count);
-                  }
-                }
-                else {
-                  assert(0);
-                }
-                break;
-              }
-            }
-            set_branch_type(branch_type, value->type);
-          }
-          else {
-            // Local function call
-            if (i + 1 < child_count) {
-              Ast args = ast_get_node_at(ast, i + 1);
-              if (args) {
-                struct Token* args_token = ast_get_value(&args);
-                if (args_token) {
-                  if (args_token->type == T_EXPR) {
-                    i32 num_args = ast_child_count(&args);
-                    if (num_args > 0) {
-                      generate(vm, &args, fs, ins_count, branch_type);
-                    }
-                    i++;
-                    // printf("I_LOCAL_CALL: %.*s\n", token->length, token->string);
-                    ins_add(vm, push_ins, ins_count);
-                    ins_add(vm, address, ins_count);
-                    ins_add(vm, I_LOCAL_CALL, ins_count);
-                    ins_add(vm, num_args, ins_count);
-                    break;
-                  }
-                }
-              }
-            }
-          }
-          ins_add(vm, push_ins, ins_count);
-          ins_add(vm, address, ins_count);
-          break;
-        }
-        // let
-        // \-- identifier
-        //        \--type (optional)
-        //     \-- (expression)
-        case T_LET: {
-          Ast let_branch = ast_get_node_at(ast, i);
-          Ast ident_branch = ast_get_node_at(&let_branch, 0);
-          Ast value_branch = ast_get_node_at(&let_branch, 1);
-          i32 value_branch_child_count = ast_child_count(&value_branch);
-          assert(value_branch_child_count == 1);
-
-          struct Token* ident = ast_get_value(&ident_branch);
-          struct Token* type_token = ast_get_node_value(&ident_branch, 0);
-          struct Object type_obj = { .type = T_UNKNOWN };
-          assert(ident);
-
-          i32 value_address = -1;
-          i32 type = T_UNKNOWN;
-
-          // Handle explicit type
-          if (type_token) {
-            if (type_token->type == T_IDENTIFIER) {
-              i32 type_value_address = -1;
-              if (get_value_address(vm, *type_token, fs, &type_value_address) == NO_ERR) {
-                assert(type_value_address >= 0 && type_value_address < vm->values_count);
-                type_obj = vm->values[type_value_address];
-                type = type_obj.type;
-              }
-              else {
-                compile_error2((*type_token), "The type '%.*s' is not defined\n", type_token->length, type_token->string);
-                return vm->status = ERR;
-              }
-            }
-            else {
-              type = type_token->type;
-            }
-          }
-
-          if (define_value_and_type(vm, *ident, fs, type, &value_address) == NO_ERR) {
-            assert(value_address != -1);
-
-            i32 value_branch_type = -1;
-            if ((generate(vm, &value_branch, fs, ins_count, &value_branch_type)) == NO_ERR) {
-              // Validate equality between value and branch types
-              if (type_token) {
-                if (type != value_branch_type) {
-                  compile_error2((*type_token), "This expression was expected to have type '%.*s'\n", type_token->length, type_token->string);
-                  return vm->status = ERR;
-                }
-              }
-
-              struct Object* value = &vm->values[value_address];
-              value->type = value_branch_type;
-              ins_add(vm, I_ASSIGN, ins_count);
-              ins_add(vm, value_address, ins_count);
-              break;
-            }
-            else {
-              return vm->status = ERR;
-            }
-          }
-          else {
-            return vm->status = ERR;
-          }
-          break;
-        }
-        case T_DEFINE: {
-          Ast func = ast_get_node_at(ast, i);
-          if ((token = ast_get_node_value(&func, 0))) {
-            Ast args = ast_get_node_at(&func, 1);
-            Ast body = ast_get_node_at(&func, 2);
-            assert(args && body);
-            if (generate_func(vm, *token, &args, &body, fs, ins_count) != NO_ERR) {
-              return vm->status;
-            }
-          }
-          else {
-            assert(0);
-          }
-          break;
-        }
-        case T_IF: {
-          Ast if_branch = ast_get_node_at(ast, i);
-          assert(if_branch);
-          Ast cond = ast_get_node_at(&if_branch, 0);
-          Ast true_body = ast_get_node_at(&if_branch, 1);
-          Ast false_body = ast_get_node_at(&if_branch, 2);
-          assert(cond && true_body && false_body);
-          generate(vm, &cond, fs, ins_count, branch_type);
-
-          i32 true_body_ins_count = 0;
-          i32 false_body_ins_count = 0;
-
-          // Conditional jump at the beginning of the if expression
-          ins_add(vm, I_COND_JUMP, &true_body_ins_count);
-          i32 cond_jump_ins_index = vm->program_size;
-          ins_add(vm, UNRESOLVED_JUMP, &true_body_ins_count);
-
-          // Generate the first expression (the 'true' expression of the if statement)
-          generate(vm, &true_body, fs, &true_body_ins_count, branch_type);
-          // Resolve jump
-          list_assign(vm->program, vm->program_size, cond_jump_ins_index, true_body_ins_count);
-          *ins_count += true_body_ins_count;
-
-          i32 false_body_child_count = ast_child_count(&false_body);
-          if (false_body_child_count > 0) {
-            // Jump at the end of the if expression body
-            ins_add(vm, I_JUMP, ins_count);
-            i32 jump_ins_index = vm->program_size;
-            ins_add(vm, UNRESOLVED_JUMP, ins_count);
-
-            // Generate the second expression of the if statement
-            generate(vm, &false_body, fs, &false_body_ins_count, branch_type);
-            // Resolve jump
-            list_assign(vm->program, vm->program_size, jump_ins_index, false_body_ins_count);
-            *ins_count += false_body_ins_count;
-          }
+#endif
+
+// Generate the code of the ir. Functions other than the one that starts at entry (-1 for none) are compiled on
+// their first call when lazy compilation is enabled. Stops when the allocator of the vm runs out of memory.
+void generate(struct VM_state* vm, Ir* ir, i32 entry) {
+  i32* labels = NULL;  // Code index of every label
+  struct Jump_fixup* fixups = NULL;
+  i32 fixups_count = 0;
+  i32 fixups_capacity = 0;
+  if (ir->labels_count > 0) {
+    labels = m_malloc(sizeof(i32) * ir->labels_count);
+    if (!labels) {
+      return;
+    }
+    for (i32 i = 0; i < ir->labels_count; i++) {
+      labels[i] = UNRESOLVED_LABEL;
+    }
+  }
+  for (i32 i = 0; i < ir->count && !vm->allocator.failed; i++) {
+    const struct Ir_ins* ins = &ir->ins[i];
+    i32 label = -1;
+    switch (ins->op) {
+      case IR_PUSH:
+        generate_temp(vm, ir, ins->args[0]);
+        break;
+      case IR_STACK_BINARY:
+        ins_add(vm, op_to_ins(ins->args[0], ins->flags));
+        break;
+      case IR_STORE:
+        generate_temp(vm, ir, ins->args[1]);
+        ins_add(vm, I_ASSIGN);
+        ins_add(vm, ins->args[0]);
+        break;
+      case IR_ASSIGN:
+        ins_add(vm, I_ASSIGN);
+        ins_add(vm, ins->args[0]);
+        break;
+      case IR_CALL:
+        ins_add(vm, (ins->flags & IR_TAIL) ? I_TAIL_CALL : I_CALL);
+        ins_add(vm, ins->args[0]);
+        ins_add(vm, call_cache_add(vm));
+        break;
+      case IR_LOCAL_CALL:
+        generate_temp(vm, ir, ins->args[0]);
+        ins_add(vm, (ins->flags & IR_TAIL) ? I_LOCAL_TAIL_CALL : I_LOCAL_CALL);
+        ins_add(vm, ins->args[1]);
+        ins_add(vm, call_cache_add(vm));
+        break;
+      case IR_JUMP:
+        ins_add(vm, I_JUMP);
+        label = ins->args[0];
+        break;
+      case IR_BRANCH:
+        generate_temp(vm, ir, ins->args[0]);
+        ins_add(vm, I_COND_JUMP);
+        label = ins->args[1];
+        break;
+      case IR_COND_BRANCH:
+        ins_add(vm, I_COND_JUMP);
+        label = ins->args[0];
+        break;
+      case IR_LABEL:
+        labels[ins->args[0]] = vm->code_size;
+        break;
+      case IR_FUNC:
+#if defined(USE_LAZY_COMPILE)
+        if (i != entry) {
+          i32 end = ir_function_end(ir, i);
+          stub_add(vm, ir, i, end);
+          i = end;
           break;
         }
-        case T_ADD:
-        case T_SUB:
-        case T_MUL:
-        case T_DIV:
-        case T_LT:
-        case T_GT:
-        case T_EQ: {
-          i32 op = token_to_op(token);
-          assert(op != I_UNKNOWN);
-          Ast op_branch = ast_get_node_at(ast, i);
-          assert(op_branch);
-          if (ast_child_count(&op_branch) < 2) {
-            compile_error2((*token), "Missing operands\n");
-            return vm->status = ERR;
-          }
-          generate(vm, &op_branch, fs, ins_count, branch_type);
-          ins_add(vm, op, ins_count);
-          break;
+#endif
+        if (i != entry) {
+          // The code will be placed at the end of the program, the address is relocated when it is encoded
+          vm->values[ins->args[0]] = MAKE_FUNCTION(vm->program_size + vm->code_size, ins->args[1]);
+          list_push(vm->code_values, vm->code_values_count, vm->code_values_capacity, ins->args[0]);
         }
-        case T_EXPR: {
-          Ast expr_branch = ast_get_node_at(ast, i);
-          if (ast_child_count(&expr_branch) > 0) {
-            generate(vm, &expr_branch, fs, ins_count, branch_type);
-          }
-          break;
+        if (ins->args[2]) {
+          ins_add(vm, I_CHECK_INT_ARGS);
+          ins_add(vm, ins->args[2]);
         }
-        default:
-          break;
-      }
+        break;
+      case IR_RETURN:
+        ins_add(vm, I_RETURN);
+        break;
+      default:
+        break;  // Temporaries are generated where they are used
     }
+    if (label >= 0) {
+      struct Jump_fixup fixup = { .index = vm->code_size, .label = label, };
+      list_push(fixups, fixups_count, fixups_capacity, fixup);
+      ins_add(vm, UNRESOLVED_JUMP);
+    }
+  }
+  // Jump offsets are relative to the end of the jump instruction
+  for (i32 i = 0; i < fixups_count && !vm->allocator.failed; i++) {
+    i32 target = labels[fixups[i].label];
+    if (target != UNRESOLVED_LABEL) {
+      list_assign(vm->code, vm->code_size, fixups[i].index, target - (fixups[i].index + 1));
+    }
+  }
+  list_free(fixups, fixups_count, fixups_capacity);
+  if (labels) {
+    m_free(labels, sizeof(i32) * ir->labels_count);
   }
-  return vm->status;
+}
+
+i32 code_gen_errors() {
+  return errors_reported;
 }
 
 i32 code_gen(struct VM_state* vm, Ast* ast) {
   if (ast_is_empty(*ast))
     return NO_ERR;
-  num_values_added = 0;
-  symbols = ht_create_empty();
-
-  old_program_size = vm->program_size;
-  i32 ins_count = 0;
-  i32 result = generate(vm, ast, &vm->fs_global, &ins_count, NULL);
-
-  if (result != NO_ERR) { // Error occured, perform rollback
-    i32 diff = vm->program_size - old_program_size;
-    list_shrink(vm->program, vm->program_size, diff);
-    assert(num_values_added <= vm->values_count);
-    list_shrink(vm->values, vm->values_count, num_values_added);  // TODO(lucas): Don't only shrink the value list, but also deallocate value contents that need be
-    for (i32 i = 0; i < ht_get_size(&symbols); i++) {
-      const Hkey* key = ht_lookup_key(&symbols, i);
-      if (key) {
-        ht_remove_element(&vm->fs_global.symbol_table, *key);
-      }
-    }
+
+  i32 old_caches_count = vm->caches_count;
+  i32 old_lazy_count = vm->lazy_count;
+  i32 old_lazy_ins_count = vm->lazy_ins_count;
+  struct Peephole_stats stats;
+  Ir ir;
+  ir_init(&ir);
+  i32 result = ir_build(vm, ast, &ir);
+  errors_reported = ir.errors;
+  if (result == NO_ERR) {
+    generate(vm, &ir, -1);
+    ins_add(vm, I_RETURN);
+    result = vm->allocator.failed ? ERR : peephole_assemble(vm, &stats);
+  }
+  if (vm->allocator.failed) {
+    result = ERR;  // Reported by the vm
+  }
+
+  if (result != NO_ERR) { // Error occured, perform rollback (the generated code is dropped below)
+    list_truncate(vm->caches, vm->caches_count, old_caches_count);
+    list_truncate(vm->lazy, vm->lazy_count, old_lazy_count);
+    list_truncate(vm->lazy_ins, vm->lazy_ins_count, old_lazy_ins_count);
+    ir_rollback(vm, &ir);
     goto done;
   }
-  ins_add(vm, I_RETURN, &ins_count);
-  output_byte_code(vm, "bytecode.txt");
+  output_byte_code(vm, &ir.removed, &stats, "bytecode.txt");
 done: {
-  ht_free(&symbols);
+  list_truncate(vm->code, vm->code_size, 0);  // The memory is reused by the next pass
+  list_truncate(vm->code_values, vm->code_values_count, 0);
+  ir_free(&ir);
 }
   return result;
 }
+
+i32 code_gen_function(struct VM_state* vm, i32 address, i32* entry) {
+  assert(vm->program[address] == I_WIDE && vm->program[address + 1] == I_COMPILE);
+  i32 index = READ_WIDE_ARG(&vm->program[address + 2]);
+  assert(index >= 0 && index < vm->lazy_count);
+  struct Lazy_function func = vm->lazy[index];
+  if (func.entry >= 0) {
+    *entry = func.entry;
+    return NO_ERR;
+  }
+  // NOTE(lucas): Nested functions add their ir to vm->lazy_ins when this one is generated, so it is copied out first
+  Ir ir;
+  ir_init(&ir);
+  ir.labels_count = func.labels_count;
+  list_append(ir.ins, ir.count, ir.capacity, &vm->lazy_ins[func.start], func.count);
+  if (ir.count != func.count) {
+    ir_free(&ir);
+    return ERR;
+  }
+  *entry = vm->program_size;
+  struct Peephole_stats stats;
+  generate(vm, &ir, 0);
+  i32 result = vm->allocator.failed ? ERR : peephole_assemble(vm, &stats);
+  if (vm->allocator.failed) {
+    result = ERR;
+  }
+  list_truncate(vm->code, vm->code_size, 0);
+  list_truncate(vm->code_values, vm->code_values_count, 0);
+  ir_free(&ir);
+  if (result != NO_ERR) {
+    return result;
+  }
+  // wide jump <offset>, relative to the end of the jump
+  u8* stub = &vm->program[address];
+  u32 offset = (u32)(*entry - (address + STUB_SIZE));
+  stub[1] = I_JUMP;
+  for (i32 i = 0; i < WIDE_ARG_SIZE; i++) {
+    stub[2 + i] = (u8)(offset >> (8 * i));
+  }
+  vm->lazy[index].entry = *entry;
+  return NO_ERR;
+}
@@ -0,0 +1,198 @@
+// constant.c
+// Constant pool, open addressing hash table of value addresses keyed by the contents of the constants
+
+#include "common.h"
+#include "memory.h"
+#include "util.h"
+#include "token.h"
+#include "vm.h"
+#include "constant.h"
+
+#define CONSTANT_POOL_INIT_SIZE 64
+
+static u32 hash_number(i32 number);
+static u32 hash_value(struct VM_state* vm, struct Object value);
+static i32 value_matches_token(struct VM_state* vm, struct Object value, const struct Token* token);
+static i32 pool_resize(struct VM_state* vm, u32 new_size);
+
+u32 hash_number(i32 number) {
+  return (u32)number * 2654435761u;
+}
+
+u32 hash_value(struct VM_state* vm, struct Object value) {
+  if (IS_STRING(value)) {
+    struct Buffer string = string_get(vm, AS_HANDLE(value));
+    return hash_bytes(string.data, string.length);
+  }
+  assert(IS_NUMBER(value));
+  return hash_number(AS_NUMBER(value));
+}
+
+i32 value_matches_token(struct VM_state* vm, struct Object value, const struct Token* token) {
+  switch (token->type) {
+    case T_NUMBER:
+      return IS_NUMBER(value) && AS_NUMBER(value) == token->value.number;
+    case T_STRING: {
+      if (!IS_STRING(value)) {
+        return 0;
+      }
+      struct Buffer string = string_get(vm, AS_HANDLE(value));
+      return string.length == token->length && !memcmp(string.data, token->string, token->length);
+    }
+    default:
+      break;
+  }
+  return 0;
+}
+
+// Rebuild the table with the new size, only keeping the constants that still exist
+i32 pool_resize(struct VM_state* vm, u32 new_size) {
+  Constant_pool* pool = &vm->constants;
+  i32* slots = m_malloc(sizeof(i32) * new_size);
+  if (!slots) {
+    return ERR;
+  }
+  for (u32 i = 0; i < new_size; i++) {
+    slots[i] = NO_CONSTANT;
+  }
+  u32 count = 0;
+  for (u32 i = 0; i < pool->size; i++) {
+    i32 address = pool->slots[i];
+    if (address == NO_CONSTANT || address >= vm->values_count) {
+      continue;
+    }
+    u32 index = hash_value(vm, vm->values[address]) & (new_size - 1);
+    while (slots[index] != NO_CONSTANT) {
+      index = (index + 1) & (new_size - 1);
+    }
+    slots[index] = address;
+    count++;
+  }
+  if (pool->slots) {
+    m_free(pool->slots, sizeof(i32) * pool->size);
+  }
+  pool->slots = slots;
+  pool->size = new_size;
+  pool->count = count;
+  return NO_ERR;
+}
+
+void constant_pool_init(Constant_pool* pool) {
+  pool->slots = NULL;
+  pool->count = 0;
+  pool->size = 0;
+}
+
+i32 constant_pool_lookup(struct VM_state* vm, const struct Token* token, i32* address) {
+  Constant_pool* pool = &vm->constants;
+  if (!pool->slots) {
+    return ERR;
+  }
+  u32 hash = 0;
+  switch (token->type) {
+    case T_NUMBER:
+      hash = hash_number(token->value.number);
+      break;
+    case T_STRING:
+      hash = hash_bytes(token->string, token->length);
+      break;
+    default:
+      return ERR;
+  }
+  for (u32 index = hash & (pool->size - 1);; index = (index + 1) & (pool->size - 1)) {
+    i32 slot = pool->slots[index];
+    if (slot == NO_CONSTANT) {
+      break;
+    }
+    if (value_matches_token(vm, vm->values[slot], token)) {
+      *address = slot;
+      return NO_ERR;
+    }
+  }
+  return ERR;
+}
+
+i32 constant_pool_contains(struct VM_state* vm, i32 address) {
+  Constant_pool* pool = &vm->constants;
+  assert(address >= 0 && address < vm->values_count);
+  struct Object value = vm->values[address];
+  if (!pool->slots || !(IS_NUMBER(value) || IS_STRING(value))) {
+    return 0;
+  }
+  for (u32 index = hash_value(vm, value) & (pool->size - 1);; index = (index + 1) & (pool->size - 1)) {
+    i32 slot = pool->slots[index];
+    if (slot == NO_CONSTANT) {
+      break;
+    }
+    if (slot == address) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+i32 constant_pool_insert(struct VM_state* vm, i32 address) {
+  Constant_pool* pool = &vm->constants;
+  assert(address >= 0 && address < vm->values_count);
+  if (pool->count >= pool->size / 2) {
+    if (pool_resize(vm, pool->size ? pool->size * 2 : CONSTANT_POOL_INIT_SIZE) != NO_ERR) {
+      return ERR;
+    }
+  }
+  u32 index = hash_value(vm, vm->values[address]) & (pool->size - 1);
+  while (pool->slots[index] != NO_CONSTANT) {
+    index = (index + 1) & (pool->size - 1);
+  }
+  pool->slots[index] = address;
+  pool->count++;
+  return NO_ERR;
+}
+
+void constant_pool_trim(struct VM_state* vm) {
+  Constant_pool* pool = &vm->constants;
+  if (pool->slots) {
+    pool_resize(vm, pool->size);
+  }
+}
+
+void constant_pool_relocate(struct VM_state* vm, i32 first, const i32* map) {
+  Constant_pool* pool = &vm->constants;
+  if (!pool->slots) {
+    return;
+  }
+  for (u32 i = 0; i < pool->size; i++) {
+    i32 address = pool->slots[i];
+    if (address != NO_CONSTANT && address >= first) {
+      pool->slots[i] = map[address - first] >= 0 ? map[address - first] : NO_CONSTANT;
+    }
+  }
+  // The constants are hashed again at their new addresses
+  pool_resize(vm, pool->size);
+}
+
+// NOTE(lucas): The constants hash the same way in every run, so the table is used as it was saved
+i32 constant_pool_restore(struct VM_state* vm, const i32* slots, u32 size) {
+  u32 count = 0;
+  for (u32 i = 0; i < size; i++) {
+    count += slots[i] != NO_CONSTANT;
+  }
+  i32* copy = NULL;
+  if (size > 0 && !(copy = m_malloc(sizeof(i32) * size))) {
+    return ERR;
+  }
+  if (size > 0) {
+    memcpy(copy, slots, sizeof(i32) * size);
+  }
+  constant_pool_free(&vm->constants);
+  vm->constants.slots = copy;
+  vm->constants.size = size;
+  vm->constants.count = count;
+  return NO_ERR;
+}
+
+void constant_pool_free(Constant_pool* pool) {
+  if (pool->slots) {
+    m_free(pool->slots, sizeof(i32) * pool->size);
+  }
+  constant_pool_init(pool);
+}
@@ -4,6 +4,7 @@
 #include "vm.h"
 #include "util.h"
 #include "6502.h"
+#include "c_compile.h"
 #include "funk.h"
 
 #define MAX_INPUT 512
@@ -27,35 +28,142 @@
 #endif
 
 static i32 user_input(struct VM_state* vm);
+static void usage(char* program);
 
+// funk                  compile test.funk to 6502 machine code
+// funk [-6502] [-c] [-i] [-nojit] [-reg] [-gc] [-arena] [-fixed=MB] [-cache[=verify]] [file]
+//   -6502   compile the file to 6502 machine code (file.o65) instead of running it
+//   -c      compile the file to C (file.c) instead of running it, to be built with e.g. gcc -O2
+//   -i      read input interactively after the file has been executed
+//   -nojit  only interpret the byte code, never compile it to machine code
+//   -reg    run the file on the register based engine instead of the byte code
+//   -gc     report every garbage collection (of the REPL session) to stderr
+//   -arena  never free memory before the vm is done
+//   -fixed=MB  take all memory from one buffer of that many megabytes, allocated at startup
+//   -cache  save the compiled program next to the file (file.fbc), and load it instead of compiling the file
+//           on later runs, as long as the file has not changed
+//   -cache=verify  like -cache, but also check all of a saved program against its checksum before it is used
 i32 funk_start(i32 argc, char** argv) {
   char* path = "test.funk";
   u8 use_6502 = 1;
+  u8 use_c = 0;
+  u8 interactive = 0;
+  u8 jit = 1;
+  u8 engine = ENGINE_STACK;
+  u8 gc_report = 0;
+  u8 allocator_kind = ALLOCATOR_SYSTEM;
+  u32 fixed_size = 0;
+  u8 image_cache = IMAGE_CACHE_OFF;
+  if (argc > 1) {
+    path = NULL;
+    use_6502 = 0;
+    for (i32 i = 1; i < argc; i++) {
+      char* arg = argv[i];
+      if (!strcmp(arg, "-6502")) {
+        use_6502 = 1;
+      }
+      else if (!strcmp(arg, "-c")) {
+        use_c = 1;
+      }
+      else if (!strcmp(arg, "-i")) {
+        interactive = 1;
+      }
+      else if (!strcmp(arg, "-nojit")) {
+        jit = 0;
+      }
+      else if (!strcmp(arg, "-reg")) {
+        engine = ENGINE_REGISTER;
+      }
+      else if (!strcmp(arg, "-gc")) {
+        gc_report = 1;
+      }
+      else if (!strcmp(arg, "-arena")) {
+        allocator_kind = ALLOCATOR_ARENA;
+      }
+      else if (!strncmp(arg, "-fixed=", 7) && atoi(&arg[7]) > 0 && atoi(&arg[7]) < 4096) {
+        allocator_kind = ALLOCATOR_FIXED;
+        fixed_size = (u32)atoi(&arg[7]) * 1024 * 1024;
+      }
+      else if (!strcmp(arg, "-cache")) {
+        image_cache = IMAGE_CACHE_ON;
+      }
+      else if (!strcmp(arg, "-cache=verify")) {
+        image_cache = IMAGE_CACHE_VERIFY;
+      }
+      else if (arg[0] != '-' && !path) {
+        path = arg;
+      }
+      else {
+        usage(argv[0]);
+        return ERR;
+      }
+    }
+    if (!path && (use_6502 || use_c || !interactive)) {
+      usage(argv[0]);
+      return ERR;
+    }
+  }
   if (use_6502) {
-    run_6502(path);
+    return run_6502(path);
   }
-  else {
-    struct VM_state vm;
-    vm_init(&vm);
-#if 0
-    user_input(&vm);
-#else
-    (void)user_input;
-    char* source = read_file(path);
-    if (source) {
-      vm_exec(&vm, path, source);
-      free(source);
-    }
-    user_input(&vm);
-#endif
-    vm_free(&vm);
-    if (memory_total() != 0) {
-      fprintf(stderr, "Memory leak!\n");
-      memory_print_info();
-      assert(memory_total() == 0);
+  if (use_c) {
+    return run_c(path);
+  }
+  Allocator allocator;
+  if (allocator_kind == ALLOCATOR_FIXED) {
+    if (allocator_fixed(&allocator, NULL, fixed_size) != NO_ERR) {
+      fprintf(stderr, "Failed to allocate %u bytes of memory\n", fixed_size);
+      return ERR;
     }
   }
-  return NO_ERR;
+  else if (allocator_kind == ALLOCATOR_ARENA) {
+    allocator_arena(&allocator);
+  }
+  else {
+    allocator_system(&allocator);
+  }
+  struct VM_state vm;
+  if (vm_init_with_allocator(&vm, &allocator) != NO_ERR) {
+    // NOTE(lucas): The vm may only be partly set up, so only its allocator is released
+    allocator_release(&vm.allocator);
+    return ERR;
+  }
+  vm.jit.enabled = jit;
+  vm.engine = engine;
+  vm.whole_program = !interactive;
+  vm.image_cache = image_cache;
+  vm.gc.report = gc_report;
+  i32 result = NO_ERR;
+  if (path) {
+    result = vm_exec_file(&vm, path);
+  }
+  if (interactive && result == NO_ERR) {
+    result = user_input(&vm);
+  }
+  vm_free(&vm);
+  if (vm.allocator.total != 0) {
+    fprintf(stderr, "Memory leak!\n");
+    memory_print_info(&vm.allocator);
+    assert(vm.allocator.total == 0);
+  }
+  return result;
+}
+
+void usage(char* program) {
+  fprintf(stderr,
+    "usage: %s [-6502] [-c] [-i] [-nojit] [-reg] [-gc] [-arena] [-fixed=MB] [-cache[=verify]] [file]\n"
+    "  -6502      compile the file to 6502 machine code (file.o65) instead of running it\n"
+    "  -c         compile the file to C (file.c) instead of running it\n"
+    "  -i         read input interactively after the file has been executed\n"
+    "  -nojit     only interpret the byte code, never compile it to machine code\n"
+    "  -reg       run the file on the register based engine instead of the byte code\n"
+    "  -gc        report every garbage collection to stderr\n"
+    "  -arena     never free memory before the vm is done\n"
+    "  -fixed=MB  take all memory from one buffer of that many megabytes\n"
+    "  -cache     save the compiled program next to the file (file.fbc) and load it on later runs,\n"
+    "             until the file changes\n"
+    "  -cache=verify  like -cache, and check all of the saved program against its checksum when it is loaded\n",
+    program);
 }
 
 i32 user_input(struct VM_state* vm) {
@@ -0,0 +1,509 @@
+// gc.c
+// Mark and compact garbage collector. The roots are the global symbols and the stack, and the byte code of the
+// functions that they refer to is walked to find the values, strings, call caches and lazily compiled functions
+// that it uses. Everything else is removed, including the top level code of the lines that have already run.
+
+#include <time.h>
+
+#include "common.h"
+#include "memory.h"
+#include "list.h"
+#include "ast.h"
+#include "code.h"
+#include "ir.h"
+#include "image.h"
+#include "vm.h"
+#include "gc.h"
+
+// Sizes are the ones from before the collection
+typedef struct Mark {
+  i32 values_count;
+  i32 strings_count;
+  i32 program_size;
+  i32 lazy_count;
+  i32 caches_count;
+  u8* values;
+  u8* pending;  // Values of functions nested in lazy functions that have not been compiled, they have no code yet
+  u8* strings;
+  u8* code;     // 1 at the start of the reachable instructions, 2 for the rest of their bytes
+  u8* lazy;
+  u8* caches;
+  i32* work;    // Addresses of code that has not been walked yet
+  i32 work_count;
+  i32 work_capacity;
+} Mark;
+
+// New location of everything that is kept, -1 for what is removed
+typedef struct Relocation {
+  i32* values;
+  i32* strings;
+  i32* code;  // Indexed by the old address, one past the end of the program included
+  i32* lazy;
+  i32* caches;
+  i32 values_count;
+  i32 strings_count;
+  i32 lazy_count;
+  i32 lazy_ins_count;
+  i32 caches_count;
+  struct String* new_strings;
+  i32 new_strings_count;
+  i32 new_strings_capacity;
+  Buffer buffer;
+} Relocation;
+
+static i64 time_us();
+static u8* flags_alloc(i32 count);
+static void flags_free(u8* flags, i32 count);
+static void mark_object(struct VM_state* vm, Mark* m, struct Object obj);
+static void mark_value(struct VM_state* vm, Mark* m, i32 address);
+static i32 mark_lazy(struct VM_state* vm, Mark* m, i32 index);
+static i32 mark_code(struct VM_state* vm, Mark* m);
+static i32 mark(struct VM_state* vm, Mark* m);
+static void mark_free(Mark* m);
+static i32 relocation_init(struct VM_state* vm, Mark* m, Relocation* r);
+static void relocation_free(Mark* m, Relocation* r);
+static struct Object relocate_object(Relocation* r, struct Object obj);
+static void write_operand(u8* program, i32 at, i32 arg, i32 value);
+static void compact_program(struct VM_state* vm, Mark* m, Relocation* r);
+static void compact_values(struct VM_state* vm, Mark* m, Relocation* r);
+static void compact_strings(struct VM_state* vm, Relocation* r);
+static void compact_lazy(struct VM_state* vm, Relocation* r);
+
+i64 time_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// One flag for every element, zeroed
+u8* flags_alloc(i32 count) {
+  return m_calloc(sizeof(u8), count + 1);
+}
+
+void flags_free(u8* flags, i32 count) {
+  if (flags) {
+    m_free(flags, sizeof(u8) * (count + 1));
+  }
+}
+
+void mark_object(struct VM_state* vm, Mark* m, struct Object obj) {
+  if (IS_STRING(obj) && AS_HANDLE(obj) != NO_STRING) {
+    assert(AS_HANDLE(obj) >= 0 && AS_HANDLE(obj) < vm->strings_count);
+    m->strings[AS_HANDLE(obj)] = 1;
+  }
+  else if (IS_FUNCTION(obj)) {
+    list_push(m->work, m->work_count, m->work_capacity, FUNC_ADDRESS(obj));
+  }
+}
+
+void mark_value(struct VM_state* vm, Mark* m, i32 address) {
+  assert(address >= 0 && address < vm->values_count);
+  if (m->values[address]) {
+    return;
+  }
+  m->values[address] = 1;
+  if (!m->pending[address]) {
+    mark_object(vm, m, vm->values[address]);
+  }
+}
+
+// The values that the ir of a function that has not been compiled yet refers to
+i32 mark_lazy(struct VM_state* vm, Mark* m, i32 index) {
+  if (index < 0 || index >= vm->lazy_count || vm->lazy[index].entry >= 0) {
+    return ERR;
+  }
+  if (m->lazy[index]) {
+    return NO_ERR;
+  }
+  m->lazy[index] = 1;
+  const struct Lazy_function* func = &vm->lazy[index];
+  for (i32 i = func->start; i < func->start + func->count; i++) {
+    const struct Ir_ins* ins = &vm->lazy_ins[i];
+    if (ir_value_operand(ins)) {
+      mark_value(vm, m, ins->args[0]);
+    }
+  }
+  return NO_ERR;
+}
+
+// Walk the code from the addresses in the work list the same way as it can be executed. Nested functions
+// are jumped over, their code is walked when their values are marked. Fails on anything unexpected, then
+// nothing is collected.
+i32 mark_code(struct VM_state* vm, Mark* m) {
+  while (m->work_count > 0) {
+    i32 at = m->work[m->work_count - 1];
+    list_shrink(m->work, m->work_count, 1);
+    if (at < 0 || at >= vm->program_size || m->code[at] == 2) {
+      return ERR;
+    }
+    if (m->code[at] == 1) {
+      continue;
+    }
+    struct Decoded d;
+    if (ins_decode(vm->program, vm->program_size, at, &d) != NO_ERR) {
+      return ERR;
+    }
+    for (i32 i = 0; i < d.size; i++) {
+      if (m->code[at + i]) {
+        return ERR;
+      }
+      m->code[at + i] = i == 0 ? 1 : 2;
+    }
+    i32 cache_arg = ins_cache_arg(d.ins);
+    for (i32 arg = 0; arg < ins_argc(d.ins); arg++) {
+      if (ins_value_arg(d.ins, arg)) {
+        if (d.args[arg] < 0 || d.args[arg] >= vm->values_count) {
+          return ERR;
+        }
+        mark_value(vm, m, d.args[arg]);
+      }
+      else if (arg == cache_arg) {
+        if (d.args[arg] < 0 || d.args[arg] >= vm->caches_count) {
+          return ERR;
+        }
+        m->caches[d.args[arg]] = 1;
+      }
+    }
+    i32 next = at + d.size;
+    i32 jump_arg = ins_jump_arg(d.ins);
+    switch (d.ins) {
+      case I_UNKNOWN:
+      case I_WIDE:
+        return ERR;
+      case I_EXIT:
+      case I_RETURN:
+        break;
+      case I_COMPILE:
+        if (mark_lazy(vm, m, d.args[0]) != NO_ERR) {
+          return ERR;
+        }
+        break;
+      case I_JUMP:
+        list_push(m->work, m->work_count, m->work_capacity, next + d.args[0]);
+        break;
+      default:
+        if (jump_arg >= 0) {
+          list_push(m->work, m->work_count, m->work_capacity, next + d.args[jump_arg]);
+        }
+        list_push(m->work, m->work_count, m->work_capacity, next);
+        break;
+    }
+  }
+  return NO_ERR;
+}
+
+i32 mark(struct VM_state* vm, Mark* m) {
+  *m = (Mark) {
+    .values_count = vm->values_count,
+    .strings_count = vm->strings_count,
+    .program_size = vm->program_size,
+    .lazy_count = vm->lazy_count,
+    .caches_count = vm->caches_count,
+    .values = flags_alloc(vm->values_count),
+    .pending = flags_alloc(vm->values_count),
+    .strings = flags_alloc(vm->strings_count),
+    .code = flags_alloc(vm->program_size),
+    .lazy = flags_alloc(vm->lazy_count),
+    .caches = flags_alloc(vm->caches_count),
+  };
+  if (!m->values || !m->pending || !m->strings || !m->code || !m->lazy || !m->caches) {
+    return ERR;
+  }
+  for (i32 i = 0; i < vm->lazy_count; i++) {
+    const struct Lazy_function* func = &vm->lazy[i];
+    if (func->entry >= 0) {
+      continue;
+    }
+    // The first instruction is the function itself, which has a stub
+    for (i32 ins = func->start + 1; ins < func->start + func->count; ins++) {
+      if (vm->lazy_ins[ins].op == IR_FUNC) {
+        m->pending[vm->lazy_ins[ins].args[0]] = 1;
+      }
+    }
+  }
+
+  const Htable* table = &vm->fs_global.symbol_table;
+  for (u32 i = 0; i < ht_get_size(table); i++) {
+    if (ht_lookup_key(table, i)) {
+      mark_value(vm, m, *ht_lookup_by_index(table, i));
+    }
+  }
+  for (i32 i = 0; i < vm->stack_top; i++) {
+    mark_object(vm, m, vm->stack[i]);
+  }
+  return mark_code(vm, m);
+}
+
+void mark_free(Mark* m) {
+  flags_free(m->values, m->values_count);
+  flags_free(m->pending, m->values_count);
+  flags_free(m->strings, m->strings_count);
+  flags_free(m->code, m->program_size);
+  flags_free(m->lazy, m->lazy_count);
+  flags_free(m->caches, m->caches_count);
+  list_free(m->work, m->work_count, m->work_capacity);
+}
+
+// Everything that can fail is done here, before the vm is changed
+i32 relocation_init(struct VM_state* vm, Mark* m, Relocation* r) {
+  *r = (Relocation) {
+    .values = m_malloc(sizeof(i32) * (vm->values_count + 1)),
+    .strings = m_malloc(sizeof(i32) * (vm->strings_count + 1)),
+    .code = m_malloc(sizeof(i32) * (vm->program_size + 1)),
+    .lazy = m_malloc(sizeof(i32) * (vm->lazy_count + 1)),
+    .caches = m_malloc(sizeof(i32) * (vm->caches_count + 1)),
+  };
+  buffer_init(&r->buffer);
+  if (!r->values || !r->strings || !r->code || !r->lazy || !r->caches) {
+    return ERR;
+  }
+  for (i32 i = 0; i < vm->values_count; i++) {
+    r->values[i] = m->values[i] ? r->values_count++ : -1;
+  }
+  for (i32 i = 0; i < vm->lazy_count; i++) {
+    r->lazy[i] = -1;
+    if (m->lazy[i]) {
+      r->lazy[i] = r->lazy_count++;
+      r->lazy_ins_count += vm->lazy[i].count;
+    }
+  }
+  for (i32 i = 0; i < vm->caches_count; i++) {
+    r->caches[i] = m->caches[i] ? r->caches_count++ : -1;
+  }
+  r->code[0] = 0;
+  for (i32 i = 0; i < vm->program_size; i++) {
+    r->code[i + 1] = r->code[i] + (m->code[i] != 0);
+  }
+  for (i32 i = 0; i < vm->strings_count; i++) {
+    r->strings[i] = -1;
+    if (!m->strings[i]) {
+      continue;
+    }
+    struct Buffer string = string_get(vm, i);
+    struct String moved = {
+      .offset = r->buffer.length,
+      .length = string.length,
+    };
+    if (buffer_append_n(&r->buffer, string.data, string.length) != NO_ERR) {
+      return ERR;
+    }
+    r->strings[i] = r->new_strings_count;
+    list_push(r->new_strings, r->new_strings_count, r->new_strings_capacity, moved);
+    if (r->new_strings_count != r->strings_count + 1) {
+      return ERR;
+    }
+    r->strings_count++;
+  }
+  return NO_ERR;
+}
+
+void relocation_free(Mark* m, Relocation* r) {
+  if (r->values) {
+    m_free(r->values, sizeof(i32) * (m->values_count + 1));
+  }
+  if (r->strings) {
+    m_free(r->strings, sizeof(i32) * (m->strings_count + 1));
+  }
+  if (r->code) {
+    m_free(r->code, sizeof(i32) * (m->program_size + 1));
+  }
+  if (r->lazy) {
+    m_free(r->lazy, sizeof(i32) * (m->lazy_count + 1));
+  }
+  if (r->caches) {
+    m_free(r->caches, sizeof(i32) * (m->caches_count + 1));
+  }
+  list_free(r->new_strings, r->new_strings_count, r->new_strings_capacity);
+  buffer_free(&r->buffer);
+}
+
+struct Object relocate_object(Relocation* r, struct Object obj) {
+  if (IS_STRING(obj) && AS_HANDLE(obj) != NO_STRING) {
+    assert(r->strings[AS_HANDLE(obj)] >= 0);
+    return MAKE_STRING(r->strings[AS_HANDLE(obj)]);
+  }
+  if (IS_FUNCTION(obj)) {
+    return MAKE_FUNCTION(r->code[FUNC_ADDRESS(obj)], FUNC_ARGC(obj));
+  }
+  return obj;
+}
+
+// Operands only get smaller (or closer to zero for jumps), so they still fit in the same encoding
+void write_operand(u8* program, i32 at, i32 arg, i32 value) {
+  i32 wide = program[at] == I_WIDE;
+  u8* p = &program[at + wide + 1 + arg * (wide ? WIDE_ARG_SIZE : ARG_SIZE)];
+  p[0] = (u8)value;
+  p[1] = (u8)(value >> 8);
+  if (wide) {
+    p[2] = (u8)(value >> 16);
+    p[3] = (u8)(value >> 24);
+  }
+  else {
+    assert(value >= INT16_MIN && value <= UINT16_MAX);
+  }
+}
+
+// The reachable instructions are moved down in order, jump offsets and the operands that refer to
+// values, caches and lazy functions are relocated on the way
+void compact_program(struct VM_state* vm, Mark* m, Relocation* r) {
+  for (i32 at = 0; at < vm->program_size;) {
+    if (m->code[at] != 1) {
+      at++;
+      continue;
+    }
+    struct Decoded d;
+    i32 result = ins_decode(vm->program, vm->program_size, at, &d);
+    assert(result == NO_ERR);
+    (void)result;
+    i32 jump_arg = ins_jump_arg(d.ins);
+    i32 cache_arg = ins_cache_arg(d.ins);
+    for (i32 arg = 0; arg < ins_argc(d.ins); arg++) {
+      if (ins_value_arg(d.ins, arg)) {
+        write_operand(vm->program, at, arg, r->values[d.args[arg]]);
+      }
+      else if (arg == cache_arg) {
+        write_operand(vm->program, at, arg, r->caches[d.args[arg]]);
+      }
+      else if (arg == jump_arg) {
+        i32 target = at + d.size + d.args[arg];
+        write_operand(vm->program, at, arg, r->code[target] - (r->code[at] + d.size));
+      }
+      else if (d.ins == I_COMPILE) {
+        write_operand(vm->program, at, arg, r->lazy[d.args[arg]]);
+      }
+    }
+    memmove(&vm->program[r->code[at]], &vm->program[at], d.size);
+    at += d.size;
+  }
+  vm->program_size = r->code[vm->program_size];
+  vm->old_program_size = vm->program_size;
+  vm->saved_ip = vm->program_size;
+  vm->ip = NULL;
+}
+
+void compact_values(struct VM_state* vm, Mark* m, Relocation* r) {
+  for (i32 i = 0; i < vm->values_count; i++) {
+    if (r->values[i] >= 0) {
+      struct Object value = vm->values[i];
+      vm->values[r->values[i]] = m->pending[i] ? value : relocate_object(r, value);
+    }
+  }
+  for (i32 i = 0; i < vm->stack_top; i++) {
+    vm->stack[i] = relocate_object(r, vm->stack[i]);
+  }
+  ir_relocate_symbols(&vm->fs_global.symbol_table, 0, r->values);
+  list_truncate(vm->values, vm->values_count, r->values_count);
+}
+
+void compact_strings(struct VM_state* vm, Relocation* r) {
+  buffer_free(&vm->buffer);
+  vm->buffer = r->buffer;
+  buffer_init(&r->buffer);
+  list_free(vm->strings, vm->strings_count, vm->strings_capacity);
+  vm->strings = r->new_strings;
+  vm->strings_count = r->new_strings_count;
+  vm->strings_capacity = r->new_strings_capacity;
+  r->new_strings = NULL;
+  r->new_strings_count = 0;
+  r->new_strings_capacity = 0;
+}
+
+// Lazy functions that have been compiled are no longer needed, their stubs have been replaced
+void compact_lazy(struct VM_state* vm, Relocation* r) {
+  i32 ins_count = 0;
+  for (i32 i = 0; i < vm->lazy_count; i++) {
+    if (r->lazy[i] < 0) {
+      continue;
+    }
+    struct Lazy_function func = vm->lazy[i];
+    memmove(&vm->lazy_ins[ins_count], &vm->lazy_ins[func.start], sizeof(struct Ir_ins) * func.count);
+    func.start = ins_count;
+    for (i32 ins = func.start; ins < func.start + func.count; ins++) {
+      if (ir_value_operand(&vm->lazy_ins[ins])) {
+        vm->lazy_ins[ins].args[0] = r->values[vm->lazy_ins[ins].args[0]];
+      }
+    }
+    ins_count += func.count;
+    vm->lazy[r->lazy[i]] = func;
+  }
+  assert(ins_count == r->lazy_ins_count);
+  list_truncate(vm->lazy, vm->lazy_count, r->lazy_count);
+  list_truncate(vm->lazy_ins, vm->lazy_ins_count, r->lazy_ins_count);
+}
+
+void gc_init(Gc* gc) {
+  *gc = (Gc) {
+    .next_values = GC_THRESHOLD,
+    .next_program = GC_THRESHOLD,
+  };
+}
+
+i32 gc_check(struct VM_state* vm) {
+  Gc* gc = &vm->gc;
+  if (vm->engine != ENGINE_STACK || vm->whole_program) {
+    return NO_ERR;
+  }
+  if (vm->values_count < gc->next_values && vm->program_size < gc->next_program) {
+    return NO_ERR;
+  }
+  i32 result = gc_collect(vm);
+  // Collections get less frequent as more is kept, so that their cost stays proportional to what is added
+  gc->next_values = vm->values_count * 2 > GC_THRESHOLD ? vm->values_count * 2 : GC_THRESHOLD;
+  gc->next_program = vm->program_size * 2 > GC_THRESHOLD ? vm->program_size * 2 : GC_THRESHOLD;
+  return result;
+}
+
+i32 gc_collect(struct VM_state* vm) {
+  Gc* gc = &vm->gc;
+  assert(vm->engine == ENGINE_STACK && vm->frame_count == 0);
+  i64 start = time_us();
+  if (image_detach(vm) != NO_ERR) {
+    return ERR;
+  }
+  gc->values = gc->strings = gc->bytes = 0;
+  Mark m;
+  Relocation r = {0};
+  i32 result = mark(vm, &m);
+  if (result == NO_ERR) {
+    result = relocation_init(vm, &m, &r);
+  }
+  // Values that did not fit on the work list were not marked, nothing is collected then
+  if (vm->allocator.failed) {
+    result = ERR;
+  }
+  if (result == NO_ERR) {
+    gc->values = vm->values_count - r.values_count;
+    gc->strings = vm->strings_count - r.strings_count;
+    gc->bytes = vm->program_size - r.code[vm->program_size];
+  }
+  if (gc->values > 0 || gc->strings > 0 || gc->bytes > 0) {
+    compact_program(vm, &m, &r);
+    compact_values(vm, &m, &r);
+    compact_strings(vm, &r);
+    compact_lazy(vm, &r);
+    // The call caches and the machine code refer to the old addresses, they are filled again by the next calls
+    list_truncate(vm->caches, vm->caches_count, r.caches_count);
+    if (vm->caches_count > 0) {
+      memset(vm->caches, 0, sizeof(struct Call_cache) * vm->caches_count);
+    }
+    i32 jit_enabled = vm->jit.enabled;
+    jit_free(&vm->jit);
+    jit_init(&vm->jit, jit_enabled);
+    constant_pool_relocate(vm, 0, r.values);
+    string_index_rebuild(vm);
+  }
+  relocation_free(&m, &r);
+  mark_free(&m);
+
+  gc->collections++;
+  gc->pause = time_us() - start;
+  if (gc->pause > gc->max_pause) {
+    gc->max_pause = gc->pause;
+  }
+  gc->total_pause += gc->pause;
+  if (gc->report) {
+    fprintf(stderr, "gc: %i values, %i strings and %i bytes of byte code reclaimed in %.3f ms (%.3f ms at most)\n",
+      gc->values, gc->strings, gc->bytes, gc->pause / 1000.0, gc->max_pause / 1000.0);
+  }
+  return result;
+}
@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "memory.h"
+#include "arena.h"
 #include "hash.h"
 
 #define UNUSED_SLOT 0
@@ -22,6 +23,7 @@ static u32 hash(const Hkey key, u32 tablesize);
 static u32 linear_probe(const Htable* table, const Hkey key, u32* collision_count);
 static i32 key_compare(const Hkey a, const Hkey b);
 static Htable resize_table(Htable* table, u32 new_size);
+static Htable create_table(struct Arena* arena, u32 size);
 
 u32 hash(const Hkey key, u32 tablesize) {
   u32 hash_number = 5381;
@@ -64,7 +66,7 @@ Htable resize_table(Htable* table, u32 new_size) {
   if (ht_num_elements(table) > new_size)
     return *table;
 
-  Htable new_table = ht_create(new_size);
+  Htable new_table = create_table(table->arena, new_size);
   if (ht_get_size(&new_table) != new_size) {
     // Allocation failed
     return *table;
@@ -81,15 +83,25 @@ Htable resize_table(Htable* table, u32 new_size) {
   return new_table;
 }
 
-Htable ht_create(u32 size) {
+Htable create_table(struct Arena* arena, u32 size) {
   if (!size)
     size = 1;
 
   Htable table = {
-    .items = m_calloc(sizeof(struct Item), size),
+    .items = NULL,
     .count = 0,
-    .size = size
+    .size = size,
+    .arena = arena
   };
+  if (arena) {
+    table.items = arena_alloc(arena, sizeof(struct Item) * size);
+    if (table.items) {
+      memset(table.items, 0, sizeof(struct Item) * size);
+    }
+  }
+  else {
+    table.items = m_calloc(sizeof(struct Item), size);
+  }
   if (!table.items) {
     // Allocation failed
     table.size = 0;
@@ -97,11 +109,20 @@ Htable ht_create(u32 size) {
   return table;
 }
 
+Htable ht_create(u32 size) {
+  return create_table(NULL, size);
+}
+
 Htable ht_create_empty() {
+  return ht_create_arena(NULL);
+}
+
+Htable ht_create_arena(struct Arena* arena) {
   Htable table = {
     .items = NULL,
     .count = 0,
-    .size = 0
+    .size = 0,
+    .arena = arena
   };
   return table;
 }
@@ -114,7 +135,7 @@ i32 ht_is_empty(const Htable* table) {
 u32 ht_insert_element(Htable* table, const Hkey key, const Hvalue value) {
   assert(table != NULL);
   if (ht_is_empty(table)) {
-    Htable new_table = ht_create(HASH_TABLE_INIT_SIZE);
+    Htable new_table = create_table(table->arena, HASH_TABLE_INIT_SIZE);
     if (ht_get_size(&new_table) == HASH_TABLE_INIT_SIZE) {
       *table = new_table;
     }
@@ -217,7 +238,9 @@ u32 ht_num_elements(const Htable* table) {
 void ht_free(Htable* table) {
   assert(table != NULL);
   if (table->items) {
-    m_free(table->items, table->size * sizeof(struct Item));
+    if (!table->arena) {
+      m_free(table->items, table->size * sizeof(struct Item));
+    }
     table->items = NULL;
     table->size = 0;
     table->count = 0;
@@ -0,0 +1,471 @@
+// image.c
+// Precompiled program files. The file is a header followed by the sections of the vm that
+// code generation produces, stored the same way as they are in memory. Function values
+// and strings only hold offsets, so the sections can be used right where they are mapped.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "list.h"
+#include "ast.h"
+#include "code.h"
+#include "ir.h"
+#include "constant.h"
+#include "vm.h"
+#include "image.h"
+
+#define IMAGE_MAGIC "funk"
+#define SECTION_ALIGN 8
+#define FNV_BASIS 14695981039346656037ull
+
+struct Image_section {
+  u32 offset;  // From the start of the file
+  i32 count;   // Number of elements
+};
+
+struct Image_symbol {
+  Hkey name;
+  Hvalue address;
+};
+
+struct Image_header {
+  char magic[4];
+  u32 version;
+  u64 source_hash;
+  u64 header_checksum;  // Hash of the header (so also of the section table), with this field set to 0
+  u64 checksum;  // Hash of the rest of the file
+  u32 ins_count;  // Number of opcodes, byte code of another instruction set can't be used
+  u32 object_size;
+  i32 cfunctions_count;  // Built-in functions that the cfunction values refer to
+  i32 caches_count;
+  i32 whole_program;  // Programs without their unreferenced code can't be extended by interactive input
+  struct Image_section values;
+  struct Image_section strings;
+  struct Image_section buffer;
+  struct Image_section program;
+  struct Image_section symbols;
+  struct Image_section lazy;      // Functions that have not been compiled yet, and their ir
+  struct Image_section lazy_ins;
+  struct Image_section constants;  // Table of the constant pool, so that later compilations reuse the constants
+};
+
+static struct Image_section section_add(u32* size, i32 count, u32 element_size);
+static i32 section_write(FILE* fp, u32* at, u64* hash, struct Image_section section, const void* data, u32 element_size);
+static i32 section_check(struct Image_section section, u32 element_size, u32 size);
+static void* section_data(u8* image, struct Image_section section);
+static u64 hash_continue(u64 hash, const u8* data, u32 length);
+static u64 header_checksum(const struct Image_header* header);
+static u64 checksum(const u8* image, u32 size);
+static i32 header_check(struct VM_state* vm, u8* image, u32 size, u64 source_hash, i32 verify);
+static i32 mapped(struct VM_state* vm, const void* data);
+static void* copy(const void* data, u32 size);
+static void release(void* data, u32 size);
+
+struct Image_section section_add(u32* size, i32 count, u32 element_size) {
+  struct Image_section section = {
+    .offset = *size,
+    .count = count,
+  };
+  *size += count * element_size;
+  *size = (*size + SECTION_ALIGN - 1) & ~(SECTION_ALIGN - 1);
+  return section;
+}
+
+// Also adds what is written to the hash of the file
+i32 section_write(FILE* fp, u32* at, u64* hash, struct Image_section section, const void* data, u32 element_size) {
+  const u8 zero = 0;
+  for (; *at < section.offset; (*at)++) {
+    if (fputc(0, fp) == EOF) {
+      return ERR;
+    }
+    *hash = hash_continue(*hash, &zero, 1);
+  }
+  u32 size = section.count * element_size;
+  if (size > 0 && fwrite(data, size, 1, fp) != 1) {
+    return ERR;
+  }
+  if (size > 0) {
+    *hash = hash_continue(*hash, data, size);
+  }
+  *at += size;
+  return NO_ERR;
+}
+
+i32 section_check(struct Image_section section, u32 element_size, u32 size) {
+  if (section.count < 0 || section.offset % SECTION_ALIGN != 0 || section.offset > size) {
+    return ERR;
+  }
+  if ((u64)section.count * element_size > size - section.offset) {
+    return ERR;
+  }
+  return NO_ERR;
+}
+
+void* section_data(u8* image, struct Image_section section) {
+  if (section.count == 0) {
+    return NULL;
+  }
+  return &image[section.offset];
+}
+
+// FNV-1a
+u64 hash_continue(u64 hash, const u8* data, u32 length) {
+  for (u32 i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+u64 header_checksum(const struct Image_header* header) {
+  struct Image_header copy;
+  memcpy(&copy, header, sizeof(copy));  // With the padding, as it is in the file
+  copy.header_checksum = 0;
+  return hash_continue(FNV_BASIS, (const u8*)&copy, sizeof(copy));
+}
+
+u64 checksum(const u8* image, u32 size) {
+  return hash_continue(FNV_BASIS, &image[sizeof(struct Image_header)], size - sizeof(struct Image_header));
+}
+
+// NOTE(lucas): The operands of the byte code and the ir are used without bounds checks, so a damaged file
+// is only caught by the checksum of the rest of the file. That reads every page of the mapping, so it is only
+// checked when asked for. The header checksum keeps a damaged section table from being followed.
+i32 header_check(struct VM_state* vm, u8* image, u32 size, u64 source_hash, i32 verify) {
+  const struct Image_header* header = (struct Image_header*)image;
+  if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+    header->version != IMAGE_VERSION ||
+    header->source_hash != source_hash ||
+    header->header_checksum != header_checksum(header) ||
+    (verify && header->checksum != checksum(image, size)) ||
+    header->ins_count != MAX_INS ||
+    header->object_size != sizeof(struct Object) ||
+    header->cfunctions_count != vm->cfunctions_count ||
+    header->caches_count < 0 ||
+    header->whole_program != vm->whole_program) {
+    return ERR;
+  }
+  if (section_check(header->values, sizeof(struct Object), size) != NO_ERR ||
+    section_check(header->strings, sizeof(struct String), size) != NO_ERR ||
+    section_check(header->buffer, sizeof(char), size) != NO_ERR ||
+    section_check(header->program, sizeof(u8), size) != NO_ERR ||
+    section_check(header->symbols, sizeof(struct Image_symbol), size) != NO_ERR ||
+    section_check(header->lazy, sizeof(struct Lazy_function), size) != NO_ERR ||
+    section_check(header->lazy_ins, sizeof(struct Ir_ins), size) != NO_ERR ||
+    section_check(header->constants, sizeof(i32), size) != NO_ERR) {
+    return ERR;
+  }
+  if (header->program.count == 0 || header->values.count < vm->values_count) {
+    return ERR;
+  }
+  // The values that the vm defines on its own (the built-in functions) have to be the same
+  const struct Object* values = section_data(image, header->values);
+  for (i32 i = 0; i < vm->values_count; i++) {
+    if (values[i].bits != vm->values[i].bits) {
+      return ERR;
+    }
+  }
+  const struct Image_symbol* symbols = section_data(image, header->symbols);
+  for (i32 i = 0; i < header->symbols.count; i++) {
+    if (symbols[i].address < 0 || symbols[i].address >= header->values.count) {
+      return ERR;
+    }
+  }
+  const struct Lazy_function* lazy = section_data(image, header->lazy);
+  for (i32 i = 0; i < header->lazy.count; i++) {
+    if (lazy[i].start < 0 || lazy[i].count <= 0 || lazy[i].start > header->lazy_ins.count - lazy[i].count) {
+      return ERR;
+    }
+  }
+  // NOTE(lucas): Checked before anything is added to the vm, so that a damaged table only means the source is
+  // compiled again
+  const i32* constants = section_data(image, header->constants);
+  if (header->constants.count & (header->constants.count - 1)) {
+    return ERR;
+  }
+  for (i32 i = 0; i < header->constants.count; i++) {
+    i32 address = constants[i];
+    if (address != NO_CONSTANT && (address < 0 || address >= header->values.count ||
+      !(IS_NUMBER(values[address]) || IS_STRING(values[address])))) {
+      return ERR;
+    }
+  }
+  // All strings are read when they are indexed, the empty string has no handle
+  const struct String* strings = section_data(image, header->strings);
+  for (i32 i = 0; i < header->strings.count; i++) {
+    if (strings[i].length <= 0 || strings[i].offset < 0 || strings[i].offset > header->buffer.count - strings[i].length) {
+      return ERR;
+    }
+  }
+  return NO_ERR;
+}
+
+// Is the data in the mapped image (and not copied out of it)?
+i32 mapped(struct VM_state* vm, const void* data) {
+  return vm->image && (const u8*)data >= vm->image && (const u8*)data < vm->image + vm->image_size;
+}
+
+void* copy(const void* data, u32 size) {
+  if (size == 0) {
+    return NULL;
+  }
+  void* result = m_malloc(size);
+  if (result) {
+    memcpy(result, data, size);
+  }
+  return result;
+}
+
+void release(void* data, u32 size) {
+  if (data) {
+    m_free(data, size);
+  }
+}
+
+u64 image_hash(const char* source, u32 length) {
+  return hash_continue(FNV_BASIS, (const u8*)source, length);
+}
+
+i32 image_save(struct VM_state* vm, const char* path, u64 source_hash) {
+  i32 result = NO_ERR;
+  struct Image_symbol* symbols = NULL;
+  i32 symbols_count = 0;
+  i32 symbols_capacity = 0;
+  const Htable* table = &vm->fs_global.symbol_table;
+  for (u32 i = 0; i < ht_get_size(table); i++) {
+    const Hkey* key = ht_lookup_key(table, i);
+    if (key) {
+      struct Image_symbol symbol = {
+        .address = *ht_lookup_by_index(table, i),
+      };
+      memcpy(symbol.name, *key, sizeof(Hkey));
+      list_push(symbols, symbols_count, symbols_capacity, symbol);
+    }
+  }
+
+  u32 size = 0;
+  section_add(&size, 1, sizeof(struct Image_header));
+  struct Image_header header = {
+    .magic = IMAGE_MAGIC,
+    .version = IMAGE_VERSION,
+    .source_hash = source_hash,
+    .ins_count = MAX_INS,
+    .object_size = sizeof(struct Object),
+    .cfunctions_count = vm->cfunctions_count,
+    .caches_count = vm->caches_count,
+    .whole_program = vm->whole_program,
+    .values = section_add(&size, vm->values_count, sizeof(struct Object)),
+    .strings = section_add(&size, vm->strings_count, sizeof(struct String)),
+    .buffer = section_add(&size, vm->buffer.length, sizeof(char)),
+    .program = section_add(&size, vm->program_size, sizeof(u8)),
+    .symbols = section_add(&size, symbols_count, sizeof(struct Image_symbol)),
+    .lazy = section_add(&size, vm->lazy_count, sizeof(struct Lazy_function)),
+    .lazy_ins = section_add(&size, vm->lazy_ins_count, sizeof(struct Ir_ins)),
+    .constants = section_add(&size, vm->constants.size, sizeof(i32)),
+  };
+
+  // NOTE(lucas): Write to a temporary file first, so that a program that is loading the image
+  // at the same time never sees a partially written file
+  char tmp_path[MAX_PATH_SIZE] = {0};
+  snprintf(tmp_path, MAX_PATH_SIZE, "%s.tmp", path);
+  FILE* fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    result = ERR;
+    goto done;
+  }
+  u32 at = 0;
+  u64 hash = FNV_BASIS;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+    result = ERR;
+  }
+  at += sizeof(header);
+  if (result != NO_ERR ||
+    section_write(fp, &at, &hash, header.values, vm->values, sizeof(struct Object)) != NO_ERR ||
+    section_write(fp, &at, &hash, header.strings, vm->strings, sizeof(struct String)) != NO_ERR ||
+    section_write(fp, &at, &hash, header.buffer, vm->buffer.data, sizeof(char)) != NO_ERR ||
+    section_write(fp, &at, &hash, header.program, vm->program, sizeof(u8)) != NO_ERR ||
+    section_write(fp, &at, &hash, header.symbols, symbols, sizeof(struct Image_symbol)) != NO_ERR ||
+    section_write(fp, &at, &hash, header.lazy, vm->lazy, sizeof(struct Lazy_function)) != NO_ERR ||
+    section_write(fp, &at, &hash, header.lazy_ins, vm->lazy_ins, sizeof(struct Ir_ins)) != NO_ERR ||
+    section_write(fp, &at, &hash, header.constants, vm->constants.slots, sizeof(i32)) != NO_ERR) {
+    result = ERR;
+  }
+  header.checksum = hash;
+  header.header_checksum = header_checksum(&header);
+  if (result == NO_ERR && (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, fp) != 1)) {
+    result = ERR;
+  }
+  if (fclose(fp) != 0) {
+    result = ERR;
+  }
+  if (result == NO_ERR && rename(tmp_path, path) != 0) {
+    result = ERR;
+  }
+  if (result != NO_ERR) {
+    remove(tmp_path);
+  }
+done:
+  list_free(symbols, symbols_count, symbols_capacity);
+  return result;
+}
+
+i32 image_load(struct VM_state* vm, const char* path, u64 source_hash, i32 verify) {
+  assert(!vm->image);
+  if (vm->program_size != 0) {
+    return ERR;
+  }
+  i32 fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return ERR;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct Image_header) || st.st_size > INT32_MAX) {
+    close(fd);
+    return ERR;
+  }
+  u32 size = st.st_size;
+  // NOTE(lucas): Private mapping, so that the values can be assigned to without changing the file
+  u8* image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return ERR;
+  }
+  if (header_check(vm, image, size, source_hash, verify) != NO_ERR) {
+    munmap(image, size);
+    return ERR;
+  }
+  const struct Image_header* header = (struct Image_header*)image;
+  struct Call_cache* caches = NULL;
+  if (header->caches_count > 0) {
+    caches = list_init(sizeof(struct Call_cache), header->caches_count);
+    if (!caches) {
+      munmap(image, size);
+      return ERR;
+    }
+  }
+
+  const struct Image_symbol* symbols = section_data(image, header->symbols);
+  for (i32 i = 0; i < header->symbols.count; i++) {
+    if (!ht_element_exists(&vm->fs_global.symbol_table, symbols[i].name)) {
+      ht_insert_element(&vm->fs_global.symbol_table, symbols[i].name, symbols[i].address);
+    }
+  }
+  list_free(vm->values, vm->values_count, vm->values_capacity);
+  // NOTE(lucas): The mapped lists have no capacity, so they are copied out of the image before they can grow
+  vm->values = section_data(image, header->values);
+  vm->values_count = header->values.count;
+  vm->values_capacity = 0;
+  vm->strings = section_data(image, header->strings);
+  vm->strings_count = header->strings.count;
+  vm->strings_capacity = 0;
+  vm->buffer.data = section_data(image, header->buffer);
+  vm->buffer.length = header->buffer.count;
+  vm->buffer.capacity = 0;
+  vm->program = section_data(image, header->program);
+  vm->program_size = header->program.count;
+  vm->program_capacity = 0;
+  vm->caches = caches;
+  vm->caches_count = header->caches_count;
+  vm->caches_capacity = header->caches_count;
+  vm->lazy = section_data(image, header->lazy);
+  vm->lazy_count = header->lazy.count;
+  vm->lazy_capacity = 0;
+  vm->lazy_ins = section_data(image, header->lazy_ins);
+  vm->lazy_ins_count = header->lazy_ins.count;
+  vm->lazy_ins_capacity = 0;
+  vm->image = image;
+  vm->image_size = size;
+  if (string_index_rebuild(vm) != NO_ERR ||
+    constant_pool_restore(vm, section_data(image, header->constants), header->constants.count) != NO_ERR) {
+    list_free(vm->caches, vm->caches_count, vm->caches_capacity);
+    image_unmap(vm);
+    return vm->status = ERR;
+  }
+  return NO_ERR;
+}
+
+i32 image_detach(struct VM_state* vm) {
+  if (!vm->image) {
+    return NO_ERR;
+  }
+  if (image_detach_program(vm) != NO_ERR) {
+    return vm->status = ERR;
+  }
+  struct Object* values = copy(vm->values, vm->values_count * sizeof(struct Object));
+  struct String* strings = copy(vm->strings, vm->strings_count * sizeof(struct String));
+  char* buffer = copy(vm->buffer.data, vm->buffer.length * sizeof(char));
+  struct Lazy_function* lazy = copy(vm->lazy, vm->lazy_count * sizeof(struct Lazy_function));
+  struct Ir_ins* lazy_ins = copy(vm->lazy_ins, vm->lazy_ins_count * sizeof(struct Ir_ins));
+  if ((vm->values_count > 0 && !values) || (vm->strings_count > 0 && !strings) ||
+    (vm->buffer.length > 0 && !buffer) || (vm->lazy_count > 0 && !lazy) || (vm->lazy_ins_count > 0 && !lazy_ins)) {
+    release(values, vm->values_count * sizeof(struct Object));
+    release(strings, vm->strings_count * sizeof(struct String));
+    release(buffer, vm->buffer.length * sizeof(char));
+    release(lazy, vm->lazy_count * sizeof(struct Lazy_function));
+    release(lazy_ins, vm->lazy_ins_count * sizeof(struct Ir_ins));
+    return vm->status = ERR;
+  }
+  munmap(vm->image, vm->image_size);
+  vm->values = values;
+  vm->values_capacity = vm->values_count;
+  vm->strings = strings;
+  vm->strings_capacity = vm->strings_count;
+  vm->buffer.data = buffer;
+  vm->buffer.capacity = vm->buffer.length;
+  vm->lazy = lazy;
+  vm->lazy_capacity = vm->lazy_count;
+  vm->lazy_ins = lazy_ins;
+  vm->lazy_ins_capacity = vm->lazy_ins_count;
+  vm->ip = NULL;  // Set again before the program is executed
+  vm->image = NULL;
+  vm->image_size = 0;
+  return NO_ERR;
+}
+
+i32 image_detach_program(struct VM_state* vm) {
+  if (!image_program_mapped(vm)) {
+    return NO_ERR;
+  }
+  u8* program = copy(vm->program, vm->program_size * sizeof(u8));
+  if (vm->program_size > 0 && !program) {
+    return vm->status = ERR;
+  }
+  vm->program = program;
+  vm->program_capacity = vm->program_size;
+  return NO_ERR;
+}
+
+i32 image_program_mapped(struct VM_state* vm) {
+  return mapped(vm, vm->program);
+}
+
+void image_unmap(struct VM_state* vm) {
+  if (!vm->image) {
+    return;
+  }
+  if (image_program_mapped(vm)) {
+    vm->program = NULL;
+    vm->program_size = 0;
+    vm->program_capacity = 0;
+  }
+  munmap(vm->image, vm->image_size);
+  vm->values = NULL;
+  vm->values_count = 0;
+  vm->values_capacity = 0;
+  vm->strings = NULL;
+  vm->strings_count = 0;
+  vm->strings_capacity = 0;
+  string_index_free(&vm->strings_index);
+  buffer_init(&vm->buffer);
+  vm->lazy = NULL;
+  vm->lazy_count = 0;
+  vm->lazy_capacity = 0;
+  vm->lazy_ins = NULL;
+  vm->lazy_ins_count = 0;
+  vm->lazy_ins_capacity = 0;
+  vm->image = NULL;
+  vm->image_size = 0;
+}
@@ -0,0 +1,132 @@
+// intern.c
+// String index, open addressing hash table of string handles keyed by the characters of the strings
+
+#include "common.h"
+#include "memory.h"
+#include "util.h"
+#include "vm.h"
+#include "intern.h"
+
+#define STRING_INDEX_INIT_SIZE 64
+
+static u32 string_hash(struct VM_state* vm, i32 handle);
+static i32 string_matches(struct VM_state* vm, i32 handle, const char* data, i32 length);
+static void slot_insert(String_index* index, u32 hash, i32 handle);
+static i32 index_resize(struct VM_state* vm, u32 new_size);
+
+u32 string_hash(struct VM_state* vm, i32 handle) {
+  struct Buffer string = string_get(vm, handle);
+  return hash_bytes(string.data, string.length);
+}
+
+i32 string_matches(struct VM_state* vm, i32 handle, const char* data, i32 length) {
+  struct Buffer string = string_get(vm, handle);
+  return string.length == length && !memcmp(string.data, data, length);
+}
+
+void slot_insert(String_index* index, u32 hash, i32 handle) {
+  u32 slot = hash & (index->size - 1);
+  while (index->slots[slot] != NO_STRING) {
+    slot = (slot + 1) & (index->size - 1);
+  }
+  index->slots[slot] = handle;
+  index->count++;
+}
+
+// Rebuild the table with the new size, only keeping the strings that still exist
+i32 index_resize(struct VM_state* vm, u32 new_size) {
+  String_index* index = &vm->strings_index;
+  i32* old_slots = index->slots;
+  u32 old_size = index->size;
+  i32* slots = m_malloc(sizeof(i32) * new_size);
+  if (!slots) {
+    return ERR;
+  }
+  for (u32 i = 0; i < new_size; i++) {
+    slots[i] = NO_STRING;
+  }
+  index->slots = slots;
+  index->size = new_size;
+  index->count = 0;
+  for (u32 i = 0; i < old_size; i++) {
+    i32 handle = old_slots[i];
+    if (handle != NO_STRING && handle < vm->strings_count) {
+      slot_insert(index, string_hash(vm, handle), handle);
+    }
+  }
+  if (old_slots) {
+    m_free(old_slots, sizeof(i32) * old_size);
+  }
+  return NO_ERR;
+}
+
+void string_index_init(String_index* index) {
+  index->slots = NULL;
+  index->count = 0;
+  index->size = 0;
+}
+
+i32 string_intern(struct VM_state* vm, const char* data, i32 length, i32* handle) {
+  if (length == 0) {
+    *handle = NO_STRING;
+    return NO_ERR;
+  }
+  String_index* index = &vm->strings_index;
+  u32 hash = hash_bytes(data, length);
+  if (index->slots) {
+    for (u32 slot = hash & (index->size - 1);; slot = (slot + 1) & (index->size - 1)) {
+      i32 found = index->slots[slot];
+      if (found == NO_STRING) {
+        break;
+      }
+      if (string_matches(vm, found, data, length)) {
+        *handle = found;
+        return NO_ERR;
+      }
+    }
+  }
+  if (index->count >= index->size / 2) {
+    if (index_resize(vm, index->size ? index->size * 2 : STRING_INDEX_INIT_SIZE) != NO_ERR) {
+      return ERR;
+    }
+  }
+  // NOTE(lucas): Strings refer to their characters by offset, so they stay valid when the buffer is reallocated
+  if (buffer_append_n(&vm->buffer, (char*)data, length) != NO_ERR) {
+    return ERR;
+  }
+  struct String string = {
+    .offset = vm->buffer.length - length,
+    .length = length,
+  };
+  i32 new_handle = vm->strings_count;
+  list_push(vm->strings, vm->strings_count, vm->strings_capacity, string);
+  if (vm->strings_count == new_handle) {
+    return ERR;
+  }
+  slot_insert(index, hash, new_handle);
+  *handle = new_handle;
+  return NO_ERR;
+}
+
+i32 string_index_rebuild(struct VM_state* vm) {
+  String_index* index = &vm->strings_index;
+  string_index_free(index);
+  u32 size = STRING_INDEX_INIT_SIZE;
+  while (size / 2 <= (u32)vm->strings_count) {
+    size *= 2;
+  }
+  if (index_resize(vm, size) != NO_ERR) {
+    return ERR;
+  }
+  for (i32 handle = 0; handle < vm->strings_count; handle++) {
+    slot_insert(index, string_hash(vm, handle), handle);
+  }
+  return NO_ERR;
+}
+
+void string_index_free(String_index* index) {
+  if (index->slots) {
+    m_free(index->slots, sizeof(i32) * index->size);
+  }
+  string_index_init(index);
+}
@@ -0,0 +1,1554 @@
+// ir.c
+// Lowering of the abstract syntax tree into the intermediate representation, and the optimizations on it
+
+#include "common.h"
+#include "memory.h"
+#include "ast.h"
+#include "vm.h"
+#include "util.h"
+#include "error.h"
+#include "optimize.h"
+#include "ir.h"
+
+// NOTE(lucas): The error macro counts the errors of the ir that is local to the lowering functions
+#define compile_error2(token, fmt, ...) \
+  ir->errors++; \
+  fprintf(stderr, "compile-error: %s:%i:%i: " fmt, token.filename, token.line, token.count, ##__VA_ARGS__); \
+  error_printline((&token.source[0]), token)
+
+// Branch type of expressions that do not push exactly one value, or where it can not be known at compile time
+#define UNKNOWN_VALUES -1
+
+// Maximum number of parameters of functions that are inlined
+#define MAX_INLINE_ARGS 8
+
+// A function whose calls can be inlined
+struct Inline_func {
+  i32 address;      // Value address of the function
+  i32 start;        // Index of its IR_FUNC
+  i32 end;          // Index of its IR_RETURN
+  i32 first_label;  // Labels in the body, which get new numbers for every inlined copy
+  i32 labels;
+};
+
+// How an argument of an inlined call is passed to the body
+enum Inline_arg {
+  ARG_SUBSTITUTE,  // The temporary of the argument is used directly, where the body uses the argument once
+  ARG_COPY,        // Literals and arguments are copied to every use
+  ARG_SPILL,       // Computed once, into a value that the body loads
+  ARG_DROP,        // Not used by the body, and can not fail
+};
+
+static i32 ins_add(Ir* ir, i32 op, struct Token* token, i32 a, i32 b, i32 c);
+static i32 label_add(Ir* ir);
+static i32 value_add(struct VM_state* vm, Ir* ir, struct Object value);
+static i32 constant_add(struct VM_state* vm, Ir* ir, struct Token* token);
+static i32 define_value(struct VM_state* vm, Ir* ir, struct Token token, struct Function_state* fs, i32 type, i32* address);
+static i32 define_arg(struct VM_state* vm, Ir* ir, struct Token token, struct Function_state* fs, i32* address);
+static i32 lookup_arg(struct Token token, struct Function_state* fs, i32* address);
+static i32 lookup_value(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address);
+static i32 get_value_address(struct VM_state* vm, Ir* ir, struct Token token, struct Function_state* fs, i32* address);
+static i32 is_op(i32 type);
+static i32 simple(struct VM_state* vm, Ast* ast, i32 index, struct Function_state* fs);
+static i32 lower_simple(struct VM_state* vm, Ir* ir, Ast* ast, i32 index, struct Function_state* fs);
+static i32 lower_func(struct VM_state* vm, Ir* ir, struct Token* name, Ast* args, Ast* body, struct Function_state* fs);
+static i32 lower(struct VM_state* vm, Ir* ir, Ast* ast, struct Function_state* fs, i32* branch_type);
+static i32 lower_range(struct VM_state* vm, Ir* ir, Ast* ast, i32 first, i32 last, struct Function_state* fs, i32* branch_type);
+static void remove_temp(Ir* ir, i32 temp);
+static void propagate_copies(Ir* ir);
+static void fold_constants(struct VM_state* vm, Ir* ir);
+static i32 may_fail(const struct Ir_ins* ins, i32 temp);
+static i32 temp_operands(struct Ir_ins* ins, i32* operands[2]);
+static void remap_temps(struct Ir_ins* ins, const i32* map);
+static i32 inline_candidate(Ir* ir, i32 start, struct Inline_func* func);
+static i32 inline_call(struct VM_state* vm, Ir* ir, const struct Inline_func* func, struct Ir_ins** out, i32* out_count, i32* out_capacity, i32* map);
+static i32 inline_calls(struct VM_state* vm, Ir* ir);
+static void fold_branches(struct VM_state* vm, Ir* ir);
+static void remove_unreachable(Ir* ir);
+static i32 mark_references(Ir* ir, i32 from, i32 to, i32 first, const i32* funcs, i32* live, i32* worklist, i32 worklist_count);
+static void remove_dead_functions(struct VM_state* vm, Ir* ir);
+static void remove_dead_stores(struct VM_state* vm, Ir* ir);
+static void remove_unused_values(struct VM_state* vm, Ir* ir);
+static i32 ins_count(const Ir* ir);
+static void mark_tail_calls(Ir* ir);
+
+static const char* ir_op_names[MAX_IR_OP] = {
+  "nop",
+  "const",
+  "arg",
+  "load",
+  "binary",
+  "push",
+  "stack_binary",
+  "store",
+  "assign",
+  "call",
+  "local_call",
+  "jump",
+  "branch",
+  "cond_branch",
+  "label",
+  "func",
+  "return",
+  "end",
+};
+
+void ir_init(Ir* ir) {
+  ir->ins = NULL;
+  ir->count = 0;
+  ir->capacity = 0;
+  ir->labels_count = 0;
+  ir->values_added = 0;
+  ir->symbols = ht_create_empty();
+  ir->errors = 0;
+  ir->removed = (struct Ir_stats) {0};
+}
+
+i32 ins_add(Ir* ir, i32 op, struct Token* token, i32 a, i32 b, i32 c) {
+  struct Ir_ins ins = {
+    .op = op,
+    .args = {a, b, c},
+    .type = T_UNKNOWN,
+    .flags = 0,
+    .token = token,
+  };
+  i32 index = ir->count;
+  list_push(ir->ins, ir->count, ir->capacity, ins);
+  return index < ir->count ? index : NO_TEMP;  // NO_TEMP when out of memory
+}
+
+i32 label_add(Ir* ir) {
+  return ir->labels_count++;
+}
+
+// Returns -1 when out of memory
+i32 value_add(struct VM_state* vm, Ir* ir, struct Object value) {
+  i32 address = vm->values_count;
+  list_push(vm->values, vm->values_count, vm->values_capacity, value);
+  if (address == vm->values_count) {
+    return -1;
+  }
+  ir->values_added++;
+  return address;
+}
+
+// Get the value address of a literal, identical literals share the same value. Returns -1 when out of memory
+i32 constant_add(struct VM_state* vm, Ir* ir, struct Token* token) {
+  i32 address = -1;
+  if (constant_pool_lookup(vm, token, &address) == NO_ERR) {
+    return address;
+  }
+  struct Object obj;
+  if (token_to_object(vm, token, &obj) != NO_ERR) {
+    return -1;
+  }
+  address = value_add(vm, ir, obj);
+  if (address >= 0) {
+    constant_pool_insert(vm, address);
+  }
+  return address;
+}
+
+i32 define_value(struct VM_state* vm, Ir* ir, struct Token token, struct Function_state* fs, i32 type, i32* address) {
+  char name[HTABLE_KEY_SIZE] = {};
+  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+
+  if (ht_lookup(&fs->symbol_table, name)) {
+    compile_error2(token, "Value '%.*s' has already been defined\n", token.length, token.string);
+    return vm->status = ERR;
+  }
+  if ((*address = value_add(vm, ir, object_of_type(type))) < 0) {
+    return vm->status = ERR;
+  }
+  ht_insert_element(&fs->symbol_table, name, *address);
+  if (fs == &vm->fs_global) {
+    // NOTE(lucas): Keep track of new global symbols that was added in this
+    // lowering (to be able to do rollback on the global symbol table in case of error(s))
+    ht_insert_element(&ir->symbols, name, *address);
+  }
+  return NO_ERR;
+}
+
+i32 define_arg(struct VM_state* vm, Ir* ir, struct Token token, struct Function_state* fs, i32* address) {
+  char name[HTABLE_KEY_SIZE] = {};
+  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+
+  if (ht_lookup(&fs->args, name)) {
+    compile_error2(token, "Parameter '%.*s' has already been defined\n", token.length, token.string);
+    return vm->status = ERR;
+  }
+  *address = ht_num_elements(&fs->args);
+  ht_insert_element(&fs->args, name, *address);
+  return NO_ERR;
+}
+
+i32 lookup_arg(struct Token token, struct Function_state* fs, i32* address) {
+  char name[HTABLE_KEY_SIZE] = {};
+  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+
+  const i32* found = ht_lookup(&fs->args, name);
+  if (found) {
+    *address = *found;
+    return NO_ERR;
+  }
+  return ERR;
+}
+
+// Find a value in the function or in any of the functions that it is defined in
+i32 lookup_value(struct VM_state* vm, struct Token token, struct Function_state* fs, i32* address) {
+  char name[HTABLE_KEY_SIZE] = {};
+  string_copy(name, token.string, token.length, HTABLE_KEY_SIZE);
+
+  do {
+    const i32* found = ht_lookup(&fs->symbol_table, name);
+    if (found) {
+      *address = *found;
+      return NO_ERR;
+    }
+    if (fs == &vm->fs_global) {
+      break;
+    }
+  } while ((fs = fs->parent) != NULL);
+  return ERR;
+}
+
+i32 get_value_address(struct VM_state* vm, Ir* ir, struct Token token, struct Function_state* fs, i32* address) {
+  if (lookup_value(vm, token, fs, address) != NO_ERR) {
+    compile_error2(token, "No such value '%.*s'\n", token.length, token.string);
+    return vm->status = ERR;
+  }
+  return NO_ERR;
+}
+
+i32 is_op(i32 type) {
+  switch (type) {
+    case T_ADD:
+    case T_SUB:
+    case T_MUL:
+    case T_DIV:
+    case T_LT:
+    case T_GT:
+    case T_EQ:
+      return 1;
+    default:
+      break;
+  }
+  return 0;
+}
+
+i32 ir_is_temp(i32 op) {
+  return op == IR_CONST || op == IR_ARG || op == IR_LOAD || op == IR_BINARY;
+}
+
+i32 ir_label(const struct Ir_ins* ins) {
+  switch (ins->op) {
+    case IR_JUMP:
+    case IR_COND_BRANCH:
+    case IR_LABEL:
+      return 0;
+    case IR_BRANCH:
+      return 1;
+    default:
+      break;
+  }
+  return -1;
+}
+
+i32 ir_function_end(const Ir* ir, i32 start) {
+  assert(ir->ins[start].op == IR_FUNC);
+  i32 depth = 0;
+  for (i32 i = start; i < ir->count; i++) {
+    if (ir->ins[i].op == IR_FUNC) {
+      depth++;
+    }
+    else if (ir->ins[i].op == IR_END && --depth == 0) {
+      return i;
+    }
+  }
+  assert(0);
+  return ir->count - 1;
+}
+
+i32 ir_copy(const Ir* ir, i32 start, i32 end, struct Ir_ins* out) {
+  i32 first_label = ir->labels_count;
+  i32 last_label = -1;
+  for (i32 i = start; i <= end; i++) {
+    struct Ir_ins ins = ir->ins[i];
+    i32* operands[2];
+    i32 count = temp_operands(&ins, operands);
+    for (i32 operand = 0; operand < count; operand++) {
+      *operands[operand] -= start;
+    }
+    i32 label = ir_label(&ins);
+    if (label >= 0) {
+      first_label = ins.args[label] < first_label ? ins.args[label] : first_label;
+      last_label = ins.args[label] > last_label ? ins.args[label] : last_label;
+    }
+    ins.token = NULL;
+    out[i - start] = ins;
+  }
+  for (i32 i = 0; i <= end - start; i++) {
+    i32 label = ir_label(&out[i]);
+    if (label >= 0) {
+      out[i].args[label] -= first_label;
+    }
+  }
+  return last_label >= first_label ? last_label - first_label + 1 : 0;
+}
+
+// Can the child of the ast be lowered into a temporary? It must not be followed by call arguments.
+i32 simple(struct VM_state* vm, Ast* ast, i32 index, struct Function_state* fs) {
+  struct Token* token = ast_get_node_value(ast, index);
+  if (!token) {
+    return 0;
+  }
+  i32 address = -1;
+  switch (token->type) {
+    case T_NUMBER:
+    case T_STRING:
+      return 1;
+    case T_IDENTIFIER:
+      return lookup_arg(*token, fs, &address) == NO_ERR || lookup_value(vm, *token, fs, &address) == NO_ERR;
+    case T_EXPR: {
+      Ast expr_branch = ast_get_node_at(ast, index);
+      return ast_child_count(&expr_branch) == 1 && simple(vm, &expr_branch, 0, fs);
+    }
+    default:
+      break;
+  }
+  if (is_op(token->type)) {
+    Ast op_branch = ast_get_node_at(ast, index);
+    return ast_child_count(&op_branch) == 2 && simple(vm, &op_branch, 0, fs) && simple(vm, &op_branch, 1, fs);
+  }
+  return 0;
+}
+
+// Lower a simple child of the ast, and return the temporary that holds its value
+i32 lower_simple(struct VM_state* vm, Ir* ir, Ast* ast, i32 index, struct Function_state* fs) {
+  struct Token* token = ast_get_node_value(ast, index);
+  assert(token);
+  i32 temp = NO_TEMP;
+  i32 address = -1;
+  switch (token->type) {
+    case T_NUMBER:
+    case T_STRING: {
+      if ((address = constant_add(vm, ir, token)) < 0) {
+        return NO_TEMP;
+      }
+      if ((temp = ins_add(ir, IR_CONST, token, address, 0, 0)) != NO_TEMP) {
+        ir->ins[temp].type = object_type(vm->values[address]);
+      }
+      break;
+    }
+    case T_IDENTIFIER: {
+      if (lookup_arg(*token, fs, &address) == NO_ERR) {
+        if ((temp = ins_add(ir, IR_ARG, token, address, 0, 0)) != NO_TEMP) {
+          ir->ins[temp].type = (fs->int_args & (1 << address)) ? T_NUMBER : T_UNKNOWN;  // Arguments are always pushed as one value
+        }
+      }
+      else if (lookup_value(vm, *token, fs, &address) == NO_ERR) {
+        if ((temp = ins_add(ir, IR_LOAD, token, address, 0, 0)) != NO_TEMP) {
+          ir->ins[temp].type = object_type(vm->values[address]);
+        }
+      }
+      else {
+        assert(0);
+      }
+      break;
+    }
+    case T_EXPR: {
+      Ast expr_branch = ast_get_node_at(ast, index);
+      return lower_simple(vm, ir, &expr_branch, 0, fs);
+    }
+    default: {
+      assert(is_op(token->type));
+      Ast op_branch = ast_get_node_at(ast, index);
+      i32 left = lower_simple(vm, ir, &op_branch, 0, fs);
+      i32 right = lower_simple(vm, ir, &op_branch, 1, fs);
+      if (left == NO_TEMP || right == NO_TEMP || (temp = ins_add(ir, IR_BINARY, token, token->type, left, right)) == NO_TEMP) {
+        return NO_TEMP;
+      }
+      ir->ins[temp].type = T_NUMBER;
+      if (ir->ins[left].type == T_NUMBER && ir->ins[right].type == T_NUMBER) {
+        ir->ins[temp].flags |= IR_INT;
+      }
+      break;
+    }
+  }
+  return temp;
+}
+
+i32 lower_func(struct VM_state* vm, Ir* ir, struct Token* name, Ast* args, Ast* body, struct Function_state* fs) {
+  i32 status = NO_ERR;
+  // Allocate a new value for this function
+  i32 address = -1;
+  if (define_value(vm, ir, *name, fs, T_UNKNOWN, &address) != NO_ERR) {
+    return vm->status = ERR;
+  }
+  assert(address != -1);
+
+  struct Function_state new_fs;
+  func_state_init(&new_fs, fs, vm->arena);
+
+  // To skip the function body
+  i32 skip_label = label_add(ir);
+  ins_add(ir, IR_JUMP, NULL, skip_label, 0, 0);
+
+  // Function arguments
+  i32 arg_count = ast_child_count(args);
+  if (arg_count > MAX_ARGC) {
+    compile_error2((*name), "Too many parameters\n");
+    status = ERR;
+    goto done;
+  }
+  for (i32 i = 0; i < arg_count; i++) {
+    struct Token* arg = ast_get_node_value(args, i);
+    if (arg) {
+      if (arg->type != T_IDENTIFIER) {
+        compile_error2((*arg), "Expected identifier in function argument list (got '%.*s')\n", arg->length, arg->string);
+        status = ERR;
+        goto done;
+      }
+      i32 arg_address = -1;
+      if ((status = define_arg(vm, ir, *arg, &new_fs, &arg_address)) != NO_ERR) {
+        goto done;
+      }
+      // Explicit parameter type, int parameters are checked at function entry
+      Ast arg_branch = ast_get_node_at(args, i);
+      struct Token* type_token = ast_get_node_value(&arg_branch, 0);
+      if (type_token) {
+        if (type_token->type != T_NUMBER) {
+          compile_error2((*type_token), "Only int parameters can be typed\n");
+          status = ERR;
+          goto done;
+        }
+        if (arg_address >= 31) {
+          compile_error2((*type_token), "Too many typed parameters\n");
+          status = ERR;
+          goto done;
+        }
+        new_fs.int_args |= 1 << arg_address;
+      }
+    }
+  }
+  // The code generators place the function, and set its address
+  vm->values[address] = MAKE_FUNCTION(0, arg_count);
+  ins_add(ir, IR_FUNC, name, address, arg_count, new_fs.int_args);
+
+  // Lower the function body
+  lower(vm, ir, body, &new_fs, NULL);
+  ins_add(ir, IR_RETURN, NULL, 0, 0, 0);
+  ins_add(ir, IR_END, NULL, address, 0, 0);
+  ins_add(ir, IR_LABEL, NULL, skip_label, 0, 0);
+done:
+  func_state_free(&new_fs); // Okay, we are done with the compile-time function state for static checks
+  return vm->status = status;
+}
+
+i32 lower(struct VM_state* vm, Ir* ir, Ast* ast, struct Function_state* fs, i32* branch_type) {
+  assert(ast);
+  return lower_range(vm, ir, ast, 0, ast_child_count(ast), fs, branch_type);
+}
+
+// Lower the children [first, last) of the ast. If they push exactly one value,
+// the branch type is the (compile-time) type of that value, otherwise it is UNKNOWN_VALUES.
+i32 lower_range(struct VM_state* vm, Ir* ir, Ast* ast, i32 first, i32 last, struct Function_state* fs, i32* branch_type) {
+  assert(ast);
+  struct Token* token = NULL;
+  i32 type = UNKNOWN_VALUES;
+  i32 num_values = 0;  // Number of expressions that pushed a value
+  i32 known = 1;  // Do we know the number of values that this range pushes?
+  // Stops when out of memory, the symbols that could not be added would give errors that are not there
+  for (i32 i = first; i < last && !vm->allocator.failed; i++) {
+    if ((token = ast_get_node_value(ast, i))) {
+      i32 pushes_value = 1;
+      i32 prev_type = type;
+      type = UNKNOWN_VALUES;
+      switch (token->type) {
+        case T_STRING:
+        case T_NUMBER: {
+          i32 temp = lower_simple(vm, ir, ast, i, fs);
+          if (temp == NO_TEMP) {
+            return vm->status = ERR;
+          }
+          type = ir->ins[temp].type;
+          ins_add(ir, IR_PUSH, token, temp, 0, 0);
+          break;
+        }
+        case T_IDENTIFIER: {
+          i32 address = -1;
+          i32 is_arg = 0;
+          if (lookup_arg(*token, fs, &address) == NO_ERR) {
+            is_arg = 1;
+          }
+          else if (get_value_address(vm, ir, *token, fs, &address) != NO_ERR) {
+            return vm->status = ERR;
+          }
+          // Function arguments (if no function arguments are passed, then this is no function call, which is totally fine!)
+          // We might want to, for instance, pass a function value to another function
+          Ast args = i + 1 < last ? ast_get_node_at(ast, i + 1) : NULL;
+          struct Token* args_token = args ? ast_get_value(&args) : NULL;
+          assert(!args || args_token);
+          i32 is_call = args_token && args_token->type == T_EXPR;
+          if (!is_arg) {
+            struct Object* value = &vm->values[address];
+            is_call = is_call && (IS_FUNCTION(*value) || IS_CFUNCTION(*value));
+          }
+          if (!is_call) {
+            i32 temp = lower_simple(vm, ir, ast, i, fs);
+            if (temp == NO_TEMP) {
+              return vm->status = ERR;
+            }
+            type = ir->ins[temp].type;
+            ins_add(ir, IR_PUSH, token, temp, 0, 0);
+            break;
+          }
+          i32 num_args = ast_child_count(&args);
+          if (num_args > 0) {
+            lower(vm, ir, &args, fs, NULL);
+          }
+          i++;
+          if (is_arg) {
+            // Local function call
+            i32 temp = ins_add(ir, IR_ARG, token, address, 0, 0);
+            ins_add(ir, IR_LOCAL_CALL, token, temp, num_args, 0);
+          }
+          else {
+            ins_add(ir, IR_CALL, token, address, 0, 0);
+          }
+          type = UNKNOWN_VALUES;  // Functions return any number of values
+          break;
+        }
+        // let
+        // \-- identifier
+        //        \--type (optional)
+        //     \-- (expression)
+        case T_LET: {
+          Ast let_branch = ast_get_node_at(ast, i);
+          Ast ident_branch = ast_get_node_at(&let_branch, 0);
+          Ast value_branch = ast_get_node_at(&let_branch, 1);
+          assert(ast_child_count(&value_branch) == 1);
+
+          pushes_value = 0;
+          struct Token* ident = ast_get_value(&ident_branch);
+          struct Token* type_token = ast_get_node_value(&ident_branch, 0);
+          assert(ident);
+
+          i32 value_address = -1;
+          i32 let_type = T_UNKNOWN;
+
+          // Handle explicit type
+          if (type_token) {
+            if (type_token->type == T_IDENTIFIER) {
+              i32 type_value_address = -1;
+              if (get_value_address(vm, ir, *type_token, fs, &type_value_address) == NO_ERR) {
+                assert(type_value_address >= 0 && type_value_address < vm->values_count);
+                let_type = object_type(vm->values[type_value_address]);
+              }
+              else {
+                compile_error2((*type_token), "The type '%.*s' is not defined\n", type_token->length, type_token->string);
+                return vm->status = ERR;
+              }
+            }
+            else {
+              let_type = type_token->type;
+            }
+          }
+
+          if (define_value(vm, ir, *ident, fs, let_type, &value_address) != NO_ERR) {
+            return vm->status = ERR;
+          }
+          assert(value_address != -1);
+          i32 value_branch_type = UNKNOWN_VALUES;
+          i32 temp = NO_TEMP;
+          if (simple(vm, &value_branch, 0, fs)) {
+            temp = lower_simple(vm, ir, &value_branch, 0, fs);
+            if (temp == NO_TEMP) {
+              return vm->status = ERR;
+            }
+            value_branch_type = ir->ins[temp].type;
+          }
+          else if (lower(vm, ir, &value_branch, fs, &value_branch_type) != NO_ERR) {
+            return vm->status = ERR;
+          }
+          // Validate equality between value and branch types. The type of a call is not known, so it is
+          // assigned as it is and the value is not treated as having the type of the let.
+          if (type_token && value_branch_type != UNKNOWN_VALUES && value_branch_type != T_UNKNOWN && let_type != value_branch_type) {
+            compile_error2((*type_token), "This expression was expected to have type '%.*s'\n", type_token->length, type_token->string);
+            return vm->status = ERR;
+          }
+          if (value_branch_type == UNKNOWN_VALUES) {
+            // The assignment pops whatever is on top of the stack, which might not be the value of this expression
+            known = 0;
+            value_branch_type = T_UNKNOWN;
+          }
+          vm->values[value_address] = object_of_type(value_branch_type);
+          if (temp != NO_TEMP) {
+            i32 store = ins_add(ir, IR_STORE, ident, value_address, temp, 0);
+            if (store != NO_TEMP && fs != &vm->fs_global) {
+              ir->ins[store].flags |= IR_LOCAL;
+            }
+          }
+          else {
+            ins_add(ir, IR_ASSIGN, ident, value_address, 0, 0);
+          }
+          break;
+        }
+        case T_DEFINE: {
+          pushes_value = 0;
+          Ast func = ast_get_node_at(ast, i);
+          if ((token = ast_get_node_value(&func, 0))) {
+            Ast args = ast_get_node_at(&func, 1);
+            Ast body = ast_get_node_at(&func, 2);
+            assert(args && body);
+            if (lower_func(vm, ir, token, &args, &body, fs) != NO_ERR) {
+              return vm->status;
+            }
+          }
+          else {
+            assert(0);
+          }
+          break;
+        }
+        case T_IF: {
+          Ast if_branch = ast_get_node_at(ast, i);
+          assert(if_branch);
+          Ast cond = ast_get_node_at(&if_branch, 0);
+          Ast true_body = ast_get_node_at(&if_branch, 1);
+          Ast false_body = ast_get_node_at(&if_branch, 2);
+          assert(cond && true_body && false_body);
+          i32 cond_type = UNKNOWN_VALUES;
+          i32 true_type = UNKNOWN_VALUES;
+          i32 false_type = UNKNOWN_VALUES;
+          i32 false_label = label_add(ir);
+
+          // Conditional jump at the beginning of the if expression
+          if (ast_child_count(&cond) == 1 && simple(vm, &cond, 0, fs)) {
+            i32 temp = lower_simple(vm, ir, &cond, 0, fs);
+            if (temp == NO_TEMP) {
+              return vm->status = ERR;
+            }
+            cond_type = ir->ins[temp].type;
+            ins_add(ir, IR_BRANCH, token, temp, false_label, 0);
+          }
+          else {
+            lower(vm, ir, &cond, fs, &cond_type);
+            ins_add(ir, IR_COND_BRANCH, token, false_label, 0, 0);
+          }
+
+          // Lower the first expression (the 'true' expression of the if statement)
+          lower(vm, ir, &true_body, fs, &true_type);
+          if (ast_child_count(&false_body) > 0) {
+            // Jump at the end of the if expression body
+            i32 end_label = label_add(ir);
+            ins_add(ir, IR_JUMP, NULL, end_label, 0, 0);
+            ins_add(ir, IR_LABEL, NULL, false_label, 0, 0);
+            // Lower the second expression of the if statement
+            lower(vm, ir, &false_body, fs, &false_type);
+            ins_add(ir, IR_LABEL, NULL, end_label, 0, 0);
+          }
+          else {
+            ins_add(ir, IR_LABEL, NULL, false_label, 0, 0);
+          }
+          // Both branches have to push one value (without a false body, nothing is pushed when the condition is false),
+          // and the conditional jump has to pop the value of the condition
+          if (cond_type == UNKNOWN_VALUES || true_type == UNKNOWN_VALUES || false_type == UNKNOWN_VALUES) {
+            type = UNKNOWN_VALUES;
+          }
+          else {
+            type = true_type == false_type ? true_type : T_UNKNOWN;
+          }
+          break;
+        }
+        case T_ADD:
+        case T_SUB:
+        case T_MUL:
+        case T_DIV:
+        case T_LT:
+        case T_GT:
+        case T_EQ: {
+          Ast op_branch = ast_get_node_at(ast, i);
+          assert(op_branch);
+          if (ast_child_count(&op_branch) < 2) {
+            compile_error2((*token), "Missing operands\n");
+            return vm->status = ERR;
+          }
+          if (simple(vm, ast, i, fs)) {
+            i32 temp = lower_simple(vm, ir, ast, i, fs);
+            if (temp == NO_TEMP) {
+              return vm->status = ERR;
+            }
+            type = ir->ins[temp].type;
+            ins_add(ir, IR_PUSH, token, temp, 0, 0);
+            break;
+          }
+          // Operands that are known to be numbers don't need to be type checked at run time
+          i32 left_type = UNKNOWN_VALUES;
+          i32 right_type = UNKNOWN_VALUES;
+          if (lower_range(vm, ir, &op_branch, 0, 1, fs, &left_type) != NO_ERR) {
+            return vm->status;
+          }
+          if (lower_range(vm, ir, &op_branch, 1, ast_child_count(&op_branch), fs, &right_type) != NO_ERR) {
+            return vm->status;
+          }
+          i32 op = ins_add(ir, IR_STACK_BINARY, token, token->type, 0, 0);
+          if (op != NO_TEMP && left_type == T_NUMBER && right_type == T_NUMBER) {
+            ir->ins[op].flags |= IR_INT;
+          }
+          // The result is a number, unless the operation failed at run time
+          type = (left_type == UNKNOWN_VALUES || right_type == UNKNOWN_VALUES) ? UNKNOWN_VALUES : T_NUMBER;
+          break;
+        }
+        case T_EXPR: {
+          Ast expr_branch = ast_get_node_at(ast, i);
+          if (ast_child_count(&expr_branch) == 0) {
+            pushes_value = 0;
+          }
+          else if (simple(vm, ast, i, fs)) {
+            i32 temp = lower_simple(vm, ir, ast, i, fs);
+            if (temp == NO_TEMP) {
+              return vm->status = ERR;
+            }
+            type = ir->ins[temp].type;
+            ins_add(ir, IR_PUSH, token, temp, 0, 0);
+          }
+          else {
+            lower(vm, ir, &expr_branch, fs, &type);
+          }
+          break;
+        }
+        default:
+          pushes_value = 0;
+          break;
+      }
+      if (!pushes_value) {
+        type = prev_type;
+      }
+      else {
+        num_values++;
+        if (type == UNKNOWN_VALUES) {
+          known = 0;
+        }
+      }
+    }
+  }
+  if (branch_type) {
+    *branch_type = (known && num_values == 1) ? type : UNKNOWN_VALUES;
+  }
+  return vm->status;
+}
+
+// Remove a temporary, and the temporaries that it is computed from
+void remove_temp(Ir* ir, i32 temp) {
+  struct Ir_ins* ins = &ir->ins[temp];
+  if (ins->op == IR_BINARY) {
+    remove_temp(ir, ins->args[1]);
+    remove_temp(ir, ins->args[2]);
+  }
+  ins->op = IR_NOP;
+}
+
+// Loads of a value that was stored from a literal or an argument earlier in the same block
+// are replaced by that literal or argument
+void propagate_copies(Ir* ir) {
+  i32 size = 0;
+  for (i32 i = 0; i < ir->count; i++) {
+    const struct Ir_ins* ins = &ir->ins[i];
+    if ((ins->op == IR_LOAD || ins->op == IR_STORE || ins->op == IR_ASSIGN) && ins->args[0] >= size) {
+      size = ins->args[0] + 1;
+    }
+  }
+  // The temporary that holds the same thing as each address (NO_TEMP if none does), and the addresses
+  // that have been given one since the last time they were all forgotten
+  i32* copies = m_malloc(sizeof(i32) * (size + 1));
+  i32* known = m_malloc(sizeof(i32) * (ir->count + 1));
+  i32 known_count = 0;
+  if (!copies || !known) {
+    goto done;
+  }
+  for (i32 i = 0; i < size; i++) {
+    copies[i] = NO_TEMP;
+  }
+  for (i32 i = 0; i < ir->count; i++) {
+    struct Ir_ins* ins = &ir->ins[i];
+    switch (ins->op) {
+      case IR_LOAD: {
+        i32 temp = copies[ins->args[0]];
+        if (temp != NO_TEMP) {
+          const struct Ir_ins* source = &ir->ins[temp];
+          ins->op = source->op;
+          ins->args[0] = source->args[0];
+          ins->type = source->type;
+        }
+        break;
+      }
+      case IR_STORE:
+      case IR_ASSIGN: {
+        i32 address = ins->args[0];
+        copies[address] = NO_TEMP;
+        if (ins->op == IR_STORE) {
+          i32 op = ir->ins[ins->args[1]].op;
+          if (op == IR_CONST || op == IR_ARG) {
+            copies[address] = ins->args[1];
+            known[known_count++] = address;
+          }
+        }
+        break;
+      }
+      // Called functions can store anything, and other code can jump to labels
+      case IR_CALL:
+      case IR_LOCAL_CALL:
+      case IR_LABEL:
+      case IR_FUNC:
+      case IR_RETURN:
+      case IR_END:
+        for (i32 k = 0; k < known_count; k++) {
+          copies[known[k]] = NO_TEMP;
+        }
+        known_count = 0;
+        break;
+      default:
+        break;
+    }
+  }
+done:
+  if (copies) {
+    m_free(copies, sizeof(i32) * (size + 1));
+  }
+  if (known) {
+    m_free(known, sizeof(i32) * (ir->count + 1));
+  }
+}
+
+// Operations on literals (which copy propagation might have found) are evaluated at compile time
+void fold_constants(struct VM_state* vm, Ir* ir) {
+  for (i32 i = 0; i < ir->count; i++) {
+    struct Ir_ins* ins = &ir->ins[i];
+    if (ins->op != IR_BINARY) {
+      continue;
+    }
+    const struct Ir_ins* left = &ir->ins[ins->args[1]];
+    const struct Ir_ins* right = &ir->ins[ins->args[2]];
+    ins->flags &= ~IR_INT;
+    if (left->type == T_NUMBER && right->type == T_NUMBER) {
+      ins->flags |= IR_INT;
+    }
+    if (left->op != IR_CONST || right->op != IR_CONST) {
+      continue;
+    }
+    struct Object a = vm->values[left->args[0]];
+    struct Object b = vm->values[right->args[0]];
+    i32 result = 0;
+    if (!IS_NUMBER(a) || !IS_NUMBER(b) || optimize_fold(ins->args[0], AS_NUMBER(a), AS_NUMBER(b), &result) != NO_ERR) {
+      continue;
+    }
+    struct Token literal = { .type = T_NUMBER, .value.number = result, };
+    i32 address = constant_add(vm, ir, &literal);
+    remove_temp(ir, ins->args[1]);
+    remove_temp(ir, ins->args[2]);
+    ins->op = IR_CONST;
+    ins->args[0] = address;
+    ins->flags = 0;
+  }
+}
+
+// Can the computation of the temporary fail at run time?
+i32 may_fail(const struct Ir_ins* ins, i32 temp) {
+  const struct Ir_ins* def = &ins[temp];
+  if (def->op != IR_BINARY) {
+    return 0;
+  }
+  if (!(def->flags & IR_INT) || def->args[0] == T_DIV) {
+    return 1;
+  }
+  return may_fail(ins, def->args[1]) || may_fail(ins, def->args[2]);
+}
+
+// Branches on literals either always or never jump
+void fold_branches(struct VM_state* vm, Ir* ir) {
+  i32 prev = -1;  // The last instruction that is not a temporary
+  for (i32 i = 0; i < ir->count; i++) {
+    struct Ir_ins* ins = &ir->ins[i];
+    i32 temp = NO_TEMP;
+    if (ins->op == IR_BRANCH) {
+      temp = ins->args[0];
+    }
+    else if (ins->op == IR_COND_BRANCH && prev >= 0 && ir->ins[prev].op == IR_PUSH) {
+      temp = ir->ins[prev].args[0];
+    }
+    if (temp != NO_TEMP && ir->ins[temp].op == IR_CONST) {
+      // Strings are never true, see object_check_true
+      struct Object value = vm->values[ir->ins[temp].args[0]];
+      i32 is_true = IS_NUMBER(value) && AS_NUMBER(value) != 0;
+      i32 label = ins->op == IR_BRANCH ? ins->args[1] : ins->args[0];
+      remove_temp(ir, temp);
+      if (ins->op == IR_COND_BRANCH) {
+        ir->ins[prev].op = IR_NOP;
+      }
+      ins->op = is_true ? IR_NOP : IR_JUMP;
+      ins->args[0] = label;
+      ins->args[1] = 0;
+    }
+    if (ins->op != IR_NOP && !ir_is_temp(ins->op)) {
+      prev = i;
+    }
+  }
+}
+
+// Instructions that follow a jump are never executed, up to the next label or function
+void remove_unreachable(Ir* ir) {
+  i32 reachable = 1;
+  for (i32 i = 0; i < ir->count; i++) {
+    struct Ir_ins* ins = &ir->ins[i];
+    switch (ins->op) {
+      case IR_LABEL:
+      case IR_FUNC:
+      case IR_RETURN:
+      case IR_END:
+        reachable = 1;
+        break;
+      default:
+        if (!reachable) {
+          ins->op = IR_NOP;
+        }
+        break;
+    }
+    if (ins->op == IR_JUMP) {
+      reachable = 0;
+    }
+  }
+}
+
+// Mark the functions that the code in [from, to) refers to, not counting the code of the functions that are
+// defined in it. Returns the new size of the worklist, which the functions that were marked are added to.
+i32 mark_references(Ir* ir, i32 from, i32 to, i32 first, const i32* funcs, i32* live, i32* worklist, i32 worklist_count) {
+  for (i32 i = from; i < to; i++) {
+    const struct Ir_ins* ins = &ir->ins[i];
+    if (ins->op == IR_FUNC) {
+      i = ir_function_end(ir, i);
+      continue;
+    }
+    if ((ins->op == IR_LOAD || ins->op == IR_CALL) && ins->args[0] >= first) {
+      i32 index = ins->args[0] - first;
+      if (funcs[index] >= 0 && !live[index]) {
+        live[index] = 1;
+        worklist[worklist_count++] = funcs[index];
+      }
+    }
+  }
+  return worklist_count;
+}
+
+// NOTE(lucas): When the whole program is compiled at once, the top-level code is all there is to run. Functions
+// that are not called or used as values from it, or from the functions that it uses, are removed together with
+// the jump that skips them. Values are resolved to their addresses when lowering, so shadowed names don't matter.
+void remove_dead_functions(struct VM_state* vm, Ir* ir) {
+  i32 first = vm->values_count - ir->values_added;
+  if (ir->values_added == 0) {
+    return;
+  }
+  i32* funcs = m_malloc(sizeof(i32) * ir->values_added);  // Index of the IR_FUNC of every function value
+  i32* live = m_calloc(sizeof(i32), ir->values_added);
+  i32* worklist = m_malloc(sizeof(i32) * ir->values_added);
+  if (!funcs || !live || !worklist) {
+    goto done;
+  }
+  for (i32 i = 0; i < ir->values_added; i++) {
+    funcs[i] = -1;
+  }
+  for (i32 i = 0; i < ir->count; i++) {
+    if (ir->ins[i].op == IR_FUNC) {
+      funcs[ir->ins[i].args[0] - first] = i;
+    }
+  }
+  i32 worklist_count = mark_references(ir, 0, ir->count, first, funcs, live, worklist, 0);
+  while (worklist_count > 0) {
+    i32 start = worklist[--worklist_count];
+    worklist_count = mark_references(ir, start + 1, ir_function_end(ir, start), first, funcs, live, worklist, worklist_count);
+  }
+  for (i32 i = 0; i < ir->values_added; i++) {
+    i32 start = funcs[i];
+    if (start < 0 || live[i]) {
+      continue;
+    }
+    ir->removed.functions++;
+    // Functions that are defined in a removed function have already been removed with it
+    if (ir->ins[start].op != IR_FUNC) {
+      continue;
+    }
+    i32 end = ir_function_end(ir, start);
+    for (i32 j = start; j <= end; j++) {
+      ir->ins[j].op = IR_NOP;
+    }
+    struct Ir_ins* skip = start > 0 ? &ir->ins[start - 1] : NULL;
+    struct Ir_ins* skip_label = end + 1 < ir->count ? &ir->ins[end + 1] : NULL;
+    if (skip && skip_label && skip->op == IR_JUMP && skip_label->op == IR_LABEL && skip->args[0] == skip_label->args[0]) {
+      skip->op = IR_NOP;
+      skip_label->op = IR_NOP;
+    }
+  }
+done:
+  if (funcs) {
+    m_free(funcs, sizeof(i32) * ir->values_added);
+  }
+  if (live) {
+    m_free(live, sizeof(i32) * ir->values_added);
+  }
+  if (worklist) {
+    m_free(worklist, sizeof(i32) * ir->values_added);
+  }
+}
+
+// Stores to values of functions that are never read are removed. Global values are kept, they are the result of
+// the program (the 6502 code leaves them in the zero page), and later compilations can read them.
+void remove_dead_stores(struct VM_state* vm, Ir* ir) {
+  if (vm->values_count == 0) {
+    return;
+  }
+  u8* read = m_calloc(sizeof(u8), vm->values_count);
+  if (!read) {
+    return;
+  }
+  for (i32 i = 0; i < ir->count; i++) {
+    const struct Ir_ins* ins = &ir->ins[i];
+    if (ins->op == IR_LOAD || ins->op == IR_CALL) {
+      read[ins->args[0]] = 1;
+    }
+  }
+  for (i32 i = 0; i < ir->count; i++) {
+    struct Ir_ins* store = &ir->ins[i];
+    if (store->op != IR_STORE || !(store->flags & IR_LOCAL) || may_fail(ir->ins, store->args[1])) {
+      continue;
+    }
+    if (!read[store->args[0]]) {
+      remove_temp(ir, store->args[1]);
+      store->op = IR_NOP;
+    }
+  }
+  m_free(read, sizeof(u8) * vm->values_count);
+}
+
+// Is the first operand of the instruction a value address?
+i32 ir_value_operand(const struct Ir_ins* ins) {
+  switch (ins->op) {
+    case IR_CONST:
+    case IR_LOAD:
+    case IR_STORE:
+    case IR_ASSIGN:
+    case IR_CALL:
+    case IR_FUNC:
+    case IR_END:
+      return 1;
+    default:
+      break;
+  }
+  return 0;
+}
+
+void ir_relocate_symbols(Htable* table, i32 first, const i32* map) {
+  Htable relocated = ht_create_empty();
+  for (u32 i = 0; i < ht_get_size(table); i++) {
+    const Hkey* key = ht_lookup_key(table, i);
+    if (!key) {
+      continue;
+    }
+    i32 address = *ht_lookup_by_index(table, i);
+    if (address >= first && (address = map[address - first]) < 0) {
+      continue;
+    }
+    ht_insert_element(&relocated, *key, address);
+  }
+  ht_free(table);
+  *table = relocated;
+}
+
+// Values that were added by this lowering and that the remaining code never refers to (literals of removed code,
+// functions that were removed, values that are never read) are removed, and the others are moved down to fill the gaps
+void remove_unused_values(struct VM_state* vm, Ir* ir) {
+  i32 added = ir->values_added;
+  i32 first = vm->values_count - added;
+  if (added == 0) {
+    return;
+  }
+  i32* map = m_malloc(sizeof(i32) * added);  // New address of every value, -1 if it is removed
+  if (!map) {
+    return;
+  }
+  for (i32 i = 0; i < added; i++) {
+    map[i] = -1;
+  }
+  for (i32 i = 0; i < ir->count; i++) {
+    const struct Ir_ins* ins = &ir->ins[i];
+    if (ir_value_operand(ins) && ins->args[0] >= first) {
+      map[ins->args[0] - first] = 0;
+    }
+  }
+  i32 count = first;
+  for (i32 i = 0; i < added; i++) {
+    if (map[i] >= 0) {
+      map[i] = count;
+      vm->values[count++] = vm->values[first + i];
+    }
+  }
+  i32 removed = vm->values_count - count;
+  if (removed > 0) {
+    for (i32 i = 0; i < ir->count; i++) {
+      struct Ir_ins* ins = &ir->ins[i];
+      if (ir_value_operand(ins) && ins->args[0] >= first) {
+        ins->args[0] = map[ins->args[0] - first];
+      }
+    }
+    ir_relocate_symbols(&vm->fs_global.symbol_table, first, map);
+    ir_relocate_symbols(&ir->symbols, first, map);
+    list_shrink(vm->values, vm->values_count, removed);
+    ir->values_added -= removed;
+    constant_pool_relocate(vm, first, map);
+    ir->removed.values += removed;
+  }
+  m_free(map, sizeof(i32) * added);
+}
+
+// Number of instructions that have not been removed
+i32 ins_count(const Ir* ir) {
+  i32 count = 0;
+  for (i32 i = 0; i < ir->count; i++) {
+    count += ir->ins[i].op != IR_NOP;
+  }
+  return count;
+}
+
+// Calls that are followed by a return, directly or through a chain of jumps
+// (as at the end of both branches of an if expression) are tail calls
+void mark_tail_calls(Ir* ir) {
+  i32* labels = NULL;  // Instruction index of every label
+  if (ir->labels_count > 0) {
+    labels = m_malloc(sizeof(i32) * ir->labels_count);
+    if (!labels) {
+      return;
+    }
+    for (i32 i = 0; i < ir->labels_count; i++) {
+      labels[i] = UNRESOLVED_LABEL;
+    }
+  }
+  for (i32 i = 0; i < ir->count; i++) {
+    if (ir->ins[i].op == IR_LABEL) {
+      labels[ir->ins[i].args[0]] = i;
+    }
+  }
+  for (i32 i = 0; i < ir->count; i++) {
+    struct Ir_ins* call = &ir->ins[i];
+    if (call->op != IR_CALL && call->op != IR_LOCAL_CALL) {
+      continue;
+    }
+    i32 next = i + 1;
+    i32 jumps = 0;  // Jumps can't loop, but unresolved ones are not followed
+    while (next < ir->count && jumps <= ir->labels_count) {
+      i32 op = ir->ins[next].op;
+      if (op == IR_NOP || op == IR_LABEL) {
+        next++;
+      }
+      else if (op == IR_JUMP && labels[ir->ins[next].args[0]] != UNRESOLVED_LABEL) {
+        next = labels[ir->ins[next].args[0]];
+        jumps++;
+      }
+      else {
+        break;
+      }
+    }
+    if (next < ir->count && ir->ins[next].op == IR_RETURN) {
+      call->flags |= IR_TAIL;
+    }
+  }
+  if (labels) {
+    m_free(labels, sizeof(i32) * ir->labels_count);
+  }
+}
+
+// The operands of the instruction that are temporaries
+i32 temp_operands(struct Ir_ins* ins, i32* operands[2]) {
+  switch (ins->op) {
+    case IR_BINARY:
+      operands[0] = &ins->args[1];
+      operands[1] = &ins->args[2];
+      return 2;
+    case IR_PUSH:
+    case IR_BRANCH:
+    case IR_LOCAL_CALL:
+      operands[0] = &ins->args[0];
+      return 1;
+    case IR_STORE:
+      operands[0] = &ins->args[1];
+      return 1;
+    default:
+      break;
+  }
+  return 0;
+}
+
+// Replace the temporaries that the instruction uses with their new indices
+void remap_temps(struct Ir_ins* ins, const i32* map) {
+  i32* operands[2];
+  i32 count = temp_operands(ins, operands);
+  for (i32 i = 0; i < count; i++) {
+    *operands[i] = map[*operands[i]];
+  }
+}
+
+// Can calls to the function that starts at this index be inlined? Its body has to be small, and it may
+// only compute temporaries, push and store them, and branch. Then it calls nothing (and is not recursive),
+// and it never pops values that the caller pushed. Every path through it also has to push at most one value,
+// as the return only keeps the top value.
+i32 inline_candidate(Ir* ir, i32 start, struct Inline_func* func) {
+  const struct Ir_ins* ins = &ir->ins[start];
+  i32 size = 0;
+  i32 first_label = ir->labels_count;
+  i32 last_label = -1;
+  func->address = ins->args[0];
+  func->start = start;
+  func->end = -1;
+  if (ins->args[1] > MAX_INLINE_ARGS) {
+    return 0;
+  }
+  for (i32 i = start + 1; i < ir->count && func->end < 0; i++) {
+    ins = &ir->ins[i];
+    i32 label = -1;
+    switch (ins->op) {
+      case IR_NOP:
+      case IR_CONST:
+      case IR_ARG:
+      case IR_LOAD:
+      case IR_BINARY:
+      case IR_PUSH:
+      case IR_STORE:
+        break;
+      case IR_RETURN:
+        func->end = i;
+        continue;
+      case IR_JUMP:
+      case IR_LABEL:
+        label = ins->args[0];
+        break;
+      case IR_BRANCH:
+        label = ins->args[1];
+        break;
+      default:
+        return 0;
+    }
+    if (label >= 0) {
+      first_label = label < first_label ? label : first_label;
+      last_label = label > last_label ? label : last_label;
+    }
+    if (ins->op != IR_LABEL && ins->op != IR_NOP) {
+      size++;
+    }
+  }
+  if (func->end < 0 || size > INLINE_BUDGET) {
+    return 0;
+  }
+  func->first_label = first_label;
+  func->labels = last_label >= first_label ? last_label - first_label + 1 : 0;
+
+  // Values pushed when reaching each label, jumps in function bodies only go forward
+  i32 result = 1;
+  i32* depths = m_malloc(sizeof(i32) * (func->labels + 1));
+  if (!depths) {
+    return 0;
+  }
+  for (i32 i = 0; i < func->labels; i++) {
+    depths[i] = -1;
+  }
+  i32 depth = 0;
+  for (i32 i = start + 1; i < func->end && result; i++) {
+    ins = &ir->ins[i];
+    switch (ins->op) {
+      case IR_PUSH:
+        depth = depth >= 0 ? depth + 1 : depth;
+        break;
+      case IR_BRANCH:
+      case IR_JUMP: {
+        i32* target = &depths[ins->args[ins->op == IR_BRANCH] - first_label];
+        if (*target >= 0 && *target != depth) {
+          result = 0;
+        }
+        *target = depth;
+        if (ins->op == IR_JUMP) {
+          depth = -1;  // Unreachable until the next label
+        }
+        break;
+      }
+      case IR_LABEL: {
+        i32* target = &depths[ins->args[0] - first_label];
+        if (depth >= 0 && *target >= 0 && *target != depth) {
+          result = 0;
+        }
+        depth = depth >= 0 ? depth : *target;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  m_free(depths, sizeof(i32) * (func->labels + 1));
+  return result && depth <= 1;
+}
+
+// Replace the call (which has not been added to out) with the body of the function. The pushes of the arguments
+// are the last pushes before it in the same block, same as the arguments that the call would take from the stack.
+// Map is updated with the new indices of the instructions of the body.
+i32 inline_call(struct VM_state* vm, Ir* ir, const struct Inline_func* func, struct Ir_ins** out, i32* out_count, i32* out_capacity, i32* map) {
+  struct Ir_ins* ins = *out;
+  i32 count = *out_count;
+  i32 capacity = *out_capacity;
+  const struct Ir_ins* f = &ir->ins[func->start];
+  i32 argc = f->args[1];
+  i32 int_args = f->args[2];
+  i32 pushes[MAX_INLINE_ARGS] = {0};
+  i32 temps[MAX_INLINE_ARGS] = {0};
+  i32 modes[MAX_INLINE_ARGS] = {0};
+  i32 slots[MAX_INLINE_ARGS] = {0};
+
+  i32 found = 0;
+  for (i32 i = count - 1; i >= 0 && found < argc; i--) {
+    if (ins[i].op == IR_PUSH) {
+      pushes[argc - 1 - found++] = i;
+    }
+    else if (ins[i].op != IR_NOP && !ir_is_temp(ins[i].op)) {
+      break;
+    }
+  }
+  if (found < argc) {
+    return ERR;
+  }
+
+  // Arguments can only be used directly where the body is evaluated in the same order as the call,
+  // before it stores or branches, or a run time error of the argument could happen too late or not at all
+  i32 effects = func->end;  // Index of the first instruction of the body with side effects
+  for (i32 i = func->start + 1; i < func->end; i++) {
+    i32 op = ir->ins[i].op;
+    if (op == IR_STORE || op == IR_JUMP || op == IR_LABEL || op == IR_BRANCH) {
+      effects = i;
+      break;
+    }
+  }
+  for (i32 arg = 0; arg < argc; arg++) {
+    temps[arg] = ins[pushes[arg]].args[0];
+    const struct Ir_ins* temp = &ins[temps[arg]];
+    if ((int_args & (1 << arg)) && temp->type != T_NUMBER) {
+      return ERR;  // The function would check the argument
+    }
+    i32 uses = 0;
+    i32 early = 1;
+    for (i32 i = func->start + 1; i < func->end; i++) {
+      if (ir->ins[i].op == IR_ARG && ir->ins[i].args[0] == arg) {
+        uses++;
+        early = early && i < effects;
+      }
+    }
+    if (temp->op == IR_CONST || temp->op == IR_ARG) {
+      modes[arg] = ARG_COPY;
+    }
+    else if (uses == 1 && early) {
+      modes[arg] = ARG_SUBSTITUTE;
+    }
+    else if (uses == 0 && !may_fail(ins, temps[arg])) {
+      modes[arg] = ARG_DROP;
+    }
+    else {
+      modes[arg] = ARG_SPILL;
+    }
+  }
+
+  for (i32 arg = 0; arg < argc; arg++) {
+    struct Ir_ins* push = &ins[pushes[arg]];
+    if (modes[arg] == ARG_SPILL) {
+      slots[arg] = value_add(vm, ir, object_of_type(ins[temps[arg]].type));
+      push->op = IR_STORE;
+      push->args[0] = slots[arg];
+      push->args[1] = temps[arg];
+      push->flags = IR_LOCAL;
+    }
+    else {
+      push->op = IR_NOP;
+    }
+  }
+  i32 label_offset = ir->labels_count - func->first_label;
+  ir->labels_count += func->labels;
+  for (i32 i = func->start + 1; i < func->end; i++) {
+    struct Ir_ins body = ir->ins[i];
+    switch (body.op) {
+      case IR_NOP:
+        continue;
+      case IR_ARG: {
+        i32 arg = body.args[0];
+        if (modes[arg] == ARG_SUBSTITUTE) {
+          map[i] = temps[arg];
+          continue;
+        }
+        if (modes[arg] == ARG_SPILL) {
+          body.op = IR_LOAD;
+          body.args[0] = slots[arg];
+          body.type = object_type(vm->values[slots[arg]]);
+        }
+        else {
+          body = ins[temps[arg]];
+        }
+        break;
+      }
+      case IR_JUMP:
+      case IR_LABEL:
+        body.args[0] += label_offset;
+        break;
+      case IR_BRANCH:
+        body.args[1] += label_offset;
+        break;
+      default:
+        break;
+    }
+    remap_temps(&body, map);
+    map[i] = count;
+    list_push(ins, count, capacity, body);
+  }
+  *out = ins;
+  *out_count = count;
+  *out_capacity = capacity;
+  return NO_ERR;
+}
+
+// Calls of small functions are replaced by their bodies, where the arguments are used in place of the parameters.
+// Returns the number of inlined calls, functions that only called inlined functions can be inlined in the next round.
+i32 inline_calls(struct VM_state* vm, Ir* ir) {
+  struct Inline_func* funcs = NULL;
+  i32 funcs_count = 0;
+  i32 funcs_capacity = 0;
+  for (i32 i = 0; i < ir->count && INLINE_BUDGET > 0; i++) {
+    struct Inline_func func;
+    if (ir->ins[i].op == IR_FUNC && inline_candidate(ir, i, &func)) {
+      list_push(funcs, funcs_count, funcs_capacity, func);
+    }
+  }
+  if (funcs_count == 0) {
+    return 0;
+  }
+  i32 inlined_count = 0;
+  struct Ir_ins* out = NULL;
+  i32 out_count = 0;
+  i32 out_capacity = 0;
+  const i32 count = ir->count;
+  const i32 values_count = vm->values_count;  // Inlining can add values
+  i32* map = m_malloc(sizeof(i32) * count);  // New index of every instruction
+  i32* by_address = m_malloc(sizeof(i32) * (values_count + 1));  // Index in funcs of the function in every value, or -1
+  if (!map || !by_address) {
+    goto done;
+  }
+  for (i32 i = 0; i < values_count; i++) {
+    by_address[i] = -1;
+  }
+  for (i32 f = funcs_count - 1; f >= 0; f--) {
+    by_address[funcs[f].address] = f;
+  }
+  for (i32 i = 0; i < count; i++) {
+    struct Ir_ins ins = ir->ins[i];
+    if (ins.op == IR_CALL && ins.args[0] >= 0 && ins.args[0] < values_count && by_address[ins.args[0]] >= 0) {
+      if (inline_call(vm, ir, &funcs[by_address[ins.args[0]]], &out, &out_count, &out_capacity, map) == NO_ERR) {
+        inlined_count++;
+        map[i] = NO_TEMP;
+        continue;
+      }
+    }
+    remap_temps(&ins, map);
+    map[i] = out_count;
+    list_push(out, out_count, out_capacity, ins);
+  }
+  list_free(ir->ins, ir->count, ir->capacity);
+  ir->ins = out;
+  ir->count = out_count;
+  ir->capacity = out_capacity;
+done:
+  if (map) {
+    m_free(map, sizeof(i32) * count);
+  }
+  if (by_address) {
+    m_free(by_address, sizeof(i32) * (values_count + 1));
+  }
+  list_free(funcs, funcs_count, funcs_capacity);
+  return inlined_count;
+}
+
+i32 ir_build(struct VM_state* vm, Ast* ast, Ir* ir) {
+  i32 result = lower(vm, ir, ast, &vm->fs_global, NULL);
+  // NOTE(lucas): The instructions that there was no memory for are missing, so the passes can't run on them
+  if (result == NO_ERR && vm->allocator.failed) {
+    result = ERR;
+  }
+  if (result == NO_ERR) {
+    // NOTE(lucas): Every round can inline the functions that only called functions inlined in the round before.
+    // The bodies grow by at least one instruction per round, so more rounds than the budget can't inline anything.
+    for (i32 round = 0; round < INLINE_BUDGET && inline_calls(vm, ir) > 0 && !vm->allocator.failed; round++);
+  }
+  if (result == NO_ERR && vm->allocator.failed) {
+    result = ERR;
+  }
+  if (result == NO_ERR) {
+    propagate_copies(ir);
+    fold_constants(vm, ir);
+    i32 count = ins_count(ir);
+    fold_branches(vm, ir);
+    remove_unreachable(ir);
+    if (vm->whole_program && ir->errors == 0) {
+      remove_dead_functions(vm, ir);
+    }
+    remove_dead_stores(vm, ir);
+    if (vm->whole_program && ir->errors == 0) {
+      remove_unused_values(vm, ir);
+    }
+    ir->removed.ins += count - ins_count(ir);
+    mark_tail_calls(ir);
+    // ir_print(vm, ir, stdout);
+    if (vm->allocator.failed) {
+      result = ERR;
+    }
+  }
+  return result;
+}
+
+void ir_rollback(struct VM_state* vm, Ir* ir) {
+  assert(ir->values_added <= vm->values_count);
+  list_shrink(vm->values, vm->values_count, ir->values_added);  // TODO(lucas): Don't only shrink the value list, but also deallocate value contents that need be
+  constant_pool_trim(vm);
+  for (i32 i = 0; i < ht_get_size(&ir->symbols); i++) {
+    const Hkey* key = ht_lookup_key(&ir->symbols, i);
+    if (key) {
+      ht_remove_element(&vm->fs_global.symbol_table, *key);
+    }
+  }
+}
+
+void ir_print(struct VM_state* vm, Ir* ir, FILE* fp) {
+  for (i32 i = 0; i < ir->count; i++) {
+    const struct Ir_ins* ins = &ir->ins[i];
+    if (ins->op == IR_NOP) {
+      continue;
+    }
+    fprintf(fp, "%.4i %-14s %i, %i, %i", i, ir_op_names[ins->op], ins->args[0], ins->args[1], ins->args[2]);
+    if (ins->flags & IR_INT) {
+      fprintf(fp, " int");
+    }
+    if (ins->flags & IR_TAIL) {
+      fprintf(fp, " tail");
+    }
+    if (ins->flags & IR_LOCAL) {
+      fprintf(fp, " local");
+    }
+    if (ins->op == IR_CONST || ins->op == IR_LOAD) {
+      fprintf(fp, " (value = ");
+      object_print(vm, fp, &vm->values[ins->args[0]]);
+      fprintf(fp, ")");
+    }
+    fprintf(fp, "\n");
+  }
+}
+
+void ir_free(Ir* ir) {
+  list_free(ir->ins, ir->count, ir->capacity);
+  ht_free(&ir->symbols);
+}
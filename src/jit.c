@@ -0,0 +1,1119 @@
+// jit.c
+// Template compiler from byte code to x86-64 machine code. Every instruction is translated to a fixed
+// sequence of machine code that does the same as its handler in execute(), on the same stack, so
+// compiled and interpreted functions can call each other, and errors leave the vm in the same state.
+//
+// Registers while a compiled function runs (all of them are callee-saved):
+//   rbx  vm
+//   r12  &vm->stack[stack_base], the arguments of the function
+//   r13  &vm->stack[vm->stack_top], written back to the vm before calls and when returning
+//   r14  vm->values
+//   r15  vm->stack
+// The stack base index is kept at [rsp]. Calls can move the stack, r12, r13 and r15 are reloaded after them.
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "memory.h"
+#include "list.h"
+#include "ast.h"
+#include "code.h"
+#include "vm.h"
+#include "jit.h"
+
+#define runtime_error(fmt, ...) \
+  fprintf(stderr, "runtime-error: " fmt, ##__VA_ARGS__)
+
+#if defined(USE_JIT)
+
+#define MAX_UNROLLED_ARGS 64  // Self tail calls copy the arguments with one move each
+
+#define OFFSET(FIELD) ((i32)offsetof(struct VM_state, FIELD))
+#define CACHE_OFFSET(INDEX, FIELD) ((i32)((INDEX) * sizeof(struct Call_cache) + offsetof(struct Call_cache, FIELD)))
+
+enum Register { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+enum Condition {
+  CC_B = 0x2,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_S = 0x8,
+  CC_L = 0xc,
+  CC_GE = 0xd,
+  CC_LE = 0xe,
+  CC_G = 0xf,
+};
+
+// Opcodes of the arithmetic instructions with a register or memory operand (op r/m, reg)
+enum Alu_op {
+  ALU_ADD = 0x01,
+  ALU_OR = 0x09,
+  ALU_SUB = 0x29,
+  ALU_XOR = 0x31,
+  ALU_CMP = 0x39,
+  ALU_TEST = 0x85,
+};
+
+// Opcode extensions of the arithmetic instructions with an immediate operand
+enum Alu_ext {
+  EXT_ADD = 0,
+  EXT_AND = 4,
+  EXT_SUB = 5,
+  EXT_CMP = 7,
+};
+
+enum Shift_ext {
+  SHIFT_SHL = 4,
+  SHIFT_SHR = 5,
+  SHIFT_SAR = 7,
+};
+
+enum Jit_error {
+  PROPAGATE = -1,  // The error has already been reported by a function that was called
+  E_NOT_ENOUGH_ARGS,
+  E_INVALID_TYPES,
+  E_INT_ARG,
+  E_ARGC,
+  E_LOCAL_ARGC,
+  E_CALL_DEPTH,
+};
+
+// Jump to the byte code at target
+struct Fixup {
+  u32 at;  // Where the 32-bit jump offset is
+  i32 target;
+};
+
+// Jump to an error exit
+struct Stub {
+  u32 at;
+  i32 error;
+  i32 arg;
+};
+
+typedef struct Assembler {
+  u8* code;
+  u32 size;
+  u32 capacity;
+  i32 status;
+  struct Fixup* fixups;
+  i32 fixups_count;
+  i32 fixups_capacity;
+  struct Stub* stubs;
+  i32 stubs_count;
+  i32 stubs_capacity;
+} Assembler;
+
+static void emit(Assembler* a, u8 byte);
+static void emit32(Assembler* a, u32 value);
+static void emit64(Assembler* a, u64 value);
+static void patch32(Assembler* a, u32 at, u32 value);
+static void emit_mem(Assembler* a, i32 w, u8 op0, u8 op1, i32 reg, i32 base, i32 disp);
+static void emit_reg(Assembler* a, i32 w, u8 op0, u8 op1, i32 reg, i32 rm);
+static void load(Assembler* a, i32 dst, i32 base, i32 disp);
+static void load32(Assembler* a, i32 dst, i32 base, i32 disp);
+static void store(Assembler* a, i32 base, i32 disp, i32 src);
+static void store32(Assembler* a, i32 base, i32 disp, i32 src);
+static void lea(Assembler* a, i32 dst, i32 base, i32 disp);
+static void lea_index(Assembler* a, i32 dst, i32 base, i32 index);
+static void mov(Assembler* a, i32 dst, i32 src);
+static void mov_imm32(Assembler* a, i32 dst, i32 value);
+static void mov_imm64(Assembler* a, i32 dst, u64 value);
+static void alu(Assembler* a, i32 op, i32 w, i32 dst, i32 src);
+static void alu_imm(Assembler* a, i32 ext, i32 w, i32 dst, i32 value);
+static void alu_mem_imm(Assembler* a, i32 ext, i32 base, i32 disp, i32 value);
+static void shift(Assembler* a, i32 ext, i32 w, i32 reg, u8 count);
+static void push(Assembler* a, i32 reg);
+static void pop(Assembler* a, i32 reg);
+static void call(Assembler* a, void* function);
+static u32 jcc(Assembler* a, i32 cc);
+static u32 jmp(Assembler* a);
+static void bind(Assembler* a, u32 at);
+static void jump_to_ins(Assembler* a, i32 cc, i32 target);
+static void stub(Assembler* a, i32 cc, i32 error, i32 arg);
+static void stub_jmp(Assembler* a, i32 error, i32 arg);
+static void sync_top(Assembler* a);
+static void reload(Assembler* a);
+static void epilogue(Assembler* a);
+static void return_ok(Assembler* a);
+static void check_number(Assembler* a, i32 reg, i32 error, i32 arg);
+static void box_number(Assembler* a);
+static void operation(Assembler* a, i32 op);
+static void compare_jump(Assembler* a, i32 op, i32 target);
+static void check_stack(Assembler* a, i32 count);
+static void call_ins(Assembler* a, struct Jit_function* func, struct Decoded* d, i32 base_ins);
+static void translate(Assembler* a, struct Jit_function* func, struct Decoded* d, i32 at);
+static i32 jit_error(struct VM_state* vm, i32 error, i32 arg);
+static i32 reachable(struct VM_state* vm, struct Jit_function* func, u8* visited, i32* last, i32* count);
+static i32 jit_compile(struct VM_state* vm, struct Jit_function* func);
+
+void emit(Assembler* a, u8 byte) {
+  if (a->size >= a->capacity) {
+    u32 capacity = a->capacity ? a->capacity * 2 : 256;
+    u8* code = a->code ? m_realloc(a->code, a->capacity, capacity) : m_malloc(capacity);
+    if (!code) {
+      a->status = ERR;
+      return;
+    }
+    a->code = code;
+    a->capacity = capacity;
+  }
+  a->code[a->size++] = byte;
+}
+
+void emit32(Assembler* a, u32 value) {
+  for (i32 i = 0; i < 4; i++) {
+    emit(a, (u8)(value >> (i * 8)));
+  }
+}
+
+void emit64(Assembler* a, u64 value) {
+  emit32(a, (u32)value);
+  emit32(a, (u32)(value >> 32));
+}
+
+void patch32(Assembler* a, u32 at, u32 value) {
+  if (a->status != NO_ERR) {
+    return;
+  }
+  for (i32 i = 0; i < 4; i++) {
+    a->code[at + i] = (u8)(value >> (i * 8));
+  }
+}
+
+// Instruction with a register operand and a memory operand [base + disp]. The opcode is
+// one byte (op1 == 0), or two bytes when it starts with 0x0f.
+void emit_mem(Assembler* a, i32 w, u8 op0, u8 op1, i32 reg, i32 base, i32 disp) {
+  u8 rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40) {
+    emit(a, rex);
+  }
+  emit(a, op0);
+  if (op1) {
+    emit(a, op1);
+  }
+  i32 mod = (disp == 0 && (base & 7) != RBP) ? 0 : (disp >= -128 && disp <= 127) ? 1 : 2;
+  emit(a, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emit(a, 0x24);
+  }
+  if (mod == 1) {
+    emit(a, (u8)disp);
+  }
+  else if (mod == 2) {
+    emit32(a, disp);
+  }
+}
+
+// Instruction with two register operands
+void emit_reg(Assembler* a, i32 w, u8 op0, u8 op1, i32 reg, i32 rm) {
+  u8 rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+  if (rex != 0x40) {
+    emit(a, rex);
+  }
+  emit(a, op0);
+  if (op1) {
+    emit(a, op1);
+  }
+  emit(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void load(Assembler* a, i32 dst, i32 base, i32 disp) {
+  emit_mem(a, 1, 0x8b, 0, dst, base, disp);
+}
+
+void load32(Assembler* a, i32 dst, i32 base, i32 disp) {
+  emit_mem(a, 0, 0x8b, 0, dst, base, disp);
+}
+
+void store(Assembler* a, i32 base, i32 disp, i32 src) {
+  emit_mem(a, 1, 0x89, 0, src, base, disp);
+}
+
+void store32(Assembler* a, i32 base, i32 disp, i32 src) {
+  emit_mem(a, 0, 0x89, 0, src, base, disp);
+}
+
+void lea(Assembler* a, i32 dst, i32 base, i32 disp) {
+  emit_mem(a, 1, 0x8d, 0, dst, base, disp);
+}
+
+// dst = base + index * 8
+void lea_index(Assembler* a, i32 dst, i32 base, i32 index) {
+  assert((index & 7) != RSP);
+  emit(a, 0x48 | ((dst >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+  emit(a, 0x8d);
+  i32 mod = (base & 7) == RBP ? 1 : 0;
+  emit(a, (mod << 6) | ((dst & 7) << 3) | RSP);
+  emit(a, (3 << 6) | ((index & 7) << 3) | (base & 7));
+  if (mod) {
+    emit(a, 0);
+  }
+}
+
+void mov(Assembler* a, i32 dst, i32 src) {
+  emit_reg(a, 1, 0x89, 0, src, dst);
+}
+
+void mov_imm32(Assembler* a, i32 dst, i32 value) {
+  if (dst >= R8) {
+    emit(a, 0x41);
+  }
+  emit(a, 0xb8 + (dst & 7));
+  emit32(a, value);
+}
+
+void mov_imm64(Assembler* a, i32 dst, u64 value) {
+  emit(a, 0x48 | (dst >> 3));
+  emit(a, 0xb8 + (dst & 7));
+  emit64(a, value);
+}
+
+void alu(Assembler* a, i32 op, i32 w, i32 dst, i32 src) {
+  emit_reg(a, w, op, 0, src, dst);
+}
+
+void alu_imm(Assembler* a, i32 ext, i32 w, i32 dst, i32 value) {
+  emit_reg(a, w, 0x81, 0, ext, dst);
+  emit32(a, value);
+}
+
+// 32-bit operation on memory with an immediate operand
+void alu_mem_imm(Assembler* a, i32 ext, i32 base, i32 disp, i32 value) {
+  emit_mem(a, 0, 0x81, 0, ext, base, disp);
+  emit32(a, value);
+}
+
+void shift(Assembler* a, i32 ext, i32 w, i32 reg, u8 count) {
+  emit_reg(a, w, 0xc1, 0, ext, reg);
+  emit(a, count);
+}
+
+void push(Assembler* a, i32 reg) {
+  if (reg >= R8) {
+    emit(a, 0x41);
+  }
+  emit(a, 0x50 + (reg & 7));
+}
+
+void pop(Assembler* a, i32 reg) {
+  if (reg >= R8) {
+    emit(a, 0x41);
+  }
+  emit(a, 0x58 + (reg & 7));
+}
+
+// Call a C function, the address is loaded into rax
+void call(Assembler* a, void* function) {
+  mov_imm64(a, RAX, (u64)function);
+  emit(a, 0xff);
+  emit(a, 0xd0);
+}
+
+// Conditional jump forward, the offset is set with bind()
+u32 jcc(Assembler* a, i32 cc) {
+  emit(a, 0x0f);
+  emit(a, 0x80 + cc);
+  emit32(a, 0);
+  return a->size - 4;
+}
+
+u32 jmp(Assembler* a) {
+  emit(a, 0xe9);
+  emit32(a, 0);
+  return a->size - 4;
+}
+
+// Make the jump at this location go to the current position
+void bind(Assembler* a, u32 at) {
+  patch32(a, at, a->size - (at + 4));
+}
+
+// Jump to the machine code of the byte code at target (cc < 0 for an unconditional jump)
+void jump_to_ins(Assembler* a, i32 cc, i32 target) {
+  struct Fixup fixup = {
+    .at = (cc < 0) ? jmp(a) : jcc(a, cc),
+    .target = target,
+  };
+  list_push(a->fixups, a->fixups_count, a->fixups_capacity, fixup);
+}
+
+void stub(Assembler* a, i32 cc, i32 error, i32 arg) {
+  struct Stub s = {
+    .at = jcc(a, cc),
+    .error = error,
+    .arg = arg,
+  };
+  list_push(a->stubs, a->stubs_count, a->stubs_capacity, s);
+}
+
+void stub_jmp(Assembler* a, i32 error, i32 arg) {
+  struct Stub s = {
+    .at = jmp(a),
+    .error = error,
+    .arg = arg,
+  };
+  list_push(a->stubs, a->stubs_count, a->stubs_capacity, s);
+}
+
+// vm->stack_top = r13 - r15 (uses rax)
+void sync_top(Assembler* a) {
+  mov(a, RAX, R13);
+  alu(a, ALU_SUB, 1, RAX, R15);
+  shift(a, SHIFT_SAR, 1, RAX, 3);
+  store32(a, RBX, OFFSET(stack_top), RAX);
+}
+
+void reload(Assembler* a) {
+  load(a, R15, RBX, OFFSET(stack));
+  load(a, RAX, RSP, 0);
+  lea_index(a, R12, R15, RAX);
+  emit_mem(a, 1, 0x63, 0, RAX, RBX, OFFSET(stack_top));  // movsxd
+  lea_index(a, R13, R15, RAX);
+}
+
+void epilogue(Assembler* a) {
+  alu_mem_imm(a, EXT_SUB, RBX, OFFSET(jit.depth), 1);
+  alu_imm(a, EXT_ADD, 1, RSP, 16);
+  pop(a, R15);
+  pop(a, R14);
+  pop(a, R13);
+  pop(a, R12);
+  pop(a, RBX);
+  emit(a, 0xc3);
+}
+
+void return_ok(Assembler* a) {
+  sync_top(a);
+  alu(a, ALU_XOR, 0, RAX, RAX);
+  epilogue(a);
+}
+
+// Go to the error exit if the value in the register is not a number (uses rdx)
+void check_number(Assembler* a, i32 reg, i32 error, i32 arg) {
+  mov(a, RDX, reg);
+  shift(a, SHIFT_SHR, 1, RDX, TAG_SHIFT);
+  alu_imm(a, EXT_CMP, 0, RDX, TAG_NUMBER);
+  stub(a, CC_NE, error, arg);
+}
+
+// rax = MAKE_NUMBER(eax), the upper half of rax is zero after 32-bit operations (uses rdx)
+void box_number(Assembler* a) {
+  mov_imm64(a, RDX, (u64)TAG_NUMBER << TAG_SHIFT);
+  alu(a, ALU_OR, 1, RAX, RDX);
+}
+
+// eax = eax <op> ecx, op is one of the generic arithmetic instructions (uses rdx)
+void operation(Assembler* a, i32 op) {
+  switch (op) {
+    case I_ADD: alu(a, ALU_ADD, 0, RAX, RCX); break;
+    case I_SUB: alu(a, ALU_SUB, 0, RAX, RCX); break;
+    case I_MUL: emit_reg(a, 0, 0x0f, 0xaf, RAX, RCX); break;  // imul eax, ecx
+    case I_DIV: {
+      emit(a, 0x99);  // cdq
+      emit_reg(a, 0, 0xf7, 0, 7, RCX);  // idiv ecx
+      break;
+    }
+    case I_LT:
+    case I_GT:
+    case I_EQ: {
+      alu(a, ALU_CMP, 0, RAX, RCX);
+      emit(a, 0x0f);
+      emit(a, 0x90 + (op == I_LT ? CC_L : op == I_GT ? CC_G : CC_E));  // setcc al
+      emit(a, 0xc0);
+      emit_reg(a, 0, 0x0f, 0xb6, RAX, RAX);  // movzx eax, al
+      break;
+    }
+    default:
+      assert(0);
+      break;
+  }
+}
+
+// Compare eax with ecx, and jump to the byte code at target if the comparison (I_LT, I_GT or I_EQ) is false
+void compare_jump(Assembler* a, i32 op, i32 target) {
+  alu(a, ALU_CMP, 0, RAX, RCX);
+  jump_to_ins(a, op == I_LT ? CC_GE : op == I_GT ? CC_LE : CC_NE, target);
+}
+
+// Go to the error exit if there are less than count values on the stack
+void check_stack(Assembler* a, i32 count) {
+  lea(a, RAX, R15, count * sizeof(struct Object));
+  alu(a, ALU_CMP, 1, R13, RAX);
+  stub(a, CC_B, E_NOT_ENOUGH_ARGS, 0);
+}
+
+// The call instructions. The called function value is loaded into rax, then compiled functions that
+// are in the inline cache are called directly, everything else goes through vm_jit_call.
+void call_ins(Assembler* a, struct Jit_function* func, struct Decoded* d, i32 base_ins) {
+  i32 argc = -1;  // Of local calls
+  i32 cache = 0;
+  switch (base_ins) {
+    case I_CALL: {
+      load(a, RAX, R14, d->args[0] * sizeof(struct Object));
+      cache = d->args[1];
+      break;
+    }
+    case I_LOCAL_CALL: {
+      alu_imm(a, EXT_SUB, 1, R13, sizeof(struct Object));
+      load(a, RAX, R13, 0);
+      argc = d->args[0];
+      cache = d->args[1];
+      break;
+    }
+    case I_PUSH_ARG_LOCAL_CALL: {
+      load(a, RAX, R12, d->args[0] * sizeof(struct Object));
+      argc = d->args[1];
+      cache = d->args[2];
+      break;
+    }
+    default:
+      assert(0);
+      break;
+  }
+  i32 tail = d->ins == I_TAIL_CALL || d->ins == I_LOCAL_TAIL_CALL || d->ins == I_PUSH_ARG_LOCAL_TAIL_CALL;
+  if (tail) {
+    // Calls to the function itself reuse the machine code frame, the arguments are moved down and it starts over
+    mov_imm64(a, RCX, MAKE_FUNCTION(func->address, func->argc).bits);
+    alu(a, ALU_CMP, 1, RAX, RCX);
+    u32 other = jcc(a, CC_NE);
+    if (argc >= 0 && argc != func->argc) {
+      stub_jmp(a, E_LOCAL_ARGC, func->argc);
+    }
+    else {
+      mov(a, RSI, R13);
+      alu(a, ALU_SUB, 1, RSI, R12);
+      shift(a, SHIFT_SAR, 1, RSI, 3);
+      alu_imm(a, EXT_CMP, 0, RSI, func->argc);
+      stub(a, CC_L, argc >= 0 ? E_LOCAL_ARGC : E_ARGC, func->argc);
+      for (i32 i = 0; i < func->argc; i++) {
+        load(a, RAX, R13, (i - func->argc) * (i32)sizeof(struct Object));
+        store(a, R12, i * sizeof(struct Object), RAX);
+      }
+      lea(a, R13, R12, func->argc * sizeof(struct Object));
+      jump_to_ins(a, -1, func->address);
+    }
+    bind(a, other);
+    mov(a, RDX, RAX);
+    sync_top(a);
+    mov(a, RDI, RBX);
+    mov_imm32(a, RSI, cache);
+    mov_imm32(a, RCX, argc);
+    load(a, R8, RSP, 0);
+    call(a, vm_jit_call);
+    alu(a, ALU_TEST, 0, RAX, RAX);
+    stub(a, CC_S, PROPAGATE, 0);
+    mov(a, RSI, RAX);  // reload uses rax
+    reload(a);
+    // C functions are called as usual, the following return takes care of the rest. Funk functions
+    // have put their result in place of the arguments of this function, so it returns right away.
+    alu_imm(a, EXT_CMP, 0, RSI, 1);
+    u32 cfunction = jcc(a, CC_E);
+    return_ok(a);
+    bind(a, cfunction);
+    return;
+  }
+
+  load(a, RCX, RBX, OFFSET(caches));
+  emit_mem(a, 1, 0x3b, 0, RAX, RCX, CACHE_OFFSET(cache, func));  // cmp rax, cache->func
+  u32 miss = jcc(a, CC_NE);
+  load(a, RDX, RCX, CACHE_OFFSET(cache, jit));
+  alu(a, ALU_TEST, 1, RDX, RDX);
+  u32 no_record = jcc(a, CC_E);
+  load(a, RDX, RDX, offsetof(struct Jit_function, code));
+  alu(a, ALU_TEST, 1, RDX, RDX);
+  u32 not_compiled = jcc(a, CC_E);
+  alu_mem_imm(a, EXT_CMP, RBX, OFFSET(jit.depth), JIT_MAX_DEPTH);
+  u32 too_deep = jcc(a, CC_GE);
+  // Enough arguments on the stack?
+  mov(a, RSI, R13);
+  alu(a, ALU_SUB, 1, RSI, R15);
+  shift(a, SHIFT_SAR, 1, RSI, 3);
+  if (argc < 0) {
+    mov(a, RDI, RAX);
+    shift(a, SHIFT_SHR, 1, RDI, 32);
+    emit_reg(a, 0, 0x0f, 0xb7, RDI, RDI);  // movzx edi, di
+    alu(a, ALU_CMP, 0, RSI, RDI);
+  }
+  else {
+    alu_imm(a, EXT_CMP, 0, RSI, argc);
+  }
+  u32 missing_args = jcc(a, CC_L);
+  store32(a, RBX, OFFSET(stack_top), RSI);
+  mov(a, RDI, RBX);
+  emit_reg(a, 0, 0xff, 0, 2, RDX);  // call rdx
+  alu(a, ALU_TEST, 0, RAX, RAX);
+  stub(a, CC_NE, PROPAGATE, 0);
+  reload(a);
+  u32 done = jmp(a);
+
+  bind(a, miss);
+  bind(a, no_record);
+  bind(a, not_compiled);
+  bind(a, too_deep);
+  bind(a, missing_args);
+  mov(a, RDX, RAX);
+  sync_top(a);
+  mov(a, RDI, RBX);
+  mov_imm32(a, RSI, cache);
+  mov_imm32(a, RCX, argc);
+  mov_imm32(a, R8, -1);
+  call(a, vm_jit_call);
+  alu(a, ALU_TEST, 0, RAX, RAX);
+  stub(a, CC_S, PROPAGATE, 0);
+  reload(a);
+  bind(a, done);
+}
+
+// Machine code of one instruction, at is its address in the program
+void translate(Assembler* a, struct Jit_function* func, struct Decoded* d, i32 at) {
+  const i32 size = sizeof(struct Object);
+  i32 next = at + d->size;
+  i32 ins = d->ins;
+  i32 arg0 = d->args[0];
+  i32 arg1 = d->args[1];
+  switch (ins) {
+    case I_NOP:
+    case I_POP:
+      break;
+    case I_PUSH: {
+      load(a, RAX, R14, arg0 * size);
+      store(a, R13, 0, RAX);
+      alu_imm(a, EXT_ADD, 1, R13, size);
+      break;
+    }
+    case I_PUSH_ARG: {
+      load(a, RAX, R12, arg0 * size);
+      store(a, R13, 0, RAX);
+      alu_imm(a, EXT_ADD, 1, R13, size);
+      break;
+    }
+    case I_ASSIGN: {
+      alu(a, ALU_CMP, 1, R13, R15);
+      u32 empty = jcc(a, CC_E);
+      alu_imm(a, EXT_SUB, 1, R13, size);
+      load(a, RAX, R13, 0);
+      store(a, R14, arg0 * size, RAX);
+      u32 done = jmp(a);
+      bind(a, empty);
+      mov_imm64(a, RAX, MAKE_UNKNOWN().bits);
+      store(a, R14, arg0 * size, RAX);
+      bind(a, done);
+      break;
+    }
+    case I_COND_JUMP: {
+      alu_imm(a, EXT_SUB, 1, R13, size);
+      load(a, RAX, R13, 0);
+      mov(a, RDX, RAX);
+      shift(a, SHIFT_SHR, 1, RDX, TAG_SHIFT);
+      alu_imm(a, EXT_CMP, 0, RDX, TAG_NUMBER);
+      jump_to_ins(a, CC_NE, next + arg0);
+      alu(a, ALU_TEST, 0, RAX, RAX);
+      jump_to_ins(a, CC_E, next + arg0);
+      break;
+    }
+    case I_JUMP: {
+      jump_to_ins(a, -1, next + arg0);
+      break;
+    }
+    case I_RETURN: {
+      lea(a, RAX, R12, func->argc * size);
+      alu(a, ALU_CMP, 1, R13, RAX);
+      u32 no_result = jcc(a, CC_BE);
+      load(a, RAX, R13, -size);
+      store(a, R12, 0, RAX);
+      lea(a, R13, R12, size);
+      u32 done = jmp(a);
+      bind(a, no_result);
+      mov(a, R13, R12);
+      bind(a, done);
+      return_ok(a);
+      break;
+    }
+    case I_CALL:
+    case I_TAIL_CALL: {
+      call_ins(a, func, d, I_CALL);
+      break;
+    }
+    case I_LOCAL_CALL:
+    case I_LOCAL_TAIL_CALL: {
+      call_ins(a, func, d, I_LOCAL_CALL);
+      break;
+    }
+    case I_PUSH_ARG_LOCAL_CALL:
+    case I_PUSH_ARG_LOCAL_TAIL_CALL: {
+      call_ins(a, func, d, I_PUSH_ARG_LOCAL_CALL);
+      break;
+    }
+    case I_CHECK_INT_ARGS: {
+      for (i32 i = 0; i < 31; i++) {
+        if (arg0 & (1 << i)) {
+          load(a, RAX, R12, i * size);
+          check_number(a, RAX, E_INT_ARG, i + 1);
+        }
+      }
+      break;
+    }
+    case I_ADD:
+    case I_SUB:
+    case I_MUL:
+    case I_DIV:
+    case I_LT:
+    case I_GT: {
+      check_stack(a, 2);
+      load(a, RAX, R13, -2 * size);
+      check_number(a, RAX, E_INVALID_TYPES, 0);
+      load(a, RCX, R13, -size);
+      check_number(a, RCX, E_INVALID_TYPES, 0);
+      operation(a, ins);
+      box_number(a);
+      store(a, R13, -2 * size, RAX);
+      alu_imm(a, EXT_SUB, 1, R13, size);
+      break;
+    }
+    case I_EQ: {
+      check_stack(a, 2);
+      mov(a, RDI, RBX);
+      load(a, RSI, R13, -2 * size);
+      load(a, RDX, R13, -size);
+      call(a, vm_jit_equal);
+      box_number(a);
+      store(a, R13, -2 * size, RAX);
+      alu_imm(a, EXT_SUB, 1, R13, size);
+      break;
+    }
+    case I_ADD_INT:
+    case I_SUB_INT:
+    case I_MUL_INT:
+    case I_DIV_INT:
+    case I_LT_INT:
+    case I_GT_INT:
+    case I_EQ_INT: {
+      load32(a, RAX, R13, -2 * size);
+      load32(a, RCX, R13, -size);
+      operation(a, ins - (I_ADD_INT - I_ADD));
+      box_number(a);
+      store(a, R13, -2 * size, RAX);
+      alu_imm(a, EXT_SUB, 1, R13, size);
+      break;
+    }
+    case I_PUSH_ARG_PUSH_ADD:
+    case I_PUSH_ARG_PUSH_SUB: {
+      load(a, RAX, R12, arg0 * size);
+      check_number(a, RAX, E_INVALID_TYPES, 0);
+      load(a, RCX, R14, arg1 * size);
+      check_number(a, RCX, E_INVALID_TYPES, 0);
+      operation(a, ins == I_PUSH_ARG_PUSH_ADD ? I_ADD : I_SUB);
+      box_number(a);
+      store(a, R13, 0, RAX);
+      alu_imm(a, EXT_ADD, 1, R13, size);
+      break;
+    }
+    case I_PUSH_ADD:
+    case I_PUSH_SUB: {
+      check_stack(a, 1);
+      load(a, RAX, R13, -size);
+      check_number(a, RAX, E_INVALID_TYPES, 0);
+      load(a, RCX, R14, arg0 * size);
+      check_number(a, RCX, E_INVALID_TYPES, 0);
+      operation(a, ins == I_PUSH_ADD ? I_ADD : I_SUB);
+      box_number(a);
+      store(a, R13, -size, RAX);
+      break;
+    }
+    case I_LT_COND_JUMP:
+    case I_GT_COND_JUMP:
+    case I_EQ_COND_JUMP: {
+      check_stack(a, 2);
+      alu_imm(a, EXT_SUB, 1, R13, 2 * size);
+      if (ins == I_EQ_COND_JUMP) {
+        mov(a, RDI, RBX);
+        load(a, RSI, R13, 0);
+        load(a, RDX, R13, size);
+        call(a, vm_jit_equal);
+        alu(a, ALU_TEST, 0, RAX, RAX);
+        jump_to_ins(a, CC_E, next + arg0);
+        break;
+      }
+      load(a, RAX, R13, 0);
+      check_number(a, RAX, E_INVALID_TYPES, 0);
+      load(a, RCX, R13, size);
+      check_number(a, RCX, E_INVALID_TYPES, 0);
+      compare_jump(a, ins == I_LT_COND_JUMP ? I_LT : I_GT, next + arg0);
+      break;
+    }
+    case I_PUSH_LT_COND_JUMP:
+    case I_PUSH_GT_COND_JUMP:
+    case I_PUSH_EQ_COND_JUMP: {
+      check_stack(a, 1);
+      alu_imm(a, EXT_SUB, 1, R13, size);
+      if (ins == I_PUSH_EQ_COND_JUMP) {
+        mov(a, RDI, RBX);
+        load(a, RSI, R13, 0);
+        load(a, RDX, R14, arg0 * size);
+        call(a, vm_jit_equal);
+        alu(a, ALU_TEST, 0, RAX, RAX);
+        jump_to_ins(a, CC_E, next + arg1);
+        break;
+      }
+      load(a, RAX, R13, 0);
+      check_number(a, RAX, E_INVALID_TYPES, 0);
+      load(a, RCX, R14, arg0 * size);
+      check_number(a, RCX, E_INVALID_TYPES, 0);
+      compare_jump(a, ins == I_PUSH_LT_COND_JUMP ? I_LT : I_GT, next + arg1);
+      break;
+    }
+    case I_PUSH_ARG_PUSH_ADD_INT:
+    case I_PUSH_ARG_PUSH_SUB_INT: {
+      load32(a, RAX, R12, arg0 * size);
+      load32(a, RCX, R14, arg1 * size);
+      operation(a, ins == I_PUSH_ARG_PUSH_ADD_INT ? I_ADD : I_SUB);
+      box_number(a);
+      store(a, R13, 0, RAX);
+      alu_imm(a, EXT_ADD, 1, R13, size);
+      break;
+    }
+    case I_PUSH_ADD_INT:
+    case I_PUSH_SUB_INT: {
+      load32(a, RAX, R13, -size);
+      load32(a, RCX, R14, arg0 * size);
+      operation(a, ins == I_PUSH_ADD_INT ? I_ADD : I_SUB);
+      box_number(a);
+      store(a, R13, -size, RAX);
+      break;
+    }
+    case I_LT_COND_JUMP_INT:
+    case I_GT_COND_JUMP_INT:
+    case I_EQ_COND_JUMP_INT: {
+      alu_imm(a, EXT_SUB, 1, R13, 2 * size);
+      load32(a, RAX, R13, 0);
+      load32(a, RCX, R13, size);
+      compare_jump(a, ins - (I_LT_COND_JUMP_INT - I_LT), next + arg0);
+      break;
+    }
+    case I_PUSH_LT_COND_JUMP_INT:
+    case I_PUSH_GT_COND_JUMP_INT:
+    case I_PUSH_EQ_COND_JUMP_INT: {
+      alu_imm(a, EXT_SUB, 1, R13, size);
+      load32(a, RAX, R13, 0);
+      load32(a, RCX, R14, arg0 * size);
+      compare_jump(a, ins - (I_PUSH_LT_COND_JUMP_INT - I_LT), next + arg1);
+      break;
+    }
+    case I_PUSH_ASSIGN: {
+      load(a, RAX, R14, arg0 * size);
+      store(a, R14, arg1 * size, RAX);
+      break;
+    }
+    case I_SHL_INT: {
+      load32(a, RAX, R13, -size);
+      shift(a, SHIFT_SHL, 0, RAX, arg0);
+      box_number(a);
+      store(a, R13, -size, RAX);
+      break;
+    }
+    case I_SHR_INT: {
+      // Negative numbers are rounded toward zero by adding 2^n - 1 first
+      load32(a, RAX, R13, -size);
+      mov(a, RCX, RAX);
+      shift(a, SHIFT_SAR, 0, RCX, 31);
+      alu_imm(a, EXT_AND, 0, RCX, (1 << arg0) - 1);
+      alu(a, ALU_ADD, 0, RAX, RCX);
+      shift(a, SHIFT_SAR, 0, RAX, arg0);
+      box_number(a);
+      store(a, R13, -size, RAX);
+      break;
+    }
+    default:
+      a->status = ERR;
+      break;
+  }
+}
+
+// Report a run time error of compiled code, same as the instruction handlers do
+i32 jit_error(struct VM_state* vm, i32 error, i32 arg) {
+  switch (error) {
+    case E_NOT_ENOUGH_ARGS:
+      runtime_error("Not enough arguments for arithmetic operation\n");
+      break;
+    case E_INVALID_TYPES:
+      runtime_error("Invalid types in arithmetic operation\n");
+      break;
+    case E_INT_ARG:
+      runtime_error("Argument %i should be an int\n", arg);
+      break;
+    case E_ARGC:
+      runtime_error("Invalid number of arguments in function call (should be %i)\n", arg);
+      break;
+    case E_LOCAL_ARGC:
+      runtime_error("Invalid number of arguments in local function call (should be %i)\n", arg);
+      break;
+    case E_CALL_DEPTH:
+      runtime_error("Call stack overflow, reached frame limit of %i!\n", vm->max_frames);
+      break;
+    default:
+      break;
+  }
+  return vm->status = ERR;
+}
+
+// Mark the instructions of the function that can be reached from its entry. Nested functions are
+// jumped over, so only the code of this function is reached. Also checks that everything can be compiled.
+i32 reachable(struct VM_state* vm, struct Jit_function* func, u8* visited, i32* last, i32* count) {
+  i32 result = NO_ERR;
+  i32* work = NULL;
+  i32 work_count = 0;
+  i32 work_capacity = 0;
+  list_push(work, work_count, work_capacity, func->address);
+  while (work_count > 0 && result == NO_ERR) {
+    i32 at = work[work_count - 1];
+    list_shrink(work, work_count, 1);
+    if (at < 0 || at >= vm->program_size) {
+      result = ERR;
+      break;
+    }
+    if (visited[at]) {
+      continue;
+    }
+    struct Decoded d;
+    if (ins_decode(vm->program, vm->program_size, at, &d) != NO_ERR) {
+      result = ERR;
+      break;
+    }
+    visited[at] = 1;
+    (*count)++;
+    if (at > *last) {
+      *last = at;
+    }
+    i32 next = at + d.size;
+    i32 jump_arg = ins_jump_arg(d.ins);
+    for (i32 i = 0; i < ins_argc(d.ins); i++) {  // Only the operands of the instruction are decoded
+      // The operands are scaled by the size of an object
+      if (d.args[i] < 0 && i != jump_arg) {
+        result = ERR;
+      }
+    }
+    switch (d.ins) {
+      case I_EXIT:
+      case I_UNKNOWN:
+      case I_WIDE:
+        result = ERR;
+        break;
+      case I_RETURN:
+        break;
+      case I_JUMP:
+        list_push(work, work_count, work_capacity, next + d.args[0]);
+        break;
+      case I_TAIL_CALL:
+      case I_LOCAL_TAIL_CALL:
+      case I_PUSH_ARG_LOCAL_TAIL_CALL:
+        if (func->argc > MAX_UNROLLED_ARGS) {
+          result = ERR;
+        }
+        list_push(work, work_count, work_capacity, next);
+        break;
+      default:
+        if (jump_arg >= 0) {
+          list_push(work, work_count, work_capacity, next + d.args[jump_arg]);
+        }
+        list_push(work, work_count, work_capacity, next);
+        break;
+    }
+  }
+  list_free(work, work_count, work_capacity);
+  return result;
+}
+
+i32 jit_compile(struct VM_state* vm, struct Jit_function* func) {
+  i32 result = NO_ERR;
+  Assembler a = {0};
+  u8* visited = m_calloc(sizeof(u8), vm->program_size);
+  i32* labels = m_malloc(sizeof(i32) * vm->program_size);  // Machine code offsets of the instructions
+  if (!visited || !labels) {
+    result = ERR;
+    goto done;
+  }
+  i32 last = func->address;
+  i32 count = 0;
+  if (reachable(vm, func, visited, &last, &count) != NO_ERR) {
+    result = ERR;
+    goto done;
+  }
+  // Every instruction pushes at most one value (calls replace their arguments with the result)
+  const i32 max_push = count;
+
+  push(&a, RBX);
+  push(&a, R12);
+  push(&a, R13);
+  push(&a, R14);
+  push(&a, R15);
+  alu_imm(&a, EXT_SUB, 1, RSP, 16);
+  mov(&a, RBX, RDI);
+  load(&a, R15, RBX, OFFSET(stack));
+  load(&a, R14, RBX, OFFSET(values));
+  emit_mem(&a, 1, 0x63, 0, RAX, RBX, OFFSET(stack_top));  // movsxd
+  lea_index(&a, R13, R15, RAX);
+  lea(&a, R12, R13, -func->argc * (i32)sizeof(struct Object));
+  alu_imm(&a, EXT_SUB, 1, RAX, func->argc);
+  store(&a, RSP, 0, RAX);
+  // Compiled functions count as call frames
+  alu_mem_imm(&a, EXT_ADD, RBX, OFFSET(jit.depth), 1);
+  load32(&a, RAX, RBX, OFFSET(frame_count));
+  emit_mem(&a, 0, 0x03, 0, RAX, RBX, OFFSET(jit.depth));  // add eax, [rbx + depth]
+  emit_mem(&a, 0, 0x3b, 0, RAX, RBX, OFFSET(max_frames));  // cmp eax, [rbx + max_frames]
+  stub(&a, CC_G, E_CALL_DEPTH, 0);
+  load32(&a, RAX, RBX, OFFSET(stack_top));
+  alu_imm(&a, EXT_ADD, 0, RAX, max_push);
+  emit_mem(&a, 0, 0x3b, 0, RAX, RBX, OFFSET(stack_size));
+  u32 enough_stack = jcc(&a, CC_LE);
+  mov(&a, RDI, RBX);
+  mov_imm32(&a, RSI, max_push);
+  call(&a, vm_jit_reserve);
+  alu(&a, ALU_TEST, 0, RAX, RAX);
+  stub(&a, CC_NE, PROPAGATE, 0);
+  reload(&a);
+  bind(&a, enough_stack);
+
+  for (i32 i = 0; i < vm->program_size; i++) {
+    labels[i] = -1;
+  }
+  for (i32 at = func->address; at <= last && a.status == NO_ERR;) {
+    struct Decoded d;
+    if (ins_decode(vm->program, vm->program_size, at, &d) != NO_ERR) {
+      result = ERR;
+      goto done;
+    }
+    if (visited[at]) {
+      labels[at] = a.size;
+      translate(&a, func, &d, at);
+    }
+    at += d.size;
+  }
+  for (i32 i = 0; i < a.stubs_count; i++) {
+    struct Stub* s = &a.stubs[i];
+    bind(&a, s->at);
+    if (s->error == PROPAGATE) {
+      mov_imm32(&a, RAX, ERR);
+    }
+    else {
+      sync_top(&a);
+      mov(&a, RDI, RBX);
+      mov_imm32(&a, RSI, s->error);
+      mov_imm32(&a, RDX, s->arg);
+      call(&a, jit_error);
+    }
+    epilogue(&a);
+  }
+  for (i32 i = 0; i < a.fixups_count; i++) {
+    struct Fixup* fixup = &a.fixups[i];
+    if (fixup->target < 0 || fixup->target >= vm->program_size || labels[fixup->target] < 0) {
+      result = ERR;
+      goto done;
+    }
+    patch32(&a, fixup->at, labels[fixup->target] - (fixup->at + 4));
+  }
+  // The fixups and stubs that there was no memory for are missing
+  if (a.status != NO_ERR || vm->allocator.failed) {
+    result = ERR;
+    goto done;
+  }
+
+  // NOTE(lucas): Every function gets its own mapping, which is never writable and executable at the same time
+  u8* code = mmap(NULL, a.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    result = ERR;
+    goto done;
+  }
+  memcpy(code, a.code, a.size);
+  if (mprotect(code, a.size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, a.size);
+    result = ERR;
+    goto done;
+  }
+  func->code = code;
+  func->code_size = a.size;
+done:
+  if (visited) {
+    m_free(visited, sizeof(u8) * vm->program_size);
+  }
+  if (labels) {
+    m_free(labels, sizeof(i32) * vm->program_size);
+  }
+  if (a.code) {
+    m_free(a.code, a.capacity);
+  }
+  list_free(a.fixups, a.fixups_count, a.fixups_capacity);
+  list_free(a.stubs, a.stubs_count, a.stubs_capacity);
+  return result;
+}
+
+struct Jit_function* jit_function(struct VM_state* vm, u64 func) {
+  if (!vm->jit.enabled) {
+    return NULL;
+  }
+  struct Object value = { .bits = func };
+  i32 address = FUNC_ADDRESS(value);
+  // NOTE(lucas): Only looked up when an inline cache misses, and there are not that many functions
+  for (i32 i = 0; i < vm->jit.functions_count; i++) {
+    if (vm->jit.functions[i]->address == address) {
+      return vm->jit.functions[i];
+    }
+  }
+  struct Jit_function* record = m_malloc(sizeof(struct Jit_function));
+  if (!record) {
+    return NULL;
+  }
+  record->address = address;
+  record->argc = FUNC_ARGC(value);
+  record->calls = 0;
+  record->failed = 0;
+  record->code = NULL;
+  record->code_size = 0;
+  list_push(vm->jit.functions, vm->jit.functions_count, vm->jit.functions_capacity, record);
+  if (vm->jit.functions_count == 0 || vm->jit.functions[vm->jit.functions_count - 1] != record) {
+    m_free(record, sizeof(struct Jit_function));
+    return NULL;
+  }
+  return record;
+}
+
+i32 jit_hot(struct VM_state* vm, struct Jit_function* func) {
+  if (func->failed || ++func->calls < JIT_THRESHOLD) {
+    return 0;
+  }
+  if (jit_compile(vm, func) != NO_ERR) {
+    func->failed = 1;
+    vm_memory_check(vm);  // The interpreter stops at the next call (see frame_push)
+    return 0;
+  }
+  return 1;
+}
+
+i32 jit_enter(struct VM_state* vm, struct Jit_function* func) {
+  return ((Jit_code)func->code)(vm);
+}
+
+#endif
+
+void jit_init(Jit* jit, i32 enabled) {
+  jit->functions = NULL;
+  jit->functions_count = 0;
+  jit->functions_capacity = 0;
+  jit->depth = 0;
+  jit->enabled = enabled;
+}
+
+void jit_free(Jit* jit) {
+  for (i32 i = 0; i < jit->functions_count; i++) {
+    struct Jit_function* func = jit->functions[i];
+#if defined(USE_JIT)
+    if (func->code) {
+      munmap(func->code, func->code_size);
+    }
+#endif
+    m_free(func, sizeof(struct Jit_function));
+  }
+  list_free(jit->functions, jit->functions_count, jit->functions_capacity);
+}
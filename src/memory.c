@@ -2,58 +2,260 @@
 
 #include "memory.h"
 
-struct {
-  i32 total;
-  i32 blocks;
-} memory_info;
+static void* system_alloc(Allocator* allocator, u32 size);
+static void* system_realloc(Allocator* allocator, void* data, u32 old_size, u32 new_size);
+static void system_free(Allocator* allocator, void* data, u32 size);
+static void system_release(Allocator* allocator);
+static void* arena_allocator_alloc(Allocator* allocator, u32 size);
+static void* arena_allocator_realloc(Allocator* allocator, void* data, u32 old_size, u32 new_size);
+static void arena_allocator_free(Allocator* allocator, void* data, u32 size);
+static void arena_allocator_release(Allocator* allocator);
+static u32 size_class(u32 size);
+static void* fixed_alloc(Allocator* allocator, u32 size);
+static void* fixed_realloc(Allocator* allocator, void* data, u32 old_size, u32 new_size);
+static void fixed_free(Allocator* allocator, void* data, u32 size);
+static void fixed_release(Allocator* allocator);
 
-#define memory_info_update(add_total, add_num_blocks) \
-  memory_info.total += (add_total); \
-  memory_info.blocks += (add_num_blocks)
+#define class_size(c) ((u32)FIXED_MIN_SIZE << (c))
 
-i32 memory_total() {
-  return memory_info.total;
+static Allocator memory_system = {
+  .alloc = system_alloc,
+  .realloc = system_realloc,
+  .free = system_free,
+  .release = system_release,
+  .kind = ALLOCATOR_SYSTEM,
+};
+
+// NOTE(lucas): The current allocator is per thread, so that vms can run on different threads. Allocations of
+// a thread that does not run a vm are counted in a system allocator of its own.
+static _Thread_local Allocator thread_system = {
+  .alloc = system_alloc,
+  .realloc = system_realloc,
+  .free = system_free,
+  .release = system_release,
+  .kind = ALLOCATOR_SYSTEM,
+};
+
+static _Thread_local Allocator* current = NULL;
+
+#define allocator_current() (current ? current : &thread_system)
+
+#define memory_info_update(allocator, add_total, add_num_blocks) \
+  (allocator)->total += (add_total); \
+  (allocator)->blocks += (add_num_blocks); \
+  if ((allocator)->total > (allocator)->peak) (allocator)->peak = (allocator)->total
+
+void* system_alloc(Allocator* allocator, u32 size) {
+  (void)allocator;
+  return malloc(size);
+}
+
+void* system_realloc(Allocator* allocator, void* data, u32 old_size, u32 new_size) {
+  (void)allocator; (void)old_size;
+  return realloc(data, new_size);
+}
+
+void system_free(Allocator* allocator, void* data, u32 size) {
+  (void)allocator; (void)size;
+  free(data);
+}
+
+void system_release(Allocator* allocator) {
+  (void)allocator;
+}
+
+void* arena_allocator_alloc(Allocator* allocator, u32 size) {
+  return arena_alloc(&allocator->arena, size);
 }
 
-i32 memory_num_blocks() {
-  return memory_info.blocks;
+void* arena_allocator_realloc(Allocator* allocator, void* data, u32 old_size, u32 new_size) {
+  return arena_realloc(&allocator->arena, data, old_size, new_size);
 }
 
-void memory_print_info() {
+void arena_allocator_free(Allocator* allocator, void* data, u32 size) {
+  (void)allocator; (void)data; (void)size;
+}
+
+void arena_allocator_release(Allocator* allocator) {
+  arena_free(&allocator->arena);
+}
+
+// Index of the smallest block size that fits, FIXED_CLASSES if there is none
+u32 size_class(u32 size) {
+  u32 c = 0;
+  while (c < FIXED_CLASSES && (u64)class_size(c) < size) {
+    c++;
+  }
+  return c;
+}
+
+// NOTE(lucas): Freed blocks are not merged. A block that is larger than needed is only split up when the
+// buffer has been used up, so that large blocks stay available for the lists that grow.
+void* fixed_alloc(Allocator* allocator, u32 size) {
+  u32 c = size_class(size);
+  if (c >= FIXED_CLASSES) {
+    return NULL;
+  }
+  void* block = allocator->free_lists[c];
+  if (block) {
+    allocator->free_lists[c] = *(void**)block;
+    return block;
+  }
+  if (allocator->size - allocator->used >= class_size(c)) {
+    block = &allocator->memory[allocator->used];
+    allocator->used += class_size(c);
+    return block;
+  }
+  for (u32 larger = c + 1; larger < FIXED_CLASSES; larger++) {
+    block = allocator->free_lists[larger];
+    if (block) {
+      allocator->free_lists[larger] = *(void**)block;
+      while (larger > c) {
+        larger--;
+        void* half = (u8*)block + class_size(larger);
+        *(void**)half = allocator->free_lists[larger];
+        allocator->free_lists[larger] = half;
+      }
+      return block;
+    }
+  }
+  return NULL;
+}
+
+void* fixed_realloc(Allocator* allocator, void* data, u32 old_size, u32 new_size) {
+  if (size_class(old_size) == size_class(new_size)) {
+    return data;
+  }
+  void* result = fixed_alloc(allocator, new_size);
+  if (!result) {
+    return NULL;
+  }
+  memcpy(result, data, old_size < new_size ? old_size : new_size);
+  fixed_free(allocator, data, old_size);
+  return result;
+}
+
+void fixed_free(Allocator* allocator, void* data, u32 size) {
+  u32 c = size_class(size);
+  *(void**)data = allocator->free_lists[c];
+  allocator->free_lists[c] = data;
+}
+
+void fixed_release(Allocator* allocator) {
+  if (allocator->owns_memory && allocator->memory) {
+    free(allocator->memory);
+  }
+  allocator->memory = NULL;
+  allocator->size = 0;
+  allocator->used = 0;
+  allocator->owns_memory = 0;
+  for (u32 c = 0; c < FIXED_CLASSES; c++) {
+    allocator->free_lists[c] = NULL;
+  }
+}
+
+void allocator_system(Allocator* allocator) {
+  *allocator = memory_system;
+  allocator->total = 0;
+  allocator->blocks = 0;
+  allocator->peak = 0;
+}
+
+void allocator_arena(Allocator* allocator) {
+  *allocator = (Allocator) {
+    .alloc = arena_allocator_alloc,
+    .realloc = arena_allocator_realloc,
+    .free = arena_allocator_free,
+    .release = arena_allocator_release,
+    .kind = ALLOCATOR_ARENA,
+  };
+  arena_init_from(&allocator->arena, &memory_system);
+}
+
+i32 allocator_fixed(Allocator* allocator, void* memory, u32 size) {
+  *allocator = (Allocator) {
+    .alloc = fixed_alloc,
+    .realloc = fixed_realloc,
+    .free = fixed_free,
+    .release = fixed_release,
+    .kind = ALLOCATOR_FIXED,
+    .memory = memory,
+    .size = size,
+  };
+  if (!memory) {
+    if (!(allocator->memory = malloc(size))) {
+      allocator->size = 0;
+      return ERR;
+    }
+    allocator->owns_memory = 1;
+  }
+  // Blocks are aligned to the smallest block size
+  allocator->used = (FIXED_MIN_SIZE - ((uintptr_t)allocator->memory % FIXED_MIN_SIZE)) % FIXED_MIN_SIZE;
+  if (allocator->used > size) {
+    allocator->used = size;
+  }
+  return NO_ERR;
+}
+
+void allocator_release(Allocator* allocator) {
+  allocator->release(allocator);
+}
+
+Allocator* memory_use(Allocator* allocator) {
+  Allocator* previous = current;
+  current = allocator;
+  return previous;
+}
+
+void memory_print_info(const Allocator* allocator) {
   fprintf(stdout,
-    "Memory info:\n  Allocated blocks: %i, Total: %.3g KB (%i bytes)\n",
-    memory_info.blocks,
-    memory_info.total / 1024.0f,
-    memory_info.total
+    "Memory info:\n  Allocated blocks: %i, Total: %.3g KB (%i bytes), Peak: %.3g KB\n",
+    allocator->blocks,
+    allocator->total / 1024.0f,
+    allocator->total,
+    allocator->peak / 1024.0f
   );
 }
 
 void* m_malloc(const u32 size) {
-  void* data = malloc(size);
-  if (!data) return NULL;
-  memory_info_update(size, 1);
+  Allocator* allocator = allocator_current();
+  void* data = allocator->alloc(allocator, size);
+  if (!data) {
+    allocator->failed = 1;
+    return NULL;
+  }
+  memory_info_update(allocator, size, 1);
   return data;
 }
 
 void* m_calloc(const u32 size, const u32 count) {
-  void* data = calloc(size, count);
-  if (!data) return NULL;
-  memory_info_update(size * count, 1);
+  Allocator* allocator = allocator_current();
+  void* data = allocator->alloc(allocator, size * count);
+  if (!data) {
+    allocator->failed = 1;
+    return NULL;
+  }
+  memset(data, 0, size * count);
+  memory_info_update(allocator, size * count, 1);
   return data;
 }
 
 void* m_realloc(void* data, const u32 old_size, const u32 new_size) {
   assert(data);
+  Allocator* allocator = allocator_current();
   i32 diff = new_size - old_size;
-  void* temp = realloc(data, new_size);
-  if (!temp)
+  void* temp = allocator->realloc(allocator, data, old_size, new_size);
+  if (!temp) {
+    allocator->failed = 1;
     return NULL;
-  memory_info_update(diff, 0);
+  }
+  memory_info_update(allocator, diff, 0);
   return temp;
 }
 
 void m_free(void* data, const u32 size) {
   assert(data);
-  free(data);
-  memory_info_update(-size, -1);
+  Allocator* allocator = allocator_current();
+  allocator->free(allocator, data, size);
+  memory_info_update(allocator, -size, -1);
 }
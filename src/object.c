@@ -9,19 +9,15 @@
 i32 token_to_object(struct VM_state* vm, struct Token* t, struct Object* obj) {
   switch (t->type) {
     case T_NUMBER: {
-      obj->type = T_NUMBER;
-      obj->value.number = t->value.number;
+      *obj = MAKE_NUMBER(t->value.number);
       break;
     }
     case T_STRING: {
-      if (buffer_append_n(&vm->buffer, t->string, t->length) == NO_ERR) {
-        obj->type = T_STRING;
-        obj->value.buffer.data = &vm->buffer.data[vm->buffer.length - t->length];
-        obj->value.buffer.length = t->length;
-      }
-      else {
-        assert(0);  // TODO(lucas): Handle
+      i32 handle = NO_STRING;
+      if (string_intern(vm, t->string, t->length, &handle) != NO_ERR) {
+        return ERR;  // Out of memory
       }
+      *obj = MAKE_STRING(handle);
       break;
     }
     default:
@@ -31,27 +27,69 @@ i32 token_to_object(struct VM_state* vm, struct Token* t, struct Object* obj) {
   return NO_ERR;
 }
 
-void object_print(FILE* fp, struct Object* obj) {
-  switch (obj->type) {
-    case T_STRING: {
-      if (obj->value.buffer.data) {
-        fprintf(fp, "\"%.*s\"", obj->value.buffer.length, obj->value.buffer.data);
+i32 object_type(struct Object obj) {
+  switch (OBJECT_TAG(obj)) {
+    case TAG_NUMBER:
+      return T_NUMBER;
+    case TAG_STRING:
+      return T_STRING;
+    case TAG_FUNCTION:
+      return T_FUNCTION;
+    case TAG_CFUNCTION:
+      return T_CFUNCTION;
+    default:
+      break;
+  }
+  return T_UNKNOWN;
+}
+
+struct Object object_of_type(i32 type) {
+  switch (type) {
+    case T_NUMBER:
+      return MAKE_NUMBER(0);
+    case T_STRING:
+      return MAKE_STRING(NO_STRING);
+    case T_FUNCTION:
+      return MAKE_FUNCTION(0, 0);
+    default:
+      break;
+  }
+  return MAKE_UNKNOWN();
+}
+
+struct Buffer string_get(struct VM_state* vm, i32 handle) {
+  if (handle < 0 || handle >= vm->strings_count) {
+    return (struct Buffer) { .data = NULL, .length = 0, };
+  }
+  struct String* string = &vm->strings[handle];
+  return (struct Buffer) {
+    .data = &vm->buffer.data[string->offset],
+    .length = string->length,
+  };
+}
+
+void object_print(struct VM_state* vm, FILE* fp, struct Object* obj) {
+  switch (OBJECT_TAG(*obj)) {
+    case TAG_STRING: {
+      struct Buffer string = string_get(vm, AS_HANDLE(*obj));
+      if (string.data) {
+        fprintf(fp, "\"%.*s\"", string.length, string.data);
       }
       else {
         fprintf(fp, "\"\"");
       }
       break;
     }
-    case T_NUMBER: {
-      fprintf(fp, "%i", obj->value.number);
+    case TAG_NUMBER: {
+      fprintf(fp, "%i", AS_NUMBER(*obj));
       break;
     }
-    case T_FUNCTION: {
-      fprintf(fp, "function: %i", obj->value.func.address);
+    case TAG_FUNCTION: {
+      fprintf(fp, "function: %i", FUNC_ADDRESS(*obj));
       break;
     }
-    case T_CFUNCTION: {
-      fprintf(fp, "cfunction: %p", obj->value.cfunc.func);
+    case TAG_CFUNCTION: {
+      fprintf(fp, "cfunction: %p", vm->cfunctions[AS_HANDLE(*obj)].func);
       break;
     }
     default:
@@ -60,30 +98,19 @@ void object_print(FILE* fp, struct Object* obj) {
   }
 }
 
-void object_printline(FILE* fp, struct Object* obj) {
-  object_print(fp, obj);
+void object_printline(struct VM_state* vm, FILE* fp, struct Object* obj) {
+  object_print(vm, fp, obj);
   fprintf(fp, "\n");
 }
 
-void func_init(struct Function* func, struct Function* parent) {
-  func->argc = 0;
-  func->address = 0;
-  func->parent = parent;
-}
-
-void func_free(struct Function* func) {
-  (void)func;
-}
-
-void func_state_init(struct Function_state* fs, struct Function_state* parent, struct Function* func) {
-  fs->func = func;
+void func_state_init(struct Function_state* fs, struct Function_state* parent, struct Arena* arena) {
   fs->parent = parent;
-  fs->symbol_table = ht_create_empty();
-  fs->args = ht_create_empty();
+  fs->symbol_table = ht_create_arena(arena);
+  fs->args = ht_create_arena(arena);
+  fs->int_args = 0;
 }
 
 void func_state_free(struct Function_state* fs) {
-  fs->func = NULL;
   ht_free(&fs->symbol_table);
   ht_free(&fs->args);
 }
@@ -0,0 +1,245 @@
+// optimize.c
+// Optimizations on the abstract syntax tree, run before code generation (shared by all backends)
+
+#include "common.h"
+#include "list.h"
+#include "token.h"
+#include "ast.h"
+#include "optimize.h"
+
+// A name that is visible at some point in the program
+struct Binding {
+  struct Token name;
+  i32 constant; // Is this a top-level let constant? If not, the name shadows any constant with the same name
+  i32 value;
+};
+
+typedef struct Optimizer {
+  struct Binding* bindings;
+  i32 bindings_count;
+  i32 bindings_capacity;
+} Optimizer;
+
+static struct Token* literal(Ast ast);
+static struct Binding* binding_lookup(Optimizer* o, struct Token* name);
+static void binding_add(Optimizer* o, struct Token* name, i32 constant, i32 value);
+static void shadow_names(Optimizer* o, Ast* ast);
+static void optimize_define(Optimizer* o, Ast* func);
+static void optimize_if(Optimizer* o, Ast* if_branch, i32 top_level);
+static void optimize(Optimizer* o, Ast* ast, i32 top_level);
+
+// Get the literal that this branch evaluates to, if it is a single literal (possibly wrapped in expressions)
+struct Token* literal(Ast ast) {
+  struct Token* token = ast_get_value(&ast);
+  while (token && token->type == T_EXPR && ast_child_count(&ast) == 1) {
+    ast = ast_get_node_at(&ast, 0);
+    token = ast_get_value(&ast);
+  }
+  if (token && (token->type == T_NUMBER || token->type == T_STRING)) {
+    return token;
+  }
+  return NULL;
+}
+
+i32 optimize_fold(i32 op, i32 left, i32 right, i32* result) {
+  switch (op) {
+    case T_ADD: *result = (i32)((u32)left + (u32)right); break;
+    case T_SUB: *result = (i32)((u32)left - (u32)right); break;
+    case T_MUL: *result = (i32)((u32)left * (u32)right); break;
+    case T_DIV: {
+      if (right == 0 || (left == INT32_MIN && right == -1)) {
+        return ERR;
+      }
+      *result = left / right;
+      break;
+    }
+    case T_LT: *result = left < right; break;
+    case T_GT: *result = left > right; break;
+    case T_EQ: *result = left == right; break;
+    default:
+      return ERR;
+  }
+  return NO_ERR;
+}
+
+struct Binding* binding_lookup(Optimizer* o, struct Token* name) {
+  for (i32 i = o->bindings_count - 1; i >= 0; i--) {
+    struct Binding* binding = &o->bindings[i];
+    if (binding->name.length == name->length && !strncmp(binding->name.string, name->string, name->length)) {
+      return binding;
+    }
+  }
+  return NULL;
+}
+
+void binding_add(Optimizer* o, struct Token* name, i32 constant, i32 value) {
+  struct Binding binding = {
+    .name = *name,
+    .constant = constant,
+    .value = value,
+  };
+  list_push(o->bindings, o->bindings_count, o->bindings_capacity, binding);
+}
+
+// Shadow every name that is defined somewhere in this branch
+void shadow_names(Optimizer* o, Ast* ast) {
+  i32 child_count = ast_child_count(ast);
+  for (i32 i = 0; i < child_count; i++) {
+    Ast node = ast_get_node_at(ast, i);
+    struct Token* token = ast_get_value(&node);
+    if (!token) {
+      continue;
+    }
+    switch (token->type) {
+      case T_LET:
+      case T_DEFINE: {
+        struct Token* name = ast_get_node_value(&node, 0);
+        if (name) {
+          binding_add(o, name, 0, 0);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    shadow_names(o, &node);
+  }
+}
+
+// define
+// \-- identifier
+// \-- (args)
+// \-- (body)
+void optimize_define(Optimizer* o, Ast* func) {
+  Ast args = ast_get_node_at(func, 1);
+  Ast* body = ast_get_node(func, 2);
+  if (!args || !body) {
+    return;
+  }
+  // Parameters and local values hide the top-level constants within the function
+  i32 bindings_count = o->bindings_count;
+  i32 arg_count = ast_child_count(&args);
+  for (i32 i = 0; i < arg_count; i++) {
+    binding_add(o, ast_get_node_value(&args, i), 0, 0);
+  }
+  shadow_names(o, body);
+  optimize(o, body, 0);
+  i32 num_locals = o->bindings_count - bindings_count;
+  list_shrink(o->bindings, o->bindings_count, num_locals);
+}
+
+// if
+// \-- (cond)
+// \-- (true-expr)
+// \-- (false-expr)
+void optimize_if(Optimizer* o, Ast* if_branch, i32 top_level) {
+  if (ast_child_count(if_branch) != 3) {
+    return;
+  }
+  Ast* cond = ast_get_node(if_branch, 0);
+  optimize(o, cond, top_level);
+  struct Token* value = literal(*cond);
+  if (!value) {
+    optimize(o, ast_get_node(if_branch, 1), 0);
+    optimize(o, ast_get_node(if_branch, 2), 0);
+    return;
+  }
+  // Strings are never true, see object_check_true
+  i32 is_true = value->type == T_NUMBER && value->value.number != 0;
+  ast_remove_node_at(if_branch, is_true ? 2 : 1);
+  ast_remove_node_at(if_branch, 0);
+  // The remaining body is always evaluated, so it can be treated as if it was written in place of the if expression
+  ast_get_value(if_branch)->type = T_EXPR;
+  optimize(o, if_branch, top_level);
+}
+
+// Optimize the children of the ast. Top-level children are always evaluated, and in order,
+// which is what makes it safe to propagate the let constants defined there.
+void optimize(Optimizer* o, Ast* ast, i32 top_level) {
+  i32 child_count = ast_child_count(ast);
+  for (i32 i = 0; i < child_count; i++) {
+    Ast* node = ast_get_node(ast, i);
+    struct Token* token = ast_get_value(node);
+    if (!token) {
+      continue;
+    }
+    switch (token->type) {
+      case T_IDENTIFIER: {
+        struct Binding* binding = binding_lookup(o, token);
+        if (binding && binding->constant) {
+          token->type = T_NUMBER;
+          token->value.number = binding->value;
+        }
+        break;
+      }
+      // let
+      // \-- identifier
+      //        \--type (optional)
+      //     \-- (expression)
+      case T_LET: {
+        struct Token* ident = ast_get_node_value(node, 0);
+        Ast* value_branch = ast_get_node(node, 1);
+        if (!ident || !value_branch) {
+          break;
+        }
+        optimize(o, value_branch, top_level);
+        struct Token* value = literal(*value_branch);
+        if (top_level && value && value->type == T_NUMBER) {
+          binding_add(o, ident, 1, value->value.number);
+        }
+        break;
+      }
+      case T_DEFINE: {
+        optimize_define(o, node);
+        break;
+      }
+      case T_IF: {
+        optimize_if(o, node, top_level);
+        break;
+      }
+      case T_ADD:
+      case T_SUB:
+      case T_MUL:
+      case T_DIV:
+      case T_LT:
+      case T_GT:
+      case T_EQ: {
+        optimize(o, node, top_level);
+        if (ast_child_count(node) != 2) {
+          break;
+        }
+        struct Token* left = literal(ast_get_node_at(node, 0));
+        struct Token* right = literal(ast_get_node_at(node, 1));
+        i32 result = 0;
+        if (left && right && left->type == T_NUMBER && right->type == T_NUMBER &&
+          optimize_fold(token->type, left->value.number, right->value.number, &result) == NO_ERR) {
+          ast_remove_node_at(node, 1);
+          ast_remove_node_at(node, 0);
+          token->type = T_NUMBER;
+          token->value.number = result;
+        }
+        break;
+      }
+      case T_EXPR: {
+        optimize(o, node, top_level);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+
+i32 optimize_ast(Ast* ast) {
+  if (ast_is_empty(*ast)) {
+    return NO_ERR;
+  }
+  Optimizer o = {
+    .bindings = NULL,
+    .bindings_count = 0,
+    .bindings_capacity = 0,
+  };
+  optimize(&o, ast, 1);
+  list_free(o.bindings, o.bindings_count, o.bindings_capacity);
+  return NO_ERR;
+}
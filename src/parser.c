@@ -12,7 +12,10 @@
   fprintf(stderr, "parse-error: %s:%i:%i: " fmt, p->l->filename, p->l->line, p->l->count, ##__VA_ARGS__); \
   error_printline(p->l->source, p->l->token)
 
-static void parser_init(Parser* parser, Lexer* lexer, Ast* ast);
+static void parser_init(Parser* parser, Lexer* lexer, Arena* arena, Ast* ast);
+static Ast add_node(Parser* p, Ast* ast, struct Token token);
+static Ast add_node_last(Parser* p, Ast* ast, struct Token token);
+static i32 out_of_memory(Parser* p);
 static i32 expect(Parser* p, i32 type);
 static i32 end(Parser* p);
 static i32 expr_end(Parser* p);
@@ -21,12 +24,38 @@ static i32 simple_expr(Parser* p);
 static i32 expression(Parser* p);
 static i32 expressions(Parser* p);
 
-void parser_init(Parser* p, Lexer* l, Ast* ast) {
+void parser_init(Parser* p, Lexer* l, Arena* arena, Ast* ast) {
   p->l = l;
+  p->arena = arena;
   p->ast = ast;
   p->status = 0;
 }
 
+Ast add_node(Parser* p, Ast* ast, struct Token token) {
+  Ast node = ast_add_node(p->arena, ast, token);
+  if (!node) {
+    out_of_memory(p);
+  }
+  return node;
+}
+
+Ast add_node_last(Parser* p, Ast* ast, struct Token token) {
+  Ast node = ast_add_node_last(p->arena, ast, token);
+  if (!node) {
+    out_of_memory(p);
+  }
+  return node;
+}
+
+// NOTE(lucas): The ast is allocated in the arena of the compilation, which runs out when the allocator of the
+// vm has a fixed size. Parsing stops at the first failure, it is only reported once.
+i32 out_of_memory(Parser* p) {
+  if (p->status == NO_ERR) {
+    parse_error("Out of memory\n");
+  }
+  return p->status = ERR;
+}
+
 i32 expect(Parser* p, i32 type) {
   return p->l->token.type == type;
 }
@@ -44,8 +73,25 @@ i32 func_args(Parser* p) {
     struct Token token = get_token(p->l);
     switch (token.type) {
       case T_IDENTIFIER: {
-        ast_add_node(p->ast, token);
+        if (!add_node(p, p->ast, token)) {
+          return p->status;
+        }
         next_token(p->l);
+        // Explicit parameter type
+        if (expect(p, T_COLON)) {
+          next_token(p->l); // Skip ':'
+          token = get_token(p->l);
+          if (token.type > T_TYPES && token.type < T_NO_TYPE) {
+            if (!add_node_last(p, p->ast, token)) {
+              return p->status;
+            }
+            next_token(p->l); // Skip type
+          }
+          else {
+            parse_error("The type '%.*s' is not defined\n", token.length, token.string);
+            return p->status = ERR;
+          }
+        }
         break;
       }
       case T_CLOSEDPAREN: {
@@ -62,7 +108,7 @@ i32 func_args(Parser* p) {
 // Identifier, number, string, operator
 // operator '(' expr ')' | symbol
 i32 simple_expr(Parser* p) {
-  while (!end(p) && !expr_end(p)) {
+  while (!end(p) && !expr_end(p) && p->status == NO_ERR) {
     struct Token token = get_token(p->l);
     switch (token.type) {
       case T_ADD:
@@ -73,11 +119,17 @@ i32 simple_expr(Parser* p) {
       case T_GT:
       case T_EQ: {
         Ast* orig = p->ast;
-        Ast op_branch = ast_add_node(p->ast, token);  // Add operator
+        Ast op_branch = add_node(p, p->ast, token);  // Add operator
+        if (!op_branch) {
+          return p->status;
+        }
         next_token(p->l); // Skip operator
         p->ast = &op_branch;
 
-        simple_expr(p);
+        if (simple_expr(p) != NO_ERR) {
+          p->ast = orig;
+          return p->status;
+        }
 
         i32 child_count = ast_child_count(p->ast);
         if (child_count != 2) {
@@ -90,7 +142,10 @@ i32 simple_expr(Parser* p) {
       }
       case T_LET: {
         Ast* orig = p->ast; // Save the pointer to the original branch so that we can return to it later
-        Ast let_branch = ast_add_node(p->ast, token); // Add 'let'
+        Ast let_branch = add_node(p, p->ast, token); // Add 'let'
+        if (!let_branch) {
+          return p->status;
+        }
         p->ast = &let_branch;
         token = next_token(p->l);  // Skip 'let'
 
@@ -100,7 +155,10 @@ i32 simple_expr(Parser* p) {
           return p->status = ERR;
         }
 
-        ast_add_node(p->ast, token); // Add identifier
+        if (!add_node(p, p->ast, token)) { // Add identifier
+          p->ast = orig;
+          return p->status;
+        }
         token = next_token(p->l); // Skip identifier
 
         //
@@ -111,7 +169,10 @@ i32 simple_expr(Parser* p) {
           token = get_token(p->l);
           if (token.type > T_TYPES && token.type < T_NO_TYPE) {
             // ast_add_node(p->ast, get_token(p->l));  // Add type
-            ast_add_node_last(p->ast, get_token(p->l));
+            if (!add_node_last(p, p->ast, get_token(p->l))) {
+              p->ast = orig;
+              return p->status;
+            }
             next_token(p->l); // Skip type
           }
           else {
@@ -120,10 +181,17 @@ i32 simple_expr(Parser* p) {
           }
         }
 
-        Ast value_branch = ast_add_node(p->ast, new_token(T_EXPR));
+        Ast value_branch = add_node(p, p->ast, new_token(T_EXPR));
+        if (!value_branch) {
+          p->ast = orig;
+          return p->status;
+        }
         p->ast = &value_branch;
 
-        simple_expr(p);
+        if (simple_expr(p) != NO_ERR) {
+          p->ast = orig;
+          return p->status;
+        }
 
         i32 value_branch_child_count = ast_child_count(p->ast);
         if (value_branch_child_count != 1) {
@@ -139,38 +207,56 @@ i32 simple_expr(Parser* p) {
       // (if (cond) (true-expr))
       case T_IF: {
         Ast* orig = p->ast;
-        ast_add_node(p->ast, token); // Add 'if'
+        Ast if_branch = add_node(p, p->ast, token); // Add 'if'
+        if (!if_branch) {
+          return p->status;
+        }
         next_token(p->l); // Skip 'if'
-
-        Ast if_branch = ast_get_last(p->ast);
         p->ast = &if_branch;
 
-        ast_add_node(p->ast, new_token(T_EXPR));
-        Ast cond = ast_get_last(p->ast);
+        Ast cond = add_node(p, p->ast, new_token(T_EXPR));
+        if (!cond) {
+          p->ast = orig;
+          return p->status;
+        }
         p->ast = &cond;
 
         // Condition
-        if (expression(p) != NO_ERR) {
+        if (!expect(p, T_OPENPAREN)) {
           p->ast = orig;
           parse_error("Missing condition in if expression\n");
+          return p->status = ERR;
+        }
+        if (expression(p) != NO_ERR) {
+          p->ast = orig;
           return p->status;
         }
 
         p->ast = &if_branch;
-        ast_add_node(p->ast, new_token(T_EXPR));
-        Ast true_body = ast_get_last(p->ast);
+        Ast true_body = add_node(p, p->ast, new_token(T_EXPR));
+        if (!true_body) {
+          p->ast = orig;
+          return p->status;
+        }
         p->ast = &true_body;
 
         // True expression body
-        if (expression(p) != NO_ERR) {
+        if (!expect(p, T_OPENPAREN)) {
           parse_error("Missing if body\n");
+          p->ast = orig;
+          return p->status = ERR;
+        }
+        if (expression(p) != NO_ERR) {
           p->ast = orig;
           return p->status;
         }
 
         p->ast = &if_branch;
-        ast_add_node(p->ast, new_token(T_EXPR));
-        Ast false_body = ast_get_last(p->ast);
+        Ast false_body = add_node(p, p->ast, new_token(T_EXPR));
+        if (!false_body) {
+          p->ast = orig;
+          return p->status;
+        }
         p->ast = &false_body;
 
         if (expect(p, T_OPENPAREN)) {
@@ -186,7 +272,10 @@ i32 simple_expr(Parser* p) {
       // (define name (args) (body))
       case T_DEFINE: {
         Ast* orig = p->ast;
-        Ast func_branch = ast_add_node(p->ast, token); // Add 'define'
+        Ast func_branch = add_node(p, p->ast, token); // Add 'define'
+        if (!func_branch) {
+          return p->status;
+        }
         token = next_token(p->l); // Skip 'define'
 
         if (!expect(p, T_IDENTIFIER)) {
@@ -196,16 +285,23 @@ i32 simple_expr(Parser* p) {
 
         p->ast = &func_branch;
 
-        ast_add_node(p->ast, token);  // Add function identifier
+        Ast name = add_node(p, p->ast, token);  // Add function identifier
         next_token(p->l); // Skip identifier
 
-        Ast args = ast_add_node(&func_branch, new_token(T_EXPR));
+        Ast args = name ? add_node(p, &func_branch, new_token(T_EXPR)) : NULL;
+        if (!args) {
+          p->ast = orig;
+          return p->status;
+        }
         p->ast = &args;
 
         if (expect(p, T_OPENPAREN)) {
           next_token(p->l);  // Skip '('
 
-          func_args(p);  // Parse function arguments
+          if (func_args(p) != NO_ERR) {  // Parse function arguments
+            p->ast = orig;
+            return p->status;
+          }
 
           if (!expect(p, T_CLOSEDPAREN)) {
             p->ast = orig;
@@ -215,10 +311,17 @@ i32 simple_expr(Parser* p) {
           next_token(p->l); // Skip ')'
         }
 
-        Ast body = ast_add_node(&func_branch, new_token(T_EXPR));
+        Ast body = add_node(p, &func_branch, new_token(T_EXPR));
+        if (!body) {
+          p->ast = orig;
+          return p->status;
+        }
         p->ast = &body;
 
-        simple_expr(p); // Parse function body
+        if (simple_expr(p) != NO_ERR) { // Parse function body
+          p->ast = orig;
+          return p->status;
+        }
 
         p->ast = orig;
         break;
@@ -226,7 +329,9 @@ i32 simple_expr(Parser* p) {
       case T_STRING:
       case T_NUMBER:
       case T_IDENTIFIER: {
-        ast_add_node(p->ast, token);
+        if (!add_node(p, p->ast, token)) {
+          return p->status;
+        }
         next_token(p->l);
         break;
       }
@@ -240,7 +345,7 @@ i32 simple_expr(Parser* p) {
         return p->status = ERR;
     }
   }
-  return NO_ERR;
+  return p->status;
 }
 
 // '(' ... ')'
@@ -250,11 +355,17 @@ i32 expression(Parser* p) {
     case T_OPENPAREN: {
       next_token(p->l); // Skip '('
       Ast* orig = p->ast;
-      Ast expr_branch = ast_add_node(p->ast, new_token(T_EXPR));
+      Ast expr_branch = add_node(p, p->ast, new_token(T_EXPR));
+      if (!expr_branch) {
+        return p->status;
+      }
 
       p->ast = &expr_branch;
       simple_expr(p);
       p->ast = orig;
+      if (p->status != NO_ERR) {
+        return p->status;
+      }
 
       if (!expect(p, T_CLOSEDPAREN)) {
         parse_error("Missing closing ')' parenthesis in expression\n");
@@ -282,12 +393,12 @@ i32 expressions(Parser* p) {
   return p->status;
 }
 
-i32 parser_parse(char* input, char* filename, Ast* ast) {
+i32 parser_parse(char* input, char* filename, Arena* arena, Ast* ast) {
   Lexer lexer;
   lexer_init(&lexer, input, filename);
 
   Parser parser;
-  parser_init(&parser, &lexer, ast);
+  parser_init(&parser, &lexer, arena, ast);
 
   next_token(parser.l);
   expressions(&parser);
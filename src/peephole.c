@@ -0,0 +1,462 @@
+// peephole.c
+// Byte code optimizations, run on newly generated code before it is encoded into the program:
+// jump threading, removal of jumps and arithmetic that do nothing, strength reduction, and superinstructions
+
+#include "common.h"
+#include "memory.h"
+#include "ast.h"
+#include "vm.h"
+#include "code.h"
+#include "peephole.h"
+
+#define MAX_ARGS 3
+#define NO_TARGET -1
+
+// Decoded instruction
+struct Ins {
+  i32 ins;
+  i32 args[MAX_ARGS];
+  i32 address;  // Address of the instruction before rewriting
+  i32 target;   // Address (before rewriting) that this instruction jumps to
+  i32 label;    // Jump target or function entry, sequences can not be fused across labels
+  i32 wide;     // Encoded with 32-bit operands
+};
+
+typedef struct Code {
+  struct Ins* ins;
+  i32 count;
+  i32 start;  // Address of the first instruction
+  i32 end;    // Address after the last instruction
+  i32* map;   // Maps old addresses (relative to start) to instruction indices, and later to new addresses
+} Code;
+
+static i32 code_decode(struct VM_state* vm, Code* code);
+static void code_index(Code* code);
+static void mark_labels(struct VM_state* vm, Code* code);
+static i32 arg_fits(i32 value, i32 is_jump);
+static i32 ins_size(const struct Ins* ins);
+static i32 code_layout(Code* code);
+static i32 jump_offset(Code* code, const struct Ins* ins);
+static void write_arg(u8** at, i32 value, i32 wide);
+static i32 code_encode(struct VM_state* vm, Code* code);
+static void code_free(Code* code);
+static struct Ins* fusable(Code* code, i32 index);
+static i32 fuse(Code* code, i32 index, struct Ins* result);
+static i32 constant_number(struct VM_state* vm, i32 address, i32* number);
+static i32 power_of_two(i32 number);
+static void thread_jumps(Code* code, struct Peephole_stats* stats);
+static i32 reduce(struct VM_state* vm, Code* code, i32 index, struct Ins* result, struct Peephole_stats* stats);
+
+// The generated code will be placed at the end of the program, so that is where its addresses start
+i32 code_decode(struct VM_state* vm, Code* code) {
+  i32 start = vm->program_size;
+  code->start = start;
+  code->end = start + vm->code_size;
+  code->count = 0;
+  i32 size = code->end - code->start;
+  code->ins = m_malloc(sizeof(struct Ins) * (size + 1));
+  code->map = m_malloc(sizeof(i32) * (size + 1));
+  if (!code->ins || !code->map) {
+    code_free(code);
+    return ERR;
+  }
+  for (i32 i = 0; i <= size; i++) {
+    code->map[i] = -1;
+  }
+
+  for (i32 address = start; address < code->end;) {
+    struct Ins* ins = &code->ins[code->count];
+    const i32* at = &vm->code[address - start];
+    ins->ins = at[0];
+    ins->address = address;
+    ins->target = NO_TARGET;
+    ins->label = 0;
+    ins->wide = 0;
+    i32 argc = ins_argc(ins->ins);
+    assert(argc <= MAX_ARGS);
+    for (i32 arg = 0; arg < argc; arg++) {
+      ins->args[arg] = at[1 + arg];
+    }
+    i32 jump = ins_jump_arg(ins->ins);
+    if (jump >= 0) {
+      ins->target = address + 1 + argc + ins->args[jump];
+    }
+    code->count++;
+    address += 1 + argc;
+  }
+  code_index(code);
+  mark_labels(vm, code);
+  return NO_ERR;
+}
+
+// Map old addresses to the index of the instruction at that address. Addresses of instructions that have
+// been removed map to the instruction that followed them, which is where jumps to them should go now.
+void code_index(Code* code) {
+  i32 size = code->end - code->start;
+  for (i32 i = 0; i <= size; i++) {
+    code->map[i] = -1;
+  }
+  for (i32 i = 0; i < code->count; i++) {
+    code->map[code->ins[i].address - code->start] = i;
+  }
+  code->map[size] = code->count;
+  for (i32 i = size - 1; i >= 0; i--) {
+    if (code->map[i] < 0) {
+      code->map[i] = code->map[i + 1];
+    }
+  }
+}
+
+// Mark jump targets and function entries, the map has to be indexed
+void mark_labels(struct VM_state* vm, Code* code) {
+  for (i32 i = 0; i < code->count; i++) {
+    code->ins[i].label = 0;
+  }
+  for (i32 i = 0; i < code->count; i++) {
+    i32 target = code->ins[i].target;
+    if (target != NO_TARGET && target < code->end) {
+      i32 index = code->map[target - code->start];
+      if (index < code->count) {
+        code->ins[index].label = 1;
+      }
+    }
+  }
+  for (i32 i = 0; i < vm->code_values_count; i++) {
+    struct Object* value = &vm->values[vm->code_values[i]];
+    if (IS_FUNCTION(*value) && FUNC_ADDRESS(*value) >= code->start && FUNC_ADDRESS(*value) < code->end) {
+      i32 index = code->map[FUNC_ADDRESS(*value) - code->start];
+      assert(index < code->count);
+      code->ins[index].label = 1;
+    }
+  }
+}
+
+// Can the operand be encoded in 16 bits?
+i32 arg_fits(i32 value, i32 is_jump) {
+  if (is_jump) {
+    return value >= INT16_MIN && value <= INT16_MAX;
+  }
+  return value >= 0 && value <= UINT16_MAX;
+}
+
+i32 ins_size(const struct Ins* ins) {
+  i32 argc = ins_argc(ins->ins);
+  if (ins->wide) {
+    return 2 + argc * WIDE_ARG_SIZE;
+  }
+  return 1 + argc * ARG_SIZE;
+}
+
+// Map the old address of every instruction to its encoded address, returns the address after the last instruction.
+// Removed instructions get the address of the instruction that followed them.
+i32 code_layout(Code* code) {
+  code_index(code);
+  i32 size = code->end - code->start;
+  i32 address = code->start;
+  i32 index = 0;
+  for (i32 i = 0; i <= size; i++) {
+    // The indices are increasing, so the address of every index is known when the map is walked
+    while (index < code->map[i]) {
+      address += ins_size(&code->ins[index++]);
+    }
+    code->map[i] = address;
+  }
+  return address;
+}
+
+// Jump offset of the instruction in the current layout, relative to the end of the instruction
+i32 jump_offset(Code* code, const struct Ins* ins) {
+  assert(ins->target >= code->start && ins->target <= code->end);
+  i32 address = code->map[ins->address - code->start];
+  i32 target = code->map[ins->target - code->start];
+  assert(target >= 0);
+  return target - (address + ins_size(ins));
+}
+
+void write_arg(u8** at, i32 value, i32 wide) {
+  i32 size = wide ? WIDE_ARG_SIZE : ARG_SIZE;
+  for (i32 i = 0; i < size; i++) {
+    *(*at)++ = (u8)((u32)value >> (8 * i));
+  }
+}
+
+// Encode the instructions at the end of the program, and resolve jumps and function addresses
+i32 code_encode(struct VM_state* vm, Code* code) {
+  // Instructions with operands that don't fit in 16 bits are widened. Jump offsets depend on the
+  // size of the instructions that are jumped over, so start with narrow jumps and widen the ones
+  // that don't reach their target until all of them do.
+  for (i32 i = 0; i < code->count; i++) {
+    struct Ins* ins = &code->ins[i];
+    i32 jump = ins_jump_arg(ins->ins);
+    for (i32 arg = 0; arg < ins_argc(ins->ins); arg++) {
+      if (arg != jump && !arg_fits(ins->args[arg], 0)) {
+        ins->wide = 1;
+      }
+    }
+    if (ins->ins == I_COMPILE) {
+      ins->wide = 1;  // Room for the wide jump that replaces the stub
+    }
+  }
+  i32 end = code_layout(code);
+  for (i32 widened = 1; widened;) {
+    widened = 0;
+    for (i32 i = 0; i < code->count; i++) {
+      struct Ins* ins = &code->ins[i];
+      if (!ins->wide && ins_jump_arg(ins->ins) >= 0 && !arg_fits(jump_offset(code, ins), 1)) {
+        ins->wide = 1;
+        widened = 1;
+      }
+    }
+    if (widened) {
+      end = code_layout(code);
+    }
+  }
+
+  list_reserve(vm->program, vm->program_capacity, end);
+  if (vm->program_capacity < end) {
+    return ERR;
+  }
+  u8* at = &vm->program[code->start];
+  for (i32 i = 0; i < code->count; i++) {
+    struct Ins* ins = &code->ins[i];
+    i32 jump = ins_jump_arg(ins->ins);
+    if (jump >= 0) {
+      ins->args[jump] = jump_offset(code, ins);
+    }
+    if (ins->wide) {
+      *at++ = I_WIDE;
+    }
+    *at++ = (u8)ins->ins;
+    for (i32 arg = 0; arg < ins_argc(ins->ins); arg++) {
+      write_arg(&at, ins->args[arg], ins->wide);
+    }
+  }
+  assert(at == &vm->program[end]);
+  vm->program_size = end;
+
+  for (i32 i = 0; i < vm->code_values_count; i++) {
+    struct Object* value = &vm->values[vm->code_values[i]];
+    if (IS_FUNCTION(*value) && FUNC_ADDRESS(*value) >= code->start && FUNC_ADDRESS(*value) < code->end) {
+      *value = MAKE_FUNCTION(code->map[FUNC_ADDRESS(*value) - code->start], FUNC_ARGC(*value));
+    }
+  }
+  return NO_ERR;
+}
+
+void code_free(Code* code) {
+  i32 size = code->end - code->start;
+  if (code->ins) {
+    m_free(code->ins, sizeof(struct Ins) * (size + 1));
+    code->ins = NULL;
+  }
+  if (code->map) {
+    m_free(code->map, sizeof(i32) * (size + 1));
+    code->map = NULL;
+  }
+  code->count = 0;
+}
+
+// Get the instruction at index, if it can be part of a fused sequence that starts before it
+struct Ins* fusable(Code* code, i32 index) {
+  if (index < code->count && !code->ins[index].label) {
+    return &code->ins[index];
+  }
+  return NULL;
+}
+
+#define IS_INT(INS) ((INS) >= I_ADD_INT && (INS) <= I_EQ_INT)
+#define GENERIC(INS) (IS_INT(INS) ? (INS) - (I_ADD_INT - I_ADD) : (INS))
+#define IS_ARITH(INS) (GENERIC(INS) == I_ADD || GENERIC(INS) == I_SUB)
+#define IS_COMPARE(INS) (GENERIC(INS) == I_LT || GENERIC(INS) == I_GT || GENERIC(INS) == I_EQ)
+// The integer superinstruction if OP is an integer instruction
+#define SPECIALIZE(SUPER, OP) (IS_INT(OP) ? (SUPER) + (I_PUSH_ARG_PUSH_ADD_INT - I_PUSH_ARG_PUSH_ADD) : (SUPER))
+
+// Try to fuse the sequence starting at index, returns the number of instructions that were fused (0 if none)
+i32 fuse(Code* code, i32 index, struct Ins* result) {
+  struct Ins* a = &code->ins[index];
+  struct Ins* b = fusable(code, index + 1);
+  struct Ins* c = b ? fusable(code, index + 2) : NULL;
+  *result = *a;
+
+  if (a->ins == I_PUSH_ARG && b && b->ins == I_PUSH && c && IS_ARITH(c->ins)) {
+    result->ins = SPECIALIZE(GENERIC(c->ins) == I_ADD ? I_PUSH_ARG_PUSH_ADD : I_PUSH_ARG_PUSH_SUB, c->ins);
+    result->args[1] = b->args[0];
+    return 3;
+  }
+  if (a->ins == I_PUSH && b && IS_COMPARE(b->ins) && c && c->ins == I_COND_JUMP) {
+    result->ins = SPECIALIZE(I_PUSH_LT_COND_JUMP + (GENERIC(b->ins) - I_LT), b->ins);
+    result->args[1] = c->args[0];
+    result->target = c->target;
+    return 3;
+  }
+  if (a->ins == I_PUSH && b && IS_ARITH(b->ins)) {
+    result->ins = SPECIALIZE(GENERIC(b->ins) == I_ADD ? I_PUSH_ADD : I_PUSH_SUB, b->ins);
+    return 2;
+  }
+  if (a->ins == I_PUSH_ARG && b && (b->ins == I_LOCAL_CALL || b->ins == I_LOCAL_TAIL_CALL)) {
+    result->ins = b->ins == I_LOCAL_CALL ? I_PUSH_ARG_LOCAL_CALL : I_PUSH_ARG_LOCAL_TAIL_CALL;
+    result->args[1] = b->args[0];
+    result->args[2] = b->args[1];
+    return 2;
+  }
+  if (a->ins == I_PUSH && b && b->ins == I_ASSIGN) {
+    result->ins = I_PUSH_ASSIGN;
+    result->args[1] = b->args[0];
+    return 2;
+  }
+  if (IS_COMPARE(a->ins) && b && b->ins == I_COND_JUMP) {
+    result->ins = SPECIALIZE(I_LT_COND_JUMP + (GENERIC(a->ins) - I_LT), a->ins);
+    result->args[0] = b->args[0];
+    result->target = b->target;
+    return 2;
+  }
+  return 0;
+}
+
+// Is the value a number literal? Other values (of lets) are only known at run time.
+i32 constant_number(struct VM_state* vm, i32 address, i32* number) {
+  if (address >= 0 && address < vm->values_count && IS_NUMBER(vm->values[address]) && constant_pool_contains(vm, address)) {
+    *number = AS_NUMBER(vm->values[address]);
+    return NO_ERR;
+  }
+  return ERR;
+}
+
+// The exponent n of a number that is 2^n, -1 if it is not a power of two
+i32 power_of_two(i32 number) {
+  if (number <= 0 || (number & (number - 1)) != 0) {
+    return -1;
+  }
+  i32 n = 0;
+  while (number > 1) {
+    number >>= 1;
+    n++;
+  }
+  return n;
+}
+
+// Jumps to unconditional jumps go directly to where the chain ends, and jumps to returns are returns.
+// NOTE(lucas): Backwards, so the forward jumps later in a chain are already threaded and it is only followed one step
+void thread_jumps(Code* code, struct Peephole_stats* stats) {
+  for (i32 i = code->count - 1; i >= 0; i--) {
+    struct Ins* ins = &code->ins[i];
+    if (ins->target == NO_TARGET) {
+      continue;
+    }
+    i32 target = ins->target;
+    i32 steps = 0;  // Chains can loop (jumps to themselves)
+    while (target < code->end && steps++ < code->count) {
+      const struct Ins* next = &code->ins[code->map[target - code->start]];
+      if (next->ins != I_JUMP || next->target == target) {
+        break;
+      }
+      target = next->target;
+    }
+    if (target != ins->target) {
+      ins->target = target;
+      stats->jumps_threaded++;
+    }
+    if (ins->ins == I_JUMP && target < code->end && code->ins[code->map[target - code->start]].ins == I_RETURN) {
+      ins->ins = I_RETURN;
+      ins->target = NO_TARGET;
+      stats->jumps_threaded++;
+    }
+  }
+}
+
+// Try to remove or strength reduce the instruction at index, returns the number of instructions that were replaced
+// by the result (0 if none, the result is empty if it is I_NOP)
+i32 reduce(struct VM_state* vm, Code* code, i32 index, struct Ins* result, struct Peephole_stats* stats) {
+  struct Ins* a = &code->ins[index];
+  struct Ins* b = fusable(code, index + 1);
+  *result = *a;
+
+  // Jumps to the next instruction
+  if (a->ins == I_JUMP && a->target == (index + 1 < code->count ? code->ins[index + 1].address : code->end)) {
+    result->ins = I_NOP;
+    stats->jumps_removed++;
+    return 1;
+  }
+  // Arithmetic with a number literal, the integer instructions don't need the type checks of the generic ones
+  i32 number = 0;
+  if (a->ins == I_PUSH && b && IS_INT(b->ins) && constant_number(vm, a->args[0], &number) == NO_ERR) {
+    i32 n = power_of_two(number);
+    switch (b->ins) {
+      case I_ADD_INT:
+      case I_SUB_INT:
+        if (number != 0) {
+          return 0;
+        }
+        result->ins = I_NOP;
+        break;
+      case I_MUL_INT:
+      case I_DIV_INT:
+        if (n < 0) {
+          return 0;
+        }
+        if (n == 0) {
+          result->ins = I_NOP;
+        }
+        else {
+          result->ins = b->ins == I_MUL_INT ? I_SHL_INT : I_SHR_INT;
+          result->args[0] = n;
+        }
+        break;
+      default:
+        return 0;
+    }
+    stats->reduced++;
+    return 2;
+  }
+  return 0;
+}
+
+i32 peephole_assemble(struct VM_state* vm, struct Peephole_stats* stats) {
+  Code code;
+  *stats = (struct Peephole_stats) {0};
+  if (vm->code_size == 0) {
+    return NO_ERR;
+  }
+  if (code_decode(vm, &code) != NO_ERR) {
+    return ERR;
+  }
+  stats->ins_before = code.count;
+  thread_jumps(&code, stats);
+
+  i32 count = 0;
+  for (i32 i = 0; i < code.count;) {
+    struct Ins result;
+    i32 reduced = reduce(vm, &code, i, &result, stats);
+    if (reduced > 0) {
+      if (result.ins != I_NOP) {
+        code.ins[count++] = result;
+      }
+      i += reduced;
+    }
+    else {
+      code.ins[count++] = code.ins[i++];
+    }
+  }
+  code.count = count;
+  // Removed instructions can make more sequences fusable
+  code_index(&code);
+  mark_labels(vm, &code);
+
+  count = 0;
+  for (i32 i = 0; i < code.count;) {
+    struct Ins result;
+    i32 fused = fuse(&code, i, &result);
+    if (fused > 0) {
+      code.ins[count++] = result;
+      i += fused;
+    }
+    else {
+      code.ins[count++] = code.ins[i++];
+    }
+  }
+  code.count = count;
+  stats->ins_after = code.count;
+  i32 status = code_encode(vm, &code);
+  code_free(&code);
+  return status;
+}
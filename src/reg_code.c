@@ -0,0 +1,360 @@
+// reg_code.c
+// Register code generator (intermediate representation -> register based code)
+// NOTE(lucas): Funk values are passed on the stack (arguments, return values, and whatever an expression
+// leaves behind), so this keeps the stack where the number of values is not known at compile time. Temporaries of the ir
+// (literals, arguments, values, and operations on them) are evaluated in registers instead, where every
+// operation is one instruction that names its operands.
+
+#include "common.h"
+#include "memory.h"
+#include "ast.h"
+#include "vm.h"
+#include "ir.h"
+#include "reg_code.h"
+
+#define UNRESOLVED_JUMP 0
+
+#define NOT_SIMPLE -1
+
+#define NO_FUNCTION -1  // Top level code
+
+// A temporary, evaluated into a slot
+struct Operand {
+  i32 slot;
+  i32 type;  // Compile-time type of the value
+};
+
+// The function that code is generated for
+struct Reg_context {
+  i32 value;  // Value address of the function (NO_FUNCTION for top level code)
+  i32 start;  // Where the code of the function starts
+  i32 argc;
+};
+
+// Jump whose offset is resolved when the label has been placed
+struct Jump_fixup {
+  i32 index;  // Index of the jump offset in the code
+  i32 label;
+};
+
+static i32 ins_add(struct VM_state* vm, i32 word);
+static i32 op_to_ins(i32 op);
+static i32 temp_regs(Ir* ir, i32 temp);
+static struct Operand temp_emit(struct VM_state* vm, Ir* ir, i32 temp, i32 dst, i32 reg);
+static void temp_push(struct VM_state* vm, Ir* ir, i32 temp);
+static i32 temp_to(struct VM_state* vm, Ir* ir, i32 temp, i32 dst, i32 reg);
+static i32 self_tail_call(struct VM_state* vm, Ir* ir, i32 index, struct Reg_context* ctx);
+static void generate(struct VM_state* vm, Ir* ir);
+
+i32 ins_add(struct VM_state* vm, i32 word) {
+  list_push(vm->reg.code, vm->reg.code_size, vm->reg.code_capacity, word);
+  return NO_ERR;
+}
+
+#define OP_CASE(OP) case T_##OP: return R_##OP
+
+i32 op_to_ins(i32 op) {
+  switch (op) {
+    OP_CASE(ADD);
+    OP_CASE(SUB);
+    OP_CASE(MUL);
+    OP_CASE(DIV);
+    OP_CASE(LT);
+    OP_CASE(GT);
+    OP_CASE(EQ);
+    default:
+      break;
+  }
+  return R_UNKNOWN;
+}
+
+// Number of registers that are needed to evaluate the temporary
+i32 temp_regs(Ir* ir, i32 temp) {
+  const struct Ir_ins* ins = &ir->ins[temp];
+  if (ins->op != IR_BINARY) {
+    return 0;
+  }
+  i32 left = temp_regs(ir, ins->args[1]);
+  i32 right = temp_regs(ir, ins->args[2]);
+  // The left operand is evaluated into the first register, the right operand into the second
+  return 2 + (left > right ? left : right);
+}
+
+// Generate code for a temporary. Operations store their result in dst, using the registers from reg
+// and up for their operands. Literals, arguments and values are not moved, their own slot is the result.
+struct Operand temp_emit(struct VM_state* vm, Ir* ir, i32 temp, i32 dst, i32 reg) {
+  const struct Ir_ins* ins = &ir->ins[temp];
+  struct Operand result = { .slot = dst, .type = ins->type, };
+  switch (ins->op) {
+    case IR_CONST:
+    case IR_LOAD:
+      result.slot = MAKE_SLOT(SLOT_VALUE, ins->args[0]);
+      break;
+    case IR_ARG:
+      result.slot = MAKE_SLOT(SLOT_ARG, ins->args[0]);
+      break;
+    case IR_BINARY: {
+      struct Operand left = temp_emit(vm, ir, ins->args[1], MAKE_SLOT(SLOT_REG, reg), reg + 2);
+      struct Operand right = temp_emit(vm, ir, ins->args[2], MAKE_SLOT(SLOT_REG, reg + 1), reg + 2);
+      i32 op = op_to_ins(ins->args[0]);
+      if (ins->flags & IR_INT) {
+        op += R_ADD_INT - R_ADD;
+      }
+      ins_add(vm, op);
+      ins_add(vm, dst);
+      ins_add(vm, left.slot);
+      ins_add(vm, right.slot);
+      break;
+    }
+    default:
+      assert(0);
+      break;
+  }
+  return result;
+}
+
+// Push the value of a temporary that needs too many registers
+void temp_push(struct VM_state* vm, Ir* ir, i32 temp) {
+  const struct Ir_ins* ins = &ir->ins[temp];
+  if (ins->op == IR_BINARY) {
+    temp_push(vm, ir, ins->args[1]);
+    temp_push(vm, ir, ins->args[2]);
+    ins_add(vm, op_to_ins(ins->args[0]) - R_ADD + R_STACK_ADD);
+    return;
+  }
+  struct Operand result = temp_emit(vm, ir, temp, MAKE_SLOT(SLOT_PUSH, 0), 0);
+  ins_add(vm, R_MOVE);
+  ins_add(vm, MAKE_SLOT(SLOT_PUSH, 0));
+  ins_add(vm, result.slot);
+}
+
+// Generate code for a temporary that stores its value in dst. Returns NOT_SIMPLE (without generating
+// any code) if it needs too many registers.
+i32 temp_to(struct VM_state* vm, Ir* ir, i32 temp, i32 dst, i32 reg) {
+  if (reg + temp_regs(ir, temp) > MAX_REGS) {
+    return NOT_SIMPLE;
+  }
+  struct Operand result = temp_emit(vm, ir, temp, dst, reg);
+  if (result.slot != dst) {
+    ins_add(vm, R_MOVE);
+    ins_add(vm, dst);
+    ins_add(vm, result.slot);
+  }
+  return NO_ERR;
+}
+
+// Call the current function in tail position, with the pushes that start at index as arguments. They are
+// evaluated into registers, and then replace the arguments of the current call. Returns the index of the
+// call, or NOT_SIMPLE (without generating any code) if there is no such call.
+i32 self_tail_call(struct VM_state* vm, Ir* ir, i32 index, struct Reg_context* ctx) {
+  if (ctx->value == NO_FUNCTION || ctx->argc > MAX_REGS / 2) {
+    return NOT_SIMPLE;
+  }
+  i32 argc = 0;
+  i32 call = index;
+  for (; call < ir->count; call++) {
+    const struct Ir_ins* ins = &ir->ins[call];
+    if (ins->op == IR_PUSH) {
+      if (ctx->argc + temp_regs(ir, ins->args[0]) > MAX_REGS) {
+        return NOT_SIMPLE;
+      }
+      argc++;
+    }
+    else if (ins->op != IR_NOP && !ir_is_temp(ins->op)) {
+      break;
+    }
+  }
+  if (call >= ir->count || ir->ins[call].op != IR_CALL || !(ir->ins[call].flags & IR_TAIL) ||
+    ir->ins[call].args[0] != ctx->value || argc != ctx->argc) {
+    return NOT_SIMPLE;
+  }
+  argc = 0;
+  for (i32 i = index; i < call; i++) {
+    if (ir->ins[i].op == IR_PUSH) {
+      temp_to(vm, ir, ir->ins[i].args[0], MAKE_SLOT(SLOT_REG, argc), ctx->argc);
+      argc++;
+    }
+  }
+  ins_add(vm, R_SELF_TAIL_CALL);
+  ins_add(vm, 0);
+  ins_add(vm, argc);
+  ins_add(vm, ctx->start - (vm->reg.code_size + 1));
+  return call;
+}
+
+void generate(struct VM_state* vm, Ir* ir) {
+  i32* labels = NULL;  // Code index of every label
+  struct Jump_fixup* fixups = NULL;
+  i32 fixups_count = 0;
+  i32 fixups_capacity = 0;
+  // Functions that are being generated, the innermost last
+  struct Reg_context* contexts = m_malloc(sizeof(struct Reg_context) * (ir->count + 1));
+  i32 contexts_count = 0;
+  if (!contexts) {
+    return;
+  }
+  if (ir->labels_count > 0) {
+    labels = m_malloc(sizeof(i32) * ir->labels_count);
+    if (!labels) {
+      m_free(contexts, sizeof(struct Reg_context) * (ir->count + 1));
+      return;
+    }
+    for (i32 i = 0; i < ir->labels_count; i++) {
+      labels[i] = UNRESOLVED_LABEL;
+    }
+  }
+  contexts[contexts_count++] = (struct Reg_context) { .value = NO_FUNCTION, .start = vm->reg.code_size, .argc = 0, };
+  i32 prev = IR_NOP;  // The last instruction that is not a temporary
+  for (i32 i = 0; i < ir->count && !vm->allocator.failed; i++) {
+    const struct Ir_ins* ins = &ir->ins[i];
+    struct Reg_context* ctx = &contexts[contexts_count - 1];
+    i32 label = -1;
+    switch (ins->op) {
+      case IR_PUSH: {
+        // A run of pushes might be the arguments of a self tail call
+        i32 call = prev != IR_PUSH ? self_tail_call(vm, ir, i, ctx) : NOT_SIMPLE;
+        if (call != NOT_SIMPLE) {
+          i = call;
+          ins = &ir->ins[i];
+          break;
+        }
+        if (temp_to(vm, ir, ins->args[0], MAKE_SLOT(SLOT_PUSH, 0), 0) != NO_ERR) {
+          temp_push(vm, ir, ins->args[0]);
+        }
+        break;
+      }
+      case IR_STACK_BINARY:
+        ins_add(vm, op_to_ins(ins->args[0]) - R_ADD + R_STACK_ADD);
+        break;
+      case IR_STORE:
+        if (temp_to(vm, ir, ins->args[1], MAKE_SLOT(SLOT_VALUE, ins->args[0]), 0) == NO_ERR) {
+          break;
+        }
+        temp_push(vm, ir, ins->args[1]);
+        ins_add(vm, R_ASSIGN);
+        ins_add(vm, ins->args[0]);
+        break;
+      case IR_ASSIGN:
+        ins_add(vm, R_ASSIGN);
+        ins_add(vm, ins->args[0]);
+        break;
+      case IR_CALL: {
+        i32 tail = ins->flags & IR_TAIL;
+        if (tail && ins->args[0] == ctx->value && ctx->argc == 0) {
+          // Values that are left on the stack are dropped by the tail call anyway
+          self_tail_call(vm, ir, i, ctx);
+          break;
+        }
+        ins_add(vm, tail ? R_TAIL_CALL : R_CALL);
+        ins_add(vm, ins->args[0]);
+        break;
+      }
+      case IR_LOCAL_CALL: {
+        struct Operand func = temp_emit(vm, ir, ins->args[0], MAKE_SLOT(SLOT_REG, 0), 0);
+        ins_add(vm, (ins->flags & IR_TAIL) ? R_LOCAL_TAIL_CALL : R_LOCAL_CALL);
+        ins_add(vm, func.slot);
+        ins_add(vm, ins->args[1]);
+        break;
+      }
+      case IR_JUMP:
+        ins_add(vm, R_JUMP);
+        label = ins->args[0];
+        break;
+      case IR_BRANCH: {
+        // Comparisons jump on the result right away
+        const struct Ir_ins* cond = &ir->ins[ins->args[0]];
+        i32 op = cond->op == IR_BINARY ? cond->args[0] : T_UNKNOWN;
+        if ((op == T_LT || op == T_GT || op == T_EQ) && temp_regs(ir, ins->args[0]) <= MAX_REGS) {
+          struct Operand left = temp_emit(vm, ir, cond->args[1], MAKE_SLOT(SLOT_REG, 0), 2);
+          struct Operand right = temp_emit(vm, ir, cond->args[2], MAKE_SLOT(SLOT_REG, 1), 2);
+          i32 jump = op_to_ins(op) - R_LT + R_LT_JUMP;
+          if (cond->flags & IR_INT) {
+            jump += R_LT_JUMP_INT - R_LT_JUMP;
+          }
+          ins_add(vm, jump);
+          ins_add(vm, left.slot);
+          ins_add(vm, right.slot);
+        }
+        else if (temp_regs(ir, ins->args[0]) + 1 <= MAX_REGS) {
+          struct Operand result = temp_emit(vm, ir, ins->args[0], MAKE_SLOT(SLOT_REG, 0), 1);
+          ins_add(vm, R_JUMP_FALSE);
+          ins_add(vm, result.slot);
+        }
+        else {
+          temp_push(vm, ir, ins->args[0]);
+          ins_add(vm, R_COND_JUMP);
+        }
+        label = ins->args[1];
+        break;
+      }
+      case IR_COND_BRANCH:
+        ins_add(vm, R_COND_JUMP);
+        label = ins->args[0];
+        break;
+      case IR_LABEL:
+        labels[ins->args[0]] = vm->reg.code_size;
+        break;
+      case IR_FUNC: {
+        contexts[contexts_count++] = (struct Reg_context) { .value = ins->args[0], .start = vm->reg.code_size, .argc = ins->args[1], };
+        vm->values[ins->args[0]] = MAKE_FUNCTION(vm->reg.code_size, ins->args[1]);
+        if (ins->args[2]) {
+          ins_add(vm, R_CHECK_INT_ARGS);
+          ins_add(vm, ins->args[2]);
+        }
+        break;
+      }
+      case IR_RETURN:
+        ins_add(vm, R_RETURN);
+        break;
+      case IR_END:
+        contexts_count--;
+        break;
+      default:
+        break;  // Temporaries are generated where they are used
+    }
+    if (ins->op != IR_NOP && !ir_is_temp(ins->op)) {
+      prev = ins->op;
+    }
+    if (label >= 0) {
+      struct Jump_fixup fixup = { .index = vm->reg.code_size, .label = label, };
+      list_push(fixups, fixups_count, fixups_capacity, fixup);
+      ins_add(vm, UNRESOLVED_JUMP);
+    }
+  }
+  // Jump offsets are relative to the end of the jump instruction
+  for (i32 i = 0; i < fixups_count && !vm->allocator.failed; i++) {
+    i32 target = labels[fixups[i].label];
+    if (target != UNRESOLVED_LABEL) {
+      vm->reg.code[fixups[i].index] = target - (fixups[i].index + 1);
+    }
+  }
+  list_free(fixups, fixups_count, fixups_capacity);
+  m_free(contexts, sizeof(struct Reg_context) * (ir->count + 1));
+  if (labels) {
+    m_free(labels, sizeof(i32) * ir->labels_count);
+  }
+}
+
+i32 reg_code_gen(struct VM_state* vm, Ast* ast) {
+  if (ast_is_empty(*ast))
+    return NO_ERR;
+
+  i32 start = vm->reg.code_size;
+  Ir ir;
+  ir_init(&ir);
+  i32 result = ir_build(vm, ast, &ir);
+  if (result == NO_ERR) {
+    generate(vm, &ir);
+    ins_add(vm, R_RETURN);
+    if (vm->allocator.failed) {
+      result = ERR;  // Reported by the vm
+    }
+  }
+  if (result != NO_ERR) { // Error occured, perform rollback
+    i32 code_added = vm->reg.code_size - start;
+    list_shrink(vm->reg.code, vm->reg.code_size, code_added);
+    ir_rollback(vm, &ir);
+  }
+  ir_free(&ir);
+  return result;
+}
@@ -0,0 +1,500 @@
+// reg_vm.c
+// Executes register based code (see reg_code.h)
+
+#include "common.h"
+#include "vm.h"
+#include "reg_vm.h"
+
+#define runtime_error(fmt, ...) \
+  fprintf(stderr, "runtime-error: " fmt, ##__VA_ARGS__)
+
+// NOTE(lucas): The instruction handler macros use the instruction pointer (ip), the stack base and the slots
+// that are local to reg_execute()
+
+// The object that an operand names
+#define SLOT(OPERAND) (&slots[SLOT_KIND(OPERAND)][SLOT_INDEX(OPERAND)])
+
+// The arguments of the current function move when the stack grows, or when another function is entered
+#define SLOTS_UPDATE(VM) (slots[SLOT_ARG] = &(VM)->stack[stack_base])
+
+#define IS_TRUE(OBJ) (IS_NUMBER(OBJ) && AS_NUMBER(OBJ) != 0)
+
+// The value is copied first, it might be on the stack that is about to grow
+#define PUSH(VM, VALUE) { \
+  struct Object pushed = VALUE; \
+  if (VM->stack_top >= VM->stack_size) { \
+    if (stack_grow(VM) != NO_ERR) { \
+      goto done; \
+    } \
+    SLOTS_UPDATE(VM); \
+  } \
+  VM->stack[VM->stack_top++] = pushed; \
+} \
+
+#define STORE(VM, DST, VALUE) { \
+  if (SLOT_KIND(DST) == SLOT_PUSH) { \
+    PUSH(VM, VALUE); \
+  } \
+  else { \
+    *SLOT(DST) = VALUE; \
+  } \
+} \
+
+// dst, a, b
+#define BINARY(VM, OP) { \
+  const struct Object* left = SLOT(ip[1]); \
+  const struct Object* right = SLOT(ip[2]); \
+  if (!(IS_NUMBER(*left) && IS_NUMBER(*right))) { \
+    runtime_error("Invalid types in arithmetic operation\n"); \
+    VM->status = ERR; \
+    goto done; \
+  } \
+  STORE(VM, ip[0], MAKE_NUMBER(AS_NUMBER(*left) OP AS_NUMBER(*right))); \
+  ip += 3; \
+} \
+
+// The code generator only emits the integer instructions when both operands are known to be numbers, so there are no checks
+#define BINARY_INT(VM, OP) { \
+  STORE(VM, ip[0], MAKE_NUMBER(AS_NUMBER(*SLOT(ip[1])) OP AS_NUMBER(*SLOT(ip[2])))); \
+  ip += 3; \
+} \
+
+// a, b, offset: jump if the comparison is false
+#define COMPARE_JUMP(VM, OP) { \
+  const struct Object* left = SLOT(ip[0]); \
+  const struct Object* right = SLOT(ip[1]); \
+  if (!(IS_NUMBER(*left) && IS_NUMBER(*right))) { \
+    runtime_error("Invalid types in arithmetic operation\n"); \
+    VM->status = ERR; \
+    goto done; \
+  } \
+  ip += (AS_NUMBER(*left) OP AS_NUMBER(*right)) ? 3 : 3 + ip[2]; \
+} \
+
+#define COMPARE_JUMP_INT(VM, OP) { \
+  ip += (AS_NUMBER(*SLOT(ip[0])) OP AS_NUMBER(*SLOT(ip[1]))) ? 3 : 3 + ip[2]; \
+} \
+
+// Operation on the two values on top of the stack, same as ARITH in vm.c
+#define STACK_BINARY(VM, OP) { \
+  if (VM->stack_top < 2) { \
+    runtime_error("Not enough arguments for arithmetic operation\n"); \
+    VM->status = ERR; \
+    goto done; \
+  } \
+  struct Object* left = &VM->stack[VM->stack_top - 2]; \
+  const struct Object* right = &VM->stack[VM->stack_top - 1]; \
+  if (!(IS_NUMBER(*left) && IS_NUMBER(*right))) { \
+    runtime_error("Invalid types in arithmetic operation\n"); \
+    VM->status = ERR; \
+    goto done; \
+  } \
+  *left = MAKE_NUMBER(AS_NUMBER(*left) OP AS_NUMBER(*right)); \
+  VM->stack_top--; \
+} \
+
+// Call the function value, C functions are called right away and execution continues after the call.
+// argc is the number of arguments given at the call site (-1 if not known at compile time).
+#define CALL_RESOLVE(VM, VALUE, ARGC) \
+  if (IS_CFUNCTION(VALUE)) { \
+    if (call_cfunction(VM, &VM->cfunctions[AS_HANDLE(VALUE)]) != NO_ERR) { \
+      goto done; \
+    } \
+    SLOTS_UPDATE(VM); \
+    reg_next(); \
+  } \
+  if (!IS_FUNCTION(VALUE)) { \
+    runtime_error("Attempted to call a value which is not a function\n"); \
+    VM->status = ERR; \
+    goto done; \
+  } \
+  if (ARGC >= 0 && FUNC_ARGC(VALUE) != ARGC) { \
+    runtime_error("Invalid number of arguments in local function call (should be %i)\n", FUNC_ARGC(VALUE)); \
+    VM->status = ERR; \
+    goto done; \
+  } \
+
+#define CALL(VM, VALUE, ARGC) { \
+  if (reg_frame_push(VM, ARGC, ip) != NO_ERR) { \
+    goto done; \
+  } \
+  stack_base = VM->stack_base; \
+  SLOTS_UPDATE(VM); \
+  ip = &VM->reg.code[FUNC_ADDRESS(VALUE)]; \
+} \
+
+// Replace the arguments of the current frame with the argc values on top of the stack
+#define TAIL_CALL(VM, VALUE, ARGC) { \
+  struct Object* args = &VM->stack[VM->stack_top - ARGC]; \
+  for (i32 i = 0; i < ARGC; i++) { \
+    VM->stack[stack_base + i] = args[i]; \
+  } \
+  VM->stack_top = stack_base + ARGC; \
+  VM->reg.frames[VM->reg.frame_count - 1].argc = ARGC; \
+  ip = &VM->reg.code[FUNC_ADDRESS(VALUE)]; \
+} \
+
+#if defined(USE_COMPUTED_GOTO) && defined(__GNUC__)
+  #define reg_dispatch() ins = *(ip++); goto *dispatch_table[ins];
+  #define reg_case(INS) L_##INS
+  #define reg_default L_default
+  #define reg_next() ins = *(ip++); goto *dispatch_table[ins]
+#else
+  #undef USE_COMPUTED_GOTO
+  #define reg_dispatch() ins = *(ip++); switch (ins)
+  #define reg_case(INS) case INS
+  #define reg_default default
+  #define reg_next() break
+#endif
+
+static i32 reg_frames_grow(struct VM_state* vm);
+static i32 reg_frame_push(struct VM_state* vm, i32 argc, i32* return_ip);
+
+void reg_init(Reg_state* reg) {
+  reg->code = NULL;
+  reg->code_size = 0;
+  reg->code_capacity = 0;
+  reg->start = 0;
+  reg->frames = NULL;
+  reg->frame_count = 0;
+  reg->frames_size = 0;
+}
+
+// Grow the call frame stack, up to the frame limit of the vm
+i32 reg_frames_grow(struct VM_state* vm) {
+  Reg_state* reg = &vm->reg;
+  if (reg->frame_count >= vm->max_frames) {
+    runtime_error("Call stack overflow, reached frame limit of %i!\n", vm->max_frames);
+    return vm->status = ERR;
+  }
+  i32 new_size = reg->frames_size ? reg->frames_size * 2 : FRAMES_INIT_SIZE;
+  if (new_size > vm->max_frames) {
+    new_size = vm->max_frames;
+  }
+  struct Reg_frame* frames = NULL;
+  if (reg->frames) {
+    frames = m_realloc(reg->frames, reg->frames_size * sizeof(struct Reg_frame), new_size * sizeof(struct Reg_frame));
+  }
+  else {
+    frames = m_malloc(new_size * sizeof(struct Reg_frame));
+  }
+  if (!frames) {
+    runtime_error("Failed to allocate call frames\n");
+    return vm->status = ERR;
+  }
+  reg->frames = frames;
+  reg->frames_size = new_size;
+  return NO_ERR;
+}
+
+// Push a new call frame for a function taking argc arguments from the top of the stack
+i32 reg_frame_push(struct VM_state* vm, i32 argc, i32* return_ip) {
+  Reg_state* reg = &vm->reg;
+  if (reg->frame_count >= reg->frames_size && reg_frames_grow(vm) != NO_ERR) {
+    return vm->status;
+  }
+  struct Reg_frame* frame = &reg->frames[reg->frame_count++];
+  frame->return_ip = return_ip;
+  frame->stack_base = vm->stack_base;
+  frame->argc = argc;
+  vm->stack_base = vm->stack_top - argc;
+  return NO_ERR;
+}
+
+i32 reg_execute(struct VM_state* vm) {
+  Reg_state* reg = &vm->reg;
+  i32 stack_base = vm->stack_base;
+  i32 ins = R_UNKNOWN;
+  i32* ip = &reg->code[reg->start];
+  struct Object* slots[SLOT_PUSH + 1] = {
+    [SLOT_REG] = reg->regs,
+    [SLOT_ARG] = &vm->stack[stack_base],
+    [SLOT_VALUE] = vm->values,
+    [SLOT_PUSH] = NULL,
+  };
+#if defined(USE_COMPUTED_GOTO)
+  static void* dispatch_table[MAX_REG_INS] = {
+    [R_UNKNOWN] = &&L_default,
+
+    [R_MOVE] = &&L_R_MOVE,
+    [R_ASSIGN] = &&L_R_ASSIGN,
+    [R_JUMP] = &&L_R_JUMP,
+    [R_JUMP_FALSE] = &&L_R_JUMP_FALSE,
+    [R_COND_JUMP] = &&L_R_COND_JUMP,
+    [R_CALL] = &&L_R_CALL,
+    [R_LOCAL_CALL] = &&L_R_LOCAL_CALL,
+    [R_TAIL_CALL] = &&L_R_TAIL_CALL,
+    [R_LOCAL_TAIL_CALL] = &&L_R_LOCAL_TAIL_CALL,
+    [R_SELF_TAIL_CALL] = &&L_R_SELF_TAIL_CALL,
+    [R_CHECK_INT_ARGS] = &&L_R_CHECK_INT_ARGS,
+    [R_RETURN] = &&L_R_RETURN,
+
+    [R_ADD] = &&L_R_ADD,
+    [R_SUB] = &&L_R_SUB,
+    [R_MUL] = &&L_R_MUL,
+    [R_DIV] = &&L_R_DIV,
+    [R_LT] = &&L_R_LT,
+    [R_GT] = &&L_R_GT,
+    [R_EQ] = &&L_R_EQ,
+
+    [R_ADD_INT] = &&L_R_ADD_INT,
+    [R_SUB_INT] = &&L_R_SUB_INT,
+    [R_MUL_INT] = &&L_R_MUL_INT,
+    [R_DIV_INT] = &&L_R_DIV_INT,
+    [R_LT_INT] = &&L_R_LT_INT,
+    [R_GT_INT] = &&L_R_GT_INT,
+    [R_EQ_INT] = &&L_R_EQ_INT,
+
+    [R_LT_JUMP] = &&L_R_LT_JUMP,
+    [R_GT_JUMP] = &&L_R_GT_JUMP,
+    [R_EQ_JUMP] = &&L_R_EQ_JUMP,
+    [R_LT_JUMP_INT] = &&L_R_LT_JUMP_INT,
+    [R_GT_JUMP_INT] = &&L_R_GT_JUMP_INT,
+    [R_EQ_JUMP_INT] = &&L_R_EQ_JUMP_INT,
+
+    [R_STACK_ADD] = &&L_R_STACK_ADD,
+    [R_STACK_SUB] = &&L_R_STACK_SUB,
+    [R_STACK_MUL] = &&L_R_STACK_MUL,
+    [R_STACK_DIV] = &&L_R_STACK_DIV,
+    [R_STACK_LT] = &&L_R_STACK_LT,
+    [R_STACK_GT] = &&L_R_STACK_GT,
+    [R_STACK_EQ] = &&L_R_STACK_EQ,
+  };
+#endif
+
+  for (;;) {
+    reg_dispatch() {
+      // move <dst>, <src>
+      reg_case(R_MOVE): {
+        STORE(vm, ip[0], *SLOT(ip[1]));
+        ip += 2;
+        reg_next();
+      }
+      // assign <address>: pop the value on top of the stack into a value
+      reg_case(R_ASSIGN): {
+        struct Object* value = &vm->values[*(ip++)];
+        if (vm->stack_top > 0) {
+          *value = vm->stack[--vm->stack_top];
+        }
+        else {
+          *value = MAKE_UNKNOWN();
+        }
+        reg_next();
+      }
+      reg_case(R_JUMP): {
+        ip += 1 + ip[0];
+        reg_next();
+      }
+      // jump_false <src>, <offset>
+      reg_case(R_JUMP_FALSE): {
+        ip += IS_TRUE(*SLOT(ip[0])) ? 2 : 2 + ip[1];
+        reg_next();
+      }
+      reg_case(R_COND_JUMP): {
+        assert(vm->stack_top > 0);
+        struct Object cond = vm->stack[--vm->stack_top];
+        ip += IS_TRUE(cond) ? 1 : 1 + ip[0];
+        reg_next();
+      }
+      // call <address>
+      reg_case(R_CALL): {
+        struct Object value = vm->values[*(ip++)];
+        CALL_RESOLVE(vm, value, -1);
+        i32 argc = FUNC_ARGC(value);
+        if (vm->stack_top < argc) {
+          runtime_error("Invalid number of arguments in function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
+        }
+        CALL(vm, value, argc);
+        reg_next();
+      }
+      // n args, local_call <src>, <n>
+      reg_case(R_LOCAL_CALL): {
+        struct Object value = *SLOT(ip[0]);
+        i32 argc = ip[1];
+        ip += 2;
+        CALL_RESOLVE(vm, value, argc);
+        if (vm->stack_top < argc) {
+          runtime_error("Invalid number of arguments in local function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
+        }
+        CALL(vm, value, argc);
+        reg_next();
+      }
+      // Tail calls reuse the frame of the current function, C functions are called as usual
+      reg_case(R_TAIL_CALL): {
+        struct Object value = vm->values[*(ip++)];
+        CALL_RESOLVE(vm, value, -1);
+        i32 argc = FUNC_ARGC(value);
+        if (vm->stack_top - stack_base < argc) {
+          runtime_error("Invalid number of arguments in function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
+        }
+        TAIL_CALL(vm, value, argc);
+        reg_next();
+      }
+      reg_case(R_LOCAL_TAIL_CALL): {
+        struct Object value = *SLOT(ip[0]);
+        i32 argc = ip[1];
+        ip += 2;
+        CALL_RESOLVE(vm, value, argc);
+        if (vm->stack_top - stack_base < argc) {
+          runtime_error("Invalid number of arguments in local function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
+        }
+        TAIL_CALL(vm, value, argc);
+        reg_next();
+      }
+      // self_tail_call <reg>, <n>, <offset>: the new arguments never touch the stack
+      reg_case(R_SELF_TAIL_CALL): {
+        const struct Object* args = &reg->regs[ip[0]];
+        i32 argc = ip[1];
+        for (i32 i = 0; i < argc; i++) {
+          vm->stack[stack_base + i] = args[i];
+        }
+        vm->stack_top = stack_base + argc;
+        ip += 3 + ip[2];
+        reg_next();
+      }
+      // check_int_args <mask>
+      reg_case(R_CHECK_INT_ARGS): {
+        i32 mask = *(ip++);
+        for (i32 i = 0; mask; i++, mask >>= 1) {
+          if ((mask & 1) && !IS_NUMBER(vm->stack[stack_base + i])) {
+            runtime_error("Argument %i should be an int\n", i + 1);
+            vm->status = ERR;
+            goto done;
+          }
+        }
+        reg_next();
+      }
+      reg_case(R_RETURN): {
+        if (reg->frame_count <= 0) {
+          return NO_ERR;
+        }
+        struct Reg_frame* frame = &reg->frames[--reg->frame_count];
+        if (vm->stack_top > stack_base + frame->argc) {
+          vm->stack[stack_base] = vm->stack[vm->stack_top - 1];
+          vm->stack_top = stack_base + 1;
+        }
+        else {
+          vm->stack_top = stack_base;
+        }
+        ip = frame->return_ip;
+        stack_base = vm->stack_base = frame->stack_base;
+        SLOTS_UPDATE(vm);
+        reg_next();
+      }
+      reg_case(R_ADD):
+        BINARY(vm, +);
+        reg_next();
+      reg_case(R_SUB):
+        BINARY(vm, -);
+        reg_next();
+      reg_case(R_MUL):
+        BINARY(vm, *);
+        reg_next();
+      reg_case(R_DIV):
+        BINARY(vm, /);
+        reg_next();
+      reg_case(R_LT):
+        BINARY(vm, <);
+        reg_next();
+      reg_case(R_GT):
+        BINARY(vm, >);
+        reg_next();
+      reg_case(R_EQ): {
+        STORE(vm, ip[0], MAKE_NUMBER(objects_are_equal(vm, SLOT(ip[1]), SLOT(ip[2]))));
+        ip += 3;
+        reg_next();
+      }
+      reg_case(R_ADD_INT):
+        BINARY_INT(vm, +);
+        reg_next();
+      reg_case(R_SUB_INT):
+        BINARY_INT(vm, -);
+        reg_next();
+      reg_case(R_MUL_INT):
+        BINARY_INT(vm, *);
+        reg_next();
+      reg_case(R_DIV_INT):
+        BINARY_INT(vm, /);
+        reg_next();
+      reg_case(R_LT_INT):
+        BINARY_INT(vm, <);
+        reg_next();
+      reg_case(R_GT_INT):
+        BINARY_INT(vm, >);
+        reg_next();
+      reg_case(R_EQ_INT):
+        BINARY_INT(vm, ==);
+        reg_next();
+      reg_case(R_LT_JUMP):
+        COMPARE_JUMP(vm, <);
+        reg_next();
+      reg_case(R_GT_JUMP):
+        COMPARE_JUMP(vm, >);
+        reg_next();
+      reg_case(R_EQ_JUMP): {
+        ip += objects_are_equal(vm, SLOT(ip[0]), SLOT(ip[1])) ? 3 : 3 + ip[2];
+        reg_next();
+      }
+      reg_case(R_LT_JUMP_INT):
+        COMPARE_JUMP_INT(vm, <);
+        reg_next();
+      reg_case(R_GT_JUMP_INT):
+        COMPARE_JUMP_INT(vm, >);
+        reg_next();
+      reg_case(R_EQ_JUMP_INT):
+        COMPARE_JUMP_INT(vm, ==);
+        reg_next();
+      reg_case(R_STACK_ADD):
+        STACK_BINARY(vm, +);
+        reg_next();
+      reg_case(R_STACK_SUB):
+        STACK_BINARY(vm, -);
+        reg_next();
+      reg_case(R_STACK_MUL):
+        STACK_BINARY(vm, *);
+        reg_next();
+      reg_case(R_STACK_DIV):
+        STACK_BINARY(vm, /);
+        reg_next();
+      reg_case(R_STACK_LT):
+        STACK_BINARY(vm, <);
+        reg_next();
+      reg_case(R_STACK_GT):
+        STACK_BINARY(vm, >);
+        reg_next();
+      reg_case(R_STACK_EQ): {
+        if (vm->stack_top < 2) {
+          runtime_error("Not enough arguments for arithmetic operation\n");
+          vm->status = ERR;
+          goto done;
+        }
+        struct Object* left = &vm->stack[vm->stack_top - 2];
+        *left = MAKE_NUMBER(objects_are_equal(vm, left, left + 1));
+        vm->stack_top--;
+        reg_next();
+      }
+      reg_default:
+        runtime_error("Tried to execute bad instruction (%i)\n", ins);
+        assert(0);
+        return vm->status;
+    }
+  }
+done:
+  return vm->status;
+}
+
+void reg_free(Reg_state* reg) {
+  list_free(reg->code, reg->code_size, reg->code_capacity);
+  if (reg->frames) {
+    m_free(reg->frames, reg->frames_size * sizeof(struct Reg_frame));
+    reg->frames = NULL;
+  }
+}
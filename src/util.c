@@ -4,7 +4,7 @@
 #include "memory.h"
 #include "util.h"
 
-char* read_file(const char* path) {
+char* read_file(const char* path, u32* size) {
 	u32 buffer_size = 0;
   u32 read_size = 0;
 	FILE* file = fopen(path, "rb");
@@ -14,7 +14,12 @@ char* read_file(const char* path) {
 	buffer_size = ftell(file);
 	rewind(file);
 
-	char* buffer = (char*)malloc(sizeof(char) * (buffer_size + 1));
+	char* buffer = (char*)m_malloc(sizeof(char) * (buffer_size + 1));
+	if (buffer == NULL) {
+		fclose(file);
+		return NULL;
+	}
+	*size = buffer_size + 1;
 
 	read_size = fread(buffer, sizeof(char), buffer_size, file);
 	buffer[read_size] = '\0';
@@ -52,3 +57,11 @@ i32 string_copy2(char* dest, char* source, i32 length, i32 max_length) {
   }
   return NO_ERR;
 }
+
+u32 hash_bytes(const char* data, i32 length) {
+  u32 hash = 5381;
+  for (i32 i = 0; i < length; i++) {
+    hash = ((hash << 5) + hash) + (u8)data[i];
+  }
+  return hash;
+}
@@ -4,20 +4,25 @@
 #include "common.h"
 #include "ast.h"
 #include "parser.h"
+#include "optimize.h"
 #include "code.h"
+#include "ir.h"
+#include "reg_code.h"
+#include "util.h"
+#include "image.h"
 #include "vm.h"
 
 #define runtime_error(fmt, ...) \
   fprintf(stderr, "runtime-error: " fmt, ##__VA_ARGS__)
 
-#define EQUAL_TYPES(a, b, t) ((a)->type == t && (b)->type == t)
+#define BOTH_NUMBERS(a, b) (IS_NUMBER(*(a)) && IS_NUMBER(*(b)))
 
 #define ARITH(VM, OP) { \
   if (VM->stack_top >= 2) { \
     struct Object* left = stack_get(VM, 1); \
     const struct Object* right = stack_get(VM, 0); \
-    if (EQUAL_TYPES(left, right, T_NUMBER)) { \
-      left->value.number = left->value.number OP right->value.number; \
+    if (BOTH_NUMBERS(left, right)) { \
+      *left = MAKE_NUMBER(AS_NUMBER(*left) OP AS_NUMBER(*right)); \
       stack_pop(VM); \
     } \
     else { \
@@ -33,44 +38,267 @@
   }\
 } \
 
-inline void stack_push(struct VM_state* vm, struct Object obj);
+// Arithmetic on two operands that are not both on the stack, the result is stored in RESULT
+#define ARITH_OPERANDS(VM, LEFT, RIGHT, OP, RESULT) { \
+  if (BOTH_NUMBERS(LEFT, RIGHT)) { \
+    RESULT = AS_NUMBER(*(LEFT)) OP AS_NUMBER(*(RIGHT)); \
+  } \
+  else { \
+    runtime_error("Invalid types in arithmetic operation\n"); \
+    VM->status = ERR; \
+    goto done; \
+  } \
+} \
+
+// NOTE(lucas): The instruction handler macros use the instruction pointer (ip) that is local to execute()
+
+// Compare the two operands, and jump if the comparison is false
+#define COMPARE_JUMP(VM, LEFT, RIGHT, OP, OFFSET) { \
+  i32 result = 0; \
+  ARITH_OPERANDS(VM, LEFT, RIGHT, OP, result); \
+  if (!result) { \
+    ip += OFFSET; \
+  } \
+} \
+
+// Arithmetic on the two numbers on top of the stack. The code generator only emits the
+// integer instructions when both operands are known to be numbers, so there are no checks.
+#define ARITH_INT(VM, OP) { \
+  assert(VM->stack_top >= 2); \
+  struct Object* left = &VM->stack[VM->stack_top - 2]; \
+  *left = MAKE_NUMBER(AS_NUMBER(*left) OP AS_NUMBER(VM->stack[VM->stack_top - 1])); \
+  VM->stack_top--; \
+} \
+
+// Pop the two numbers on top of the stack, and jump if the comparison is false
+#define COMPARE_JUMP_INT(VM, OP, OFFSET) { \
+  assert(VM->stack_top >= 2); \
+  VM->stack_top -= 2; \
+  if (!(AS_NUMBER(VM->stack[VM->stack_top]) OP AS_NUMBER(VM->stack[VM->stack_top + 1]))) { \
+    ip += OFFSET; \
+  } \
+} \
+
+// Pop the number on top of the stack, compare it with a value, and jump if the comparison is false
+#define PUSH_COMPARE_JUMP_INT(VM, OP, ADDRESS, OFFSET) { \
+  assert(VM->stack_top >= 1); \
+  VM->stack_top--; \
+  if (!(AS_NUMBER(VM->stack[VM->stack_top]) OP AS_NUMBER(VM->values[ADDRESS]))) { \
+    ip += OFFSET; \
+  } \
+} \
+
+#define CFUNCTION_CALLED 1
+
+// Does the inline cache of the call site hold the function in VALUE?
+#define CACHE_HIT(CACHE, VALUE) ((VALUE)->bits == (CACHE)->func.bits)
+
+// Look up the function to call in the inline cache, and update the cache on a miss.
+// C functions are not cached, they are called right away and execution continues after the call.
+// A miss can compile the function (see function_entry), which moves the program and the caches.
+#define CALL_RESOLVE(VM, CACHE, VALUE, ARGC) \
+  if (!CACHE_HIT(CACHE, VALUE)) { \
+    i32 offset = (i32)(ip - (VM)->program); \
+    i32 cache_index = (i32)((CACHE) - (VM)->caches); \
+    i32 status = call_cache_miss(VM, CACHE, VALUE, ARGC); \
+    ip = &(VM)->program[offset]; \
+    CACHE = &(VM)->caches[cache_index]; \
+    if (status == ERR) { \
+      goto done; \
+    } \
+    if (status == CFUNCTION_CALLED) { \
+      vm_next(); \
+    } \
+  } \
+
+#if defined(USE_JIT)
+
+// Has the function in the inline cache been compiled (counting the call if it has not)?
+#define JIT_READY(VM, CACHE) ((CACHE)->jit && ((CACHE)->jit->code || jit_hot(VM, (CACHE)->jit)) && (VM)->jit.depth < JIT_MAX_DEPTH)
+
+// Call compiled functions from the interpreter. They return like I_RETURN does, so execution
+// continues after the call instruction. The program can move while they run (see function_entry).
+#define JIT_CALL(VM, CACHE) \
+  if (JIT_READY(VM, CACHE)) { \
+    i32 offset = (i32)(ip - (VM)->program); \
+    i32 status = jit_enter(VM, (CACHE)->jit); \
+    ip = &(VM)->program[offset]; \
+    if (status != NO_ERR) { \
+      goto done; \
+    } \
+    vm_next(); \
+  } \
+
+// Tail calls to compiled functions replace the current frame, and then return from it
+#define JIT_TAIL_CALL(VM, CACHE, ARGC) \
+  if ((VM)->frame_count > entry_frame && JIT_READY(VM, CACHE)) { \
+    tail_call(VM, stack_base, ARGC); \
+    if (jit_enter(VM, (CACHE)->jit) != NO_ERR) { \
+      goto done; \
+    } \
+    struct Call_frame* frame = &(VM)->frames[--(VM)->frame_count]; \
+    ip = frame->return_ip; \
+    stack_base = (VM)->stack_base = frame->stack_base; \
+    vm_next(); \
+  } \
+
+// Compiled functions that are being executed count as call frames
+#define FRAMES_IN_USE(VM) ((VM)->frame_count + (VM)->jit.depth)
+
+#else
+  #define JIT_CALL(VM, CACHE)
+  #define JIT_TAIL_CALL(VM, CACHE, ARGC)
+  #define FRAMES_IN_USE(VM) ((VM)->frame_count)
+#endif
+
+// Instruction dispatch, either through a jump table of label addresses
+// (computed goto, where every handler jumps directly to the next one)
+// or through a portable switch statement. Chosen at build time in config.mk.
+#if defined(USE_COMPUTED_GOTO) && defined(__GNUC__)
+  #define vm_dispatch() ins = *(ip++); goto *dispatch_table[ins];
+  #define vm_case(INS) L_##INS
+  #define vm_default L_default
+  #define vm_next() ins = *(ip++); goto *dispatch_table[ins]
+#else
+  #undef USE_COMPUTED_GOTO
+  #define vm_dispatch() ins = *(ip++); switch (ins)
+  #define vm_case(INS) case INS
+  #define vm_default default
+  #define vm_next() break
+#endif
+
+// Operands are read into arg0..arg2 before the body of the instruction handler, which starts at
+// the vm_wide label. Wide instructions read their 32-bit operands in I_WIDE and jump to that label.
+#define NEXT_ARG() (ip += ARG_SIZE, READ_ARG(ip - ARG_SIZE))
+#define NEXT_JUMP_ARG() (ip += ARG_SIZE, READ_JUMP_ARG(ip - ARG_SIZE))
+#define vm_wide(INS) W_##INS
+
+inline i32 stack_push(struct VM_state* vm, struct Object obj);
 inline struct Object* stack_pop(struct VM_state* vm);
 inline struct Object* stack_get(struct VM_state* vm, i32 offset);
 inline struct Object* stack_get_top(struct VM_state* vm);
 inline i32 object_check_true(struct Object* obj);
-inline i32 objects_are_equal(struct Object* a, struct Object* b);
 static i32 vm_define_value(struct VM_state* vm, const char* name, struct Object value);
 static i32 vm_define_function(struct VM_state* vm, const char* name, cfunction func, i32 argc);
 static i32 vm_debug_print(struct VM_state* vm);
-static i32 execute(struct VM_state* vm);
+static i32 frames_grow(struct VM_state* vm);
+inline i32 frame_push(struct VM_state* vm, i32 argc, u8* return_ip);
+inline void tail_call(struct VM_state* vm, i32 stack_base, i32 argc);
+static void program_moved(struct VM_state* vm, uintptr_t old_program, i32 old_size);
+static i32 function_entry(struct VM_state* vm, i32 address, i32* entry);
+static i32 call_cache_miss(struct VM_state* vm, struct Call_cache* cache, const struct Object* value, i32 argc);
+static i32 execute(struct VM_state* vm, const i32 entry_frame);
+#if defined(USE_JIT)
+static i32 call_function(struct VM_state* vm, struct Call_cache* cache);
+#endif
+static i32 setup(struct VM_state* vm);
+static i32 exec_file(struct VM_state* vm, char* path);
+static i32 compile(struct VM_state* vm, char* file, char* source);
+static void run(struct VM_state* vm);
 static void stack_print_all(struct VM_state* vm);
 
 i32 vm_init(struct VM_state* vm) {
+  Allocator allocator;
+  allocator_system(&allocator);
+  return vm_init_with_allocator(vm, &allocator);
+}
+
+i32 vm_init_with_allocator(struct VM_state* vm, const Allocator* allocator) {
+  vm->allocator = *allocator;
+  Allocator* previous = memory_use(&vm->allocator);
+  i32 result = setup(vm);
+  memory_use(previous);
+  return result;
+}
+
+i32 setup(struct VM_state* vm) {
+  vm->status = NO_ERR;
+  vm->stack = m_malloc(STACK_INIT_SIZE * sizeof(struct Object));
+  if (!vm->stack) {
+    return vm_memory_check(vm);
+  }
+  vm->stack_size = STACK_INIT_SIZE;
+  vm->max_stack = MAX_STACK;
   vm->stack_top = 0;
   vm->stack_base = 0;
   vm->values = NULL;
   vm->values_count = 0;
+  vm->values_capacity = 0;
+  constant_pool_init(&vm->constants);
   buffer_init(&vm->buffer);
-  func_init(&vm->global, NULL);
-  func_state_init(&vm->fs_global, NULL, &vm->global);
+  vm->strings = NULL;
+  vm->strings_count = 0;
+  vm->strings_capacity = 0;
+  string_index_init(&vm->strings_index);
+  vm->cfunctions = NULL;
+  vm->cfunctions_count = 0;
+  vm->cfunctions_capacity = 0;
+  func_state_init(&vm->fs_global, NULL, NULL);
   vm->program = NULL;
   vm->program_size = 0;
+  vm->program_capacity = 0;
+  vm->code = NULL;
+  vm->code_size = 0;
+  vm->code_capacity = 0;
+  vm->code_values = NULL;
+  vm->code_values_count = 0;
+  vm->code_values_capacity = 0;
   vm->old_program_size = 0;
+  vm->image = NULL;
+  vm->image_size = 0;
   vm->ip = NULL;
   vm->saved_ip = 0;
+  vm->frames = NULL;
+  vm->frame_count = 0;
+  vm->frames_size = 0;
+  vm->max_frames = MAX_FRAMES;
+  vm->caches = NULL;
+  vm->caches_count = 0;
+  vm->caches_capacity = 0;
+  vm->lazy = NULL;
+  vm->lazy_count = 0;
+  vm->lazy_capacity = 0;
+  vm->lazy_ins = NULL;
+  vm->lazy_ins_count = 0;
+  vm->lazy_ins_capacity = 0;
+  jit_init(&vm->jit, 1);
+  gc_init(&vm->gc);
+  vm->engine = ENGINE_STACK;
+  vm->whole_program = 0;
+  vm->image_cache = IMAGE_CACHE_OFF;
+  vm->arena = NULL;
+  reg_init(&vm->reg);
   vm->status = NO_ERR;
   vm_define_function(vm, "print", vm_debug_print, 1);
-  return NO_ERR;
+  return vm_memory_check(vm);
 }
 
-void stack_push(struct VM_state* vm, struct Object obj) {
-  if (vm->stack_top < MAX_STACK) {
-    vm->stack[vm->stack_top++] = obj;
+// Double the size of the stack, up to the stack limit
+i32 stack_grow(struct VM_state* vm) {
+  if (vm->stack_size >= vm->max_stack) {
+    runtime_error("Stack overflow, reached stack limit of %i!\n", vm->max_stack);
+    return vm->status = ERR;
   }
-  else {
-    runtime_error("Stack overflow, reached stack limit of %i!\n", MAX_STACK);
-    vm->status = ERR;
+  i32 new_size = vm->stack_size * 2;
+  if (new_size > vm->max_stack) {
+    new_size = vm->max_stack;
+  }
+  struct Object* stack = m_realloc(vm->stack, vm->stack_size * sizeof(struct Object), new_size * sizeof(struct Object));
+  if (!stack) {
+    runtime_error("Failed to grow the stack to %i values\n", new_size);
+    return vm->status = ERR;
   }
+  vm->stack = stack;
+  vm->stack_size = new_size;
+  return NO_ERR;
+}
+
+i32 stack_push(struct VM_state* vm, struct Object obj) {
+  if (vm->stack_top >= vm->stack_size && stack_grow(vm) != NO_ERR) {
+    return vm->status;
+  }
+  vm->stack[vm->stack_top++] = obj;
+  return NO_ERR;
 }
 
 struct Object* stack_pop(struct VM_state* vm) {
@@ -96,31 +324,17 @@ struct Object* stack_get_top(struct VM_state* vm) {
 }
 
 i32 object_check_true(struct Object* obj) {
-  switch (obj->type) {
-    case T_NUMBER:
-      return obj->value.number != 0;
-    default:
-      break;
-  }
-  return 0;
+  return IS_NUMBER(*obj) && AS_NUMBER(*obj) != 0;
 }
 
-i32 objects_are_equal(struct Object* a, struct Object* b) {
-  if (a->type == b->type) {
-    switch (a->type) {
-      case T_NUMBER: {
-        return a->value.number == b->value.number;
-      }
-      case T_FUNCTION: {
-        return a->value.func.address == b->value.func.address;
-      }
-      case T_STRING: {
-        if (a->value.buffer.data == b->value.buffer.data) {
-          return 1;
-        }
-        else if (a->value.buffer.length == b->value.buffer.length) {
-          return (strncmp(a->value.buffer.data, b->value.buffer.data, a->value.buffer.length)) == 0;
-        }
+i32 objects_are_equal(struct VM_state* vm, struct Object* a, struct Object* b) {
+  i32 tag = OBJECT_TAG(*a);
+  if (tag == OBJECT_TAG(*b)) {
+    switch (tag) {
+      case TAG_NUMBER:
+      case TAG_STRING:  // Strings are interned
+      case TAG_FUNCTION: {
+        return a->bits == b->bits;
       }
       default:
         break;
@@ -139,60 +353,342 @@ i32 vm_define_value(struct VM_state* vm, const char* name, struct Object value)
   }
   else {
     address = vm->values_count;
-    list_push(vm->values, vm->values_count, value);
+    list_push(vm->values, vm->values_count, vm->values_capacity, value);
     ht_insert_element(&vm->fs_global.symbol_table, name, address);
   }
   return NO_ERR;
 }
 
 i32 vm_define_function(struct VM_state* vm, const char* name, cfunction func, i32 argc) {
-  struct Object value = (struct Object) {
-    .value.cfunc = (struct CFunction) {
-      .func = func,
-      .argc = argc,
-    },
-    .type = T_CFUNCTION,
+  struct CFunction cfunc = {
+    .func = func,
+    .argc = argc,
   };
-  return vm_define_value(vm, name, value);
+  i32 handle = vm->cfunctions_count;
+  list_push(vm->cfunctions, vm->cfunctions_count, vm->cfunctions_capacity, cfunc);
+  return vm_define_value(vm, name, MAKE_CFUNCTION(handle));
 }
 
 i32 vm_debug_print(struct VM_state* vm) {
   struct Object* value = stack_pop(vm);
   if (value) {
-    object_printline(stdout, value);
+    object_printline(vm, stdout, value);
   }
   return 0;
 }
 
-i32 execute(struct VM_state* vm) {
+// Grow the call frame stack, up to the frame limit
+i32 frames_grow(struct VM_state* vm) {
+  if (FRAMES_IN_USE(vm) >= vm->max_frames) {
+    runtime_error("Call stack overflow, reached frame limit of %i!\n", vm->max_frames);
+    return vm->status = ERR;
+  }
+  i32 new_size = vm->frames_size ? vm->frames_size * 2 : FRAMES_INIT_SIZE;
+  if (new_size > vm->max_frames) {
+    new_size = vm->max_frames;
+  }
+  struct Call_frame* frames = NULL;
+  if (vm->frames) {
+    frames = m_realloc(vm->frames, vm->frames_size * sizeof(struct Call_frame), new_size * sizeof(struct Call_frame));
+  }
+  else {
+    frames = m_malloc(new_size * sizeof(struct Call_frame));
+  }
+  if (!frames) {
+    runtime_error("Failed to allocate call frames\n");
+    return vm->status = ERR;
+  }
+  vm->frames = frames;
+  vm->frames_size = new_size;
+  return NO_ERR;
+}
+
+// Push a new call frame for a function taking argc arguments from the top of the stack
+i32 frame_push(struct VM_state* vm, i32 argc, u8* return_ip) {
+  if (FRAMES_IN_USE(vm) >= vm->frames_size && frames_grow(vm) != NO_ERR) {
+    return vm->status;
+  }
+  struct Call_frame* frame = &vm->frames[vm->frame_count++];
+  frame->return_ip = return_ip;
+  frame->stack_base = vm->stack_base;
+  frame->argc = argc;
+  vm->stack_base = vm->stack_top - argc;
+  return vm->status;  // Stops calls after an error outside of the dispatch loop (see jit_hot)
+}
+
+// Replace the arguments of the current frame with the argc values on top of the stack
+void tail_call(struct VM_state* vm, i32 stack_base, i32 argc) {
+  struct Call_frame* frame = &vm->frames[vm->frame_count - 1];
+  memmove(&vm->stack[stack_base], &vm->stack[vm->stack_top - argc], argc * sizeof(struct Object));
+  vm->stack_top = stack_base + argc;
+  frame->argc = argc;
+}
+
+// C functions are called directly, and their (optional) return value replaces the arguments on the stack
+i32 call_cfunction(struct VM_state* vm, struct CFunction* cfunc) {
+  i32 argc = cfunc->argc;
+  if (vm->stack_top < argc) {
+    runtime_error("Invalid number of arguments in C function call (should be %i)\n", argc);
+    return vm->status = ERR;
+  }
+  i32 base = vm->stack_top - argc;
+  i32 old_stack_base = vm->stack_base;
+  vm->stack_base = base;
+  i32 ret_value_count = cfunc->func(vm);
+  if (ret_value_count > 0) {
+    vm->stack[base] = *stack_get_top(vm);
+    vm->stack_top = base + 1;
+  }
+  else {
+    vm->stack_top = base;
+  }
+  vm->stack_base = old_stack_base;
+  return NO_ERR;
+}
+
+// Pointers into the program that are kept while a function is compiled on its first call, which can reallocate it
+void program_moved(struct VM_state* vm, uintptr_t old_program, i32 old_size) {
+  if ((uintptr_t)vm->program == old_program) {
+    return;
+  }
+  for (i32 i = 0; i < vm->frame_count; i++) {
+    uintptr_t offset = (uintptr_t)vm->frames[i].return_ip - old_program;
+    if (offset <= (uintptr_t)old_size) {
+      vm->frames[i].return_ip = &vm->program[offset];
+    }
+  }
+  uintptr_t offset = (uintptr_t)vm->ip - old_program;
+  if (vm->ip && offset <= (uintptr_t)old_size) {
+    vm->ip = &vm->program[offset];
+  }
+}
+
+// Where the code of the function at address starts. Functions that are compiled on their first call
+// start with a stub, which is compiled here and replaced by a wide jump to the code.
+i32 function_entry(struct VM_state* vm, i32 address, i32* entry) {
+  const u8* stub = &vm->program[address];
+  *entry = address;
+  if (stub[0] != I_WIDE || (stub[1] != I_COMPILE && stub[1] != I_JUMP)) {
+    return NO_ERR;
+  }
+  if (stub[1] == I_JUMP) {
+    *entry = address + STUB_SIZE + READ_WIDE_ARG(&stub[2]);
+    return NO_ERR;
+  }
+  uintptr_t old_program = (uintptr_t)vm->program;
+  i32 old_size = vm->program_size;
+  i32 result = image_detach_program(vm);
+  if (result == NO_ERR) {
+    result = code_gen_function(vm, address, entry);
+  }
+  program_moved(vm, old_program, old_size);
+  if (vm_memory_check(vm) != NO_ERR) {
+    return vm->status;
+  }
+  if (result != NO_ERR) {
+    runtime_error("Failed to compile function\n");
+    return vm->status = ERR;
+  }
+  return NO_ERR;
+}
+
+// The function called at a call site was not in its inline cache. Funk functions are checked
+// and cached, C functions are called. argc is the number of arguments given at the call site
+// (-1 if not known at compile time).
+i32 call_cache_miss(struct VM_state* vm, struct Call_cache* cache, const struct Object* value, i32 argc) {
+  if (IS_CFUNCTION(*value)) {
+    if (call_cfunction(vm, &vm->cfunctions[AS_HANDLE(*value)]) != NO_ERR) {
+      return ERR;
+    }
+    return CFUNCTION_CALLED;
+  }
+  if (!IS_FUNCTION(*value)) {
+    runtime_error("Attempted to call a value which is not a function\n");
+    return vm->status = ERR;
+  }
+  if (argc >= 0 && FUNC_ARGC(*value) != argc) {
+    runtime_error("Invalid number of arguments in local function call (should be %i)\n", FUNC_ARGC(*value));
+    return vm->status = ERR;
+  }
+  i32 index = (i32)(cache - vm->caches);
+  const struct Object func = *value;
+  i32 entry = 0;
+  if (function_entry(vm, FUNC_ADDRESS(func), &entry) != NO_ERR) {
+    return ERR;
+  }
+  cache = &vm->caches[index];
+  cache->func = func;
+  cache->entry = entry;
+#if defined(USE_JIT)
+  cache->jit = jit_function(vm, value->bits);
+#endif
+  return NO_ERR;
+}
+
+// NOTE(lucas): Calls between funk functions do not recurse into execute(),
+// they push a call frame and continue in the same dispatch loop. execute()
+// returns when the frame it was entered with (entry_frame) returns.
+i32 execute(struct VM_state* vm, const i32 entry_frame) {
   i32 stack_base = vm->stack_base;
+  i32 ins = I_UNKNOWN;
+  u8* ip = vm->ip;  // Kept in a register, written back to the vm when execution stops
+  i32 arg0 = 0, arg1 = 0, arg2 = 0;  // Operands of the current instruction
+#if defined(USE_COMPUTED_GOTO)
+  static void* dispatch_table[MAX_INS] = {
+    [I_EXIT] = &&L_I_EXIT,
+    [I_UNKNOWN] = &&L_default,
+    [I_NOP] = &&L_I_NOP,
+    [I_WIDE] = &&L_I_WIDE,
+
+    [I_PUSH] = &&L_I_PUSH,
+    [I_PUSH_ARG] = &&L_I_PUSH_ARG,
+    [I_POP] = &&L_I_POP,
+    [I_ASSIGN] = &&L_I_ASSIGN,
+    [I_COND_JUMP] = &&L_I_COND_JUMP,
+    [I_JUMP] = &&L_I_JUMP,
+    [I_RETURN] = &&L_I_RETURN,
+    [I_CALL] = &&L_I_CALL,
+    [I_LOCAL_CALL] = &&L_I_LOCAL_CALL,
+    [I_TAIL_CALL] = &&L_I_TAIL_CALL,
+    [I_LOCAL_TAIL_CALL] = &&L_I_LOCAL_TAIL_CALL,
+    [I_CHECK_INT_ARGS] = &&L_I_CHECK_INT_ARGS,
+
+    [I_ADD] = &&L_I_ADD,
+    [I_SUB] = &&L_I_SUB,
+    [I_MUL] = &&L_I_MUL,
+    [I_DIV] = &&L_I_DIV,
+
+    [I_LT] = &&L_I_LT,
+    [I_GT] = &&L_I_GT,
+    [I_EQ] = &&L_I_EQ,
+
+    [I_ADD_INT] = &&L_I_ADD_INT,
+    [I_SUB_INT] = &&L_I_SUB_INT,
+    [I_MUL_INT] = &&L_I_MUL_INT,
+    [I_DIV_INT] = &&L_I_DIV_INT,
+    [I_LT_INT] = &&L_I_LT_INT,
+    [I_GT_INT] = &&L_I_GT_INT,
+    [I_EQ_INT] = &&L_I_EQ_INT,
+
+    [I_PUSH_ARG_PUSH_ADD] = &&L_I_PUSH_ARG_PUSH_ADD,
+    [I_PUSH_ARG_PUSH_SUB] = &&L_I_PUSH_ARG_PUSH_SUB,
+    [I_PUSH_ADD] = &&L_I_PUSH_ADD,
+    [I_PUSH_SUB] = &&L_I_PUSH_SUB,
+    [I_LT_COND_JUMP] = &&L_I_LT_COND_JUMP,
+    [I_GT_COND_JUMP] = &&L_I_GT_COND_JUMP,
+    [I_EQ_COND_JUMP] = &&L_I_EQ_COND_JUMP,
+    [I_PUSH_LT_COND_JUMP] = &&L_I_PUSH_LT_COND_JUMP,
+    [I_PUSH_GT_COND_JUMP] = &&L_I_PUSH_GT_COND_JUMP,
+    [I_PUSH_EQ_COND_JUMP] = &&L_I_PUSH_EQ_COND_JUMP,
+
+    [I_PUSH_ARG_PUSH_ADD_INT] = &&L_I_PUSH_ARG_PUSH_ADD_INT,
+    [I_PUSH_ARG_PUSH_SUB_INT] = &&L_I_PUSH_ARG_PUSH_SUB_INT,
+    [I_PUSH_ADD_INT] = &&L_I_PUSH_ADD_INT,
+    [I_PUSH_SUB_INT] = &&L_I_PUSH_SUB_INT,
+    [I_LT_COND_JUMP_INT] = &&L_I_LT_COND_JUMP_INT,
+    [I_GT_COND_JUMP_INT] = &&L_I_GT_COND_JUMP_INT,
+    [I_EQ_COND_JUMP_INT] = &&L_I_EQ_COND_JUMP_INT,
+    [I_PUSH_LT_COND_JUMP_INT] = &&L_I_PUSH_LT_COND_JUMP_INT,
+    [I_PUSH_GT_COND_JUMP_INT] = &&L_I_PUSH_GT_COND_JUMP_INT,
+    [I_PUSH_EQ_COND_JUMP_INT] = &&L_I_PUSH_EQ_COND_JUMP_INT,
+
+    [I_PUSH_ARG_LOCAL_CALL] = &&L_I_PUSH_ARG_LOCAL_CALL,
+    [I_PUSH_ARG_LOCAL_TAIL_CALL] = &&L_I_PUSH_ARG_LOCAL_TAIL_CALL,
+
+    [I_PUSH_ASSIGN] = &&L_I_PUSH_ASSIGN,
+    [I_SHL_INT] = &&L_I_SHL_INT,
+    [I_SHR_INT] = &&L_I_SHR_INT,
+
+    [I_COMPILE] = &&L_I_COMPILE,
+  };
+#endif
   for (;;) {
-    i32 ins = *(vm->ip++);
-    switch (ins) {
-      case I_EXIT:
+    vm_dispatch() {
+      vm_case(I_EXIT):
+        vm->ip = ip;
         return NO_ERR;
-      case I_NOP:
-        break;
+      vm_case(I_NOP):
+        vm_next();
+      // wide <instruction>, the operands of the instruction are 32 bits wide
+      vm_case(I_WIDE): {
+        ins = *(ip++);
+        assert(ins >= 0 && ins < MAX_INS);
+        i32 argc = ins_argc(ins);
+        arg0 = argc > 0 ? READ_WIDE_ARG(ip) : 0;
+        arg1 = argc > 1 ? READ_WIDE_ARG(ip + WIDE_ARG_SIZE) : 0;
+        arg2 = argc > 2 ? READ_WIDE_ARG(ip + 2 * WIDE_ARG_SIZE) : 0;
+        ip += argc * WIDE_ARG_SIZE;
+        switch (ins) {
+          case I_PUSH: goto vm_wide(I_PUSH);
+          case I_PUSH_ARG: goto vm_wide(I_PUSH_ARG);
+          case I_ASSIGN: goto vm_wide(I_ASSIGN);
+          case I_COND_JUMP: goto vm_wide(I_COND_JUMP);
+          case I_JUMP: goto vm_wide(I_JUMP);
+          case I_CALL: goto vm_wide(I_CALL);
+          case I_LOCAL_CALL: goto vm_wide(I_LOCAL_CALL);
+          case I_PUSH_ARG_LOCAL_CALL: goto vm_wide(I_PUSH_ARG_LOCAL_CALL);
+          case I_TAIL_CALL: goto vm_wide(I_TAIL_CALL);
+          case I_LOCAL_TAIL_CALL: goto vm_wide(I_LOCAL_TAIL_CALL);
+          case I_PUSH_ARG_LOCAL_TAIL_CALL: goto vm_wide(I_PUSH_ARG_LOCAL_TAIL_CALL);
+          case I_CHECK_INT_ARGS: goto vm_wide(I_CHECK_INT_ARGS);
+          case I_PUSH_ARG_PUSH_ADD:
+          case I_PUSH_ARG_PUSH_SUB: goto vm_wide(I_PUSH_ARG_PUSH_ADD);
+          case I_PUSH_ADD:
+          case I_PUSH_SUB: goto vm_wide(I_PUSH_ADD);
+          case I_LT_COND_JUMP:
+          case I_GT_COND_JUMP:
+          case I_EQ_COND_JUMP: goto vm_wide(I_LT_COND_JUMP);
+          case I_PUSH_LT_COND_JUMP:
+          case I_PUSH_GT_COND_JUMP:
+          case I_PUSH_EQ_COND_JUMP: goto vm_wide(I_PUSH_LT_COND_JUMP);
+          case I_PUSH_ARG_PUSH_ADD_INT:
+          case I_PUSH_ARG_PUSH_SUB_INT: goto vm_wide(I_PUSH_ARG_PUSH_ADD_INT);
+          case I_PUSH_ADD_INT: goto vm_wide(I_PUSH_ADD_INT);
+          case I_PUSH_SUB_INT: goto vm_wide(I_PUSH_SUB_INT);
+          case I_LT_COND_JUMP_INT: goto vm_wide(I_LT_COND_JUMP_INT);
+          case I_GT_COND_JUMP_INT: goto vm_wide(I_GT_COND_JUMP_INT);
+          case I_EQ_COND_JUMP_INT: goto vm_wide(I_EQ_COND_JUMP_INT);
+          case I_PUSH_LT_COND_JUMP_INT: goto vm_wide(I_PUSH_LT_COND_JUMP_INT);
+          case I_PUSH_GT_COND_JUMP_INT: goto vm_wide(I_PUSH_GT_COND_JUMP_INT);
+          case I_PUSH_EQ_COND_JUMP_INT: goto vm_wide(I_PUSH_EQ_COND_JUMP_INT);
+          case I_PUSH_ASSIGN: goto vm_wide(I_PUSH_ASSIGN);
+          case I_COMPILE: goto vm_wide(I_COMPILE);
+          default:
+            runtime_error("Instruction can not be wide (%i)\n", ins);
+            assert(0);
+            return vm->status = ERR;
+        }
+      }
 
-      case I_PUSH: {
-        i32 address = *(vm->ip++);
+      vm_case(I_PUSH):
+        arg0 = NEXT_ARG();
+      vm_wide(I_PUSH): {
+        i32 address = arg0;
         assert(address >= 0 && address < vm->values_count);
         struct Object obj = vm->values[address];
-        stack_push(vm, obj);
-        break;
+        if (stack_push(vm, obj) != NO_ERR) {
+          goto done;
+        }
+        vm_next();
       }
-      case I_PUSH_ARG: {
-        i32 address = *(vm->ip++);
+      vm_case(I_PUSH_ARG):
+        arg0 = NEXT_ARG();
+      vm_wide(I_PUSH_ARG): {
+        i32 address = arg0;
         i32 index = stack_base + address;
         assert(index <= vm->stack_top);
         struct Object obj = vm->stack[index];
-        stack_push(vm, obj);
-        break;
+        if (stack_push(vm, obj) != NO_ERR) {
+          goto done;
+        }
+        vm_next();
       }
-      case I_POP:
-        break;
-      case I_ASSIGN: {
-        i32 address = *(vm->ip++);
+      vm_case(I_POP):
+        vm_next();
+      vm_case(I_ASSIGN):
+        arg0 = NEXT_ARG();
+      vm_wide(I_ASSIGN): {
+        i32 address = arg0;
         struct Object* left = &vm->values[address];
         const struct Object* right = stack_get_top(vm);
         if (!right) {
@@ -200,152 +696,218 @@ i32 execute(struct VM_state* vm) {
           assert(0);
           return vm->status = ERR;
 #else
-          left->type = T_UNKNOWN;
-          break;
+          *left = MAKE_UNKNOWN();
+          vm_next();
 #endif
         }
         *left = *right;
         stack_pop(vm);
-        break;
+        vm_next();
       }
-      case I_COND_JUMP: {
-        i32 offset = *(vm->ip++);
-        struct Object* obj = stack_get_top(vm);
+      vm_case(I_COND_JUMP):
+        arg0 = NEXT_JUMP_ARG();
+      vm_wide(I_COND_JUMP): {
+        i32 offset = arg0;
+        struct Object* obj = stack_pop(vm);
         assert(obj);
 
         if (!object_check_true(obj)) {
-          stack_pop(vm);
-          vm->ip += offset;
+          ip += offset;
         }
-        stack_pop(vm);
-        break;
+        vm_next();
       }
-      case I_JUMP: {
-        i32 offset = *(vm->ip++);
-        vm->ip += offset;
-        break;
+      vm_case(I_JUMP):
+        arg0 = NEXT_JUMP_ARG();
+      vm_wide(I_JUMP): {
+        ip += arg0;
+        vm_next();
       }
-      // TODO(lucas): Clean up I_CALL and I_LOCAL_CALL
-      case I_CALL: {
-        i32 address = *(vm->ip++);
-        assert(address >= 0 && address < vm->values_count);
-        struct Object* value = &vm->values[address];
-        if (value->type == T_CFUNCTION) {
-          i32 argc = value->value.cfunc.argc;
-          if (vm->stack_top < argc) {
-            runtime_error("Invalid number of arguments in C function call (should be %i)\n", argc);
-          }
-          i32 base = vm->stack_base = vm->stack_top - argc;
-          i32 ret_value_count = value->value.cfunc.func(vm);
-          if (ret_value_count > 0) {
-            vm->stack[base] = *stack_get_top(vm);
-            vm->stack_top = base + 1;
-          }
-          else {
-            vm->stack_top = base - 2;
-          }
-          break;
+      // Calls go through the inline cache of the call site. When it holds the called function
+      // (a single compare), the call can be made right away, without checking the kind of
+      // value that is called or its number of parameters.
+      // call <address>, <cache>
+      vm_case(I_CALL):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+      vm_wide(I_CALL): {
+        i32 address = arg0;
+        struct Call_cache* cache = &vm->caches[arg1];
+        const struct Object* value = &vm->values[address];
+        CALL_RESOLVE(vm, cache, value, -1);
+        i32 argc = FUNC_ARGC(cache->func);
+        if (vm->stack_top < argc) {
+          runtime_error("Invalid number of arguments in function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
         }
-        if (value->type != T_FUNCTION) {
-          runtime_error("Attempted to call a value which is not a function\n");
-          return vm->status = ERR;
+        JIT_CALL(vm, cache);
+        if (frame_push(vm, argc, ip) != NO_ERR) {
+          goto done;
         }
-        i32 argc = value->value.func.argc;
+        stack_base = vm->stack_base;
+        ip = &vm->program[cache->entry];
+        vm_next();
+      }
+      // n args, push <function>, local_call <n>, <cache>
+      vm_case(I_LOCAL_CALL):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+      vm_wide(I_LOCAL_CALL): {
+        i32 argc = arg0;
+        struct Call_cache* cache = &vm->caches[arg1];
+        assert(vm->stack_top > 0);
+        const struct Object* value = &vm->stack[--vm->stack_top];
+        CALL_RESOLVE(vm, cache, value, argc);
         if (vm->stack_top < argc) {
-          runtime_error("Invalid number of arguments in function call (should be %i)\n", value->value.func.argc);
-          return vm->status = ERR;
+          runtime_error("Invalid number of arguments in local function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
         }
-        i32 old_stack_top = vm->stack_top; // Save the stack pointer so that we can figure out how many return values that the function produced
-        i32 base = vm->stack_base = vm->stack_top - argc;
-
-        i32* old_ip = vm->ip; // Save the current instruction pointer position
-        vm->ip = &vm->program[value->value.func.address];
-        execute(vm);  // Execute function
-        vm->ip = old_ip; // Restore the old instruction pointer
-
-        i32 ret_value_count = vm->stack_top - old_stack_top; // TODO(lucas): Implement use of multiple return values
-        if (ret_value_count > 0) {
-          vm->stack[base] = *stack_get_top(vm);
-          vm->stack_top = base + 1;
+        JIT_CALL(vm, cache);
+        if (frame_push(vm, argc, ip) != NO_ERR) {
+          goto done;
         }
-        else {
-          vm->stack_top = base - 2;
+        stack_base = vm->stack_base;
+        ip = &vm->program[cache->entry];
+        vm_next();
+      }
+      // n args, push_arg <index>, local_call <n>, <cache>
+      vm_case(I_PUSH_ARG_LOCAL_CALL):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+        arg2 = NEXT_ARG();
+      vm_wide(I_PUSH_ARG_LOCAL_CALL): {
+        const struct Object* value = &vm->stack[stack_base + arg0];
+        i32 argc = arg1;
+        struct Call_cache* cache = &vm->caches[arg2];
+        CALL_RESOLVE(vm, cache, value, argc);
+        if (vm->stack_top < argc) {
+          runtime_error("Invalid number of arguments in local function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
         }
-        break;
+        JIT_CALL(vm, cache);
+        if (frame_push(vm, argc, ip) != NO_ERR) {
+          goto done;
+        }
+        stack_base = vm->stack_base;
+        ip = &vm->program[cache->entry];
+        vm_next();
       }
-      // n args, i_push <function>, i_local_call <n_args>
-      case I_LOCAL_CALL: {
-        i32 argc = *(vm->ip++);
-        struct Object value = *stack_pop(vm);
-        if (value.type == T_CFUNCTION) {
-          i32 argc = value.value.cfunc.argc;
-          if (vm->stack_top < argc) {
-            runtime_error("Invalid number of arguments in C function call (should be %i)\n", argc);
-          }
-          i32 base = vm->stack_base = vm->stack_top - argc;
-          i32 ret_value_count = value.value.cfunc.func(vm);
-          if (ret_value_count > 0) {
-            vm->stack[base] = *stack_get_top(vm);
-            vm->stack_top = base + 1;
-          }
-          else {
-            vm->stack_top = base - 2;
-          }
-          break;
+      // Tail calls move the arguments down to the base of the current frame and
+      // reuse it, so that recursion in tail position runs in constant space.
+      // C functions are called as usual, the following return takes care of the rest.
+      vm_case(I_TAIL_CALL):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+      vm_wide(I_TAIL_CALL): {
+        i32 address = arg0;
+        struct Call_cache* cache = &vm->caches[arg1];
+        const struct Object* value = &vm->values[address];
+        CALL_RESOLVE(vm, cache, value, -1);
+        i32 argc = FUNC_ARGC(cache->func);
+        if (vm->stack_top - stack_base < argc) {
+          runtime_error("Invalid number of arguments in function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
         }
-        if (value.type != T_FUNCTION) {
-          runtime_error("Attempted to call a value which is not a function\n");
-          return vm->status = ERR;
+        JIT_TAIL_CALL(vm, cache, argc);
+        tail_call(vm, stack_base, argc);
+        ip = &vm->program[cache->entry];
+        vm_next();
+      }
+      vm_case(I_LOCAL_TAIL_CALL):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+      vm_wide(I_LOCAL_TAIL_CALL): {
+        i32 argc = arg0;
+        struct Call_cache* cache = &vm->caches[arg1];
+        assert(vm->stack_top > 0);
+        const struct Object* value = &vm->stack[--vm->stack_top];
+        CALL_RESOLVE(vm, cache, value, argc);
+        if (vm->stack_top - stack_base < argc) {
+          runtime_error("Invalid number of arguments in local function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
         }
-        i32 func_argc = value.value.func.argc;
-        if (vm->stack_top < func_argc && func_argc != argc) {
-          runtime_error("Invalid number of arguments in local function call (should be %i)\n", func_argc);
-          return vm->status = ERR;
+        JIT_TAIL_CALL(vm, cache, argc);
+        tail_call(vm, stack_base, argc);
+        ip = &vm->program[cache->entry];
+        vm_next();
+      }
+      vm_case(I_PUSH_ARG_LOCAL_TAIL_CALL):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+        arg2 = NEXT_ARG();
+      vm_wide(I_PUSH_ARG_LOCAL_TAIL_CALL): {
+        const struct Object* value = &vm->stack[stack_base + arg0];
+        i32 argc = arg1;
+        struct Call_cache* cache = &vm->caches[arg2];
+        CALL_RESOLVE(vm, cache, value, argc);
+        if (vm->stack_top - stack_base < argc) {
+          runtime_error("Invalid number of arguments in local function call (should be %i)\n", argc);
+          vm->status = ERR;
+          goto done;
         }
-
-        i32 old_stack_top = vm->stack_top;
-        i32 base = vm->stack_base = vm->stack_top - argc;
-
-        i32* old_ip = vm->ip;
-        vm->ip = &vm->program[value.value.func.address];
-        execute(vm);
-        vm->ip = old_ip;
-
-        i32 ret_value_count = vm->stack_top - old_stack_top;
-        if (ret_value_count > 0) {
-          vm->stack[base] = *stack_get_top(vm);
-          vm->stack_top = base + 1;
+        JIT_TAIL_CALL(vm, cache, argc);
+        tail_call(vm, stack_base, argc);
+        ip = &vm->program[cache->entry];
+        vm_next();
+      }
+      vm_case(I_CHECK_INT_ARGS):
+        arg0 = NEXT_ARG();
+      vm_wide(I_CHECK_INT_ARGS): {
+        i32 mask = arg0;
+        for (i32 i = 0; mask; i++, mask >>= 1) {
+          if ((mask & 1) && !IS_NUMBER(vm->stack[stack_base + i])) {
+            runtime_error("Argument %i should be an int\n", i + 1);
+            vm->status = ERR;
+            goto done;
+          }
         }
-        break;
+        vm_next();
       }
-      case I_RETURN: {
-        return NO_ERR;
+      vm_case(I_RETURN): {
+        if (vm->frame_count <= entry_frame) {
+          vm->ip = ip;
+          return NO_ERR;
+        }
+        struct Call_frame* frame = &vm->frames[--vm->frame_count];
+        // TODO(lucas): Implement use of multiple return values
+        if (vm->stack_top > stack_base + frame->argc) {
+          vm->stack[stack_base] = *stack_get_top(vm);
+          vm->stack_top = stack_base + 1;
+        }
+        else {
+          vm->stack_top = stack_base;
+        }
+        ip = frame->return_ip;
+        stack_base = vm->stack_base = frame->stack_base;
+        vm_next();
       }
-      case I_ADD:
+      vm_case(I_ADD):
         ARITH(vm, +);
-        break;
-      case I_SUB:
+        vm_next();
+      vm_case(I_SUB):
         ARITH(vm, -);
-        break;
-      case I_MUL:
+        vm_next();
+      vm_case(I_MUL):
         ARITH(vm, *);
-        break;
-      case I_DIV:
+        vm_next();
+      vm_case(I_DIV):
         ARITH(vm, /);
-        break;
-      case I_LT:
+        vm_next();
+      vm_case(I_LT):
         ARITH(vm, <);
-        break;
-      case I_GT:
+        vm_next();
+      vm_case(I_GT):
         ARITH(vm, >);
-        break;
-      case I_EQ: {
+        vm_next();
+      vm_case(I_EQ): {
         if (vm->stack_top >= 2) {
           struct Object* left = stack_get(vm, 1);
           struct Object* right = stack_get(vm, 0);
-          i32 result = objects_are_equal(left, right);
-          left->value.number = result;
-          left->type = T_NUMBER;
+          *left = MAKE_NUMBER(objects_are_equal(vm, left, right));
           stack_pop(vm);
         }
         else {
@@ -353,23 +915,261 @@ i32 execute(struct VM_state* vm) {
           vm->status = ERR;
           goto done;
         }
-        break;
+        vm_next();
       }
-      default:
+      // push_arg <index>, push <address>, add/sub
+      vm_case(I_PUSH_ARG_PUSH_ADD):
+      vm_case(I_PUSH_ARG_PUSH_SUB):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+      vm_wide(I_PUSH_ARG_PUSH_ADD): {
+        i32 index = stack_base + arg0;
+        i32 address = arg1;
+        assert(index < vm->stack_top);
+        const struct Object* left = &vm->stack[index];
+        const struct Object* right = &vm->values[address];
+        i32 result = 0;
+        if (ins == I_PUSH_ARG_PUSH_ADD) {
+          ARITH_OPERANDS(vm, left, right, +, result);
+        }
+        else {
+          ARITH_OPERANDS(vm, left, right, -, result);
+        }
+        if (stack_push(vm, MAKE_NUMBER(result)) != NO_ERR) {
+          goto done;
+        }
+        vm_next();
+      }
+      // push <address>, add/sub
+      vm_case(I_PUSH_ADD):
+      vm_case(I_PUSH_SUB):
+        arg0 = NEXT_ARG();
+      vm_wide(I_PUSH_ADD): {
+        i32 address = arg0;
+        struct Object* left = stack_get_top(vm);
+        const struct Object* right = &vm->values[address];
+        if (!left) {
+          runtime_error("Not enough arguments for arithmetic operation\n");
+          vm->status = ERR;
+          goto done;
+        }
+        i32 result = 0;
+        if (ins == I_PUSH_ADD) {
+          ARITH_OPERANDS(vm, left, right, +, result);
+        }
+        else {
+          ARITH_OPERANDS(vm, left, right, -, result);
+        }
+        *left = MAKE_NUMBER(result);
+        vm_next();
+      }
+      // lt/gt/eq, cond_jump <offset>
+      vm_case(I_LT_COND_JUMP):
+      vm_case(I_GT_COND_JUMP):
+      vm_case(I_EQ_COND_JUMP):
+        arg0 = NEXT_JUMP_ARG();
+      vm_wide(I_LT_COND_JUMP): {
+        i32 offset = arg0;
+        if (vm->stack_top < 2) {
+          runtime_error("Not enough arguments for arithmetic operation\n");
+          vm->status = ERR;
+          goto done;
+        }
+        vm->stack_top -= 2;
+        struct Object* left = &vm->stack[vm->stack_top];
+        struct Object* right = &vm->stack[vm->stack_top + 1];
+        if (ins == I_LT_COND_JUMP) {
+          COMPARE_JUMP(vm, left, right, <, offset);
+        }
+        else if (ins == I_GT_COND_JUMP) {
+          COMPARE_JUMP(vm, left, right, >, offset);
+        }
+        else if (!objects_are_equal(vm, left, right)) {
+          ip += offset;
+        }
+        vm_next();
+      }
+      // push <address>, lt/gt/eq, cond_jump <offset>
+      vm_case(I_PUSH_LT_COND_JUMP):
+      vm_case(I_PUSH_GT_COND_JUMP):
+      vm_case(I_PUSH_EQ_COND_JUMP):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_JUMP_ARG();
+      vm_wide(I_PUSH_LT_COND_JUMP): {
+        i32 address = arg0;
+        i32 offset = arg1;
+        struct Object* left = stack_pop(vm);
+        struct Object* right = &vm->values[address];
+        if (!left) {
+          runtime_error("Not enough arguments for arithmetic operation\n");
+          vm->status = ERR;
+          goto done;
+        }
+        if (ins == I_PUSH_LT_COND_JUMP) {
+          COMPARE_JUMP(vm, left, right, <, offset);
+        }
+        else if (ins == I_PUSH_GT_COND_JUMP) {
+          COMPARE_JUMP(vm, left, right, >, offset);
+        }
+        else if (!objects_are_equal(vm, left, right)) {
+          ip += offset;
+        }
+        vm_next();
+      }
+      vm_case(I_ADD_INT):
+        ARITH_INT(vm, +);
+        vm_next();
+      vm_case(I_SUB_INT):
+        ARITH_INT(vm, -);
+        vm_next();
+      vm_case(I_MUL_INT):
+        ARITH_INT(vm, *);
+        vm_next();
+      vm_case(I_DIV_INT):
+        ARITH_INT(vm, /);
+        vm_next();
+      vm_case(I_LT_INT):
+        ARITH_INT(vm, <);
+        vm_next();
+      vm_case(I_GT_INT):
+        ARITH_INT(vm, >);
+        vm_next();
+      vm_case(I_EQ_INT):
+        ARITH_INT(vm, ==);
+        vm_next();
+      vm_case(I_PUSH_ARG_PUSH_ADD_INT):
+      vm_case(I_PUSH_ARG_PUSH_SUB_INT):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+      vm_wide(I_PUSH_ARG_PUSH_ADD_INT): {
+        i32 index = stack_base + arg0;
+        i32 address = arg1;
+        assert(index < vm->stack_top);
+        i32 left = AS_NUMBER(vm->stack[index]);
+        i32 right = AS_NUMBER(vm->values[address]);
+        struct Object result = MAKE_NUMBER((ins == I_PUSH_ARG_PUSH_ADD_INT) ? left + right : left - right);
+        if (stack_push(vm, result) != NO_ERR) {
+          goto done;
+        }
+        vm_next();
+      }
+      vm_case(I_PUSH_ADD_INT):
+        arg0 = NEXT_ARG();
+      vm_wide(I_PUSH_ADD_INT): {
+        i32 address = arg0;
+        assert(vm->stack_top >= 1);
+        struct Object* left = &vm->stack[vm->stack_top - 1];
+        *left = MAKE_NUMBER(AS_NUMBER(*left) + AS_NUMBER(vm->values[address]));
+        vm_next();
+      }
+      vm_case(I_PUSH_SUB_INT):
+        arg0 = NEXT_ARG();
+      vm_wide(I_PUSH_SUB_INT): {
+        i32 address = arg0;
+        assert(vm->stack_top >= 1);
+        struct Object* left = &vm->stack[vm->stack_top - 1];
+        *left = MAKE_NUMBER(AS_NUMBER(*left) - AS_NUMBER(vm->values[address]));
+        vm_next();
+      }
+      vm_case(I_LT_COND_JUMP_INT):
+        arg0 = NEXT_JUMP_ARG();
+      vm_wide(I_LT_COND_JUMP_INT):
+        COMPARE_JUMP_INT(vm, <, arg0);
+        vm_next();
+      vm_case(I_GT_COND_JUMP_INT):
+        arg0 = NEXT_JUMP_ARG();
+      vm_wide(I_GT_COND_JUMP_INT):
+        COMPARE_JUMP_INT(vm, >, arg0);
+        vm_next();
+      vm_case(I_EQ_COND_JUMP_INT):
+        arg0 = NEXT_JUMP_ARG();
+      vm_wide(I_EQ_COND_JUMP_INT):
+        COMPARE_JUMP_INT(vm, ==, arg0);
+        vm_next();
+      vm_case(I_PUSH_LT_COND_JUMP_INT):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_JUMP_ARG();
+      vm_wide(I_PUSH_LT_COND_JUMP_INT):
+        PUSH_COMPARE_JUMP_INT(vm, <, arg0, arg1);
+        vm_next();
+      vm_case(I_PUSH_GT_COND_JUMP_INT):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_JUMP_ARG();
+      vm_wide(I_PUSH_GT_COND_JUMP_INT):
+        PUSH_COMPARE_JUMP_INT(vm, >, arg0, arg1);
+        vm_next();
+      vm_case(I_PUSH_EQ_COND_JUMP_INT):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_JUMP_ARG();
+      vm_wide(I_PUSH_EQ_COND_JUMP_INT):
+        PUSH_COMPARE_JUMP_INT(vm, ==, arg0, arg1);
+        vm_next();
+      // push <address>, assign <address>
+      vm_case(I_PUSH_ASSIGN):
+        arg0 = NEXT_ARG();
+        arg1 = NEXT_ARG();
+      vm_wide(I_PUSH_ASSIGN):
+        vm->values[arg1] = vm->values[arg0];
+        vm_next();
+      // Multiply the number on top of the stack by 2^n
+      vm_case(I_SHL_INT): {
+        i32 n = NEXT_ARG();
+        assert(vm->stack_top >= 1);
+        struct Object* left = &vm->stack[vm->stack_top - 1];
+        *left = MAKE_NUMBER((i32)((u32)AS_NUMBER(*left) << n));
+        vm_next();
+      }
+      // Divide the number on top of the stack by 2^n, rounding toward zero as division does
+      vm_case(I_SHR_INT): {
+        i32 n = NEXT_ARG();
+        assert(vm->stack_top >= 1);
+        struct Object* left = &vm->stack[vm->stack_top - 1];
+        i32 number = AS_NUMBER(*left);
+        *left = MAKE_NUMBER((number + ((number >> 31) & ((1 << n) - 1))) >> n);
+        vm_next();
+      }
+      // wide compile <function>, the stub of a function that is compiled on its first call. Calls continue
+      // past it (see function_entry), so it is only reached by entering the function without a call.
+      vm_case(I_COMPILE):
+      vm_wide(I_COMPILE): {
+        i32 entry = 0;
+        i32 offset = (i32)(ip - vm->program);
+        i32 status = function_entry(vm, offset - STUB_SIZE, &entry);
+        ip = &vm->program[status == NO_ERR ? entry : offset];
+        if (status != NO_ERR) {
+          goto done;
+        }
+        vm_next();
+      }
+      vm_default:
         runtime_error("Tried to execute bad instruction (%i)\n", ins);
         assert(0);
         return vm->status;
     }
   }
 done:
+  vm->ip = ip;
   return vm->status;
 }
 
+// NOTE(lucas): Lists skip the writes that there was no memory for (see list.h), so whatever was built when
+// an allocation failed is incomplete. The allocator is checked after every step that allocates (compiling,
+// running, collecting and the jit), and once it has failed nothing else is compiled or run.
+i32 vm_memory_check(struct VM_state* vm) {
+  if (!vm->allocator.failed) {
+    return NO_ERR;
+  }
+  if (vm->status == NO_ERR) {
+    fprintf(stderr, "error: Out of memory\n");
+  }
+  return vm->status = ERR;
+}
+
 void stack_print_all(struct VM_state* vm) {
   printf("[");
   for (i32 i = 0; i < vm->stack_top; i++) {
     struct Object* obj = &vm->stack[i];
-    object_print(stdout, obj);
+    object_print(vm, stdout, obj);
     if (i < vm->stack_top - 1) {
       printf(", ");
     }
@@ -377,53 +1177,232 @@ void stack_print_all(struct VM_state* vm) {
   printf("]\n");
 }
 
-i32 vm_exec(struct VM_state* vm, char* file, char* source) {
-  Ast ast = ast_create();
-  if (parser_parse(source, file, &ast) == NO_ERR) {
-    // ast_print(ast);
-#if 1
-    if (code_gen(vm, &ast) == NO_ERR) {
-#if 1
-      if (vm->program_size > 0) {
-        if (!vm->ip) {
-          vm->ip = &vm->program[0];
-        }
-        if (vm->old_program_size != vm->program_size) {
-          vm->ip = &vm->program[vm->saved_ip];
-          execute(vm);
-          stack_print_all(vm);
-          list_shrink(vm->program, vm->program_size, 1); // Remove I_RETURN instruction
-          vm->old_program_size = vm->program_size;
-          vm->saved_ip = (i32)(&vm->program[vm->program_size] - &vm->program[0]); // Save the instruction pointer index, and restore it in the next execution.
-          vm->stack_top = 0;
-        }
-      }
-#endif
+#if defined(USE_JIT)
+
+// Call the funk function in the inline cache, with its arguments on top of the stack.
+// Returns when the function has returned.
+i32 call_function(struct VM_state* vm, struct Call_cache* cache) {
+  if (JIT_READY(vm, cache)) {
+    return jit_enter(vm, cache->jit);
+  }
+  // NOTE(lucas): The function is interpreted in a nested dispatch loop, its return continues at an exit instruction
+  static u8 exit_program[] = { I_EXIT };
+  i32 offset = (i32)(vm->ip - vm->program);  // The program can move while the function runs
+  if (frame_push(vm, FUNC_ARGC(cache->func), exit_program) != NO_ERR) {
+    return ERR;
+  }
+  vm->ip = &vm->program[cache->entry];
+  i32 status = execute(vm, vm->frame_count - 1);
+  vm->ip = &vm->program[offset];
+  return status;
+}
+
+i32 vm_jit_call(struct VM_state* vm, i32 cache_index, u64 func, i32 argc, i32 tail_base) {
+  struct Call_cache* cache = &vm->caches[cache_index];
+  const struct Object value = { .bits = func };
+  if (!CACHE_HIT(cache, &value)) {
+    i32 status = call_cache_miss(vm, cache, &value, argc);
+    if (status != NO_ERR) {
+      return status;
+    }
+    cache = &vm->caches[cache_index];  // Compiling the function can add caches
+  }
+  i32 func_argc = FUNC_ARGC(cache->func);
+  i32 arg_values = (tail_base >= 0) ? vm->stack_top - tail_base : vm->stack_top;
+  if (arg_values < func_argc) {
+    if (argc >= 0) {
+      runtime_error("Invalid number of arguments in local function call (should be %i)\n", func_argc);
     }
     else {
-      vm->status = NO_ERR;
+      runtime_error("Invalid number of arguments in function call (should be %i)\n", func_argc);
+    }
+    return vm->status = ERR;
+  }
+  if (tail_base >= 0) {
+    memmove(&vm->stack[tail_base], &vm->stack[vm->stack_top - func_argc], func_argc * sizeof(struct Object));
+    vm->stack_top = tail_base + func_argc;
+  }
+  return call_function(vm, cache);
+}
+
+i32 vm_jit_equal(struct VM_state* vm, u64 a, u64 b) {
+  struct Object left = { .bits = a };
+  struct Object right = { .bits = b };
+  return objects_are_equal(vm, &left, &right);
+}
+
+i32 vm_jit_reserve(struct VM_state* vm, i32 count) {
+  while (vm->stack_top + count > vm->stack_size) {
+    if (stack_grow(vm) != NO_ERR) {
+      return ERR;
     }
-#endif
   }
-  ast_free(&ast);
   return NO_ERR;
 }
 
-void vm_free(struct VM_state* vm) {
-  for (i32 i = 0; i < vm->values_count; i++) {
-    struct Object* obj = &vm->values[i];
-    switch (obj->type) {
-      case T_FUNCTION:
-        func_free(&obj->value.func);
-        break;
-      default:
-        break;
+#endif
+
+i32 vm_exec(struct VM_state* vm, char* file, char* source) {
+  if (vm->allocator.failed) {
+    return ERR;
+  }
+  Allocator* previous = memory_use(&vm->allocator);
+  if (compile(vm, file, source) == NO_ERR) {
+    run(vm);
+  }
+  memory_use(previous);
+  return vm->allocator.failed ? ERR : NO_ERR;
+}
+
+i32 vm_exec_file(struct VM_state* vm, char* path) {
+  Allocator* previous = memory_use(&vm->allocator);
+  i32 result = exec_file(vm, path);
+  memory_use(previous);
+  return result;
+}
+
+i32 exec_file(struct VM_state* vm, char* path) {
+  if (vm->allocator.failed) {
+    return ERR;
+  }
+  u32 source_size = 0;
+  char* source = read_file(path, &source_size);
+  if (!source) {
+    if (vm_memory_check(vm) == NO_ERR) {
+      fprintf(stderr, "Failed to read file '%s'\n", path);
+    }
+    return ERR;
+  }
+  u64 source_hash = image_hash(source, strlen(source));
+  char image_path[MAX_PATH_SIZE] = {0};
+  snprintf(image_path, MAX_PATH_SIZE, "%s.fbc", path);
+  if (vm->engine == ENGINE_REGISTER) {
+    // NOTE(lucas): Images only hold byte code, register based code is always compiled from the source
+    if (compile(vm, path, source) == NO_ERR) {
+      run(vm);
+    }
+  }
+  else if (vm->image_cache != IMAGE_CACHE_OFF && image_load(vm, image_path, source_hash, vm->image_cache == IMAGE_CACHE_VERIFY) == NO_ERR) {
+    run(vm);
+  }
+  else {
+    i32 is_new = vm->program_size == 0;  // Only the program of a new vm can be loaded into another one
+    if (compile(vm, path, source) == NO_ERR) {
+      // Programs with compile errors are not saved, so that the errors are reported every time
+      if (vm->image_cache != IMAGE_CACHE_OFF && is_new && code_gen_errors() == 0) {
+        image_save(vm, image_path, source_hash);  // NOTE(lucas): If this fails the source is just compiled again the next time
+      }
+      run(vm);
     }
   }
-  list_free(vm->values, vm->values_count);
+  m_free(source, source_size);
+  return vm->allocator.failed ? ERR : NO_ERR;
+}
+
+void vm_free(struct VM_state* vm) {
+  Allocator* previous = memory_use(&vm->allocator);
+  image_unmap(vm);
+  list_free(vm->values, vm->values_count, vm->values_capacity);
+  constant_pool_free(&vm->constants);
   buffer_free(&vm->buffer);
-  func_free(&vm->global);
+  list_free(vm->strings, vm->strings_count, vm->strings_capacity);
+  string_index_free(&vm->strings_index);
+  list_free(vm->cfunctions, vm->cfunctions_count, vm->cfunctions_capacity);
   func_state_free(&vm->fs_global);
-  list_free(vm->program, vm->program_size);
+  list_free(vm->program, vm->program_size, vm->program_capacity);
+  list_free(vm->code, vm->code_size, vm->code_capacity);
+  list_free(vm->code_values, vm->code_values_count, vm->code_values_capacity);
+  list_free(vm->caches, vm->caches_count, vm->caches_capacity);
+  list_free(vm->lazy, vm->lazy_count, vm->lazy_capacity);
+  list_free(vm->lazy_ins, vm->lazy_ins_count, vm->lazy_ins_capacity);
+  jit_free(&vm->jit);
+  reg_free(&vm->reg);
+  if (vm->stack) {
+    m_free(vm->stack, vm->stack_size * sizeof(struct Object));
+    vm->stack = NULL;
+  }
+  if (vm->frames) {
+    m_free(vm->frames, vm->frames_size * sizeof(struct Call_frame));
+    vm->frames = NULL;
+  }
   vm->ip = NULL;
+  memory_use(previous);
+  // NOTE(lucas): The counts of the allocator are kept, so that leaks can still be found
+  allocator_release(&vm->allocator);
+}
+
+i32 compile(struct VM_state* vm, char* file, char* source) {
+  i32 result = ERR;
+  Arena arena;
+  arena_init(&arena);
+  vm->arena = &arena;
+  Ast ast = ast_create();
+  if (parser_parse(source, file, &arena, &ast) == NO_ERR) {
+    optimize_ast(&ast);
+    // ast_print(ast);
+    if (vm->engine == ENGINE_REGISTER) {
+      result = reg_code_gen(vm, &ast);
+      vm->status = NO_ERR;
+    }
+    else if (image_detach(vm) == NO_ERR && code_gen(vm, &ast) == NO_ERR) {
+      result = NO_ERR;
+    }
+    else {
+      vm->status = NO_ERR;
+    }
+    if (vm_memory_check(vm) != NO_ERR) {
+      result = ERR;
+    }
+  }
+  vm->arena = NULL;
+  arena_free(&arena);
+  return result;
+}
+
+// Execute the code that was added to the program since the last run
+void run(struct VM_state* vm) {
+  if (vm->engine == ENGINE_REGISTER) {
+    Reg_state* reg = &vm->reg;
+    if (reg->start != reg->code_size) {
+      reg_execute(vm);
+      if (vm_memory_check(vm) != NO_ERR) {
+        return;
+      }
+      stack_print_all(vm);
+      reg->frame_count = 0;
+      vm->stack_base = 0;
+      vm->status = NO_ERR;
+      list_shrink(reg->code, reg->code_size, 1);  // Remove R_RETURN instruction
+      reg->start = reg->code_size;
+      vm->stack_top = 0;
+    }
+    return;
+  }
+  if (vm->program_size > 0) {
+    if (!vm->ip) {
+      vm->ip = &vm->program[0];
+    }
+    if (vm->old_program_size != vm->program_size) {
+      vm->ip = &vm->program[vm->saved_ip];
+      i32 size = vm->program_size;
+      execute(vm, vm->frame_count);
+      if (vm_memory_check(vm) != NO_ERR) {
+        return;  // NOTE(lucas): The vm is left as it is, nothing is run on it after this
+      }
+      stack_print_all(vm);
+      vm->frame_count = 0;
+      vm->stack_base = 0;
+      vm->status = NO_ERR;
+      // Remove I_RETURN instruction, the memory is kept (a mapped program is copied when more code is added to it).
+      // Functions that were compiled during the run come after it, then it is left in place.
+      if (vm->program_size == size) {
+        list_shrink(vm->program, vm->program_size, 1);
+      }
+      vm->old_program_size = vm->program_size;
+      vm->saved_ip = (i32)(&vm->program[vm->program_size] - &vm->program[0]); // Save the instruction pointer index, and restore it in the next execution.
+      vm->stack_top = 0;
+      gc_check(vm);
+      vm_memory_check(vm);
+    }
+  }
 }
@@ -0,0 +1,67 @@
+#!/bin/sh
+# test.sh
+# Runs the test scripts on every execution engine. Each one has to print what its .out file holds, and the
+# byte code engine is run with and without the jit compiler, so that the machine code is checked against the
+# interpreter. The jit runs are repeated, since some of its failures depend on where memory is mapped.
+# With -cache the first run saves the compiled program and the later ones run it from the image.
+# usage: test/test.sh [scripts], with funk built in build/funk (make prepare compile)
+
+FUNK=${FUNK:-build/funk}
+RUNS=${RUNS:-3}
+SCRIPTS=${@:-test/*.funk}
+FAILED=0
+
+# Output of a run, without the addresses that differ between runs
+output() {
+  "$@" 2>&1 | sed 's/0x[0-9a-f]*//g'
+}
+
+check() {
+  expected=$1
+  shift
+  if [ "$(output "$@")" != "$(cat $expected)" ]; then
+    echo "FAILED: $*"
+    FAILED=$((FAILED + 1))
+  fi
+}
+
+for script in $SCRIPTS; do
+  expected=${script%.funk}.out
+  check $expected $FUNK -nojit $script
+  check $expected $FUNK -reg $script
+  i=0
+  while [ $i -lt $RUNS ]; do
+    check $expected $FUNK $script
+    i=$((i + 1))
+  done
+  rm -f $script.fbc
+  check $expected $FUNK -cache $script
+  check $expected $FUNK -cache $script
+  check $expected $FUNK -cache=verify $script
+  rm -f $script.fbc
+done
+
+# A program that does not fit in the fixed buffer has to stop with an error, instead of running what fitted
+oom_check() {
+  out=$("$@" 2>&1)
+  status=$?
+  if [ $status -eq 0 ] || ! echo "$out" | grep -q "Out of memory"; then
+    echo "FAILED: $* (exit status $status)"
+    FAILED=$((FAILED + 1))
+  fi
+}
+
+big=$(mktemp)
+awk 'BEGIN { for (i = 0; i < 3000; i++) printf "(define f%d (a b) (if (< a b) (a) ((f%d ((- a 1) b)))))\n(print (f%d (9 %d)))\n", i, i, i, i % 5 }' > $big
+for fixed in 1 2 4; do
+  oom_check $FUNK -nojit -fixed=$fixed $big
+  oom_check $FUNK -reg -fixed=$fixed $big
+  oom_check $FUNK -fixed=$fixed $big
+done
+rm -f $big
+
+if [ $FAILED -ne 0 ]; then
+  echo "$FAILED failed"
+  exit 1
+fi
+echo "All tests passed"